@@ -1,7 +1,8 @@
 matrix 	World;
 matrix 	ViewProj;
 
-matrix 	BoneTransform[60];
+// affine bone matrices, transposed so every bone takes three registers
+row_major float3x4 	BoneTransform[60];
 
 struct VIn 
 {
@@ -23,19 +24,44 @@ VOut VShader(VIn input, uint vertexId : SV_VertexID)
 {
 	VOut output;
 
-	matrix boneTransform = 0;
+	float3x4 boneTransform = 0;
 	[unroll]
 	for(int i=0; i<4; ++i) {
 		boneTransform += BoneTransform[input.boneInd[i]] * input.boneWeights[i];
 	}
 
-	matrix objectMatrix = mul(boneTransform, World);
+	float3 skinnedPosition = mul(boneTransform, float4(input.position, 1));
+	float3 skinnedNormal = mul(boneTransform, float4(input.normal, 0));
 
-	float4 position = float4(input.position, 1);
-	position = mul(position, objectMatrix);
+	float4 position = mul(float4(skinnedPosition, 1), World);
 	position = mul(position, ViewProj);
 	output.position = position;
-	output.normal = mul(input.normal, (float3x3) objectMatrix);
+	output.normal = mul(skinnedNormal, (float3x3) World);
+	output.texcoord = input.texcoord;
+	return output;
+}
+
+struct VInInstanced
+{
+	float3 	position : POSITION;
+	float3 	normal : NORMAL;
+	float2 	texcoord : TEXCOORD;
+	// transposed world matrix rows, per instance
+	float4 	world0 : INSTANCE_WORLD0;
+	float4 	world1 : INSTANCE_WORLD1;
+	float4 	world2 : INSTANCE_WORLD2;
+};
+
+// static meshes, no skinning
+VOut VShaderInstanced(VInInstanced input)
+{
+	VOut output;
+
+	float4 position = float4(input.position, 1);
+	float3 wposition = float3(dot(position, input.world0), dot(position, input.world1), dot(position, input.world2));
+	output.position = mul(float4(wposition, 1), ViewProj);
+	float4 normal = float4(input.normal, 0);
+	output.normal = float3(dot(normal, input.world0), dot(normal, input.world1), dot(normal, input.world2));
 	output.texcoord = input.texcoord;
 	return output;
 }
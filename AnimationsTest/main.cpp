@@ -28,10 +28,18 @@ ICameraControler *CameraControlerPtr = &FpsCamera;
 
 void CreateTestScene(Scene &Scene, i32 sceneObjectsNum);
 
+bool AnimationLod = true;
+bool SharePoses = true;
+
 void ShowSceneWidget(Scene& Scene) {
 	static i32 sceneObjectsNum = 100;
 
 	ImGui::SliderInt("Scene objects", &sceneObjectsNum, 0, 2000);
+	ImGui::Checkbox("Animation lod", &AnimationLod);
+	ImGui::Checkbox("Share poses", &SharePoses);
+	ImGui::Text("Animations: %u evaluated, %u interpolated, %u shared, %u culled", Scene.AnimationStats.evaluated_states, Scene.AnimationStats.interpolated_states, Scene.AnimationStats.shared_states, Scene.AnimationStats.culled_states);
+	ImGui::Text("Bones: %u evaluated, %u skipped", Scene.AnimationStats.evaluated_bones, Scene.AnimationStats.skipped_bones);
+	ImGui::Text("Visible entities: %u / %u", Scene.VisibleEntitiesNum, Scene.EntitiesNum);
 
 	if (Scene.EntitiesNum != sceneObjectsNum) {
 		call_destructor(Scene);
@@ -198,6 +206,15 @@ void Tick(float fDeltaTime) {
 		SetConstant(drawList, TEXT_("WriteColor"), color);
 		Draw(drawList, 3);
 
+		if (AnimationLod) {
+			auto viewProj = FpsCamera.GetViewMatrix()
+				* DirectX::XMMatrixPerspectiveFovLH(3.14f * 0.25f, (float)GDisplaySettings.resolution.x / (float)GDisplaySettings.resolution.y, 0.01f, 1000.f);
+			SetAnimationLodView(testScene, viewProj, toFloat3(FpsCamera.Position));
+		}
+		else {
+			DisableAnimationLod(testScene);
+		}
+		SetPoseCacheStep(testScene, SharePoses ? 1.f / 30.f : 0.f);
 		UpdateScene(testScene, fDeltaTime);
 
 		auto clearFinished = GetCompletionFence(drawList);
@@ -458,6 +458,12 @@ void Tick(float fDeltaTime) {
 		Draw(drawList, 3);
 	}
 
+	// next frame clears them as targets, the wait moves from that clear to the end of this list and overlaps the ui
+	BeginTransitionBarrier(drawList, Slice(GBufferA), D3D12_RESOURCE_STATE_RENDER_TARGET);
+	BeginTransitionBarrier(drawList, Slice(GBufferB), D3D12_RESOURCE_STATE_RENDER_TARGET);
+	BeginTransitionBarrier(drawList, Slice(DepthBuffer), D3D12_RESOURCE_STATE_DEPTH_WRITE);
+	FlushBarriers(drawList);
+
 	RenderUserInterface(drawList);
 	TransitionBarrier(drawList, Slice(GetCurrentBackbuffer()), D3D12_RESOURCE_STATE_PRESENT);
 	Execute(drawList);
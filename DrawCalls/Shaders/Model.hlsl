@@ -42,6 +42,30 @@ VOut VShader(VIn input, uint vertexId : SV_VertexID)
 	return output;
 }
 
+struct VInInstanced
+{
+	float3 	position : POSITION;
+	float3 	normal : NORMAL;
+	float2 	texcoord : TEXCOORD;
+	// transposed world matrix rows, per instance
+	float4 	world0 : INSTANCE_WORLD0;
+	float4 	world1 : INSTANCE_WORLD1;
+	float4 	world2 : INSTANCE_WORLD2;
+};
+
+VOut VShaderInstanced(VInInstanced input)
+{
+	VOut output;
+
+	float4 position = float4(input.position, 1);
+	output.wposition = float3(dot(position, input.world0), dot(position, input.world1), dot(position, input.world2));
+	output.position = mul(float4(output.wposition, 1), ViewProj);
+	float4 normal = float4(input.normal, 0);
+	output.normal = float3(dot(normal, input.world0), dot(normal, input.world1), dot(normal, input.world2));
+	output.texcoord = input.texcoord;
+	return output;
+}
+
 void PShader(VOut interpolated, out float4 outColor : SV_TARGET0)
 {
 	outColor = ColorTex.Sample(Sampler, interpolated.texcoord);
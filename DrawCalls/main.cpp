@@ -9,6 +9,7 @@
 #include "StatWindows.h"
 #include "Hashmap.h"
 #include "Random.h"
+#include "RenderQueue.h"
 #include "SDL.h"
 
 #pragma comment(lib,"SDL2main.lib")
@@ -56,6 +57,17 @@ random_generator RNG;
 float ObjectsToRender = 100;
 float Alpha = 1;
 const u32 MaxObjects = 100000;
+bool FrustumCulling = true;
+u32 VisibleObjectsNum;
+Array<cull_bounds4_t> RenderObjectBounds;
+Array<u32> VisibleObjects;
+bool Instancing = true;
+u32 DrawCallsNum;
+
+// pipeline follows the model, batches only need the exact model
+bool IsSameObjectModel(void*, u32 firstItem, u32 item) {
+	return RenderObjects[firstItem].model == RenderObjects[item].model;
+}
 
 float3 UniformSpherePoint(float radius) {
 	while (true) {
@@ -90,6 +102,15 @@ void Init() {
 		RenderObjects[i].model = models[RNG.u32Next() % _countof(models)];
 	}
 
+	// objects never move, bounds are packed once
+	Resize(RenderObjectBounds, (MaxObjects + CULL_BLOCK_SIZE - 1) / CULL_BLOCK_SIZE);
+	Resize(VisibleObjects, MaxObjects);
+	for (u32 i = 0; i < MaxObjects; ++i) {
+		auto world = XMMatrixScaling(RenderObjects[i].scale.x, RenderObjects[i].scale.y, RenderObjects[i].scale.z)
+			* XMMatrixTranslation(RenderObjects[i].position.x, RenderObjects[i].position.y, RenderObjects[i].position.z);
+		SetCullBounds(RenderObjectBounds.DataPtr, i, world, GetModelRenderData(RenderObjects[i].model)->bounds);
+	}
+
 	auto initialCopies = GetCommandList(GGPUCopyQueue, NAME_("Copy"));
 	auto local_texture = LoadDDSFromFile(TEXT_("Textures/uvchecker.dds"), initialCopies, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE);
 	texture = local_texture.resource;
@@ -156,6 +177,10 @@ void Tick(float fDeltaTime) {
 
 	ImGui::Text("Hello, world!");
 	ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
+	ImGui::Checkbox("Frustum culling", &FrustumCulling);
+	ImGui::Text("Visible objects: %u / %u", VisibleObjectsNum, (u32)ObjectsToRender);
+	ImGui::Checkbox("Instancing", &Instancing);
+	ImGui::Text("Draw calls: %u", DrawCallsNum);
 	if (ImGui::Button("Recompile shaders")) {
 		ReloadShaders();
 		ClearWarnings(TYPE_ID("ShaderBindings"));
@@ -190,40 +215,96 @@ void Tick(float fDeltaTime) {
 	SetTexture2D(drawList, TEXT_("ColorTex"), GetSRV(texture));
 
 	u32 N = (u32)ObjectsToRender;
-	for (u32 o = 0; o < N; ++o) {
-		float3 scale = RenderObjects[o].scale;
-		float4 qrotation = float4(0, 0, 0, 1);
-		float3 position = RenderObjects[o].position;
-
-		auto worldMatrix = XMMatrixTranspose(
-			XMMatrixAffineTransformation(
-				XMLoadFloat3((XMFLOAT3*)&scale),
-				XMVectorZero(),
-				XMLoadFloat4((XMFLOAT4*)&qrotation),
-				XMLoadFloat3((XMFLOAT3*)&position)
-				));
-
-		renderData = GetModelRenderData(RenderObjects[o].model);
-
-		SetShaderState(drawList, SHADER_(Model, VShader, VS_5_1), SHADER_(Model, PShader, PS_5_1), renderData->vertex_layout);
-
-		buffer_location_t vb;
-		vb.address = GetResourceFast(renderData->vertex_buffer)->resource->GetGPUVirtualAddress();
-		vb.size = renderData->vertices_num * sizeof(mesh_vertex_t);
-		vb.stride = sizeof(mesh_vertex_t);
-		SetVertexStream(drawList, 0, vb);
-
-		buffer_location_t ib;
-		ib.address = GetResourceFast(renderData->index_buffer)->resource->GetGPUVirtualAddress();
-		ib.size = renderData->indices_num * sizeof(u32);
-		ib.stride = sizeof(u32);
-		SetIndexBuffer(drawList, ib);
-
-		SetConstant(drawList, TEXT_("World"), worldMatrix);
-
-		for (auto i : MakeRange(renderData->submeshes.num)) {
-			auto submesh = renderData->submeshes[i];
-			DrawIndexed(drawList, submesh.index_count, submesh.start_index, submesh.base_vertex);
+	VisibleObjectsNum = N;
+	if (FrustumCulling) {
+		frustum_t frustum;
+		ExtractFrustum(XMMatrixTranspose(viewProjMatrix), &frustum);
+		VisibleObjectsNum = ParallelCullBounds(frustum, RenderObjectBounds.DataPtr, N, VisibleObjects.DataPtr);
+	}
+	else {
+		for (u32 o = 0; o < N; ++o) {
+			VisibleObjects[o] = o;
+		}
+	}
+
+	DrawCallsNum = 0;
+	if (Instancing) {
+		// group by model, front to back inside a group
+		auto viewMatrix = CameraControlerPtr->GetViewMatrix();
+		render_queue_t queue;
+		queue.keys = Array<u64>(GetThreadScratchAllocator());
+		queue.items = Array<u32>(GetThreadScratchAllocator());
+		Reserve(queue.keys, VisibleObjectsNum);
+		Reserve(queue.items, VisibleObjectsNum);
+		for (u32 v = 0; v < VisibleObjectsNum; ++v) {
+			auto o = VisibleObjects[v];
+			auto model = RenderObjects[o].model;
+			float depth = XMVectorGetZ(XMVector3TransformCoord(XMLoadFloat3((XMFLOAT3*)&RenderObjects[o].position), viewMatrix)) / 1000.f;
+			PushRenderItem(queue, MakeRenderSortKey(RENDER_PASS_OPAQUE, GetModelRenderData(model)->instanced_vertex_layout.GetIndex(), 0, model.GetIndex(), depth), o);
+		}
+		SortRenderQueue(queue);
+
+		Array<render_batch_t> batches(GetThreadScratchAllocator());
+		BuildRenderBatches(queue, MAX_INSTANCES_PER_DRAW, IsSameObjectModel, nullptr, &batches);
+
+		Array<instance_transform_t> instances(GetThreadScratchAllocator());
+		Resize(instances, VisibleObjectsNum);
+		for (u32 v = 0; v < VisibleObjectsNum; ++v) {
+			auto const& object = RenderObjects[queue.items[v]];
+			PackInstanceTransform(&instances[v], XMMatrixScaling(object.scale.x, object.scale.y, object.scale.z)
+				* XMMatrixTranslation(object.position.x, object.position.y, object.position.z));
+		}
+
+		for (auto batch : batches) {
+			auto model = RenderObjects[queue.items[batch.first]].model;
+			renderData = GetModelRenderData(model);
+
+			SetShaderState(drawList, SHADER_(Model, VShaderInstanced, VS_5_1), SHADER_(Model, PShader, PS_5_1), renderData->instanced_vertex_layout);
+			SetConstant(drawList, TEXT_("ViewProj"), viewProjMatrix);
+			SetTexture2D(drawList, TEXT_("ColorTex"), GetSRV(texture));
+
+			DrawModelInstances(drawList, model, instances.DataPtr + batch.first, batch.count);
+			DrawCallsNum += renderData->submeshes.num;
+		}
+	}
+	else {
+		for (u32 v = 0; v < VisibleObjectsNum; ++v) {
+			auto o = VisibleObjects[v];
+			float3 scale = RenderObjects[o].scale;
+			float4 qrotation = float4(0, 0, 0, 1);
+			float3 position = RenderObjects[o].position;
+
+			auto worldMatrix = XMMatrixTranspose(
+				XMMatrixAffineTransformation(
+					XMLoadFloat3((XMFLOAT3*)&scale),
+					XMVectorZero(),
+					XMLoadFloat4((XMFLOAT4*)&qrotation),
+					XMLoadFloat3((XMFLOAT3*)&position)
+					));
+
+			renderData = GetModelRenderData(RenderObjects[o].model);
+
+			SetShaderState(drawList, SHADER_(Model, VShader, VS_5_1), SHADER_(Model, PShader, PS_5_1), renderData->vertex_layout);
+
+			buffer_location_t vb;
+			vb.address = GetResourceFast(renderData->vertex_buffer)->resource->GetGPUVirtualAddress();
+			vb.size = renderData->vertices_num * sizeof(mesh_vertex_t);
+			vb.stride = sizeof(mesh_vertex_t);
+			SetVertexStream(drawList, 0, vb);
+
+			buffer_location_t ib;
+			ib.address = GetResourceFast(renderData->index_buffer)->resource->GetGPUVirtualAddress();
+			ib.size = renderData->indices_num * sizeof(u32);
+			ib.stride = sizeof(u32);
+			SetIndexBuffer(drawList, ib);
+
+			SetConstant(drawList, TEXT_("World"), worldMatrix);
+
+			for (auto i : MakeRange(renderData->submeshes.num)) {
+				auto submesh = renderData->submeshes[i];
+				DrawIndexed(drawList, submesh.index_count, submesh.start_index, submesh.base_vertex);
+			}
+			DrawCallsNum += renderData->submeshes.num;
 		}
 	}
 
@@ -239,6 +320,8 @@ void Tick(float fDeltaTime) {
 void Shutdown() {
 	WaitForCompletion();
 	FreeMemory(RenderObjects);
+	FreeMemory(RenderObjectBounds);
+	FreeMemory(VisibleObjects);
 }
 
 int main(int argc, char * argv[]) {
@@ -1,4 +1,5 @@
 #include <cstdio>
+#include <windows.h>
 #include "Memory.h"
 #include "AssertionMacros.h"
 #include "Files.h"
@@ -46,5 +47,26 @@ file_read_result_t ReadEntireFile(const char* filename, IAllocator* allocator) {
 	return result;
 }
 
+bool WriteEntireFile(const char* filename, const void* data, u64 bytesize) {
+	// written aside and moved over, a crash or a full disk leaves the old file whole
+	char tmpFilename[MAX_PATH];
+	if (snprintf(tmpFilename, sizeof(tmpFilename), "%s.tmp", filename) >= (int)sizeof(tmpFilename)) {
+		return false;
+	}
+
+	FILE * f;
+	if (fopen_s(&f, tmpFilename, "wb") != 0) {
+		return false;
+	}
+
+	u64 written = fwrite(data, 1, bytesize, f);
+	bool closed = fclose(f) == 0;
+	if (written != bytesize || !closed) {
+		remove(tmpFilename);
+		return false;
+	}
+	return MoveFileExA(tmpFilename, filename, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+}
+
 
 }
\ No newline at end of file
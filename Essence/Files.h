@@ -18,5 +18,7 @@ struct file_read_result_t {
 
 file_read_result_t	ReadEntireFile(const char* filename, IAllocator* allocator = GetMallocAllocator());
 void				FreeMemory(file_read_result_t read);
+// replaces the file at once, false and the old file kept if it can't be written whole
+bool				WriteEntireFile(const char* filename, const void* data, u64 bytesize);
 
 }
\ No newline at end of file
@@ -78,7 +78,7 @@ template<typename T> T		Front(Ringbuffer<T>const& Rb) {
 
 template<typename T> T const& At(Ringbuffer<T> const& Rb, u32 index) {
 	Check(Size(Rb));
-	return Rb.Buffer[(Rb.Begin + index) % Capacity(r)];
+	return Rb.Buffer[(Rb.Begin + index) % Capacity(Rb)];
 }
 
 template<typename T> void	PushBack(Ringbuffer<T>& Rb, T const& v) {
@@ -0,0 +1,1199 @@
+#include "Animation.h"
+#include "Essence.h"
+#include <DirectXMath.h>
+#include <float.h>
+#include <xmmintrin.h>
+#include <emmintrin.h>
+using namespace DirectX;
+
+namespace Essence {
+
+// max angle (radians) between nlerp and slerp inside a segment before it gets split
+const float ANIMATION_NLERP_TOLERANCE = 0.0005f;
+const u32 ANIMATION_MAX_REFINE_DEPTH = 8;
+const u32 ANIMATION_ERROR_SAMPLES = 64;
+// smallest three components of a unit quaternion lie in [-1/sqrt(2), 1/sqrt(2)]
+const float ANIMATION_ROTATION_RANGE = 0.70710678f;
+
+template<typename T>
+u32 FindKey(T const* keys, u32 keysNum, float time) {
+	// last key not after time
+	u32 lo = 0;
+	u32 hi = keysNum;
+	while (lo < hi) {
+		auto mid = (lo + hi) / 2;
+		if (keys[mid].time <= time) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo ? lo - 1 : 0;
+}
+
+template<typename T>
+float KeyBlend(T const* keys, u32 key, u32 next, float time) {
+	auto diffTime = keys[next].time - keys[key].time;
+	float blend = diffTime > 0 ? (time - keys[key].time) / diffTime : 0;
+	return min(max(blend, 0.f), 1.f);
+}
+
+xmvec SampleChannelPosition(animation_channel_t const& channel, float time) {
+	if (channel.position_keys_num == 0) {
+		return XMVectorZero();
+	}
+	auto p = FindKey(channel.position_keys, channel.position_keys_num, time);
+	auto next = min(p + 1, channel.position_keys_num - 1);
+	auto blend = KeyBlend(channel.position_keys, p, next, time);
+	return XMVectorLerp(XMLoadFloat3A(&channel.position_keys[p].value), XMLoadFloat3A(&channel.position_keys[next].value), blend);
+}
+
+xmvec SampleChannelRotation(animation_channel_t const& channel, float time) {
+	if (channel.rotation_keys_num == 0) {
+		return XMQuaternionIdentity();
+	}
+	auto r = FindKey(channel.rotation_keys, channel.rotation_keys_num, time);
+	auto next = min(r + 1, channel.rotation_keys_num - 1);
+	auto blend = KeyBlend(channel.rotation_keys, r, next, time);
+	return XMQuaternionSlerp(XMLoadFloat4(&channel.rotation_keys[r].value), XMLoadFloat4(&channel.rotation_keys[next].value), blend);
+}
+
+float NlerpError(xmvec q0, xmvec q1, float blend, xmvec reference) {
+	if (XMVectorGetX(XMQuaternionDot(q0, q1)) < 0) {
+		q1 = XMVectorNegate(q1);
+	}
+	auto q = XMQuaternionNormalize(XMVectorLerp(q0, q1, blend));
+	if (XMVectorGetX(XMQuaternionDot(q, reference)) < 0) {
+		reference = XMVectorNegate(reference);
+	}
+	// rotation angle from the chord, acos of the dot product is too noisy for small angles
+	auto chord = XMVectorGetX(XMVector4Length(XMVectorSubtract(q, reference)));
+	return 4.f * asinf(min(chord * 0.5f, 1.f));
+}
+
+void RefineSegment(animation_channel_t const* channels, u32 lanes, float t0, float t1, u32 depth, Array<float>* outTimes) {
+	if (depth >= ANIMATION_MAX_REFINE_DEPTH) {
+		return;
+	}
+
+	// nlerp drifts most around a quarter of the segment
+	float error = 0.f;
+	for (auto l = 0u; l < lanes; ++l) {
+		auto q0 = SampleChannelRotation(channels[l], t0);
+		auto q1 = SampleChannelRotation(channels[l], t1);
+		error = max(error, NlerpError(q0, q1, 0.25f, SampleChannelRotation(channels[l], t0 + (t1 - t0) * 0.25f)));
+		error = max(error, NlerpError(q0, q1, 0.75f, SampleChannelRotation(channels[l], t0 + (t1 - t0) * 0.75f)));
+	}
+
+	if (error > ANIMATION_NLERP_TOLERANCE) {
+		auto mid = (t0 + t1) * 0.5f;
+		RefineSegment(channels, lanes, t0, mid, depth + 1, outTimes);
+		PushBack(*outTimes, mid);
+		RefineSegment(channels, lanes, mid, t1, depth + 1, outTimes);
+	}
+}
+
+void BuildGroupTimeline(animation_channel_t const* channels, u32 lanes, Array<float>* outTimes) {
+	// merge already sorted key times of all channels in the group
+	u32 positionCursors[ANIMATION_GROUP_CHANNELS] = {};
+	u32 rotationCursors[ANIMATION_GROUP_CHANNELS] = {};
+
+	Array<float> merged(GetThreadScratchAllocator());
+	while (true) {
+		float next = FLT_MAX;
+		for (auto l = 0u; l < lanes; ++l) {
+			if (positionCursors[l] < channels[l].position_keys_num) {
+				next = min(next, channels[l].position_keys[positionCursors[l]].time);
+			}
+			if (rotationCursors[l] < channels[l].rotation_keys_num) {
+				next = min(next, channels[l].rotation_keys[rotationCursors[l]].time);
+			}
+		}
+		if (next == FLT_MAX) {
+			break;
+		}
+		for (auto l = 0u; l < lanes; ++l) {
+			while (positionCursors[l] < channels[l].position_keys_num && channels[l].position_keys[positionCursors[l]].time <= next) {
+				++positionCursors[l];
+			}
+			while (rotationCursors[l] < channels[l].rotation_keys_num && channels[l].rotation_keys[rotationCursors[l]].time <= next) {
+				++rotationCursors[l];
+			}
+		}
+		PushBack(merged, next);
+	}
+
+	if (Size(merged) == 0) {
+		PushBack(merged, 0.f);
+	}
+
+	for (auto i = 0u; i < Size(merged); ++i) {
+		PushBack(*outTimes, merged[i]);
+		if (i + 1 < Size(merged)) {
+			RefineSegment(channels, lanes, merged[i], merged[i + 1], 0, outTimes);
+		}
+	}
+}
+
+void LerpKeys(animation_soa_key_t const& key, animation_soa_key_t const& nextKey, float blend, animation_soa_key_t* outKey) {
+	auto w = _mm_set1_ps(blend);
+	for (auto i = 0u; i < 3; ++i) {
+		outKey->translation[i] = _mm_add_ps(key.translation[i], _mm_mul_ps(_mm_sub_ps(nextKey.translation[i], key.translation[i]), w));
+	}
+	// not normalized, consumers fold the normalization in
+	for (auto i = 0u; i < 4; ++i) {
+		outKey->rotation[i] = _mm_add_ps(key.rotation[i], _mm_mul_ps(_mm_sub_ps(nextKey.rotation[i], key.rotation[i]), w));
+	}
+}
+
+// elements[r][c] holds element r, c of the local matrices of all four lanes
+void KeyTransformElements(animation_soa_key_t const& key, xmvec (&rows)[4][4]) {
+	auto zero = _mm_setzero_ps();
+	auto one = _mm_set1_ps(1.f);
+	auto two = _mm_set1_ps(2.f);
+
+	auto x = key.rotation[0];
+	auto y = key.rotation[1];
+	auto z = key.rotation[2];
+	auto q = key.rotation[3];
+
+	auto lengthSq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_add_ps(_mm_mul_ps(z, z), _mm_mul_ps(q, q)));
+	// 2 / |q|^2 folds normalization into the matrix terms
+	auto s = _mm_div_ps(two, lengthSq);
+
+	auto xs = _mm_mul_ps(x, s);
+	auto ys = _mm_mul_ps(y, s);
+	auto zs = _mm_mul_ps(z, s);
+	auto xx = _mm_mul_ps(x, xs);
+	auto yy = _mm_mul_ps(y, ys);
+	auto zz = _mm_mul_ps(z, zs);
+	auto xy = _mm_mul_ps(x, ys);
+	auto xz = _mm_mul_ps(x, zs);
+	auto yz = _mm_mul_ps(y, zs);
+	auto wx = _mm_mul_ps(q, xs);
+	auto wy = _mm_mul_ps(q, ys);
+	auto wz = _mm_mul_ps(q, zs);
+
+	// same layout as XMMatrixRotationQuaternion, one matrix element per register
+	rows[0][0] = _mm_sub_ps(one, _mm_add_ps(yy, zz));
+	rows[0][1] = _mm_add_ps(xy, wz);
+	rows[0][2] = _mm_sub_ps(xz, wy);
+	rows[0][3] = zero;
+	rows[1][0] = _mm_sub_ps(xy, wz);
+	rows[1][1] = _mm_sub_ps(one, _mm_add_ps(xx, zz));
+	rows[1][2] = _mm_add_ps(yz, wx);
+	rows[1][3] = zero;
+	rows[2][0] = _mm_add_ps(xz, wy);
+	rows[2][1] = _mm_sub_ps(yz, wx);
+	rows[2][2] = _mm_sub_ps(one, _mm_add_ps(xx, yy));
+	rows[2][3] = zero;
+	rows[3][0] = key.translation[0];
+	rows[3][1] = key.translation[1];
+	rows[3][2] = key.translation[2];
+	rows[3][3] = one;
+}
+
+// local matrices of the four lanes, rows[r][l] is row r of lane l
+void KeyTransformRows(animation_soa_key_t const& key, xmvec (&rows)[4][4]) {
+	KeyTransformElements(key, rows);
+	for (auto r = 0u; r < 4; ++r) {
+		_MM_TRANSPOSE4_PS(rows[r][0], rows[r][1], rows[r][2], rows[r][3]);
+	}
+}
+
+// columns[c][l] is column c of lane l, the last column of an affine matrix is left out
+void KeyTransformColumns(animation_soa_key_t const& key, xmvec (&columns)[3][4]) {
+	// rows before the transpose hold one element per register for all lanes
+	xmvec elements[4][4];
+	KeyTransformElements(key, elements);
+
+	for (auto c = 0u; c < 3; ++c) {
+		columns[c][0] = elements[0][c];
+		columns[c][1] = elements[1][c];
+		columns[c][2] = elements[2][c];
+		columns[c][3] = elements[3][c];
+		_MM_TRANSPOSE4_PS(columns[c][0], columns[c][1], columns[c][2], columns[c][3]);
+	}
+}
+
+// writes local matrices of the first lanes
+void WriteKeyTransforms(animation_soa_key_t const& key, u32 lanes, xmmatrix* outTransforms) {
+	xmvec rows[4][4];
+	KeyTransformRows(key, rows);
+
+	for (auto l = 0u; l < lanes; ++l) {
+		outTransforms[l].r[0] = rows[0][l];
+		outTransforms[l].r[1] = rows[1][l];
+		outTransforms[l].r[2] = rows[2][l];
+		outTransforms[l].r[3] = rows[3][l];
+	}
+}
+
+bone_transform_t AffineColumns(xmmatrix const& m) {
+	auto t = XMMatrixTranspose(m);
+	return { { t.r[0], t.r[1], t.r[2] } };
+}
+
+// a * b in column form, columns of a combine by the elements of each column of b
+bone_transform_t MultiplyAffineColumns(bone_transform_t const& a, bone_transform_t const& b) {
+	auto lastColumn = _mm_castsi128_ps(_mm_set_epi32(-1, 0, 0, 0));
+	bone_transform_t result;
+	for (auto c = 0u; c < 3; ++c) {
+		auto column = b.columns[c];
+		auto v = _mm_mul_ps(a.columns[0], _mm_shuffle_ps(column, column, _MM_SHUFFLE(0, 0, 0, 0)));
+		v = _mm_add_ps(v, _mm_mul_ps(a.columns[1], _mm_shuffle_ps(column, column, _MM_SHUFFLE(1, 1, 1, 1))));
+		v = _mm_add_ps(v, _mm_mul_ps(a.columns[2], _mm_shuffle_ps(column, column, _MM_SHUFFLE(2, 2, 2, 2))));
+		// translation row of a is the only one with a 1 in the last column
+		result.columns[c] = _mm_add_ps(v, _mm_and_ps(column, lastColumn));
+	}
+	return result;
+}
+
+__m128i LoadPackedLanes(u16 const* lanes) {
+	return _mm_unpacklo_epi16(_mm_loadl_epi64((__m128i const*)lanes), _mm_setzero_si128());
+}
+
+xmvec SelectLanes(__m128i mask, xmvec a, xmvec b) {
+	auto m = _mm_castsi128_ps(mask);
+	return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b));
+}
+
+void DecodeKey(animation_group_t const& group, animation_packed_key_t const& packed, animation_soa_key_t* outKey) {
+	for (auto i = 0u; i < 3; ++i) {
+		auto q = _mm_cvtepi32_ps(LoadPackedLanes(packed.translation[i]));
+		outKey->translation[i] = _mm_add_ps(group.translation_min[i], _mm_mul_ps(q, group.translation_scale[i]));
+	}
+
+	auto r0 = LoadPackedLanes(packed.rotation[0]);
+	auto r1 = LoadPackedLanes(packed.rotation[1]);
+	auto r2 = LoadPackedLanes(packed.rotation[2]);
+	auto valueMask = _mm_set1_epi32(0x7FFF);
+	auto scale = _mm_set1_ps(ANIMATION_ROTATION_RANGE * 2.f / 32767.f);
+	auto bias = _mm_set1_ps(ANIMATION_ROTATION_RANGE);
+
+	auto a = _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(r0, valueMask)), scale), bias);
+	auto b = _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(r1, valueMask)), scale), bias);
+	auto c = _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(r2, valueMask)), scale), bias);
+
+	auto sum = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a, a), _mm_mul_ps(b, b)), _mm_mul_ps(c, c));
+	auto largest = _mm_sqrt_ps(_mm_max_ps(_mm_sub_ps(_mm_set1_ps(1.f), sum), _mm_setzero_ps()));
+	// top bit of the third component keeps the sign of the dropped one, so tracks stay in one hemisphere
+	largest = _mm_xor_ps(largest, _mm_castsi128_ps(_mm_slli_epi32(_mm_srli_epi32(r2, 15), 31)));
+
+	auto index = _mm_or_si128(_mm_srli_epi32(r0, 15), _mm_slli_epi32(_mm_srli_epi32(r1, 15), 1));
+	auto is0 = _mm_cmpeq_epi32(index, _mm_setzero_si128());
+	auto is1 = _mm_cmpeq_epi32(index, _mm_set1_epi32(1));
+	auto is2 = _mm_cmpeq_epi32(index, _mm_set1_epi32(2));
+	auto is3 = _mm_cmpeq_epi32(index, _mm_set1_epi32(3));
+
+	outKey->rotation[0] = SelectLanes(is0, largest, a);
+	outKey->rotation[1] = SelectLanes(is0, a, SelectLanes(is1, largest, b));
+	outKey->rotation[2] = SelectLanes(_mm_or_si128(is0, is1), b, SelectLanes(is2, largest, c));
+	outKey->rotation[3] = SelectLanes(is3, largest, c);
+}
+
+u16 QuantizeRotationComponent(float value) {
+	auto normalized = (value + ANIMATION_ROTATION_RANGE) / (ANIMATION_ROTATION_RANGE * 2.f);
+	return (u16)min(max(normalized * 32767.f + 0.5f, 0.f), 32767.f);
+}
+
+void PackRotation(float4 q, animation_packed_key_t* outKey, u32 lane) {
+	float c[4] = { q.x, q.y, q.z, q.w };
+	u32 index = 0;
+	for (auto i = 1u; i < 4; ++i) {
+		if (fabsf(c[i]) > fabsf(c[index])) {
+			index = i;
+		}
+	}
+
+	u16 packed[3];
+	for (auto i = 0u, j = 0u; i < 4; ++i) {
+		if (i != index) {
+			packed[j++] = QuantizeRotationComponent(c[i]);
+		}
+	}
+	packed[0] |= (index & 1) << 15;
+	packed[1] |= (index >> 1) << 15;
+	packed[2] |= (c[index] < 0) << 15;
+
+	for (auto i = 0u; i < 3; ++i) {
+		outKey->rotation[i][lane] = packed[i];
+	}
+}
+
+void PackGroupKeys(animation_soa_key_t const* keys, u32 keysNum, animation_group_t* group, animation_packed_key_t* outKeys) {
+	xmvec minimum[3];
+	xmvec maximum[3];
+	for (auto i = 0u; i < 3; ++i) {
+		minimum[i] = keys[0].translation[i];
+		maximum[i] = keys[0].translation[i];
+		for (auto k = 1u; k < keysNum; ++k) {
+			minimum[i] = _mm_min_ps(minimum[i], keys[k].translation[i]);
+			maximum[i] = _mm_max_ps(maximum[i], keys[k].translation[i]);
+		}
+		group->translation_min[i] = minimum[i];
+		group->translation_scale[i] = _mm_div_ps(_mm_sub_ps(maximum[i], minimum[i]), _mm_set1_ps(65535.f));
+	}
+
+	for (auto k = 0u; k < keysNum; ++k) {
+		float4a translation[3];
+		float4a rotation[4];
+		for (auto i = 0u; i < 3; ++i) {
+			XMStoreFloat4A(&translation[i], _mm_div_ps(_mm_sub_ps(keys[k].translation[i], group->translation_min[i]), group->translation_scale[i]));
+		}
+		for (auto i = 0u; i < 4; ++i) {
+			XMStoreFloat4A(&rotation[i], keys[k].rotation[i]);
+		}
+
+		for (auto l = 0u; l < ANIMATION_GROUP_CHANNELS; ++l) {
+			for (auto i = 0u; i < 3; ++i) {
+				// constant tracks divide by zero scale
+				auto value = (&translation[i].x)[l];
+				outKeys[k].translation[i][l] = value == value ? (u16)min(max(value + 0.5f, 0.f), 65535.f) : 0;
+			}
+			PackRotation(float4((&rotation[0].x)[l], (&rotation[1].x)[l], (&rotation[2].x)[l], (&rotation[3].x)[l]), &outKeys[k], l);
+		}
+	}
+}
+
+// per lane displacement at the bone tip between a sampled key and the reference
+xmvec KeyError(animation_soa_key_t const& key, animation_soa_key_t const& reference, xmvec tipDistance) {
+	auto translationSq = _mm_setzero_ps();
+	for (auto i = 0u; i < 3; ++i) {
+		auto d = _mm_sub_ps(key.translation[i], reference.translation[i]);
+		translationSq = _mm_add_ps(translationSq, _mm_mul_ps(d, d));
+	}
+
+	auto lengthSq = _mm_setzero_ps();
+	auto dot = _mm_setzero_ps();
+	for (auto i = 0u; i < 4; ++i) {
+		lengthSq = _mm_add_ps(lengthSq, _mm_mul_ps(key.rotation[i], key.rotation[i]));
+		dot = _mm_add_ps(dot, _mm_mul_ps(key.rotation[i], reference.rotation[i]));
+	}
+	auto invLength = _mm_div_ps(_mm_set1_ps(1.f), _mm_sqrt_ps(lengthSq));
+	auto sign = _mm_and_ps(dot, _mm_castsi128_ps(_mm_set1_epi32(0x80000000)));
+
+	auto chordSq = _mm_setzero_ps();
+	for (auto i = 0u; i < 4; ++i) {
+		auto d = _mm_sub_ps(_mm_mul_ps(key.rotation[i], invLength), _mm_xor_ps(reference.rotation[i], sign));
+		chordSq = _mm_add_ps(chordSq, _mm_mul_ps(d, d));
+	}
+
+	// tip moves by 2 sin(angle / 2) * distance, with angle = 4 asin(chord / 2)
+	auto chord = _mm_sqrt_ps(chordSq);
+	auto cosine = _mm_sqrt_ps(_mm_max_ps(_mm_sub_ps(_mm_set1_ps(1.f), _mm_mul_ps(chordSq, _mm_set1_ps(0.25f))), _mm_setzero_ps()));
+	auto displacement = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(_mm_set1_ps(2.f), chord), cosine), tipDistance);
+
+	return _mm_add_ps(_mm_sqrt_ps(translationSq), displacement);
+}
+
+bool SegmentWithinBudget(animation_soa_key_t const* reference, animation_soa_key_t const* decoded, float const* times, u32 from, u32 to, xmvec tipDistance, xmvec budget) {
+	for (auto k = from + 1; k < to; ++k) {
+		animation_soa_key_t key;
+		LerpKeys(decoded[from], decoded[to], (times[k] - times[from]) / (times[to] - times[from]), &key);
+		if (_mm_movemask_ps(_mm_cmpgt_ps(KeyError(key, reference[k], tipDistance), budget))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void SampleGroupKeys(animation_channel_t const* channels, u32 lanes, float const* times, u32 keysNum, animation_soa_key_t* outKeys) {
+	float4 previous[ANIMATION_GROUP_CHANNELS];
+	for (auto k = 0u; k < keysNum; ++k) {
+		float4a translation[ANIMATION_GROUP_CHANNELS];
+		float4a rotation[ANIMATION_GROUP_CHANNELS];
+		for (auto l = 0u; l < ANIMATION_GROUP_CHANNELS; ++l) {
+			auto p = XMVectorZero();
+			auto q = XMQuaternionIdentity();
+			if (l < lanes) {
+				p = SampleChannelPosition(channels[l], times[k]);
+				q = SampleChannelRotation(channels[l], times[k]);
+				if (k && XMVectorGetX(XMQuaternionDot(q, XMLoadFloat4(&previous[l]))) < 0) {
+					q = XMVectorNegate(q);
+				}
+			}
+			XMStoreFloat4(&previous[l], q);
+			XMStoreFloat4A(&translation[l], p);
+			XMStoreFloat4A(&rotation[l], q);
+		}
+
+		// transpose lanes into SoA
+		xmvec tx = XMLoadFloat4A(&translation[0]);
+		xmvec ty = XMLoadFloat4A(&translation[1]);
+		xmvec tz = XMLoadFloat4A(&translation[2]);
+		xmvec tw = XMLoadFloat4A(&translation[3]);
+		_MM_TRANSPOSE4_PS(tx, ty, tz, tw);
+		outKeys[k].translation[0] = tx;
+		outKeys[k].translation[1] = ty;
+		outKeys[k].translation[2] = tz;
+
+		xmvec rx = XMLoadFloat4A(&rotation[0]);
+		xmvec ry = XMLoadFloat4A(&rotation[1]);
+		xmvec rz = XMLoadFloat4A(&rotation[2]);
+		xmvec rw = XMLoadFloat4A(&rotation[3]);
+		_MM_TRANSPOSE4_PS(rx, ry, rz, rw);
+		outKeys[k].rotation[0] = rx;
+		outKeys[k].rotation[1] = ry;
+		outKeys[k].rotation[2] = rz;
+		outKeys[k].rotation[3] = rw;
+	}
+}
+
+void BuildKeyBuckets(animation_group_t* group, float const* times, Array<u16>* outBuckets) {
+	group->buckets_offset = (u32)Size(*outBuckets);
+	group->first_time = times[0];
+	group->bucket_scale = 0.f;
+	group->buckets_num = 1;
+
+	auto span = times[group->keys_num - 1] - times[0];
+	if (group->keys_num > 1 && span > 0.f) {
+		// bucket no wider than the closest keys holds at most one key boundary
+		auto minGap = span;
+		for (auto k = 0u; k + 1 < group->keys_num; ++k) {
+			minGap = min(minGap, times[k + 1] - times[k]);
+		}
+		auto bucketsNum = (u32)ceilf(span / minGap);
+		group->buckets_num = min(max(bucketsNum, 1u), group->keys_num * ANIMATION_BUCKETS_PER_KEY);
+		group->bucket_scale = group->buckets_num / span;
+	}
+
+	auto k = 0u;
+	for (auto b = 0u; b < group->buckets_num; ++b) {
+		auto bucketStart = group->first_time + b / (group->bucket_scale ? group->bucket_scale : 1.f);
+		while (k + 1 < group->keys_num && times[k + 1] <= bucketStart) {
+			++k;
+		}
+		PushBack(*outBuckets, (u16)k);
+	}
+}
+
+void BuildAnimation(
+	animation_t* outAnimation,
+	animation_channel_t const* channels,
+	u32 channelsNum,
+	float duration,
+	float ticksPerSecond,
+	animation_channel_weight_t const* weights,
+	float errorBudget,
+	animation_compression_stats_t* outStats) {
+
+	animation_t animation = {};
+	animation.duration = duration;
+	animation.ticks_per_second = ticksPerSecond;
+	animation.channels_num = channelsNum;
+	animation.groups_num = (channelsNum + ANIMATION_GROUP_CHANNELS - 1) / ANIMATION_GROUP_CHANNELS;
+
+	allocate_c_array(animation.groups, GetMallocAllocator(), animation.groups_num);
+
+	animation_compression_stats_t stats = {};
+
+	Array<float> times(GetThreadScratchAllocator());
+	Array<animation_packed_key_t> keys(GetThreadScratchAllocator());
+	for (auto g = 0u; g < animation.groups_num; ++g) {
+		auto& group = animation.groups[g];
+		auto first = g * ANIMATION_GROUP_CHANNELS;
+		auto lanes = min(ANIMATION_GROUP_CHANNELS, channelsNum - first);
+
+		Array<float> groupTimes(GetThreadScratchAllocator());
+		BuildGroupTimeline(channels + first, lanes, &groupTimes);
+		auto groupKeysNum = (u32)Size(groupTimes);
+
+		Array<animation_soa_key_t> reference(GetThreadScratchAllocator());
+		Array<animation_packed_key_t> packed(GetThreadScratchAllocator());
+		Array<animation_soa_key_t> decoded(GetThreadScratchAllocator());
+		Resize(reference, groupKeysNum);
+		Resize(packed, groupKeysNum);
+		Resize(decoded, groupKeysNum);
+
+		SampleGroupKeys(channels + first, lanes, groupTimes.DataPtr, groupKeysNum, reference.DataPtr);
+		PackGroupKeys(reference.DataPtr, groupKeysNum, &group, packed.DataPtr);
+		for (auto k = 0u; k < groupKeysNum; ++k) {
+			DecodeKey(group, packed[k], &decoded[k]);
+		}
+
+		float4a tipDistance;
+		float4a budget;
+		for (auto l = 0u; l < ANIMATION_GROUP_CHANNELS; ++l) {
+			(&tipDistance.x)[l] = l < lanes ? (weights ? weights[first + l].tip_distance : 1.f) : 0.f;
+			(&budget.x)[l] = l < lanes ? errorBudget * (weights ? weights[first + l].budget_share : 1.f) : FLT_MAX;
+		}
+
+		// greedy: drop a key while interpolating its kept neighbours stays in budget for every key in between
+		group.keys_offset = (u32)Size(times);
+		PushBack(times, groupTimes[0]);
+		PushBack(keys, packed[0]);
+		auto from = 0u;
+		for (auto k = 1u; k + 1 < groupKeysNum; ++k) {
+			if (!SegmentWithinBudget(reference.DataPtr, decoded.DataPtr, groupTimes.DataPtr, from, k + 1, XMLoadFloat4A(&tipDistance), XMLoadFloat4A(&budget))) {
+				PushBack(times, groupTimes[k]);
+				PushBack(keys, packed[k]);
+				from = k;
+			}
+		}
+		if (groupKeysNum > 1) {
+			PushBack(times, groupTimes[groupKeysNum - 1]);
+			PushBack(keys, packed[groupKeysNum - 1]);
+		}
+		group.keys_num = (u32)Size(times) - group.keys_offset;
+		Check(group.keys_num < SHORT_NULL_INDEX);
+
+		stats.sampled_keys_num += groupKeysNum;
+	}
+
+	auto keysNum = (u32)Size(times);
+	allocate_c_array(animation.key_times, GetMallocAllocator(), keysNum);
+	allocate_c_array(animation.keys, GetMallocAllocator(), keysNum);
+	memcpy(animation.key_times, times.DataPtr, sizeof(float) * keysNum);
+	memcpy(animation.keys, keys.DataPtr, sizeof(animation_packed_key_t) * keysNum);
+
+	Array<u16> buckets(GetThreadScratchAllocator());
+	for (auto g = 0u; g < animation.groups_num; ++g) {
+		BuildKeyBuckets(&animation.groups[g], animation.key_times + animation.groups[g].keys_offset, &buckets);
+	}
+	allocate_c_array(animation.key_buckets, GetMallocAllocator(), (u32)Size(buckets));
+	memcpy(animation.key_buckets, buckets.DataPtr, sizeof(u16) * Size(buckets));
+
+	if (outStats) {
+		for (auto c = 0u; c < channelsNum; ++c) {
+			stats.raw_keys_num += channels[c].position_keys_num + channels[c].rotation_keys_num;
+			stats.raw_size += channels[c].position_keys_num * sizeof(position_key_t) + channels[c].rotation_keys_num * sizeof(rotation_key_t);
+		}
+		stats.keys_num = keysNum;
+		stats.compressed_size = animation.groups_num * sizeof(animation_group_t) + keysNum * (sizeof(float) + sizeof(animation_packed_key_t)) + (u32)Size(buckets) * sizeof(u16);
+		*outStats = stats;
+	}
+
+	*outAnimation = animation;
+}
+
+void FreeAnimation(animation_t* animation) {
+	GetMallocAllocator()->Free(animation->groups);
+	GetMallocAllocator()->Free(animation->key_times);
+	GetMallocAllocator()->Free(animation->keys);
+	GetMallocAllocator()->Free(animation->key_buckets);
+	*animation = {};
+}
+
+float ComputeChannelWeights(animation_skeleton_t const* skeleton, u32 channelsNum, animation_channel_weight_t* outWeights) {
+	auto nodesNum = skeleton->nodes_num;
+
+	Array<float> tipDistances(GetThreadScratchAllocator());
+	Array<u32> animatedAbove(GetThreadScratchAllocator());
+	Array<u32> animatedBelow(GetThreadScratchAllocator());
+	Resize(tipDistances, nodesNum);
+	Resize(animatedAbove, nodesNum);
+	Resize(animatedBelow, nodesNum);
+
+	// nodes are stored parents first
+	for (auto n = 0u; n < nodesNum; ++n) {
+		auto animated = skeleton->node_channel_indices[n] != SHORT_NULL_INDEX ? 1u : 0u;
+		auto parent = skeleton->node_parents[n];
+		animatedAbove[n] = (parent != SHORT_NULL_INDEX ? animatedAbove[parent] : 0u) + animated;
+		animatedBelow[n] = 0;
+		// a node without children still carries a bone about as long as the one leading to it
+		tipDistances[n] = XMVectorGetX(XMVector3Length(skeleton->node_local_transforms[n].r[3]));
+	}
+
+	for (auto n = nodesNum; n-- > 0;) {
+		animatedBelow[n] += skeleton->node_channel_indices[n] != SHORT_NULL_INDEX ? 1u : 0u;
+		auto parent = skeleton->node_parents[n];
+		if (parent != SHORT_NULL_INDEX) {
+			auto length = XMVectorGetX(XMVector3Length(skeleton->node_local_transforms[n].r[3]));
+			tipDistances[parent] = max(tipDistances[parent], tipDistances[n] + length);
+			animatedBelow[parent] = max(animatedBelow[parent], animatedBelow[n]);
+		}
+	}
+
+	for (auto c = 0u; c < channelsNum; ++c) {
+		outWeights[c].tip_distance = 0.f;
+		outWeights[c].budget_share = 1.f;
+	}
+
+	float size = 0.f;
+	for (auto n = 0u; n < nodesNum; ++n) {
+		size = max(size, tipDistances[n]);
+		auto channel = skeleton->node_channel_indices[n];
+		if (channel != SHORT_NULL_INDEX && channel < channelsNum) {
+			// errors of all channels along the longest chain through the node add up at its tip
+			auto chain = animatedAbove[n] + animatedBelow[n] - 1;
+			outWeights[channel].tip_distance = tipDistances[n];
+			outWeights[channel].budget_share = 1.f / chain;
+		}
+	}
+	return size;
+}
+
+float AnimationTicks(animation_t const* Animation, float Time) {
+	auto duration = Animation->duration;
+	return duration ? fmodf(Time * Animation->ticks_per_second, duration) : 0;
+}
+
+void SampleGroup(animation_t const* Animation, u32 g, float time, animation_soa_key_t* outKey) {
+	auto& group = Animation->groups[g];
+	auto times = Animation->key_times + group.keys_offset;
+	auto keys = Animation->keys + group.keys_offset;
+
+	auto bucket = (u32)min(max((time - group.first_time) * group.bucket_scale, 0.f), (float)(group.buckets_num - 1));
+	auto k = (u32)Animation->key_buckets[group.buckets_offset + bucket];
+	// rounding at bucket edges can land one key late
+	if (k && times[k] > time) {
+		--k;
+	}
+	while ((k + 1) < group.keys_num && times[k + 1] <= time) {
+		++k;
+	}
+
+	auto next = min(k + 1, group.keys_num - 1);
+	auto diffTime = times[next] - times[k];
+	float blend = diffTime > 0 ? (time - times[k]) / diffTime : 0;
+	blend = min(max(blend, 0.f), 1.f);
+
+	animation_soa_key_t key, nextKey;
+	DecodeKey(group, keys[k], &key);
+	DecodeKey(group, keys[next], &nextKey);
+	LerpKeys(key, nextKey, blend, outKey);
+}
+
+void calculate_animation_frames(
+	animation_t const* Animation,
+	animation_state_t* AnimationState,
+	float Time,
+	Array<xmmatrix> *outTransforms
+	) {
+	Array<xmmatrix>& transforms = *outTransforms;
+
+	auto channelsNum = Animation->channels_num;
+	Resize(transforms, channelsNum);
+
+	float time = AnimationTicks(Animation, Time);
+
+	for (auto g = 0u; g < Animation->groups_num; ++g) {
+		animation_soa_key_t sampled;
+		SampleGroup(Animation, g, time, &sampled);
+
+		auto first = g * ANIMATION_GROUP_CHANNELS;
+		WriteKeyTransforms(sampled, min(ANIMATION_GROUP_CHANNELS, channelsNum - first), transforms.DataPtr + first);
+	}
+
+	AnimationState->last_scaled_time = time;
+}
+
+u32 PoseGroupsNum(u32 channelsNum) {
+	return (channelsNum + ANIMATION_GROUP_CHANNELS - 1) / ANIMATION_GROUP_CHANNELS;
+}
+
+void NormalizeRotation(xmvec* rotation) {
+	auto lengthSq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(rotation[0], rotation[0]), _mm_mul_ps(rotation[1], rotation[1])),
+		_mm_add_ps(_mm_mul_ps(rotation[2], rotation[2]), _mm_mul_ps(rotation[3], rotation[3])));
+	auto scale = _mm_div_ps(_mm_set1_ps(1.f), _mm_sqrt_ps(lengthSq));
+	for (auto i = 0u; i < 4; ++i) {
+		rotation[i] = _mm_mul_ps(rotation[i], scale);
+	}
+}
+
+// flips lanes pointing away from the reference, so lerps take the short way
+void AlignRotation(xmvec const* reference, xmvec const* rotation, xmvec* outRotation) {
+	auto d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(reference[0], rotation[0]), _mm_mul_ps(reference[1], rotation[1])),
+		_mm_add_ps(_mm_mul_ps(reference[2], rotation[2]), _mm_mul_ps(reference[3], rotation[3])));
+	auto sign = _mm_and_ps(_mm_cmplt_ps(d, _mm_setzero_ps()), _mm_set1_ps(-0.f));
+	for (auto i = 0u; i < 4; ++i) {
+		outRotation[i] = _mm_xor_ps(rotation[i], sign);
+	}
+}
+
+// hamilton product a * b, b is applied first
+void MultiplyRotations(xmvec const* a, xmvec const* b, xmvec* outRotation) {
+	auto x = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[3], b[0]), _mm_mul_ps(a[0], b[3])), _mm_sub_ps(_mm_mul_ps(a[1], b[2]), _mm_mul_ps(a[2], b[1])));
+	auto y = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(a[3], b[1]), _mm_mul_ps(a[0], b[2])), _mm_add_ps(_mm_mul_ps(a[1], b[3]), _mm_mul_ps(a[2], b[0])));
+	auto z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[3], b[2]), _mm_mul_ps(a[0], b[1])), _mm_sub_ps(_mm_mul_ps(a[2], b[3]), _mm_mul_ps(a[1], b[0])));
+	auto w = _mm_sub_ps(_mm_sub_ps(_mm_mul_ps(a[3], b[3]), _mm_mul_ps(a[0], b[0])), _mm_add_ps(_mm_mul_ps(a[1], b[1]), _mm_mul_ps(a[2], b[2])));
+	outRotation[0] = x;
+	outRotation[1] = y;
+	outRotation[2] = z;
+	outRotation[3] = w;
+}
+
+xmvec LayerWeight(animation_mask_t const* Mask, u32 g, float Weight) {
+	auto weight = _mm_set1_ps(Weight);
+	return Mask ? _mm_mul_ps(Mask->weights[g], weight) : weight;
+}
+
+void BuildSkeletonPoseData(animation_skeleton_t* skeleton) {
+	u32 channelsNum = 0;
+	for (auto n = 0u; n < skeleton->nodes_num; ++n) {
+		if (skeleton->node_channel_indices[n] != SHORT_NULL_INDEX) {
+			channelsNum = max(channelsNum, skeleton->node_channel_indices[n] + 1u);
+		}
+	}
+	skeleton->channels_num = channelsNum;
+
+	auto groupsNum = PoseGroupsNum(channelsNum);
+	Array<float4a> translations(GetThreadScratchAllocator());
+	Array<float4a> rotations(GetThreadScratchAllocator());
+	// channels without a node stay identity
+	Resize(translations, groupsNum * ANIMATION_GROUP_CHANNELS);
+	Resize(rotations, groupsNum * ANIMATION_GROUP_CHANNELS);
+	for (auto c = 0u; c < Size(translations); ++c) {
+		translations[c] = float4a(0, 0, 0, 0);
+		rotations[c] = float4a(0, 0, 0, 1);
+	}
+
+	for (auto n = 0u; n < skeleton->nodes_num; ++n) {
+		auto channel = skeleton->node_channel_indices[n];
+		if (channel != SHORT_NULL_INDEX) {
+			xmvec scale, rotation, translation;
+			XMMatrixDecompose(&scale, &rotation, &translation, skeleton->node_local_transforms[n]);
+			XMStoreFloat4A(&translations[channel], translation);
+			XMStoreFloat4A(&rotations[channel], rotation);
+		}
+	}
+
+	allocate_c_array(skeleton->channel_node_indices, GetMallocAllocator(), groupsNum * ANIMATION_GROUP_CHANNELS);
+	for (auto c = 0u; c < groupsNum * ANIMATION_GROUP_CHANNELS; ++c) {
+		skeleton->channel_node_indices[c] = SHORT_NULL_INDEX;
+	}
+	for (auto n = 0u; n < skeleton->nodes_num; ++n) {
+		if (skeleton->node_channel_indices[n] != SHORT_NULL_INDEX) {
+			skeleton->channel_node_indices[skeleton->node_channel_indices[n]] = (u16)n;
+		}
+	}
+
+	allocate_c_array(skeleton->bind_pose, GetMallocAllocator(), groupsNum);
+	for (auto g = 0u; g < groupsNum; ++g) {
+		auto first = g * ANIMATION_GROUP_CHANNELS;
+		xmvec t[4] = { XMLoadFloat4A(&translations[first]), XMLoadFloat4A(&translations[first + 1]), XMLoadFloat4A(&translations[first + 2]), XMLoadFloat4A(&translations[first + 3]) };
+		xmvec r[4] = { XMLoadFloat4A(&rotations[first]), XMLoadFloat4A(&rotations[first + 1]), XMLoadFloat4A(&rotations[first + 2]), XMLoadFloat4A(&rotations[first + 3]) };
+		_MM_TRANSPOSE4_PS(t[0], t[1], t[2], t[3]);
+		_MM_TRANSPOSE4_PS(r[0], r[1], r[2], r[3]);
+
+		auto& key = skeleton->bind_pose[g];
+		for (auto i = 0u; i < 3; ++i) {
+			key.translation[i] = t[i];
+		}
+		for (auto i = 0u; i < 4; ++i) {
+			key.rotation[i] = r[i];
+		}
+	}
+
+	Array<u32> depths(GetThreadScratchAllocator());
+	Resize(depths, skeleton->nodes_num);
+	u32 maxDepth = 0;
+	for (auto n = 0u; n < skeleton->nodes_num; ++n) {
+		auto parent = skeleton->node_parents[n];
+		depths[n] = parent != SHORT_NULL_INDEX ? depths[parent] + 1 : 0;
+		maxDepth = max(maxDepth, depths[n]);
+	}
+
+	// a leading run of nodes always contains its parents, even if the order isn't strictly by depth
+	for (auto l = 0u; l < ANIMATION_LODS; ++l) {
+		auto depthLimit = maxDepth * (ANIMATION_LODS - l) / ANIMATION_LODS;
+		auto nodesNum = 0u;
+		while (nodesNum < skeleton->nodes_num && depths[nodesNum] <= depthLimit) {
+			++nodesNum;
+		}
+		skeleton->lod_nodes_num[l] = nodesNum;
+
+		skeleton->lod_bones_num[l] = 0;
+		for (auto b = 0u; b < skeleton->bones_num; ++b) {
+			skeleton->lod_bones_num[l] += skeleton->bone_node_indices[b] < nodesNum;
+		}
+	}
+
+	allocate_c_array(skeleton->group_lods, GetMallocAllocator(), groupsNum);
+	ZeroMemory(skeleton->group_lods, groupsNum);
+	for (auto n = 0u; n < skeleton->nodes_num; ++n) {
+		auto channel = skeleton->node_channel_indices[n];
+		if (channel == SHORT_NULL_INDEX) {
+			continue;
+		}
+		auto lod = 0u;
+		while (lod + 1 < ANIMATION_LODS && n < skeleton->lod_nodes_num[lod + 1]) {
+			++lod;
+		}
+		auto& groupLod = skeleton->group_lods[channel / ANIMATION_GROUP_CHANNELS];
+		groupLod = (u8)max((u32)groupLod, lod);
+	}
+
+	allocate_c_array(skeleton->node_local_columns, GetMallocAllocator(), skeleton->nodes_num);
+	for (auto n = 0u; n < skeleton->nodes_num; ++n) {
+		skeleton->node_local_columns[n] = AffineColumns(skeleton->node_local_transforms[n]);
+	}
+	allocate_c_array(skeleton->bone_offset_columns, GetMallocAllocator(), skeleton->bones_num);
+	for (auto b = 0u; b < skeleton->bones_num; ++b) {
+		skeleton->bone_offset_columns[b] = AffineColumns(skeleton->bone_offsets[b]);
+	}
+}
+
+void FreeSkeletonPoseData(animation_skeleton_t* skeleton) {
+	GetMallocAllocator()->Free(skeleton->bind_pose);
+	GetMallocAllocator()->Free(skeleton->channel_node_indices);
+	GetMallocAllocator()->Free(skeleton->group_lods);
+	GetMallocAllocator()->Free(skeleton->node_local_columns);
+	GetMallocAllocator()->Free(skeleton->bone_offset_columns);
+	skeleton->bind_pose = nullptr;
+	skeleton->channel_node_indices = nullptr;
+	skeleton->group_lods = nullptr;
+	skeleton->node_local_columns = nullptr;
+	skeleton->bone_offset_columns = nullptr;
+}
+
+void InitPose(animation_pose_t* pose, u32 channelsNum, IAllocator* allocator) {
+	pose->channels_num = channelsNum;
+	allocate_array(&pose->groups, PoseGroupsNum(channelsNum), allocator);
+}
+
+void FreePose(animation_pose_t* pose, IAllocator* allocator) {
+	allocator->Free(pose->groups.elements);
+	(*pose) = {};
+}
+
+void BuildChannelMask(animation_skeleton_t const* skeleton, u32 rootNode, float weight, animation_mask_t* outMask, IAllocator* allocator) {
+	Check(rootNode < skeleton->nodes_num);
+
+	auto groupsNum = PoseGroupsNum(skeleton->channels_num);
+	Array<float> channelWeights(GetThreadScratchAllocator());
+	Resize(channelWeights, groupsNum * ANIMATION_GROUP_CHANNELS);
+	ZeroMemory(channelWeights.DataPtr, sizeof(float) * Size(channelWeights));
+
+	// nodes come parents first, one pass finds the whole subtree
+	Array<u8> inside(GetThreadScratchAllocator());
+	Resize(inside, skeleton->nodes_num);
+	for (auto n = 0u; n < skeleton->nodes_num; ++n) {
+		auto parent = skeleton->node_parents[n];
+		inside[n] = n == rootNode || (n > rootNode && parent != SHORT_NULL_INDEX && inside[parent]);
+
+		auto channel = skeleton->node_channel_indices[n];
+		if (inside[n] && channel != SHORT_NULL_INDEX) {
+			channelWeights[channel] = weight;
+		}
+	}
+
+	allocate_array(&outMask->weights, groupsNum, allocator);
+	for (auto g = 0u; g < groupsNum; ++g) {
+		outMask->weights[g] = _mm_loadu_ps(channelWeights.DataPtr + g * ANIMATION_GROUP_CHANNELS);
+	}
+}
+
+void FreeChannelMask(animation_mask_t* mask, IAllocator* allocator) {
+	allocator->Free(mask->weights.elements);
+	(*mask) = {};
+}
+
+float sample_animation(animation_skeleton_t const* Skeleton, animation_t const* Animation, float Time, animation_pose_t* outPose, u32 Lod) {
+	Check(outPose->groups.num <= PoseGroupsNum(Skeleton->channels_num));
+
+	float time = AnimationTicks(Animation, Time);
+
+	auto groupsNum = min(Animation->groups_num, outPose->groups.num);
+	for (auto g = 0u; g < groupsNum; ++g) {
+		// every channel of the group is frozen at this lod
+		if (Skeleton->group_lods[g] < Lod) {
+			outPose->groups[g] = Skeleton->bind_pose[g];
+			continue;
+		}
+
+		animation_soa_key_t sampled;
+		SampleGroup(Animation, g, time, &sampled);
+		NormalizeRotation(sampled.rotation);
+
+		auto first = g * ANIMATION_GROUP_CHANNELS;
+		if (first + ANIMATION_GROUP_CHANNELS > Animation->channels_num) {
+			// lanes past the animation channels keep the bind pose
+			auto animated = _mm_cmplt_epi32(_mm_setr_epi32(0, 1, 2, 3), _mm_set1_epi32(Animation->channels_num - first));
+			auto& bind = Skeleton->bind_pose[g];
+			for (auto i = 0u; i < 3; ++i) {
+				sampled.translation[i] = SelectLanes(animated, sampled.translation[i], bind.translation[i]);
+			}
+			for (auto i = 0u; i < 4; ++i) {
+				sampled.rotation[i] = SelectLanes(animated, sampled.rotation[i], bind.rotation[i]);
+			}
+		}
+		outPose->groups[g] = sampled;
+	}
+
+	for (auto g = groupsNum; g < outPose->groups.num; ++g) {
+		outPose->groups[g] = Skeleton->bind_pose[g];
+	}
+
+	return time;
+}
+
+void blend_poses(animation_pose_t const* const* Poses, float const* Weights, u32 PosesNum, animation_pose_t* outPose) {
+	Check(PosesNum > 0);
+
+	float weightSum = 0.f;
+	for (auto p = 0u; p < PosesNum; ++p) {
+		Check(Poses[p]->groups.num == outPose->groups.num);
+		weightSum += Weights[p];
+	}
+	Check(weightSum > 0.f);
+
+	for (auto g = 0u; g < outPose->groups.num; ++g) {
+		auto& first = Poses[0]->groups[g];
+
+		animation_soa_key_t blended;
+		for (auto i = 0u; i < 3; ++i) {
+			blended.translation[i] = _mm_setzero_ps();
+		}
+		for (auto i = 0u; i < 4; ++i) {
+			blended.rotation[i] = _mm_setzero_ps();
+		}
+
+		for (auto p = 0u; p < PosesNum; ++p) {
+			auto& key = Poses[p]->groups[g];
+			auto w = _mm_set1_ps(Weights[p] / weightSum);
+
+			xmvec rotation[4];
+			AlignRotation(first.rotation, key.rotation, rotation);
+			for (auto i = 0u; i < 3; ++i) {
+				blended.translation[i] = _mm_add_ps(blended.translation[i], _mm_mul_ps(key.translation[i], w));
+			}
+			for (auto i = 0u; i < 4; ++i) {
+				blended.rotation[i] = _mm_add_ps(blended.rotation[i], _mm_mul_ps(rotation[i], w));
+			}
+		}
+
+		NormalizeRotation(blended.rotation);
+		outPose->groups[g] = blended;
+	}
+}
+
+void blend_pose_layer(animation_pose_t* Pose, animation_pose_t const* Layer, float Weight, animation_mask_t const* Mask) {
+	Check(Pose->groups.num == Layer->groups.num);
+	Check(!Mask || Mask->weights.num == Pose->groups.num);
+
+	for (auto g = 0u; g < Pose->groups.num; ++g) {
+		auto& key = Pose->groups[g];
+		auto& layer = Layer->groups[g];
+		auto w = LayerWeight(Mask, g, Weight);
+
+		xmvec rotation[4];
+		AlignRotation(key.rotation, layer.rotation, rotation);
+		for (auto i = 0u; i < 3; ++i) {
+			key.translation[i] = _mm_add_ps(key.translation[i], _mm_mul_ps(_mm_sub_ps(layer.translation[i], key.translation[i]), w));
+		}
+		for (auto i = 0u; i < 4; ++i) {
+			key.rotation[i] = _mm_add_ps(key.rotation[i], _mm_mul_ps(_mm_sub_ps(rotation[i], key.rotation[i]), w));
+		}
+		NormalizeRotation(key.rotation);
+	}
+}
+
+void make_additive_pose(animation_pose_t const* Pose, animation_pose_t const* Reference, animation_pose_t* outAdditive) {
+	Check(Pose->groups.num == Reference->groups.num && Pose->groups.num == outAdditive->groups.num);
+
+	auto signMask = _mm_set1_ps(-0.f);
+	for (auto g = 0u; g < Pose->groups.num; ++g) {
+		auto& key = Pose->groups[g];
+		auto& reference = Reference->groups[g];
+
+		animation_soa_key_t additive;
+		for (auto i = 0u; i < 3; ++i) {
+			additive.translation[i] = _mm_sub_ps(key.translation[i], reference.translation[i]);
+		}
+		// inverse of a unit rotation is its conjugate
+		xmvec inverse[4] = { _mm_xor_ps(reference.rotation[0], signMask), _mm_xor_ps(reference.rotation[1], signMask), _mm_xor_ps(reference.rotation[2], signMask), reference.rotation[3] };
+		MultiplyRotations(inverse, key.rotation, additive.rotation);
+
+		outAdditive->groups[g] = additive;
+	}
+}
+
+void add_pose_layer(animation_pose_t* Pose, animation_pose_t const* Additive, float Weight, animation_mask_t const* Mask) {
+	Check(Pose->groups.num == Additive->groups.num);
+	Check(!Mask || Mask->weights.num == Pose->groups.num);
+
+	auto zero = _mm_setzero_ps();
+	auto one = _mm_set1_ps(1.f);
+	xmvec identity[4] = { zero, zero, zero, one };
+
+	for (auto g = 0u; g < Pose->groups.num; ++g) {
+		auto& key = Pose->groups[g];
+		auto& additive = Additive->groups[g];
+		auto w = LayerWeight(Mask, g, Weight);
+
+		for (auto i = 0u; i < 3; ++i) {
+			key.translation[i] = _mm_add_ps(key.translation[i], _mm_mul_ps(additive.translation[i], w));
+		}
+
+		// partial weights scale the additive rotation from identity
+		xmvec rotation[4];
+		AlignRotation(identity, additive.rotation, rotation);
+		for (auto i = 0u; i < 4; ++i) {
+			rotation[i] = _mm_add_ps(identity[i], _mm_mul_ps(_mm_sub_ps(rotation[i], identity[i]), w));
+		}
+		NormalizeRotation(rotation);
+
+		xmvec base[4] = { key.rotation[0], key.rotation[1], key.rotation[2], key.rotation[3] };
+		MultiplyRotations(base, rotation, key.rotation);
+	}
+}
+
+// node workspace stays on the stack for common skeletons
+const u32 POSE_STACK_NODES = 256;
+
+void calculate_pose_transforms(animation_skeleton_t const* Skeleton, animation_pose_t const* Pose, bone_transform_t* outTransforms, u32 Lod) {
+	auto nodesNum = Skeleton->nodes_num;
+	auto lodNodesNum = Skeleton->lod_nodes_num[Lod];
+
+	bone_transform_t stackNodes[POSE_STACK_NODES];
+	auto nodeTransforms = stackNodes;
+	if (nodesNum > POSE_STACK_NODES) {
+		allocate_c_array(nodeTransforms, GetThreadScratchAllocator(), nodesNum);
+	}
+	for (auto n = 0u; n < nodesNum; ++n) {
+		if (Skeleton->node_channel_indices[n] == SHORT_NULL_INDEX || n >= lodNodesNum) {
+			nodeTransforms[n] = Skeleton->node_local_columns[n];
+		}
+	}
+
+	// animated locals go straight to their nodes, already in the layout the shader reads
+	for (auto g = 0u; g < Pose->groups.num; ++g) {
+		if (Skeleton->group_lods[g] < Lod) {
+			continue;
+		}
+
+		xmvec columns[3][4];
+		KeyTransformColumns(Pose->groups[g], columns);
+
+		auto nodes = Skeleton->channel_node_indices + g * ANIMATION_GROUP_CHANNELS;
+		for (auto l = 0u; l < ANIMATION_GROUP_CHANNELS; ++l) {
+			if (nodes[l] < lodNodesNum) {
+				auto& transform = nodeTransforms[nodes[l]];
+				transform.columns[0] = columns[0][l];
+				transform.columns[1] = columns[1][l];
+				transform.columns[2] = columns[2][l];
+			}
+		}
+	}
+
+	// output is relative to the root, so its global transform would be cancelled by its inverse in every bone
+	// parents come before children, globals replace locals in place
+	nodeTransforms[0] = AffineColumns(XMMatrixIdentity());
+	for (auto n = 1u; n < nodesNum; ++n) {
+		nodeTransforms[n] = MultiplyAffineColumns(nodeTransforms[n], nodeTransforms[Skeleton->node_parents[n]]);
+	}
+
+	auto bonesNum = Skeleton->bones_num;
+	for (auto b = 0u; b < bonesNum; ++b) {
+		outTransforms[b] = MultiplyAffineColumns(Skeleton->bone_offset_columns[b], nodeTransforms[Skeleton->bone_node_indices[b]]);
+	}
+
+	if (nodeTransforms != stackNodes) {
+		GetThreadScratchAllocator()->Free(nodeTransforms);
+	}
+}
+
+xmmatrix ChannelTransform(animation_channel_t const& channel, float time) {
+	auto transform = XMMatrixRotationQuaternion(SampleChannelRotation(channel, time));
+	transform.r[3] = XMVectorSetW(SampleChannelPosition(channel, time), 1.f);
+	return transform;
+}
+
+void MeasureAnimationError(animation_skeleton_t const* Skeleton, animation_t const* Animation, animation_channel_t const* channels, animation_compression_stats_t* stats) {
+	auto nodesNum = Skeleton->nodes_num;
+
+	Array<xmmatrix> animationMatrices(GetThreadScratchAllocator());
+	Array<xmmatrix> rawGlobal(GetThreadScratchAllocator());
+	Array<xmmatrix> sampledGlobal(GetThreadScratchAllocator());
+	Resize(rawGlobal, nodesNum);
+	Resize(sampledGlobal, nodesNum);
+
+	animation_state_t state = {};
+
+	float maxError = 0.f;
+	float errorSum = 0.f;
+	u32 measuresNum = 0;
+	for (auto s = 0u; s < ANIMATION_ERROR_SAMPLES; ++s) {
+		float time = Animation->duration * s / ANIMATION_ERROR_SAMPLES;
+		calculate_animation_frames(Animation, &state, time / Animation->ticks_per_second, &animationMatrices);
+
+		for (auto n = 0u; n < nodesNum; ++n) {
+			auto channel = Skeleton->node_channel_indices[n];
+			auto animated = channel != SHORT_NULL_INDEX && channel < Animation->channels_num;
+			auto rawLocal = animated ? ChannelTransform(channels[channel], time) : Skeleton->node_local_transforms[n];
+			auto sampledLocal = animated ? animationMatrices[channel] : Skeleton->node_local_transforms[n];
+
+			auto parent = Skeleton->node_parents[n];
+			rawGlobal[n] = parent != SHORT_NULL_INDEX ? rawLocal * rawGlobal[parent] : rawLocal;
+			sampledGlobal[n] = parent != SHORT_NULL_INDEX ? sampledLocal * sampledGlobal[parent] : sampledLocal;
+
+			// joint and a virtual tip one bone length further
+			auto tip = Skeleton->node_local_transforms[n].r[3];
+			auto jointError = XMVectorGetX(XMVector3Length(XMVectorSubtract(rawGlobal[n].r[3], sampledGlobal[n].r[3])));
+			auto tipError = XMVectorGetX(XMVector3Length(XMVectorSubtract(XMVector3TransformCoord(tip, rawGlobal[n]), XMVector3TransformCoord(tip, sampledGlobal[n]))));
+			auto error = max(jointError, tipError);
+
+			maxError = max(maxError, error);
+			errorSum += error;
+			measuresNum++;
+		}
+	}
+
+	stats->max_error = maxError;
+	stats->average_error = measuresNum ? errorSum / measuresNum : 0.f;
+}
+
+void calculate_animation(
+	animation_skeleton_t const* Skeleton,
+	animation_t const* Animation,
+	animation_state_t* AnimationState,
+	float Time,
+	Array<xmmatrix> *outNodeTransforms,
+	Array<xmmatrix> *outTransforms) {
+
+	Array<xmmatrix> localTransformationMatrices(GetThreadScratchAllocator());
+	Resize(localTransformationMatrices, Skeleton->nodes_num);
+
+	Array<xmmatrix> fallbackNodeTransforms(GetThreadScratchAllocator());
+	if (outNodeTransforms == nullptr) {
+		outNodeTransforms = &fallbackNodeTransforms;
+	}
+	auto &globalTransformationMatrices = *outNodeTransforms;
+	Resize(globalTransformationMatrices, Skeleton->nodes_num);
+
+	Array<xmmatrix> animationMatrices(GetThreadScratchAllocator());
+	calculate_animation_frames(Animation, AnimationState, Time, &animationMatrices);
+
+	auto nodesNum = Skeleton->nodes_num;
+	// calculate channels
+	for (auto i = 0u; i < nodesNum; ++i) {
+		localTransformationMatrices[i] = Skeleton->node_channel_indices[i] != SHORT_NULL_INDEX ? animationMatrices[Skeleton->node_channel_indices[i]] : Skeleton->node_local_transforms[i];
+	}
+
+	// calculate all nodes starting from root
+	globalTransformationMatrices[0] = localTransformationMatrices[0];
+	for (auto i = 1u; i < nodesNum; ++i) {
+		globalTransformationMatrices[i] = localTransformationMatrices[i] * globalTransformationMatrices[Skeleton->node_parents[i]];
+	}
+
+	xmvec determinant;
+	xmmatrix globalInverseMatrix = XMMatrixInverse(&determinant, globalTransformationMatrices[0]);
+	auto& transformationMatrices = *outTransforms;
+	Resize(transformationMatrices, Skeleton->bones_num);
+
+	auto bonesNum = Skeleton->bones_num;
+	for (auto i = 0u; i < bonesNum; ++i) {
+		transformationMatrices[i] = Skeleton->bone_offsets[i] * globalTransformationMatrices[Skeleton->bone_node_indices[i]] * globalInverseMatrix;
+	}
+}
+
+
+void calculate_animation(
+	animation_skeleton_t const* Skeleton,
+	animation_t const* Animation,
+	animation_state_t* AnimationState,
+	float Time,
+	bone_transform_t *outTransforms,
+	u32 Lod) {
+
+	animation_pose_t pose;
+	InitPose(&pose, Skeleton->channels_num, GetThreadScratchAllocator());
+	AnimationState->last_scaled_time = sample_animation(Skeleton, Animation, Time, &pose, Lod);
+	calculate_pose_transforms(Skeleton, &pose, outTransforms, Lod);
+	FreePose(&pose, GetThreadScratchAllocator());
+}
+
+}
\ No newline at end of file
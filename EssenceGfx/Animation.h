@@ -0,0 +1,170 @@
+#pragma once
+
+#include "Types.h"
+#include "Maths.h"
+#include "Array.h"
+#include "Views.h"
+
+namespace Essence {
+
+const u16 SHORT_NULL_INDEX = 0xFFFF;
+const u32 ANIMATION_GROUP_CHANNELS = 4;
+// default error budget as a fraction of the skeleton size
+const float ANIMATION_ERROR_BUDGET = 0.001f;
+// bucket table size cap, keys per bucket only go above one when keys are much denser somewhere
+const u32 ANIMATION_BUCKETS_PER_KEY = 2;
+// detail levels drop the deepest levels of the hierarchy, lod 0 is the whole skeleton
+const u32 ANIMATION_LODS = 4;
+
+// one key of four channels in SoA, lane i belongs to channel group * 4 + i
+struct animation_soa_key_t {
+	xmvec	translation[3];
+	xmvec	rotation[4];
+};
+
+// bone matrix as the shader reads it: first three columns of the row vector matrix
+struct bone_transform_t {
+	xmvec	columns[3];
+};
+
+struct animation_skeleton_t {
+	u32					nodes_num;
+	u32					bones_num;
+	u32					channels_num;
+
+	xmmatrix*			node_local_transforms;
+	u16*				node_parents;
+	u16*				node_channel_indices;
+	u16*				bone_node_indices;
+	xmmatrix*			bone_offsets;
+	// local transforms of channel nodes in pose layout, fills channels an animation doesn't have
+	animation_soa_key_t*	bind_pose;
+	// padded to whole groups with SHORT_NULL_INDEX
+	u16*				channel_node_indices;
+	// nodes are sorted by depth, every lod evaluates a prefix of them and freezes the rest in bind pose
+	u32					lod_nodes_num[ANIMATION_LODS];
+	u32					lod_bones_num[ANIMATION_LODS];
+	u8*					group_lods;	// coarsest lod still sampling the group
+	// column form of node_local_transforms and bone_offsets, the bone pass multiplies in its output layout
+	bone_transform_t*	node_local_columns;
+	bone_transform_t*	bone_offset_columns;
+};
+
+struct position_key_t {
+	float3a	value;
+	float	time;
+};
+
+struct rotation_key_t {
+	float4	value;
+	float	time;
+};
+
+// keys as imported, only used to build the sampled representation
+struct animation_channel_t {
+	u32						position_keys_num;
+	u32						rotation_keys_num;
+	position_key_t const*	position_keys;
+	rotation_key_t const*	rotation_keys;
+};
+
+// stored form of animation_soa_key_t: translations quantized to the group range,
+// rotations as smallest three in 48 bits (15 bits per component, index of the dropped one and its sign in the top bits)
+struct animation_packed_key_t {
+	u16		translation[3][4];
+	u16		rotation[3][4];
+};
+
+// channels of a group share one timeline, keys are removed where interpolation stays in the error budget
+// uniform buckets over the timeline hold the key active at their start, so lookup doesn't depend on the previous time
+struct animation_group_t {
+	u32		keys_offset;
+	u32		keys_num;
+	u32		buckets_offset;
+	u32		buckets_num;
+	float	first_time;
+	float	bucket_scale;	// buckets per tick
+	xmvec	translation_min[3];
+	xmvec	translation_scale[3];
+};
+
+struct animation_t {
+	float					ticks_per_second;
+	float					duration; // in ticks
+	u32						channels_num;
+	u32						groups_num;
+	animation_group_t*		groups;
+	float*					key_times;
+	animation_packed_key_t*	keys;
+	u16*					key_buckets;
+};
+
+// how far error of a channel travels down the hierarchy
+struct animation_channel_weight_t {
+	float	tip_distance;	// to the farthest bone tip it moves
+	float	budget_share;	// shares of channels along one chain add up to 1
+};
+
+struct animation_compression_stats_t {
+	u32		raw_keys_num;
+	u32		sampled_keys_num;	// group keys before reduction, four channels each
+	u32		keys_num;			// group keys kept
+	u32		raw_size;
+	u32		compressed_size;
+	float	max_error;			// at joints and bone tips through the hierarchy, in model units
+	float	average_error;
+};
+
+// local space pose in channel order, four channels per group like the keys
+// rotations are kept normalized, blends expect poses of the same skeleton
+struct animation_pose_t {
+	u32								channels_num;
+	array_view<animation_soa_key_t>	groups;
+};
+
+// per channel layer weights in SoA, 0 leaves the channel to the layers below
+struct animation_mask_t {
+	array_view<xmvec>	weights;
+};
+
+struct animation_state_t {
+	float	last_time;
+	float	last_scaled_time;
+};
+
+// returns the skeleton size: longest distance from a node to the bone tips below it
+float ComputeChannelWeights(animation_skeleton_t const* skeleton, u32 channelsNum, animation_channel_weight_t* outWeights);
+// weights can be null, then every channel gets the whole budget measured at unit distance
+void BuildAnimation(animation_t* outAnimation, animation_channel_t const* channels, u32 channelsNum, float duration, float ticksPerSecond,
+	animation_channel_weight_t const* weights, float errorBudget, animation_compression_stats_t* outStats = nullptr);
+void FreeAnimation(animation_t* animation);
+// compares compressed animation against the imported keys
+void MeasureAnimationError(animation_skeleton_t const* Skeleton, animation_t const* Animation, animation_channel_t const* channels, animation_compression_stats_t* stats);
+
+// channels_num, bind_pose, channel_node_indices and lods from the other skeleton fields
+void BuildSkeletonPoseData(animation_skeleton_t* skeleton);
+void FreeSkeletonPoseData(animation_skeleton_t* skeleton);
+
+void InitPose(animation_pose_t* pose, u32 channelsNum, IAllocator* allocator);
+void FreePose(animation_pose_t* pose, IAllocator* allocator);
+// weight for channels of the node and everything below it, 0 for the rest
+void BuildChannelMask(animation_skeleton_t const* skeleton, u32 rootNode, float weight, animation_mask_t* outMask, IAllocator* allocator);
+void FreeChannelMask(animation_mask_t* mask, IAllocator* allocator);
+
+// returns time in ticks
+float sample_animation(animation_skeleton_t const* Skeleton, animation_t const* Animation, float Time, animation_pose_t* outPose, u32 Lod = 0);
+// weights don't have to add up to 1, output can be one of the inputs
+void blend_poses(animation_pose_t const* const* Poses, float const* Weights, u32 PosesNum, animation_pose_t* outPose);
+// mask can be null for the whole pose
+void blend_pose_layer(animation_pose_t* Pose, animation_pose_t const* Layer, float Weight, animation_mask_t const* Mask);
+// difference that brings reference to pose, output can be one of the inputs
+void make_additive_pose(animation_pose_t const* Pose, animation_pose_t const* Reference, animation_pose_t* outAdditive);
+void add_pose_layer(animation_pose_t* Pose, animation_pose_t const* Additive, float Weight, animation_mask_t const* Mask);
+// bone matrices relative to the root node, root transform cancels out so it's never applied
+void calculate_pose_transforms(animation_skeleton_t const* Skeleton, animation_pose_t const* Pose, bone_transform_t* outTransforms, u32 Lod = 0);
+
+void calculate_animation_frames(animation_t const* Animation, animation_state_t* AnimationState, float Time, Array<xmmatrix> *outTransforms);
+void calculate_animation(animation_skeleton_t const* Skeleton, animation_t const* Animation, animation_state_t* AnimationState, float Time, Array<xmmatrix> *outNodeTransforms, Array<xmmatrix> *outTransforms);
+void calculate_animation(animation_skeleton_t const* Skeleton, animation_t const* Animation, animation_state_t* AnimationState, float Time, bone_transform_t *outTransforms, u32 Lod = 0);
+
+}
\ No newline at end of file
@@ -116,6 +116,7 @@ void InitApplication(u32 windowWidth, u32 windowHeight, ApplicationFlagsEnum fla
 	InitSDL(&SDLWindow);
 
 	InitDevice(GDisplaySettings.hwnd, false, flags & APP_FLAG_D3D12_DEBUG, adapterIndex);
+	InitShaders();
 	InitRenderingEngines();
 	InitResources();
 
@@ -0,0 +1,604 @@
+#include "Bvh.h"
+#include "Essence.h"
+#include "Scheduler.h"
+#include <float.h>
+#include <xmmintrin.h>
+#include <emmintrin.h>
+
+namespace Essence {
+
+const u32 BVH_BINS_NUM = 16;
+const u32 BVH_MAX_SAH_DEPTH = 40;
+const u32 BVH_STACK_SIZE = 96;
+const u32 BVH_PARALLEL_MIN_PRIMITIVES = 4096;
+const u32 BVH_RAYS_PER_BATCH = 256;
+
+struct bvh_build_context_t {
+	Vec3f const*	prim_min;
+	Vec3f const*	prim_max;
+	Vec3f const*	centroids;
+	u32*			order;
+	bvh_node_t*		nodes;
+	au32			nodes_num;
+	bool			parallel;
+};
+
+struct BvhBuildTask_Payload {
+	bvh_build_context_t*	context;
+	u32						node;
+	u32						begin;
+	u32						end;
+	u32						depth;
+};
+
+struct bvh_bin_t {
+	Vec3f	bounds_min;
+	Vec3f	bounds_max;
+	u32		count;
+};
+
+inline void ResetBounds(Vec3f* bmin, Vec3f* bmax) {
+	*bmin = Vec3f(FLT_MAX);
+	*bmax = Vec3f(-FLT_MAX);
+}
+
+inline void GrowBounds(Vec3f* bmin, Vec3f* bmax, Vec3f const& pmin, Vec3f const& pmax) {
+	for (i32 a = 0; a < 3; ++a) {
+		bmin->data[a] = min(bmin->data[a], pmin.data[a]);
+		bmax->data[a] = max(bmax->data[a], pmax.data[a]);
+	}
+}
+
+inline float HalfArea(Vec3f const& bmin, Vec3f const& bmax) {
+	Vec3f e = bmax - bmin;
+	return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+void BuildBvhNode(bvh_build_context_t* context, u32 nodeIndex, u32 begin, u32 end, u32 depth, Job* job);
+
+void BvhBuildTask(const void* InArgs, Job* job) {
+	PROFILE_SCOPE(bvh_build_task);
+
+	auto Args = *(BvhBuildTask_Payload*)InArgs;
+	GetMallocAllocator()->Free((void*)InArgs);
+
+	BuildBvhNode(Args.context, Args.node, Args.begin, Args.end, Args.depth, job);
+}
+
+void SpawnBvhBuildTask(Job* parent, Job** outJob, bvh_build_context_t* context, u32 nodeIndex, u32 begin, u32 end, u32 depth) {
+	BvhBuildTask_Payload* payload;
+	allocate_c_array(payload, GetMallocAllocator(), 1);
+	payload->context = context;
+	payload->node = nodeIndex;
+	payload->begin = begin;
+	payload->end = end;
+	payload->depth = depth;
+	*outJob = CreateChildJob(parent, BvhBuildTask, payload);
+}
+
+void BuildBvhNode(bvh_build_context_t* context, u32 nodeIndex, u32 begin, u32 end, u32 depth, Job* job) {
+	auto order = context->order;
+	auto count = end - begin;
+
+	Vec3f boundsMin, boundsMax, centroidMin, centroidMax;
+	ResetBounds(&boundsMin, &boundsMax);
+	ResetBounds(&centroidMin, &centroidMax);
+	for (u32 i = begin; i < end; ++i) {
+		auto p = order[i];
+		GrowBounds(&boundsMin, &boundsMax, context->prim_min[p], context->prim_max[p]);
+		GrowBounds(&centroidMin, &centroidMax, context->centroids[p], context->centroids[p]);
+	}
+
+	auto& node = context->nodes[nodeIndex];
+	memcpy(node.bounds_min, boundsMin.data, sizeof(node.bounds_min));
+	memcpy(node.bounds_max, boundsMax.data, sizeof(node.bounds_max));
+
+	// with four wide leaf test splitting small nodes never pays off
+	if (count <= BVH_LEAF_SIZE) {
+		node.first = begin;
+		node.count = count;
+		return;
+	}
+
+	i32 bestAxis = -1;
+	u32 bestBin = 0;
+	float bestCost = FLT_MAX;
+
+	if (depth < BVH_MAX_SAH_DEPTH) {
+		for (i32 axis = 0; axis < 3; ++axis) {
+			float extent = centroidMax[axis] - centroidMin[axis];
+			if (extent <= 0.f) {
+				continue;
+			}
+			float scale = BVH_BINS_NUM / extent;
+
+			bvh_bin_t bins[BVH_BINS_NUM];
+			for (auto& bin : bins) {
+				ResetBounds(&bin.bounds_min, &bin.bounds_max);
+				bin.count = 0;
+			}
+
+			for (u32 i = begin; i < end; ++i) {
+				auto p = order[i];
+				u32 b = min((u32)((context->centroids[p][axis] - centroidMin[axis]) * scale), BVH_BINS_NUM - 1);
+				GrowBounds(&bins[b].bounds_min, &bins[b].bounds_max, context->prim_min[p], context->prim_max[p]);
+				bins[b].count++;
+			}
+
+			float leftCost[BVH_BINS_NUM - 1];
+			Vec3f accMin, accMax;
+			ResetBounds(&accMin, &accMax);
+			u32 accCount = 0;
+			for (u32 b = 0; b < BVH_BINS_NUM - 1; ++b) {
+				GrowBounds(&accMin, &accMax, bins[b].bounds_min, bins[b].bounds_max);
+				accCount += bins[b].count;
+				leftCost[b] = accCount ? HalfArea(accMin, accMax) * accCount : FLT_MAX;
+			}
+
+			ResetBounds(&accMin, &accMax);
+			accCount = 0;
+			for (u32 b = BVH_BINS_NUM - 1; b > 0; --b) {
+				GrowBounds(&accMin, &accMax, bins[b].bounds_min, bins[b].bounds_max);
+				accCount += bins[b].count;
+				if (!accCount || leftCost[b - 1] == FLT_MAX) {
+					continue;
+				}
+				float cost = leftCost[b - 1] + HalfArea(accMin, accMax) * accCount;
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestBin = b - 1;
+				}
+			}
+		}
+	}
+
+	u32 mid;
+	if (bestAxis >= 0) {
+		float scale = BVH_BINS_NUM / (centroidMax[bestAxis] - centroidMin[bestAxis]);
+		u32 i = begin;
+		u32 j = end;
+		while (i < j) {
+			auto p = order[i];
+			u32 b = min((u32)((context->centroids[p][bestAxis] - centroidMin[bestAxis]) * scale), BVH_BINS_NUM - 1);
+			if (b <= bestBin) {
+				++i;
+			}
+			else {
+				--j;
+				order[i] = order[j];
+				order[j] = p;
+			}
+		}
+		mid = i;
+	}
+	else {
+		// centroids coincide or tree got too deep, any split is as good
+		mid = begin + count / 2;
+	}
+	Check(mid > begin && mid < end);
+
+	u32 children = context->nodes_num.fetch_add(2);
+	node.first = children;
+	node.count = 0;
+
+	if (job && context->parallel && count >= BVH_PARALLEL_MIN_PRIMITIVES) {
+		Job* childJobs[2];
+		SpawnBvhBuildTask(job, &childJobs[0], context, children, begin, mid, depth + 1);
+		SpawnBvhBuildTask(job, &childJobs[1], context, children + 1, mid, end, depth + 1);
+		RunJobs(childJobs, 2);
+		return;
+	}
+
+	BuildBvhNode(context, children, begin, mid, depth + 1, job);
+	BuildBvhNode(context, children + 1, mid, end, depth + 1, job);
+}
+
+void BuildBvh(bvh_t* outBvh, Array<u32>* order, Vec3f const* primMin, Vec3f const* primMax, u32 primitivesNum, bool parallel) {
+	PROFILE_SCOPE(build_bvh);
+
+	*outBvh = {};
+	if (primitivesNum == 0) {
+		return;
+	}
+
+	Array<Vec3f> centroids(GetThreadScratchAllocator());
+	Resize(centroids, primitivesNum);
+	Resize(*order, primitivesNum);
+	for (u32 i = 0; i < primitivesNum; ++i) {
+		centroids[i] = (primMin[i] + primMax[i]) * 0.5f;
+		(*order)[i] = i;
+	}
+
+	Array<bvh_node_t> nodes(GetThreadScratchAllocator());
+	Resize(nodes, primitivesNum * 2);
+
+	bvh_build_context_t context;
+	context.prim_min = primMin;
+	context.prim_max = primMax;
+	context.centroids = centroids.DataPtr;
+	context.order = order->DataPtr;
+	context.nodes = nodes.DataPtr;
+	context.nodes_num = 1;
+	context.parallel = parallel;
+
+	if (parallel && primitivesNum >= BVH_PARALLEL_MIN_PRIMITIVES) {
+		BvhBuildTask_Payload* payload;
+		allocate_c_array(payload, GetMallocAllocator(), 1);
+		payload->context = &context;
+		payload->node = 0;
+		payload->begin = 0;
+		payload->end = primitivesNum;
+		payload->depth = 0;
+
+		auto rootJob = CreateJob(BvhBuildTask, payload);
+		RunJobs(&rootJob, 1);
+		WaitFor(rootJob, true);
+	}
+	else {
+		BuildBvhNode(&context, 0, 0, primitivesNum, 0, nullptr);
+	}
+
+	allocate_array(&outBvh->nodes, context.nodes_num, GetMallocAllocator());
+	memcpy(outBvh->nodes.elements, nodes.DataPtr, sizeof(bvh_node_t) * context.nodes_num);
+}
+
+void BuildTriangleBvh(bvh_t* outBvh, Vec3f const* positions, u32 const* indices, u32 trianglesNum, bool parallel) {
+	Array<Vec3f> primMin(GetThreadScratchAllocator());
+	Array<Vec3f> primMax(GetThreadScratchAllocator());
+	Resize(primMin, trianglesNum);
+	Resize(primMax, trianglesNum);
+	for (u32 i = 0; i < trianglesNum; ++i) {
+		ResetBounds(&primMin[i], &primMax[i]);
+		for (u32 k = 0; k < 3; ++k) {
+			auto p = positions[indices[i * 3 + k]];
+			GrowBounds(&primMin[i], &primMax[i], p, p);
+		}
+	}
+
+	Array<u32> order(GetThreadScratchAllocator());
+	BuildBvh(outBvh, &order, primMin.DataPtr, primMax.DataPtr, trianglesNum, parallel);
+
+	u32 leavesNum = 0;
+	for (u32 n = 0; n < outBvh->nodes.num; ++n) {
+		leavesNum += outBvh->nodes[n].count > 0;
+	}
+	allocate_array(&outBvh->triangles, leavesNum, GetMallocAllocator());
+	zero_array(&outBvh->triangles);
+
+	u32 block = 0;
+	for (u32 n = 0; n < outBvh->nodes.num; ++n) {
+		auto& node = outBvh->nodes[n];
+		if (!node.count) {
+			continue;
+		}
+
+		auto& tri4 = outBvh->triangles[block];
+		for (u32 lane = 0; lane < BVH_LEAF_SIZE; ++lane) {
+			tri4.primitives[lane] = BVH_NULL_INDEX;
+			if (lane >= node.count) {
+				continue;
+			}
+			auto t = order[node.first + lane];
+			Vec3f v0 = positions[indices[t * 3 + 0]];
+			Vec3f e1 = positions[indices[t * 3 + 1]] - v0;
+			Vec3f e2 = positions[indices[t * 3 + 2]] - v0;
+			for (i32 a = 0; a < 3; ++a) {
+				tri4.v0[a][lane] = v0[a];
+				tri4.e1[a][lane] = e1[a];
+				tri4.e2[a][lane] = e2[a];
+			}
+			tri4.primitives[lane] = t;
+		}
+		node.first = block++;
+	}
+}
+
+void BuildBoxBvh(bvh_t* outBvh, Vec3f const* boundsMin, Vec3f const* boundsMax, u32 boxesNum, bool parallel) {
+	Array<u32> order(GetThreadScratchAllocator());
+	BuildBvh(outBvh, &order, boundsMin, boundsMax, boxesNum, parallel);
+
+	allocate_array(&outBvh->primitives, boxesNum, GetMallocAllocator());
+	memcpy(outBvh->primitives.elements, order.DataPtr, sizeof(u32) * boxesNum);
+}
+
+void FreeBvh(bvh_t* bvh) {
+	GetMallocAllocator()->Free(bvh->nodes.elements);
+	GetMallocAllocator()->Free(bvh->triangles.elements);
+	GetMallocAllocator()->Free(bvh->primitives.elements);
+	*bvh = {};
+}
+
+struct bvh_ray_setup_t {
+	__m128	origin;
+	__m128	inv_direction;
+	__m128	ox, oy, oz;
+	__m128	dx, dy, dz;
+	float	tmin;
+};
+
+inline float SafeInverse(float d) {
+	const float eps = 1e-20f;
+	if (fabsf(d) < eps) {
+		d = d < 0.f ? -eps : eps;
+	}
+	return 1.f / d;
+}
+
+inline void SetupRay(bvh_ray_setup_t* r, ray_t const& ray) {
+	r->origin = _mm_setr_ps(ray.origin.x, ray.origin.y, ray.origin.z, 0.f);
+	r->inv_direction = _mm_setr_ps(SafeInverse(ray.direction.x), SafeInverse(ray.direction.y), SafeInverse(ray.direction.z), 0.f);
+	r->ox = _mm_set1_ps(ray.origin.x);
+	r->oy = _mm_set1_ps(ray.origin.y);
+	r->oz = _mm_set1_ps(ray.origin.z);
+	r->dx = _mm_set1_ps(ray.direction.x);
+	r->dy = _mm_set1_ps(ray.direction.y);
+	r->dz = _mm_set1_ps(ray.direction.z);
+	r->tmin = ray.tmin;
+}
+
+inline bool IntersectBounds(bvh_node_t const& node, bvh_ray_setup_t const& r, float tmax, float* outEntry) {
+	const __m128 xyzMask = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+
+	__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds_min), r.origin), r.inv_direction);
+	__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds_max), r.origin), r.inv_direction);
+	__m128 tnear = _mm_min_ps(t0, t1);
+	__m128 tfar = _mm_max_ps(t0, t1);
+
+	// w lane holds node indices, replace it with the ray interval
+	tnear = _mm_or_ps(_mm_and_ps(xyzMask, tnear), _mm_andnot_ps(xyzMask, _mm_set1_ps(r.tmin)));
+	tfar = _mm_or_ps(_mm_and_ps(xyzMask, tfar), _mm_andnot_ps(xyzMask, _mm_set1_ps(tmax)));
+
+	tnear = _mm_max_ps(tnear, _mm_shuffle_ps(tnear, tnear, _MM_SHUFFLE(2, 3, 0, 1)));
+	tnear = _mm_max_ps(tnear, _mm_shuffle_ps(tnear, tnear, _MM_SHUFFLE(1, 0, 3, 2)));
+	tfar = _mm_min_ps(tfar, _mm_shuffle_ps(tfar, tfar, _MM_SHUFFLE(2, 3, 0, 1)));
+	tfar = _mm_min_ps(tfar, _mm_shuffle_ps(tfar, tfar, _MM_SHUFFLE(1, 0, 3, 2)));
+
+	*outEntry = _mm_cvtss_f32(tnear);
+	return _mm_comile_ss(tnear, tfar) != 0;
+}
+
+// moller-trumbore on four triangles, returns lane mask of hits closer than tmax
+inline i32 IntersectTriangles(bvh_tri4_t const& tri, bvh_ray_setup_t const& r, float tmax, float* outT, float* outU, float* outV) {
+	__m128 e1x = _mm_loadu_ps(tri.e1[0]);
+	__m128 e1y = _mm_loadu_ps(tri.e1[1]);
+	__m128 e1z = _mm_loadu_ps(tri.e1[2]);
+	__m128 e2x = _mm_loadu_ps(tri.e2[0]);
+	__m128 e2y = _mm_loadu_ps(tri.e2[1]);
+	__m128 e2z = _mm_loadu_ps(tri.e2[2]);
+
+	__m128 px = _mm_sub_ps(_mm_mul_ps(r.dy, e2z), _mm_mul_ps(r.dz, e2y));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(r.dz, e2x), _mm_mul_ps(r.dx, e2z));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(r.dx, e2y), _mm_mul_ps(r.dy, e2x));
+
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+	__m128 invDet = _mm_div_ps(_mm_set1_ps(1.f), det);
+
+	__m128 tx = _mm_sub_ps(r.ox, _mm_loadu_ps(tri.v0[0]));
+	__m128 ty = _mm_sub_ps(r.oy, _mm_loadu_ps(tri.v0[1]));
+	__m128 tz = _mm_sub_ps(r.oz, _mm_loadu_ps(tri.v0[2]));
+
+	__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+
+	__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(r.dx, qx), _mm_mul_ps(r.dy, qy)), _mm_mul_ps(r.dz, qz)), invDet);
+	__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+
+	const __m128 zero = _mm_setzero_ps();
+	__m128 mask = _mm_cmpneq_ps(det, zero);
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(u, zero));
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+	mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.f)));
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(t, _mm_set1_ps(r.tmin)));
+	mask = _mm_and_ps(mask, _mm_cmplt_ps(t, _mm_set1_ps(tmax)));
+
+	_mm_storeu_ps(outT, t);
+	_mm_storeu_ps(outU, u);
+	_mm_storeu_ps(outV, v);
+	return _mm_movemask_ps(mask);
+}
+
+struct bvh_stack_entry_t {
+	u32		node;
+	float	entry;
+};
+
+// LEAF is called for every leaf touched by the ray, returns true to stop traversal, may shrink tmax
+template<typename LEAF>
+void TraverseBvh(bvh_t const& bvh, bvh_ray_setup_t const& r, float* tmax, LEAF leaf) {
+	if (!bvh.nodes.num) {
+		return;
+	}
+
+	float entry;
+	if (!IntersectBounds(bvh.nodes[0], r, *tmax, &entry)) {
+		return;
+	}
+
+	bvh_stack_entry_t stack[BVH_STACK_SIZE];
+	u32 stackSize = 0;
+	u32 nodeIndex = 0;
+
+	while (true) {
+		auto const& node = bvh.nodes.elements[nodeIndex];
+
+		if (node.count) {
+			if (leaf(node)) {
+				return;
+			}
+		}
+		else {
+			u32 nearChild = node.first;
+			u32 farChild = node.first + 1;
+			float nearEntry, farEntry;
+			bool nearHit = IntersectBounds(bvh.nodes.elements[nearChild], r, *tmax, &nearEntry);
+			bool farHit = IntersectBounds(bvh.nodes.elements[farChild], r, *tmax, &farEntry);
+
+			if (nearHit && farHit) {
+				if (farEntry < nearEntry) {
+					auto tmpIndex = nearChild; nearChild = farChild; farChild = tmpIndex;
+					auto tmpEntry = nearEntry; nearEntry = farEntry; farEntry = tmpEntry;
+				}
+				Check(stackSize < BVH_STACK_SIZE);
+				stack[stackSize++] = { farChild, farEntry };
+				nodeIndex = nearChild;
+				continue;
+			}
+			if (nearHit || farHit) {
+				nodeIndex = nearHit ? nearChild : farChild;
+				continue;
+			}
+		}
+
+		// pop skipping nodes behind the closest hit so far
+		bool found = false;
+		while (stackSize) {
+			auto top = stack[--stackSize];
+			if (top.entry <= *tmax) {
+				nodeIndex = top.node;
+				found = true;
+				break;
+			}
+		}
+		if (!found) {
+			return;
+		}
+	}
+}
+
+bool IntersectClosest(bvh_t const& bvh, ray_t const& ray, ray_hit_t* outHit) {
+	bvh_ray_setup_t r;
+	SetupRay(&r, ray);
+
+	ray_hit_t hit = {};
+	hit.t = ray.tmax;
+	hit.primitive = BVH_NULL_INDEX;
+
+	TraverseBvh(bvh, r, &hit.t, [&](bvh_node_t const& node) {
+		auto const& tri4 = bvh.triangles.elements[node.first];
+		float t[4], u[4], v[4];
+		i32 mask = IntersectTriangles(tri4, r, hit.t, t, u, v);
+		for (u32 lane = 0; mask; ++lane, mask >>= 1) {
+			if ((mask & 1) && t[lane] < hit.t) {
+				hit.t = t[lane];
+				hit.u = u[lane];
+				hit.v = v[lane];
+				hit.primitive = tri4.primitives[lane];
+			}
+		}
+		return false;
+	});
+
+	*outHit = hit;
+	return hit.primitive != BVH_NULL_INDEX;
+}
+
+bool IntersectAny(bvh_t const& bvh, ray_t const& ray) {
+	bvh_ray_setup_t r;
+	SetupRay(&r, ray);
+
+	float tmax = ray.tmax;
+	bool anyHit = false;
+
+	TraverseBvh(bvh, r, &tmax, [&](bvh_node_t const& node) {
+		float t[4], u[4], v[4];
+		anyHit = IntersectTriangles(bvh.triangles.elements[node.first], r, tmax, t, u, v) != 0;
+		return anyHit;
+	});
+
+	return anyHit;
+}
+
+void IntersectClosest(bvh_t const& bvh, ray_t const* rays, ray_hit_t* outHits, u32 raysNum) {
+	for (u32 i = 0; i < raysNum; ++i) {
+		IntersectClosest(bvh, rays[i], &outHits[i]);
+	}
+}
+
+u32 IntersectClosestPrimitive(bvh_t const& bvh, ray_t const& ray, bvh_primitive_test_t test, void* userData, float* outT) {
+	bvh_ray_setup_t r;
+	SetupRay(&r, ray);
+
+	ray_t testRay = ray;
+	u32 closest = BVH_NULL_INDEX;
+
+	TraverseBvh(bvh, r, &testRay.tmax, [&](bvh_node_t const& node) {
+		for (u32 i = node.first; i < node.first + node.count; ++i) {
+			auto primitive = bvh.primitives.elements[i];
+			float t = test(userData, primitive, testRay);
+			if (t >= ray.tmin && t < testRay.tmax) {
+				testRay.tmax = t;
+				closest = primitive;
+			}
+		}
+		return false;
+	});
+
+	*outT = testRay.tmax;
+	return closest;
+}
+
+struct ParallelIntersectRange_Payload {
+	bvh_t const*	bvh;
+	ray_t const*	rays;
+	ray_hit_t*		hits;
+	u32				from;
+	u32				to;
+};
+
+struct ParallelIntersectRoot_Payload {
+	Array<ParallelIntersectRange_Payload>*	SubtasksData;
+};
+
+void ParallelIntersectRange(const void* InArgs, Job*) {
+	PROFILE_SCOPE(intersect_rays_range);
+
+	auto Args = *(ParallelIntersectRange_Payload*)InArgs;
+	IntersectClosest(*Args.bvh, Args.rays + Args.from, Args.hits + Args.from, Args.to - Args.from);
+}
+
+void ParallelIntersectRoot(const void* InArgs, Job* job) {
+	auto Args = *(ParallelIntersectRoot_Payload*)InArgs;
+
+	Job* children[512];
+	Check(Size(*Args.SubtasksData) < _countof(children));
+
+	for (auto i : MakeRange(Size(*Args.SubtasksData))) {
+		children[i] = CreateChildJob(job, ParallelIntersectRange, &(*Args.SubtasksData)[i]);
+	}
+
+	RunJobs(children, (u32)Size(*Args.SubtasksData));
+}
+
+void ParallelIntersectClosest(bvh_t const& bvh, ray_t const* rays, ray_hit_t* outHits, u32 raysNum) {
+	PROFILE_SCOPE(intersect_rays);
+
+	// keep within the root job fan-out
+	u32 raysPerBatch = max(BVH_RAYS_PER_BATCH, (raysNum + 510) / 511);
+
+	Array<ParallelIntersectRange_Payload> childWorkspaces(GetMallocAllocator());
+	Reserve(childWorkspaces, raysNum / raysPerBatch + 1);
+
+	for (u32 i = 0; i < raysNum; i += raysPerBatch) {
+		ParallelIntersectRange_Payload payload = {};
+		payload.bvh = &bvh;
+		payload.rays = rays;
+		payload.hits = outHits;
+		payload.from = i;
+		payload.to = min(raysNum, i + raysPerBatch);
+		PushBack(childWorkspaces, payload);
+	}
+
+	ParallelIntersectRoot_Payload payload = {};
+	payload.SubtasksData = &childWorkspaces;
+
+	auto rootJob = CreateJob(ParallelIntersectRoot, &payload);
+	RunJobs(&rootJob, 1);
+
+	WaitFor(rootJob, true);
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "Types.h"
+#include "Array.h"
+#include "Views.h"
+#include "VectorMath.h"
+
+namespace Essence {
+
+const u32 BVH_LEAF_SIZE = 4;
+const u32 BVH_NULL_INDEX = 0xFFFFFFFF;
+
+struct bvh_node_t {
+	float	bounds_min[3];
+	u32		first;		// inner: left child, right child follows it; leaf: triangle block or offset into primitives
+	float	bounds_max[3];
+	u32		count;		// primitives in leaf, 0 for inner nodes
+};
+
+// four triangles in SoA with precomputed edges, unused lanes are degenerate
+struct bvh_tri4_t {
+	float	v0[3][4];
+	float	e1[3][4];
+	float	e2[3][4];
+	u32		primitives[4];
+};
+
+struct bvh_t {
+	array_view<bvh_node_t>	nodes;
+	array_view<bvh_tri4_t>	triangles;	// triangle bvh leaves
+	array_view<u32>			primitives;	// box bvh leaves
+};
+
+struct ray_t {
+	Vec3f	origin;
+	Vec3f	direction;
+	float	tmin;
+	float	tmax;
+};
+
+struct ray_hit_t {
+	float	t;
+	float	u;
+	float	v;
+	u32		primitive;	// BVH_NULL_INDEX when nothing was hit
+};
+
+// primitive is the index of the triangle in indices
+void	BuildTriangleBvh(bvh_t* outBvh, Vec3f const* positions, u32 const* indices, u32 trianglesNum, bool parallel = false);
+void	BuildBoxBvh(bvh_t* outBvh, Vec3f const* boundsMin, Vec3f const* boundsMax, u32 boxesNum, bool parallel = false);
+void	FreeBvh(bvh_t* bvh);
+
+bool	IntersectClosest(bvh_t const& bvh, ray_t const& ray, ray_hit_t* outHit);
+bool	IntersectAny(bvh_t const& bvh, ray_t const& ray);
+void	IntersectClosest(bvh_t const& bvh, ray_t const* rays, ray_hit_t* outHits, u32 raysNum);
+void	ParallelIntersectClosest(bvh_t const& bvh, ray_t const* rays, ray_hit_t* outHits, u32 raysNum);
+
+// box bvh traversal, test returns hit distance or a negative value on miss, called only with rays still worth testing
+typedef float(*bvh_primitive_test_t)(void* userData, u32 primitive, ray_t const& ray);
+u32		IntersectClosestPrimitive(bvh_t const& bvh, ray_t const& ray, bvh_primitive_test_t test, void* userData, float* outT);
+
+}
\ No newline at end of file
@@ -6,6 +6,12 @@
 #include "Ringbuffer.h"
 #include "Freelist.h"
 #include "Application.h"
+#include "ResourceTracking.h"
+#include "PipelineKey.h"
+#include "PipelineCache.h"
+#include "PipelineDependencies.h"
+#include "UploadAllocator.h"
+#include "Scheduler.h"
 
 #include <d3d12shader.h>
 #include <d3dcompiler.h>
@@ -57,24 +63,13 @@ bool IsExclusiveState(D3D12_RESOURCE_STATES state) {
 	}
 }
 
-bool NeedStateChange(GPUQueueEnum queueType, ResourceHeapType heapType, D3D12_RESOURCE_STATES before, D3D12_RESOURCE_STATES after, bool exclusive = false) {
-	if (heapType != DEFAULT_MEMORY) {
-		return false;
-	}
-
-	if (queueType == GPUQueueEnum::Direct) {
-		return (after != before) && ((after & before) == 0 || exclusive);
-	}
-	else if (queueType == GPUQueueEnum::Copy) {
-		return false;
-	}
-
-	Check(0);
-	return false;
+// direct queue rules, copy queue and upload or readback heaps never get here
+bool NeedStateChange(u32 before, u32 after, bool exclusive) {
+	return (after != before) && ((after & before) == 0 || exclusive);
 }
 
-D3D12_RESOURCE_STATES GetNextState(GPUQueueEnum queueType, D3D12_RESOURCE_STATES before, D3D12_RESOURCE_STATES after) {
-	if (IsExclusiveState(after) || IsExclusiveState(before)) {
+u32 GetNextState(u32 before, u32 after) {
+	if (IsExclusiveState((D3D12_RESOURCE_STATES)after) || IsExclusiveState((D3D12_RESOURCE_STATES)before)) {
 		return after;
 	}
 
@@ -83,6 +78,8 @@ D3D12_RESOURCE_STATES GetNextState(GPUQueueEnum queueType, D3D12_RESOURCE_STATES
 	return before | after;
 }
 
+const state_rules_t D3D12StateRules = { NeedStateChange, GetNextState };
+
 void GetD3D12StateDefaults(D3D12_RASTERIZER_DESC *pDest) {
 	*pDest = CD3DX12_RASTERIZER_DESC(D3D12_DEFAULT);
 }
@@ -112,213 +109,45 @@ bool IsStencilReadOnly(D3D12_GRAPHICS_PIPELINE_STATE_DESC const* desc) {
 				&& desc->DepthStencilState.BackFace.StencilPassOp == D3D12_STENCIL_OP_KEEP));
 }
 
-// threadsafe ringbuffer, not suited for bigger allocations
-class UploadHeapAllocator {
-public:
-	struct block_fence_t {
-		u64				read_offset;
-		GPUFenceHandle	fence;
-	};
-
-	struct MemoryBlock {
-		ID3D12Resource*				D12Resource;
-		void*						MappedPtr;
-		Ringbuffer<block_fence_t>	Fences;
-		u64							Size;
-
-		au64						ReadOffset;
-		au64						WriteOffset;
-
-		MemoryBlock(u32 size) : Size(size), MappedPtr(nullptr), ReadOffset(0), WriteOffset(0) {
-			Reserve(Fences, 8);
-
-			VerifyHr(GD12Device->CreateCommittedResource(
-				&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_UPLOAD),
-				D3D12_HEAP_FLAG_NONE,
-				&CD3DX12_RESOURCE_DESC::Buffer(Size),
-				D3D12_RESOURCE_STATE_GENERIC_READ,
-				nullptr,
-				IID_PPV_ARGS(&D12Resource)));
-
-			VerifyHr(D12Resource->Map(0, nullptr, &MappedPtr));
-		}
-
-		~MemoryBlock() {
-			if (D12Resource) {
-				D12Resource->Unmap(0, nullptr);
-			}
-			ComRelease(D12Resource);
-			FreeMemory(Fences);
-		}
-	};
-
-	u32						MinBlockSize = 1024 * 1024; // 1 Mb chunks, larger if needed
-	Array<MemoryBlock*>		AvailableBlocks;
-	Array<MemoryBlock*>		PendingBlocks;
-	MemoryBlock*			CurrentBlock;
-
-	CriticalSection			CS;
-
-	UploadHeapAllocator() : CurrentBlock(nullptr) {
-	}
-
-	UploadHeapAllocator& operator =(UploadHeapAllocator&& other) {
-		AvailableBlocks = std::move(other.AvailableBlocks);
-		PendingBlocks = std::move(other.PendingBlocks);
-		CurrentBlock = other.CurrentBlock;
-		other.CurrentBlock = nullptr;
-
-		return *this;
-	}
-
-	UploadHeapAllocator(UploadHeapAllocator&& other) {
-		*this = std::move(other);
-	}
-
-	~UploadHeapAllocator() {
-		RemoveAll(AvailableBlocks, [](auto block) { return block == nullptr; });
-		FreeTemporaryAllocations();
-
-		for (auto b : AvailableBlocks) {
-			_delete(b);
-		}
-		for (auto b : PendingBlocks) {
-			_delete(b);
-		}
-		_delete(CurrentBlock);
-		CurrentBlock = nullptr;
-
-		FreeMemory(AvailableBlocks);
-		FreeMemory(PendingBlocks);
-	}
-
-	void				AllocateNewBlock() {
-		u32 blockSize = MinBlockSize;
-
-		MemoryBlock* block;
-		_new(block, blockSize);
-
-		CurrentBlock = block;
-	}
-
-	upload_allocation_t AllocateTemporary(u32 size, u32 alignment = 256) {
-		Check(size < MinBlockSize);
-
-		if (CurrentBlock == nullptr) {
-			ScopeLock lock(&CS);
-			if (CurrentBlock == nullptr) {
-				AllocateNewBlock();
-			}
-		}
-
-		auto block = CurrentBlock;
-		auto paddedSize = (size + alignment - 1) & ~(alignment - 1);
-
-		u64 writeOffset = block->WriteOffset.load();
-		while (true) {
-			auto nextWriteOffset = (u64)align_forward((void*)writeOffset, alignment) + paddedSize;
-			auto readOffset = block->ReadOffset.load();
-			auto diff = nextWriteOffset - readOffset;
-			auto blockSize = block->Size;
-
-			auto notContinous = (writeOffset / blockSize) != (nextWriteOffset / blockSize);
-
-			if (notContinous) {
-				// rewind
-				auto blockEnd = ((writeOffset / blockSize) + 1) * blockSize;
-				if (block->WriteOffset.compare_exchange_strong(writeOffset, blockEnd)) {
-					writeOffset = blockEnd;
-				}
-				continue;
-			}
-			if (diff > blockSize) {
-				ScopeLock lock(&CS);
-				if (block == CurrentBlock) {
-					PushBack(PendingBlocks, block);
-					bool recycled = false;
-					for (u32 i = 0; i < Size(AvailableBlocks); ++i) {
-						if (AvailableBlocks[i] != nullptr) {
-							CurrentBlock = AvailableBlocks[i];
-							AvailableBlocks[i] = nullptr;
-							recycled = true;
-							break;
-						}
-					}
-					if (!recycled) {
-						AllocateNewBlock();
-					}
-				}
-				block = CurrentBlock;
-				writeOffset = block->WriteOffset.load();
-				continue;
-			}
-
-			if (block->WriteOffset.compare_exchange_strong(writeOffset, nextWriteOffset)) {
-				break;
-			}
-		}
-
-		u64 alignedWriteOffset = (u64)align_forward((void*)writeOffset, alignment);
-
-		auto block_byte_offset = alignedWriteOffset % block->Size;
+bool CreateD12UploadBlock(void*, u64 size, upload_block_memory_t* outMemory) {
+	ID3D12Resource* resource;
+	VerifyHr(GD12Device->CreateCommittedResource(
+		&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_UPLOAD),
+		D3D12_HEAP_FLAG_NONE,
+		&CD3DX12_RESOURCE_DESC::Buffer(size),
+		D3D12_RESOURCE_STATE_GENERIC_READ,
+		nullptr,
+		IID_PPV_ARGS(&resource)));
 
-		Check(block_byte_offset + size <= block->Size);
-
-		upload_allocation_t out;
-		out.virtual_address = block->D12Resource->GetGPUVirtualAddress() + block_byte_offset;
-		out.write_ptr = pointer_add(block->MappedPtr, block_byte_offset);
-
-		return out;
-	}
-
-	void FreeTemporaryAllocations() {
-		for (auto& block : PendingBlocks) {
-
-			while (Size(block->Fences)) {
-				if (IsFenceCompleted(Front(block->Fences).fence)) {
-					block->ReadOffset = Front(block->Fences).read_offset;
-					PopFront(block->Fences);
-				}
-				else {
-					break;
-				}
-			}
+	VerifyHr(resource->Map(0, nullptr, &outMemory->mapped_ptr));
+	outMemory->resource = resource;
+	outMemory->gpu_address = resource->GetGPUVirtualAddress();
+	return true;
+}
 
-			if (!Size(block->Fences)) {
-				PushBack(AvailableBlocks, block);
-				block = nullptr;
-			}
-		}
+void DestroyD12UploadBlock(void*, upload_block_memory_t const& memory) {
+	auto resource = (ID3D12Resource*)memory.resource;
+	resource->Unmap(0, nullptr);
+	ComRelease(resource);
+}
 
-		RemoveAll(PendingBlocks, [](auto block) { return block == nullptr; });
-		if (CurrentBlock == nullptr) {
-			CurrentBlock = Size(AvailableBlocks) ? AvailableBlocks[0] : nullptr;
-		}
-	}
+u64 ToUploadFence(GPUFenceHandle fence) {
+	return ((u64)fence.handle << 32) | fence.generation;
+}
 
-	void FenceTemporaryAllocations(GPUFenceHandle fence) {
-		RemoveAll(AvailableBlocks, [](auto block) { return block == nullptr; });
+bool IsD12UploadFenceCompleted(void*, u64 fence) {
+	GPUFenceHandle handle;
+	handle.handle = (u32)(fence >> 32);
+	handle.generation = (u32)fence;
+	return IsFenceCompleted(handle);
+}
 
-		for (auto& block : AvailableBlocks) {
-			if ((!Size(block->Fences) && block->ReadOffset != block->WriteOffset) ||
-				(Size(block->Fences) && Back(block->Fences).read_offset != block->WriteOffset)) {
-				block_fence_t blockFence;
-				blockFence.fence = fence;
-				blockFence.read_offset = block->WriteOffset;
-				PushBack(block->Fences, blockFence);
-			}
-		}
-		for (auto& block : PendingBlocks) {
-			if (!Size(block->Fences) ||
-				(Size(block->Fences) && Back(block->Fences).read_offset != block->WriteOffset)) {
-				block_fence_t blockFence;
-				blockFence.fence = fence;
-				blockFence.read_offset = block->WriteOffset;
-				PushBack(block->Fences, blockFence);
-			}
-		}
-	}
-};
+upload_allocation_t ToUploadAllocation(upload_t upload) {
+	upload_allocation_t out;
+	out.virtual_address = upload.gpu_address;
+	out.write_ptr = upload.write_ptr;
+	return out;
+}
 
 struct gpu_sample {
 	cstr	label;
@@ -434,12 +263,12 @@ vertex_factory_handle	GetVertexFactory(std::initializer_list<input_layout_elemen
 		d12elements[index] = {};
 
 		d12elements[index].SemanticName = in.semantic_name;
-		d12elements[index].SemanticIndex = 0;
+		d12elements[index].SemanticIndex = in.semantic_index;
 		d12elements[index].Format = in.format;
 		d12elements[index].AlignedByteOffset = D3D12_APPEND_ALIGNED_ELEMENT;
-		d12elements[index].InputSlot = 0;
-		d12elements[index].InputSlotClass = D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA;
-		d12elements[index].InstanceDataStepRate = 0;
+		d12elements[index].InputSlot = in.input_slot;
+		d12elements[index].InputSlotClass = in.instance_step_rate ? D3D12_INPUT_CLASSIFICATION_PER_INSTANCE_DATA : D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA;
+		d12elements[index].InstanceDataStepRate = in.instance_step_rate;
 
 		++index;
 	}
@@ -502,7 +331,7 @@ u32							FenceGenerations[MAX_PENDING_FENCES];
 u64							FenceCounter;
 
 Array<GPUQueue*>			GPUQueues;
-UploadHeapAllocator			ConstantsAllocator;
+upload_allocator_t			ConstantsAllocator;
 DescriptorAllocator			GpuDescriptorsAllocator;
 DescriptorAllocator			CpuConstantsDescriptorsCacheAllocator;
 GPUFenceHandle				CreateFence(GPUQueue* queue);
@@ -511,10 +340,23 @@ Ringbuffer<GPUFenceHandle>	FrameFences;
 d12_stats_t					LastFrameStats;
 d12_stats_t					FrameStats;
 
+pipeline_cache_t			GPipelineCache;
+const char*					PipelineCachePath = "pipelines.cache";
+
 void				InitRenderingEngines() {
+	InitPipelineCache(&GPipelineCache, MakeFileCacheStorage(PipelineCachePath), GetDriverStamp());
+	BeginLoadPipelineCache(&GPipelineCache);
+
 	GpuDescriptorsAllocator = std::move(DescriptorAllocator(512 * 1024, D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV, true));
 	CpuConstantsDescriptorsCacheAllocator = std::move(DescriptorAllocator(512 * 1024, D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV, false));
-	ConstantsAllocator = std::move(UploadHeapAllocator());
+
+	// ring covers constants and small per frame data, big uploads get pooled blocks of their own
+	upload_allocator_desc_t uploadDesc;
+	uploadDesc.ring_size = 8 * 1024 * 1024;
+	uploadDesc.block_size = 1024 * 1024;
+	uploadDesc.large_size = 1024 * 1024;
+	uploadDesc.history_frames = 32;
+	InitUploadAllocator(&ConstantsAllocator, { nullptr, CreateD12UploadBlock, DestroyD12UploadBlock, IsD12UploadFenceCompleted }, uploadDesc);
 }
 
 class GPUCommandListPool;
@@ -732,38 +574,26 @@ public:
 	}
 };
 
-struct resource_tracking_state {
-	u32		resource_state;
-	bool	per_subresource_tracking;
-};
-
-Hashmap<resource_handle, resource_tracking_state>			GResourceState;
-Hashmap<resource_slice_t, D3D12_RESOURCE_STATES>			GSubresourceState;
+resource_states_table_t								GResourceStates;
 
 class ResourceTracker {
 public:
-	Hashmap<resource_handle, resource_tracking_state>	ExpectedState;
-	Hashmap<resource_slice_t, u32>						ExpectedSubresourceState;
-
-	Hashmap<resource_handle, resource_tracking_state>	CurrentState;
-	Hashmap<resource_slice_t, u32>						CurrentSubresourceState;
-
-	Array<D3D12_RESOURCE_BARRIER>						QueuedBarriers;
+	state_tracker_t										Tracker;
+	Array<state_transition_t>							QueuedTransitions;
 	GPUCommandList*										Owner;
 
 	ResourceTracker(GPUCommandList* list);
 	~ResourceTracker();
 
+	bool IsTracked(resource_slice_t resource);
 	void Transition(resource_slice_t resource, D3D12_RESOURCE_STATES after);
+	void BeginTransition(resource_slice_t resource, D3D12_RESOURCE_STATES after);
+	void EndTransitions();
 	void FireBarriers();
-	void EnqueueTransition(ID3D12Resource* resource, u32 subresource, D3D12_RESOURCE_STATES before, D3D12_RESOURCE_STATES after);
 
 	void Clear() {
-		Essence::Clear(ExpectedState);
-		Essence::Clear(ExpectedSubresourceState);
-		Essence::Clear(CurrentState);
-		Essence::Clear(CurrentSubresourceState);
-		Check(Size(QueuedBarriers) == 0);
+		ResetStateTracker(&Tracker);
+		Check(Size(QueuedTransitions) == 0);
 	}
 };
 
@@ -870,6 +700,7 @@ public:
 		vertex_factory_handle					VertexFactory;
 		D3D12_VERTEX_BUFFER_VIEW				VertexStreams[D3D12_IA_VERTEX_INPUT_RESOURCE_SLOT_COUNT];
 		u32										VertexStreamsNum;
+		D3D12_INDEX_BUFFER_VIEW					IndexBuffer;
 		D3D12_GRAPHICS_PIPELINE_STATE_DESC		PipelineDesc;
 	} Graphics;
 	struct {
@@ -1258,6 +1089,7 @@ void Close(GPUCommandList* list) {
 	Check(list->State == CL_RECORDING);
 	list->State = CL_CLOSED;
 
+	list->ResourcesStateTracker.EndTransitions();
 	list->ResourcesStateTracker.FireBarriers();
 
 	for (auto kv : list->Root.ConstantBuffers) {
@@ -1270,8 +1102,6 @@ void Close(GPUCommandList* list) {
 	VerifyHr(list->D12CommandList->Close());
 }
 
-const u32 RESOURCE_STATE_UNKNOWN = 0xFFFFFFFF;
-
 void Execute(GPUCommandList* list) {
 #if GPU_PROFILING
 	Check(list->Sample.cl == nullptr);
@@ -1289,7 +1119,7 @@ void Execute(GPUCommandList* list) {
 	Check(list->State == CL_CLOSED);
 
 	// fix resources states!
-	Check(Size(list->ResourcesStateTracker.QueuedBarriers) == 0);
+	Check(Size(list->ResourcesStateTracker.QueuedTransitions) == 0);
 
 	Array<D3D12_RESOURCE_BARRIER> patchupBarriers(GetThreadScratchAllocator());
 
@@ -1304,118 +1134,12 @@ void Execute(GPUCommandList* list) {
 		PushBack(patchupBarriers, barrier);
 	};
 
-	for (auto kv : list->ResourcesStateTracker.ExpectedState) {
-		if (kv.value.per_subresource_tracking == 0) {
-			auto expected = (D3D12_RESOURCE_STATES)kv.value.resource_state;
-			if (GResourceState[kv.key].per_subresource_tracking == 0) {
-				// whole to whole
-				auto before = (D3D12_RESOURCE_STATES)GResourceState[kv.key].resource_state;
-				auto expected = (D3D12_RESOURCE_STATES)kv.value.resource_state;
-
-				if (NeedStateChange(list->Queue->Type, GetResourceTransitionInfo(kv.key)->heap_type, before, expected)) {
-					auto after = GetNextState(list->Queue->Type, before, expected);
-					EnqueueBarrier(GetResourceFast(kv.key)->resource, -1, before, after);
-					GResourceState[kv.key].resource_state = (u32)after;
-				}
-			}
-			else {
-				// subres to whole
-				auto subresNum = GetResourceInfo(kv.key)->subresources_num;
-				resource_slice_t query = {};
-				query.handle = kv.key;
-				for (auto subresIndex : MakeRange(subresNum)) {
-					query.subresource = subresIndex + 1;
-
-					auto pSubresState = Get(GSubresourceState, query);
-					auto before = (D3D12_RESOURCE_STATES)GResourceState[kv.key].resource_state;
-					if (pSubresState) {
-						before = *pSubresState;
-						Remove(GSubresourceState, query);
-					}
-
-					if (NeedStateChange(list->Queue->Type, GetResourceTransitionInfo(kv.key)->heap_type, before, expected, true)) {
-						EnqueueBarrier(GetResourceFast(kv.key)->resource, subresIndex, before, expected);
-					}
-				}
-
-				GResourceState[kv.key].per_subresource_tracking = 0;
-				GResourceState[kv.key].resource_state = (u32)expected;
-			}
-
-		}
-		else if (kv.value.per_subresource_tracking == 1) {
-			auto before = (D3D12_RESOURCE_STATES)GResourceState[kv.key].resource_state;
-			auto subresNum = GetResourceInfo(kv.key)->subresources_num;
-			if (GResourceState[kv.key].per_subresource_tracking == 0) {
-				// whole to subres
-				auto before = (D3D12_RESOURCE_STATES)GResourceState[kv.key].resource_state;
-
-				bool change = false;
-
-				auto subresNum = GetResourceInfo(kv.key)->subresources_num;
-				resource_slice_t query = {};
-				query.handle = kv.key;
-
-				for (auto subresIndex : MakeRange(subresNum)) {
-					query.subresource = subresIndex + 1;
-					auto pExpectedState = Get(list->ResourcesStateTracker.ExpectedSubresourceState, query);
-
-					if (kv.value.resource_state == RESOURCE_STATE_UNKNOWN && pExpectedState == nullptr) {
-						continue;
-					}
-
-					auto expected = (D3D12_RESOURCE_STATES)kv.value.resource_state;
-					if (pExpectedState) {
-						expected = (D3D12_RESOURCE_STATES)*pExpectedState;
-					}
-
-					if (NeedStateChange(list->Queue->Type, GetResourceTransitionInfo(kv.key)->heap_type, before, expected)) {
-						auto after = GetNextState(list->Queue->Type, before, expected);
-						EnqueueBarrier(GetResourceFast(kv.key)->resource, subresIndex, before, after);
-						GSubresourceState[query] = after;
-						change = true;
-					}
-				}
-
-				if (change) {
-					GResourceState[kv.key].per_subresource_tracking = 1;
-				}
-			}
-			else {
-				// subres to subres
-
-				auto subresNum = GetResourceInfo(kv.key)->subresources_num;
-				resource_slice_t query = {};
-				query.handle = kv.key;
-				for (auto subresIndex : MakeRange(subresNum)) {
-					query.subresource = subresIndex + 1;
-
-					auto pSubresState = Get(GSubresourceState, query);
-					auto before = (D3D12_RESOURCE_STATES)GResourceState[kv.key].resource_state;
-					if (pSubresState) {
-						before = *pSubresState;
-						Remove(GSubresourceState, query);
-					}
-					auto pExpectedState = Get(list->ResourcesStateTracker.ExpectedSubresourceState, query);
-
-					if (kv.value.resource_state == RESOURCE_STATE_UNKNOWN && pExpectedState == nullptr) {
-						continue;
-					}
-
-					auto expected = (D3D12_RESOURCE_STATES)kv.value.resource_state;
-					if (pExpectedState) {
-						expected = (D3D12_RESOURCE_STATES)*pExpectedState;
-					}
-					Check((u32)expected != RESOURCE_STATE_UNKNOWN);
-
-					if (NeedStateChange(list->Queue->Type, GetResourceTransitionInfo(kv.key)->heap_type, before, expected)) {
-						auto after = GetNextState(list->Queue->Type, before, expected);
-						EnqueueBarrier(GetResourceFast(kv.key)->resource, subresIndex, before, after);
-						GSubresourceState[query] = after;
-					}
-				}
-			}
-		}
+	Array<state_transition_t> transitions(GetThreadScratchAllocator());
+	ResolveTrackedStates(&GResourceStates, list->ResourcesStateTracker.Tracker, &transitions);
+	for (auto const& transition : transitions) {
+		// ALL_SUBRESOURCES matches D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES
+		EnqueueBarrier(GetResourceFastByIndex(transition.resource)->resource, transition.subresource,
+			(D3D12_RESOURCE_STATES)transition.before, (D3D12_RESOURCE_STATES)transition.after);
 	}
 
 	Array<ID3D12CommandList*> executionList(GetThreadScratchAllocator());
@@ -1468,8 +1192,7 @@ void Execute(GPUCommandList* list) {
 		patchupList->CommandAllocator = nullptr;
 
 		patchupList->Pool->Return(patchupList);
-		Check(Size(patchupList->ResourcesStateTracker.ExpectedState) == 0);
-		Check(Size(patchupList->ResourcesStateTracker.ExpectedSubresourceState) == 0);
+		Check(Size(patchupList->ResourcesStateTracker.Tracker.entries) == 0);
 	}
 }
 
@@ -1486,7 +1209,7 @@ void EndCommandsFrame(GPUQueue* mainQueue) {
 	// fence read with last fence from queue(!)
 	GpuDescriptorsAllocator.FenceTemporaryAllocations(GetLastSignaledFence(mainQueue));
 	CpuConstantsDescriptorsCacheAllocator.FenceTemporaryAllocations(GetLastSignaledFence(mainQueue));
-	ConstantsAllocator.FenceTemporaryAllocations(GetLastSignaledFence(mainQueue));
+	FenceUploads(&ConstantsAllocator, ToUploadFence(GetLastSignaledFence(mainQueue)));
 
 	auto frameFence = GetLastSignaledFence(mainQueue);
 
@@ -1506,7 +1229,7 @@ void EndCommandsFrame(GPUQueue* mainQueue) {
 
 	GpuDescriptorsAllocator.FreeTemporaryAllocations();
 	CpuConstantsDescriptorsCacheAllocator.FreeTemporaryAllocations();
-	ConstantsAllocator.FreeTemporaryAllocations();
+	RetireUploads(&ConstantsAllocator);
 
 #if COLLECT_RENDER_STATS
 	LastFrameStats = FrameStats;
@@ -1539,154 +1262,74 @@ void WaitForCompletion() {
 }
 
 ResourceTracker::ResourceTracker(GPUCommandList* list) : Owner(list) {
+	InitStateTracker(&Tracker, &D3D12StateRules);
 }
 
 ResourceTracker::~ResourceTracker() {
-	FreeMemory(CurrentState);
-	FreeMemory(CurrentSubresourceState);
-	FreeMemory(ExpectedState);
-	FreeMemory(ExpectedSubresourceState);
-	FreeMemory(QueuedBarriers);
+	FreeStateTracker(&Tracker);
+	FreeMemory(QueuedTransitions);
 }
 
-void ResourceTracker::EnqueueTransition(ID3D12Resource* resource, u32 subresource, D3D12_RESOURCE_STATES before, D3D12_RESOURCE_STATES after) {
-	D3D12_RESOURCE_BARRIER barrier;
-	barrier.Type = D3D12_RESOURCE_BARRIER_TYPE_TRANSITION;
-	barrier.Flags = D3D12_RESOURCE_BARRIER_FLAG_NONE;
-	barrier.Transition.pResource = resource;
-	barrier.Transition.Subresource = subresource;
-	barrier.Transition.StateBefore = before;
-	barrier.Transition.StateAfter = after;
-	PushBack(QueuedBarriers, barrier);
+bool ResourceTracker::IsTracked(resource_slice_t slice) {
+	return Owner->Queue->Type != GPUQueueEnum::Copy && GetResourceTransitionInfo(slice.handle)->heap_type == DEFAULT_MEMORY;
 }
 
-// state exists => expected state exists
-// state is tracked per subresource => expected might tracked per subresource
-// state is tracked per subresource but no entry for subresource => inherit from resource (subres has precedence over resource)
-
+// first use of a subresource in a list becomes its expected state, Execute glues global state to it
 void ResourceTracker::Transition(resource_slice_t slice, D3D12_RESOURCE_STATES desired) {
-	if (slice.subresource == 0) {
-		const auto pState = Get(CurrentState, slice.handle);
-		if (pState && pState->per_subresource_tracking == 0) {
-			Check(pState->resource_state != RESOURCE_STATE_UNKNOWN);
-			auto before = (D3D12_RESOURCE_STATES)pState->resource_state;
-			if (NeedStateChange(Owner->Queue->Type, GetResourceTransitionInfo(slice.handle)->heap_type, before, desired)) {
-				auto after = GetNextState(Owner->Queue->Type, before, desired);
-				EnqueueTransition(GetResourceFast(slice.handle)->resource, slice.subresource - 1, before, after);
-				CurrentState[slice.handle].resource_state = after;
-			}
-		}
-		else if (!pState) {
-			ExpectedState[slice.handle].resource_state = (u32)desired;
-			ExpectedState[slice.handle].per_subresource_tracking = 0;
+	if (!IsTracked(slice)) {
+		return;
+	}
 
-			CurrentState[slice.handle].resource_state = (u32)desired;
-			CurrentState[slice.handle].per_subresource_tracking = 0;
-		}
-		else {
-			Check(pState && pState->per_subresource_tracking == 1);
-
-			auto subresNum = GetResourceInfo(slice.handle)->subresources_num;
-			auto query = slice;
-
-			auto after = pState->resource_state != RESOURCE_STATE_UNKNOWN
-				? GetNextState(Owner->Queue->Type, (D3D12_RESOURCE_STATES)pState->resource_state, desired)
-				: desired;
-
-			for (auto subresIndex : MakeRange(subresNum)) {
-				query.subresource = subresIndex + 1;
-				const auto pSubresState = Get(CurrentSubresourceState, query);
-				if (pSubresState) {
-					auto before = (D3D12_RESOURCE_STATES)*pSubresState;
-					if (NeedStateChange(Owner->Queue->Type, GetResourceTransitionInfo(slice.handle)->heap_type, before, after)) {
-						EnqueueTransition(GetResourceFast(slice.handle)->resource, subresIndex, before, after);
-					}
-					// we go to one state per res, drop rest
-					Remove(CurrentSubresourceState, query);
-				}
-				else if (pState->resource_state != RESOURCE_STATE_UNKNOWN) {
-					auto before = (D3D12_RESOURCE_STATES)pState->resource_state;
-					if (NeedStateChange(Owner->Queue->Type, GetResourceTransitionInfo(slice.handle)->heap_type, before, after, true)) {
-						EnqueueTransition(GetResourceFast(slice.handle)->resource, subresIndex, before, after);
-					}
-				}
-			}
+	TrackTransition(&Tracker, slice.handle.GetIndex(), GetResourceInfo(slice.handle)->subresources_num,
+		slice.subresource ? slice.subresource - 1 : ALL_SUBRESOURCES, (u32)desired, &QueuedTransitions);
+}
 
-			if (pState->resource_state != RESOURCE_STATE_UNKNOWN && NeedStateChange(Owner->Queue->Type, GetResourceTransitionInfo(slice.handle)->heap_type, (D3D12_RESOURCE_STATES)pState->resource_state, after, true)) {
-				//EnqueueTransition(GetResourceFast(slice.handle)->resource, -1, (D3D12_RESOURCE_STATES)pState->resource_state, after);
-			}
-			else {
-				// expect resource to be in after state
-				ExpectedState[slice.handle].resource_state = (u32)after;
-			}
-			CurrentState[slice.handle].resource_state = after;
-			CurrentState[slice.handle].per_subresource_tracking = 0;
-		}
-	}
-	else {
-		Check(slice.subresource != 0);
-
-		const auto pResState = Get(CurrentState, slice.handle);
-		const auto pSubresState = Get(CurrentSubresourceState, slice);
-		if (pSubresState) {
-			Check(*pSubresState != RESOURCE_STATE_UNKNOWN);
-
-			auto before = (D3D12_RESOURCE_STATES)*pSubresState;
-			if (NeedStateChange(Owner->Queue->Type, GetResourceTransitionInfo(slice.handle)->heap_type, before, desired)) {
-				auto after = GetNextState(Owner->Queue->Type, before, desired);
-				EnqueueTransition(GetResourceFast(slice.handle)->resource, slice.subresource - 1, before, after);
-				Set(CurrentSubresourceState, slice, (u32)after);
-			}
-		}
-		else if (pResState && pResState->per_subresource_tracking == 1) {
-			if (pResState->resource_state == RESOURCE_STATE_UNKNOWN) {
-				Set(ExpectedSubresourceState, slice, (u32)desired);
-				Set(CurrentSubresourceState, slice, (u32)desired);
-			}
-			else {
-				Check(pResState->resource_state != RESOURCE_STATE_UNKNOWN);
-				auto before = (D3D12_RESOURCE_STATES)pResState->resource_state;
-				if (NeedStateChange(Owner->Queue->Type, GetResourceTransitionInfo(slice.handle)->heap_type, before, desired)) {
-					auto after = GetNextState(Owner->Queue->Type, before, desired);
-					EnqueueTransition(GetResourceFast(slice.handle)->resource, slice.subresource - 1, before, after);
-					Set(CurrentSubresourceState, slice, (u32)after);
-				}
-			}
-		}
-		else if (pResState && pResState->per_subresource_tracking == 0 && pResState->resource_state != RESOURCE_STATE_UNKNOWN) {
-			auto before = (D3D12_RESOURCE_STATES)pResState->resource_state;
-			if (NeedStateChange(Owner->Queue->Type, GetResourceTransitionInfo(slice.handle)->heap_type, before, desired)) {
-				auto after = GetNextState(Owner->Queue->Type, before, desired);
-				EnqueueTransition(GetResourceFast(slice.handle)->resource, slice.subresource - 1, before, after);
-				Set(CurrentSubresourceState, slice, (u32)after);
-				Get(CurrentState, slice.handle)->per_subresource_tracking = 1;
-			}
-		}
-		else if (!pResState) {
-			Set(CurrentSubresourceState, slice, (u32)desired);
-			Set(ExpectedSubresourceState, slice, (u32)desired);
-			resource_tracking_state tracking = {};
-			tracking.per_subresource_tracking = 1;
-			tracking.resource_state = RESOURCE_STATE_UNKNOWN;
-			Set(CurrentState, slice.handle, tracking);
-			Set(ExpectedState, slice.handle, tracking);
-		}
-		else {
-			Check(0);
-		}
+// the next Transition of the resource ends it, so the gpu gets the work in between to finish the flush
+void ResourceTracker::BeginTransition(resource_slice_t slice, D3D12_RESOURCE_STATES desired) {
+	if (!IsTracked(slice)) {
+		return;
 	}
+
+	BeginTrackedTransition(&Tracker, slice.handle.GetIndex(), GetResourceInfo(slice.handle)->subresources_num,
+		slice.subresource ? slice.subresource - 1 : ALL_SUBRESOURCES, (u32)desired, &QueuedTransitions);
+}
+
+void ResourceTracker::EndTransitions() {
+	EndTrackedTransitions(&Tracker, &QueuedTransitions);
 }
 
 void ResourceTracker::FireBarriers() {
-	if (Size(QueuedBarriers)) {
-		Owner->D12CommandList->ResourceBarrier((u32)Size(QueuedBarriers), QueuedBarriers.DataPtr);
-		Essence::Clear(QueuedBarriers);
+	if (!Size(QueuedTransitions)) {
+		return;
+	}
+
+	// everything queued since the last draw is emitted together
+	MergeTransitions(QueuedTransitions);
+
+	const D3D12_RESOURCE_BARRIER_FLAGS splitFlags[] = { D3D12_RESOURCE_BARRIER_FLAG_NONE, D3D12_RESOURCE_BARRIER_FLAG_BEGIN_ONLY, D3D12_RESOURCE_BARRIER_FLAG_END_ONLY };
+
+	Array<D3D12_RESOURCE_BARRIER> barriers(GetThreadScratchAllocator());
+	Reserve(barriers, Size(QueuedTransitions));
+	for (auto const& transition : QueuedTransitions) {
+		D3D12_RESOURCE_BARRIER barrier;
+		barrier.Type = D3D12_RESOURCE_BARRIER_TYPE_TRANSITION;
+		barrier.Flags = splitFlags[transition.split];
+		barrier.Transition.pResource = GetResourceFastByIndex(transition.resource)->resource;
+		// ALL_SUBRESOURCES matches D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES
+		barrier.Transition.Subresource = transition.subresource;
+		barrier.Transition.StateBefore = (D3D12_RESOURCE_STATES)transition.before;
+		barrier.Transition.StateAfter = (D3D12_RESOURCE_STATES)transition.after;
+		PushBack(barriers, barrier);
+	}
+	Essence::Clear(QueuedTransitions);
+
+	if (Size(barriers)) {
+		Owner->D12CommandList->ResourceBarrier((u32)Size(barriers), barriers.DataPtr);
 	}
 }
 
 void	 RegisterResource(resource_handle resource, D3D12_RESOURCE_STATES initialState) {
-	GResourceState[resource].resource_state = (u32)initialState;
-	GResourceState[resource].per_subresource_tracking = 0;
+	SetResourceState(&GResourceStates, resource.GetIndex(), GetResourceInfo(resource)->subresources_num, (u32)initialState);
 }
 
 void CopyResource(GPUCommandList* list, resource_handle dst, resource_handle src) {
@@ -1785,10 +1428,25 @@ root_signature_t GetRootSignature(D3D12_ROOT_SIGNATURE_DESC const& desc,
 	) {
 	Array<D3D12_STATIC_SAMPLER_DESC> samplers(GetThreadScratchAllocator());
 
-	// hash only content, not pointers!
+	// hash only content, not pointers! tables go in as offsets into ranges so the hash holds between runs
 	u64 rootHash = 0;
 	rootHash = Hash::MurmurHash2_64(ranges->DataPtr, (i32)(ranges->Size * sizeof(ranges->DataPtr[0])), rootHash);
-	rootHash = Hash::MurmurHash2_64(params->DataPtr, (i32)(params->Size * sizeof(params->DataPtr[0])), rootHash);
+	for (auto const& param : *params) {
+		u32 fields[4] = { (u32)param.ParameterType, (u32)param.ShaderVisibility };
+		if (param.ParameterType == D3D12_ROOT_PARAMETER_TYPE_DESCRIPTOR_TABLE) {
+			fields[2] = param.DescriptorTable.NumDescriptorRanges;
+			fields[3] = (u32)(param.DescriptorTable.pDescriptorRanges - ranges->DataPtr);
+		}
+		else if (param.ParameterType == D3D12_ROOT_PARAMETER_TYPE_32BIT_CONSTANTS) {
+			fields[2] = param.Constants.ShaderRegister | (param.Constants.RegisterSpace << 16);
+			fields[3] = param.Constants.Num32BitValues;
+		}
+		else {
+			fields[2] = param.Descriptor.ShaderRegister;
+			fields[3] = param.Descriptor.RegisterSpace;
+		}
+		rootHash = Hash::MurmurHash2_64(fields, sizeof(fields), rootHash);
+	}
 	rootHash = Hash::MurmurHash2_64(&desc.Flags, (i32)sizeof(desc.Flags), rootHash);
 	if (desc.pStaticSamplers) {
 		rootHash = Hash::MurmurHash2_64(desc.pStaticSamplers, (i32)(desc.NumStaticSamplers * sizeof(desc.pStaticSamplers[0])), rootHash);
@@ -1802,17 +1460,26 @@ root_signature_t GetRootSignature(D3D12_ROOT_SIGNATURE_DESC const& desc,
 		return out;
 	}
 
-	ID3D12RootSignature *rootSignaturePtr;
-	ID3DBlob* pOutBlob;
-	ID3DBlob* pErrorBlob;
-	auto hr = D3D12SerializeRootSignature(&desc, D3D_ROOT_SIGNATURE_VERSION_1, &pOutBlob, &pErrorBlob);
-	if (pErrorBlob) {
-		debugf(Format("Root signature errors: %s", (char*)pErrorBlob->GetBufferPointer()));
+	ID3D12RootSignature *rootSignaturePtr = nullptr;
+
+	Array<u8> cachedBlob(GetThreadScratchAllocator());
+	if (FindCachedBlob(&GPipelineCache, CACHED_ROOT_SIGNATURE, rootHash, &cachedBlob)) {
+		GD12Device->CreateRootSignature(0, cachedBlob.DataPtr, Size(cachedBlob), IID_PPV_ARGS(&rootSignaturePtr));
+	}
+
+	if (!rootSignaturePtr) {
+		ID3DBlob* pOutBlob;
+		ID3DBlob* pErrorBlob;
+		auto hr = D3D12SerializeRootSignature(&desc, D3D_ROOT_SIGNATURE_VERSION_1, &pOutBlob, &pErrorBlob);
+		if (pErrorBlob) {
+			debugf(Format("Root signature errors: %s", (char*)pErrorBlob->GetBufferPointer()));
+		}
+		VerifyHr(hr);
+		VerifyHr(GD12Device->CreateRootSignature(0, pOutBlob->GetBufferPointer(), pOutBlob->GetBufferSize(), IID_PPV_ARGS(&rootSignaturePtr)));
+		StoreCachedBlob(&GPipelineCache, CACHED_ROOT_SIGNATURE, rootHash, pOutBlob->GetBufferPointer(), pOutBlob->GetBufferSize());
+		ComRelease(pOutBlob);
+		ComRelease(pErrorBlob);
 	}
-	VerifyHr(hr);
-	VerifyHr(GD12Device->CreateRootSignature(0, pOutBlob->GetBufferPointer(), pOutBlob->GetBufferSize(), IID_PPV_ARGS(&rootSignaturePtr)));
-	ComRelease(pOutBlob);
-	ComRelease(pErrorBlob);
 
 	out.ptr = rootSignaturePtr;
 	RootSignatures[rootHash] = out;
@@ -2550,6 +2217,29 @@ bool LoadShadersMetadataFromReflection(
 	return true;
 }
 
+template<typename T>
+u32 GetHandleBits(T handle) {
+	static_assert(sizeof(T) == sizeof(u32), "handle has to fill u32");
+	u32 bits;
+	memcpy(&bits, &handle, sizeof(bits));
+	return bits;
+}
+
+// shader index to bindings and pipelines built from it
+pipeline_dependencies_t											ShaderDependents;
+CriticalSection													ShaderDependentsCS;
+
+void AddShaderDependent(shader_handle shader, u32 kind, u64 key) {
+	if (IsValid(shader)) {
+		ScopeLock lock(&ShaderDependentsCS);
+		AddPipelineDependency(&ShaderDependents, shader.GetIndex(), kind, key);
+	}
+}
+
+u64 GetBindingsDependentKey(graphics_pipeline_root_key key) {
+	return GetHandleBits(key.VS) | ((u64)GetHandleBits(key.PS) << 32);
+}
+
 Hashmap<u64, PipelineStateBindings*>							CachedBindings;
 Hashmap<graphics_pipeline_root_key, PipelineStateBindings*>		CachedGraphicsBindings;
 Hashmap<compute_pipeline_root_key, PipelineStateBindings*>		CachedComputeBindings;
@@ -2588,6 +2278,9 @@ PipelineStateBindings* GetPipelineStateBindings(shader_handle VS, shader_handle
 		CachedGraphicsBindings[key] = binding;
 
 		CachedStateBindingsRWL.UnlockExclusive();
+
+		AddShaderDependent(VS, DEPENDENT_GRAPHICS_BINDINGS, GetBindingsDependentKey(key));
+		AddShaderDependent(PS, DEPENDENT_GRAPHICS_BINDINGS, GetBindingsDependentKey(key));
 		return binding;
 	}
 
@@ -2600,6 +2293,9 @@ PipelineStateBindings* GetPipelineStateBindings(shader_handle VS, shader_handle
 
 	CachedStateBindingsRWL.UnlockExclusive();
 
+	AddShaderDependent(VS, DEPENDENT_GRAPHICS_BINDINGS, GetBindingsDependentKey(key));
+	AddShaderDependent(PS, DEPENDENT_GRAPHICS_BINDINGS, GetBindingsDependentKey(key));
+
 	return val;
 }
 
@@ -2633,6 +2329,8 @@ PipelineStateBindings* GetPipelineStateBindings(shader_handle CS) {
 		CachedComputeBindings[key] = binding;
 
 		CachedStateBindingsRWL.UnlockExclusive();
+
+		AddShaderDependent(CS, DEPENDENT_COMPUTE_BINDINGS, GetHandleBits(CS));
 		return binding;
 	}
 
@@ -2645,6 +2343,8 @@ PipelineStateBindings* GetPipelineStateBindings(shader_handle CS) {
 
 	CachedStateBindingsRWL.UnlockExclusive();
 
+	AddShaderDependent(CS, DEPENDENT_COMPUTE_BINDINGS, GetHandleBits(CS));
+
 	return val;
 }
 
@@ -2748,108 +2448,184 @@ Hashmap<u64, pipeline_t>				PipelineDescriptors;
 
 RWLock									PipelineRWL;
 
+// root signature, input layout and bytecode follow from the handles, cached pso and stream output aren't used
+graphics_pipeline_key_t MakeGraphicsPipelineKey(pipeline_query_t const* query) {
+	auto const& desc = query->Graphics.graphics_desc;
+	Check(desc.StreamOutput.NumEntries == 0 && desc.CachedPSO.pCachedBlob == nullptr);
+
+	graphics_pipeline_key_t key = {};
+	key.vs = GetHandleBits(query->Graphics.vs);
+	key.ps = GetHandleBits(query->Graphics.ps);
+	key.vertex_factory = GetHandleBits(query->Graphics.vertex_factory);
+	key.sample_mask = desc.SampleMask;
+	key.sample_count = desc.SampleDesc.Count;
+	key.sample_quality = desc.SampleDesc.Quality;
+	for (u32 i = 0; i < MAX_PIPELINE_RENDER_TARGETS; ++i) {
+		key.rtv_formats[i] = desc.RTVFormats[i];
+	}
+	key.dsv_format = desc.DSVFormat;
+	key.ib_strip_cut_value = desc.IBStripCutValue;
+	key.node_mask = desc.NodeMask;
+	key.flags = desc.Flags;
+
+	auto const& raster = desc.RasterizerState;
+	key.fill_mode = (u8)raster.FillMode;
+	key.cull_mode = (u8)raster.CullMode;
+	key.front_counter_clockwise = raster.FrontCounterClockwise != 0;
+	key.depth_bias = raster.DepthBias;
+	key.depth_bias_clamp = raster.DepthBiasClamp;
+	key.slope_scaled_depth_bias = raster.SlopeScaledDepthBias;
+	key.depth_clip_enable = raster.DepthClipEnable != 0;
+	key.multisample_enable = raster.MultisampleEnable != 0;
+	key.antialiased_line_enable = raster.AntialiasedLineEnable != 0;
+	key.forced_sample_count = raster.ForcedSampleCount;
+	key.conservative_raster = (u8)raster.ConservativeRaster;
+
+	auto const& ds = desc.DepthStencilState;
+	key.depth_enable = ds.DepthEnable != 0;
+	key.depth_write_mask = (u8)ds.DepthWriteMask;
+	key.depth_func = (u8)ds.DepthFunc;
+	key.stencil_enable = ds.StencilEnable != 0;
+	key.stencil_read_mask = ds.StencilReadMask;
+	key.stencil_write_mask = ds.StencilWriteMask;
+	key.front_face = { (u8)ds.FrontFace.StencilFailOp, (u8)ds.FrontFace.StencilDepthFailOp, (u8)ds.FrontFace.StencilPassOp, (u8)ds.FrontFace.StencilFunc };
+	key.back_face = { (u8)ds.BackFace.StencilFailOp, (u8)ds.BackFace.StencilDepthFailOp, (u8)ds.BackFace.StencilPassOp, (u8)ds.BackFace.StencilFunc };
+
+	key.alpha_to_coverage_enable = desc.BlendState.AlphaToCoverageEnable != 0;
+	key.independent_blend_enable = desc.BlendState.IndependentBlendEnable != 0;
+	for (u32 i = 0; i < MAX_PIPELINE_RENDER_TARGETS; ++i) {
+		auto const& rt = desc.BlendState.RenderTarget[i];
+		auto& blend = key.blend[i];
+		blend.blend_enable = rt.BlendEnable != 0;
+		blend.logic_op_enable = rt.LogicOpEnable != 0;
+		blend.src_blend = (u8)rt.SrcBlend;
+		blend.dest_blend = (u8)rt.DestBlend;
+		blend.blend_op = (u8)rt.BlendOp;
+		blend.src_blend_alpha = (u8)rt.SrcBlendAlpha;
+		blend.dest_blend_alpha = (u8)rt.DestBlendAlpha;
+		blend.blend_op_alpha = (u8)rt.BlendOpAlpha;
+		blend.logic_op = (u8)rt.LogicOp;
+		blend.write_mask = rt.RenderTargetWriteMask;
+	}
+
+	key.topology_type = (u8)desc.PrimitiveTopologyType;
+	key.num_render_targets = (u8)desc.NumRenderTargets;
+
+	NormalizePipelineKey(&key);
+	return key;
+}
+
+compute_pipeline_key_t MakeComputePipelineKey(pipeline_query_t const* query) {
+	compute_pipeline_key_t key = {};
+	key.cs = GetHandleBits(query->Compute.cs);
+	key.node_mask = query->Compute.compute_desc.NodeMask;
+	key.flags = query->Compute.compute_desc.Flags;
+	return key;
+}
+
 u64 CalculatePipelineQueryHash(pipeline_query_t const* query) {
 	Check(query->Type != PIPELINE_UNKNOWN);
 	if (query->Type == PIPELINE_GRAPHICS) {
-		u64 hash = Hash::MurmurHash2_64(&query->Graphics.graphics_desc, sizeof(query->Graphics.graphics_desc), 0);
-		hash = Hash::MurmurHash2_64(&query->Graphics.vs, sizeof(query->Graphics.vs), hash);
-		hash = Hash::MurmurHash2_64(&query->Graphics.ps, sizeof(query->Graphics.ps), hash);
-		hash = Hash::MurmurHash2_64(&query->Graphics.vertex_factory, sizeof(query->Graphics.vertex_factory), hash);
-		return hash;
+		return HashPipelineKey(MakeGraphicsPipelineKey(query));
 	}
 	if (query->Type == PIPELINE_COMPUTE) {
-		u64 hash = Hash::MurmurHash2_64(&query->Compute.compute_desc, sizeof(query->Compute.compute_desc), 0);
-		hash = Hash::MurmurHash2_64(&query->Compute.cs, sizeof(query->Compute.cs), hash);
-		return hash;
+		return HashPipelineKey(MakeComputePipelineKey(query));
 	}
 	return -1;
 }
 
-ID3D12PipelineState* CreatePipelineState(pipeline_query_t const* query, u64 hash);
-
-void FlushShaderChanges() {
-	Hashmap<graphics_pipeline_root_key, i32> InvalidGraphicBindings;
-	Hashmap<compute_pipeline_root_key, i32> InvalidComputeBindings;
-	Hashmap<PipelineStateBindings*, i32> InvalidPSOs;
-
-	for (auto kv : CachedGraphicsBindings) {
-		if (GetShaderMetadata(kv.key.VS).recompiled || GetShaderMetadata(kv.key.PS).recompiled) {
-			Set(InvalidPSOs, kv.value, 1);
-			Set(InvalidGraphicBindings, kv.key, 1);
-		}
-	}
-	for (auto kv : CachedComputeBindings) {
-		if (GetShaderMetadata(kv.key.CS).recompiled) {
-			Set(InvalidPSOs, kv.value, 1);
-			Set(InvalidComputeBindings, kv.key, 1);
-		}
-	}
-
-	for (auto kv : InvalidGraphicBindings) {
-		Remove(CachedGraphicsBindingHash, kv.key);
-		Remove(CachedGraphicsBindings, kv.key);
-	}
-	for (auto kv : InvalidComputeBindings) {
-		Remove(CachedComputeBindingHash, kv.key);
-		Remove(CachedComputeBindings, kv.key);
-	}
-	// todo-optimize: clear cache from old objects
-
-	for (auto kv : PipelineDescriptors) {
-		// todo-optimize: check if shaders changed
-		CreatePipelineState(&PipelineDescriptors[kv.key].query, kv.key);
-	}
-}
-
 u64	CalculatePipelinePersistantHash(pipeline_query_t const* query) {
 	Check(query->Type != PIPELINE_UNKNOWN);
 	if (query->Type == PIPELINE_GRAPHICS) {
 		auto hash = Hash::Combine_64(GetShaderBytecode(query->Graphics.vs).bytecode_hash, IsValid(query->Graphics.ps) ? GetShaderBytecode(query->Graphics.ps).bytecode_hash : 0);
-		hash = Hash::MurmurHash2_64(&query->Graphics.graphics_desc, sizeof(query->Graphics.graphics_desc), hash);
+		// handles don't survive a restart, bytecode and layout stand in for them
+		auto key = MakeGraphicsPipelineKey(query);
+		key.vs = 0;
+		key.ps = 0;
+		key.vertex_factory = 0;
+		hash = Hash::Combine_64(hash, HashPipelineKey(key));
 		auto layout = GetInputLayoutDesc(query->Graphics.vertex_factory);
-		hash = Hash::MurmurHash2_64(layout.pInputElementDescs, sizeof(layout.pInputElementDescs[0]) * layout.NumElements, hash);
+		for (u32 i = 0; i < layout.NumElements; ++i) {
+			auto const& element = layout.pInputElementDescs[i];
+			hash = Hash::MurmurHash2_64(element.SemanticName, strlen(element.SemanticName), hash);
+			u32 fields[] = { element.SemanticIndex, (u32)element.Format, element.InputSlot, element.AlignedByteOffset, (u32)element.InputSlotClass, element.InstanceDataStepRate };
+			hash = Hash::MurmurHash2_64(fields, sizeof(fields), hash);
+		}
 		return hash;
 	}
 	if (query->Type == PIPELINE_COMPUTE) {
-		u64 hash = GetShaderBytecode(query->Compute.cs).bytecode_hash;
-		hash = Hash::MurmurHash2_64(&query->Compute.compute_desc, sizeof(query->Compute.compute_desc), hash);
+		auto key = MakeComputePipelineKey(query);
+		key.cs = 0;
+		u64 hash = Hash::Combine_64(GetShaderBytecode(query->Compute.cs).bytecode_hash, HashPipelineKey(key));
 		return hash;
 	}
 	return -1;
 }
 
-ID3D12PipelineState* CreatePipelineState(pipeline_query_t const* query, u64 hash) {
-	auto persistantHash = CalculatePipelinePersistantHash(query);
-	Check(Contains(PipelineByHash, hash));
-	Check(Contains(PipelineDescriptors, hash));
+// driver rejects blobs it can't use, then the pso is built from scratch and the blob replaced
+ID3D12PipelineState* BuildPipelineState(pipeline_query_t const* query, u64 persistantHash) {
+	ID3D12PipelineState *pipelineState = nullptr;
 
-	if (PipelineDescriptors[hash].persistant_hash != persistantHash) {
-		ID3D12PipelineState *pipelineState = nullptr;
-
-		if (query->Type == PIPELINE_GRAPHICS) {
-			D3D12_GRAPHICS_PIPELINE_STATE_DESC desc;
-			desc = query->Graphics.graphics_desc;
-			desc.pRootSignature = GetPipelineStateBindings(query->Graphics.vs, query->Graphics.ps)->RootSignature;
-			auto VS = GetShaderBytecode(query->Graphics.vs);
-			desc.VS.pShaderBytecode = VS.bytecode;
-			desc.VS.BytecodeLength = VS.bytesize;
-			auto PS = IsValid(query->Graphics.ps) ? GetShaderBytecode(query->Graphics.ps) : shader_bytecode_t();
-			desc.PS.pShaderBytecode = PS.bytecode;
-			desc.PS.BytecodeLength = PS.bytesize;
-			desc.InputLayout = GetInputLayoutDesc(query->Graphics.vertex_factory);
+	Array<u8> cachedBlob(GetThreadScratchAllocator());
+	D3D12_CACHED_PIPELINE_STATE cachedPSO = {};
+	if (FindCachedBlob(&GPipelineCache, CACHED_PIPELINE_STATE, persistantHash, &cachedBlob)) {
+		cachedPSO.pCachedBlob = cachedBlob.DataPtr;
+		cachedPSO.CachedBlobSizeInBytes = Size(cachedBlob);
+	}
 
+	if (query->Type == PIPELINE_GRAPHICS) {
+		D3D12_GRAPHICS_PIPELINE_STATE_DESC desc;
+		desc = query->Graphics.graphics_desc;
+		desc.pRootSignature = GetPipelineStateBindings(query->Graphics.vs, query->Graphics.ps)->RootSignature;
+		auto VS = GetShaderBytecode(query->Graphics.vs);
+		desc.VS.pShaderBytecode = VS.bytecode;
+		desc.VS.BytecodeLength = VS.bytesize;
+		auto PS = IsValid(query->Graphics.ps) ? GetShaderBytecode(query->Graphics.ps) : shader_bytecode_t();
+		desc.PS.pShaderBytecode = PS.bytecode;
+		desc.PS.BytecodeLength = PS.bytesize;
+		desc.InputLayout = GetInputLayoutDesc(query->Graphics.vertex_factory);
+
+		desc.CachedPSO = cachedPSO;
+		if (!cachedPSO.pCachedBlob || FAILED(GD12Device->CreateGraphicsPipelineState(&desc, IID_PPV_ARGS(&pipelineState)))) {
+			desc.CachedPSO = {};
 			VerifyHr(GD12Device->CreateGraphicsPipelineState(&desc, IID_PPV_ARGS(&pipelineState)));
+			cachedPSO = {};
 		}
-		else if (query->Type == PIPELINE_COMPUTE) {
-			D3D12_COMPUTE_PIPELINE_STATE_DESC desc;
-			desc = query->Compute.compute_desc;
-			desc.pRootSignature = GetPipelineStateBindings(query->Compute.cs)->RootSignature;
-			auto CS = GetShaderBytecode(query->Compute.cs);
-			desc.CS.pShaderBytecode = CS.bytecode;
-			desc.CS.BytecodeLength = CS.bytesize;
+	}
+	else if (query->Type == PIPELINE_COMPUTE) {
+		D3D12_COMPUTE_PIPELINE_STATE_DESC desc;
+		desc = query->Compute.compute_desc;
+		desc.pRootSignature = GetPipelineStateBindings(query->Compute.cs)->RootSignature;
+		auto CS = GetShaderBytecode(query->Compute.cs);
+		desc.CS.pShaderBytecode = CS.bytecode;
+		desc.CS.BytecodeLength = CS.bytesize;
 
+		desc.CachedPSO = cachedPSO;
+		if (!cachedPSO.pCachedBlob || FAILED(GD12Device->CreateComputePipelineState(&desc, IID_PPV_ARGS(&pipelineState)))) {
+			desc.CachedPSO = {};
 			VerifyHr(GD12Device->CreateComputePipelineState(&desc, IID_PPV_ARGS(&pipelineState)));
+			cachedPSO = {};
 		}
+	}
+
+	if (!cachedPSO.pCachedBlob) {
+		ID3DBlob* pBlob = nullptr;
+		if (SUCCEEDED(pipelineState->GetCachedBlob(&pBlob))) {
+			StoreCachedBlob(&GPipelineCache, CACHED_PIPELINE_STATE, persistantHash, pBlob->GetBufferPointer(), pBlob->GetBufferSize());
+		}
+		ComRelease(pBlob);
+	}
+
+	return pipelineState;
+}
+
+ID3D12PipelineState* CreatePipelineState(pipeline_query_t const* query, u64 hash) {
+	auto persistantHash = CalculatePipelinePersistantHash(query);
+	Check(Contains(PipelineByHash, hash));
+	Check(Contains(PipelineDescriptors, hash));
+
+	if (PipelineDescriptors[hash].persistant_hash != persistantHash) {
+		auto pipelineState = BuildPipelineState(query, persistantHash);
 
 		if (PipelineByHash[hash] != nullptr) {
 			PipelineByHash[hash]->Release();
@@ -2864,6 +2640,190 @@ ID3D12PipelineState* CreatePipelineState(pipeline_query_t const* query, u64 hash
 	return PipelineByHash[hash];
 }
 
+struct RebuildPipelines_Payload {
+	pipeline_query_t const*	queries;	// copies, builders run without the pipeline lock
+	u64 const*				old_persistant_hashes;
+	u32						from;
+	u32						to;
+	u64*					persistant_hashes;
+	ID3D12PipelineState**	built;		// nullptr where the pipeline didn't change
+};
+
+struct RebuildPipelinesRoot_Payload {
+	Array<RebuildPipelines_Payload>*	SubtasksData;
+};
+
+void RebuildPipelinesRange(const void* InArgs, Job*) {
+	auto Args = *(RebuildPipelines_Payload*)InArgs;
+	for (u32 i = Args.from; i < Args.to; ++i) {
+		Args.persistant_hashes[i] = CalculatePipelinePersistantHash(&Args.queries[i]);
+		Args.built[i] = Args.old_persistant_hashes[i] != Args.persistant_hashes[i] ? BuildPipelineState(&Args.queries[i], Args.persistant_hashes[i]) : nullptr;
+	}
+}
+
+void RebuildPipelinesRoot(const void* InArgs, Job* job) {
+	auto Args = *(RebuildPipelinesRoot_Payload*)InArgs;
+
+	Job* children[512];
+	Check(Size(*Args.SubtasksData) < _countof(children));
+
+	for (auto i : MakeRange(Size(*Args.SubtasksData))) {
+		children[i] = CreateChildJob(job, RebuildPipelinesRange, &(*Args.SubtasksData)[i]);
+	}
+
+	RunJobs(children, (u32)Size(*Args.SubtasksData));
+}
+
+// only what was built from recompiled shaders is dropped or rebuilt, called between frames
+void FlushShaderChanges() {
+	Array<shader_handle> recompiled(GetThreadScratchAllocator());
+	GetRecompiledShaders(&recompiled);
+	if (!Size(recompiled)) {
+		return;
+	}
+
+	Array<u64> graphicsBindings(GetThreadScratchAllocator());
+	Array<u64> computeBindings(GetThreadScratchAllocator());
+	Array<u64> dependentPipelines(GetThreadScratchAllocator());
+	{
+		ScopeLock lock(&ShaderDependentsCS);
+		for (auto shader : recompiled) {
+			GatherPipelineDependents(ShaderDependents, shader.GetIndex(), DEPENDENT_GRAPHICS_BINDINGS, &graphicsBindings);
+			GatherPipelineDependents(ShaderDependents, shader.GetIndex(), DEPENDENT_COMPUTE_BINDINGS, &computeBindings);
+			GatherPipelineDependents(ShaderDependents, shader.GetIndex(), DEPENDENT_PIPELINE, &dependentPipelines);
+		}
+	}
+
+	CachedStateBindingsRWL.LockExclusive();
+
+	Hashmap<PipelineStateBindings*, i32> staleBindings(GetThreadScratchAllocator());
+	for (auto bits : graphicsBindings) {
+		graphics_pipeline_root_key key;
+		memcpy(&key, &bits, sizeof(key));
+		auto pbinding = Get(CachedGraphicsBindings, key);
+		if (pbinding) {
+			Set(staleBindings, *pbinding, 1);
+			Remove(CachedGraphicsBindings, key);
+		}
+		if (Contains(CachedGraphicsBindingHash, key)) {
+			Remove(CachedGraphicsBindingHash, key);
+		}
+	}
+	for (auto bits : computeBindings) {
+		compute_pipeline_root_key key;
+		memcpy(&key, &bits, sizeof(key));
+		auto pbinding = Get(CachedComputeBindings, key);
+		if (pbinding) {
+			Set(staleBindings, *pbinding, 1);
+			Remove(CachedComputeBindings, key);
+		}
+		if (Contains(CachedComputeBindingHash, key)) {
+			Remove(CachedComputeBindingHash, key);
+		}
+	}
+
+	// same layout is shared by content, keep what other shaders still reach
+	for (auto kv : CachedGraphicsBindings) {
+		if (Contains(staleBindings, kv.value)) {
+			Remove(staleBindings, kv.value);
+		}
+	}
+	for (auto kv : CachedComputeBindings) {
+		if (Contains(staleBindings, kv.value)) {
+			Remove(staleBindings, kv.value);
+		}
+	}
+	Array<u64> staleBindingHashes(GetThreadScratchAllocator());
+	for (auto kv : CachedBindings) {
+		if (Contains(staleBindings, kv.value)) {
+			PushBack(staleBindingHashes, kv.key);
+		}
+	}
+	for (auto hash : staleBindingHashes) {
+		_delete(CachedBindings[hash]);
+		Remove(CachedBindings, hash);
+	}
+
+	CachedStateBindingsRWL.UnlockExclusive();
+
+	// pipeline with both shaders recompiled shows up twice
+	Hashmap<u64, i32> seen(GetThreadScratchAllocator());
+	Array<u64> rebuilt(GetThreadScratchAllocator());
+	for (auto hash : dependentPipelines) {
+		if (!Contains(seen, hash)) {
+			Set(seen, hash, 1);
+			PushBack(rebuilt, hash);
+		}
+	}
+	u32 rebuiltNum = (u32)Size(rebuilt);
+	if (!rebuiltNum) {
+		return;
+	}
+
+	Array<pipeline_query_t> queries(GetThreadScratchAllocator());
+	Array<u64> oldPersistantHashes(GetThreadScratchAllocator());
+	Array<u64> persistantHashes(GetThreadScratchAllocator());
+	Array<ID3D12PipelineState*> built(GetThreadScratchAllocator());
+	Resize(queries, rebuiltNum);
+	Resize(oldPersistantHashes, rebuiltNum);
+	Resize(persistantHashes, rebuiltNum);
+	Resize(built, rebuiltNum);
+
+	PipelineRWL.LockShared();
+	for (u32 i = 0; i < rebuiltNum; ++i) {
+		auto const& pipeline = PipelineDescriptors[rebuilt[i]];
+		queries[i] = pipeline.query;
+		oldPersistantHashes[i] = pipeline.persistant_hash;
+	}
+	PipelineRWL.UnlockShared();
+
+	const u32 pipelinesPerBatch = max(4u, (rebuiltNum + 510) / 511);
+	Array<RebuildPipelines_Payload> childWorkspaces(GetMallocAllocator());
+	for (u32 i = 0; i < rebuiltNum; i += pipelinesPerBatch) {
+		RebuildPipelines_Payload payload = {};
+		payload.queries = queries.DataPtr;
+		payload.old_persistant_hashes = oldPersistantHashes.DataPtr;
+		payload.from = i;
+		payload.to = min(rebuiltNum, i + pipelinesPerBatch);
+		payload.persistant_hashes = persistantHashes.DataPtr;
+		payload.built = built.DataPtr;
+		PushBack(childWorkspaces, payload);
+	}
+
+	Array<ID3D12PipelineState*> retired(GetThreadScratchAllocator());
+
+	// waiting steals jobs that may call GetPipelineState, so no pipeline lock is held until the swap
+	RebuildPipelinesRoot_Payload payload = {};
+	payload.SubtasksData = &childWorkspaces;
+	auto rootJob = CreateJob(RebuildPipelinesRoot, &payload);
+	RunJobs(&rootJob, 1);
+	WaitFor(rootJob, true);
+
+	PipelineRWL.LockExclusive();
+
+	for (u32 i = 0; i < rebuiltNum; ++i) {
+		if (built[i]) {
+			if (PipelineByHash[rebuilt[i]]) {
+				PushBack(retired, PipelineByHash[rebuilt[i]]);
+			}
+			PipelineByHash[rebuilt[i]] = built[i];
+			PipelineDescriptors[rebuilt[i]].persistant_hash = persistantHashes[i];
+		}
+	}
+
+	PipelineRWL.UnlockExclusive();
+
+	FreeMemory(childWorkspaces);
+
+	// frames in flight may still use the old ones
+	if (Size(retired)) {
+		WaitForCompletion();
+		for (auto pipelineState : retired) {
+			pipelineState->Release();
+		}
+	}
+}
+
 ID3D12PipelineState* GetPipelineState(pipeline_query_t const* query) {
 	u64 hash = CalculatePipelineQueryHash(query);
 
@@ -2885,6 +2845,14 @@ ID3D12PipelineState* GetPipelineState(pipeline_query_t const* query) {
 	auto pipeline = CreatePipelineState(query, hash);
 	PipelineRWL.UnlockExclusive();
 
+	if (query->Type == PIPELINE_GRAPHICS) {
+		AddShaderDependent(query->Graphics.vs, DEPENDENT_PIPELINE, hash);
+		AddShaderDependent(query->Graphics.ps, DEPENDENT_PIPELINE, hash);
+	}
+	else {
+		AddShaderDependent(query->Compute.cs, DEPENDENT_PIPELINE, hash);
+	}
+
 	return pipeline;
 }
 
@@ -3216,7 +3184,7 @@ void SetRootParams(GPUCommandList* list) {
 		auto& cbData = kv.value;
 		if (cbData.commited == 0) {
 			auto const& cb = list->Bindings->ConstantBuffers[kv.key];
-			auto allocation = ConstantsAllocator.AllocateTemporary(list->Bindings->ConstantBuffers[kv.key].bytesize);
+			auto allocation = ToUploadAllocation(AllocateUpload(&ConstantsAllocator, list->Bindings->ConstantBuffers[kv.key].bytesize, 256));
 			auto const& param = list->Bindings->RootParams[cb.param_hash];
 
 			Check(Contains(list->Root.Params, cb.param_hash));
@@ -3301,7 +3269,7 @@ void ResetRootBindingMappings(GPUCommandList* list) {
 }
 
 upload_allocation_t AllocateSmallUploadMemory(GPUCommandList*, u64 size, u64 alignment) {
-	return ConstantsAllocator.AllocateTemporary((u32)size, (u32)alignment);
+	return ToUploadAllocation(AllocateUpload(&ConstantsAllocator, size, alignment));
 }
 
 void	SetIndexBuffer(GPUCommandList* list, buffer_location_t stream) {
@@ -3310,6 +3278,11 @@ void	SetIndexBuffer(GPUCommandList* list, buffer_location_t stream) {
 	ibv.Format = stream.stride == 4 ? DXGI_FORMAT_R32_UINT : DXGI_FORMAT_R16_UINT;
 	ibv.SizeInBytes = stream.size;
 
+	if (!ForceStateChange && !memcmp(&list->Graphics.IndexBuffer, &ibv, sizeof(ibv))) {
+		return;
+	}
+
+	list->Graphics.IndexBuffer = ibv;
 	list->D12CommandList->IASetIndexBuffer(&ibv);
 }
 
@@ -3403,6 +3376,10 @@ void TransitionBarrier(GPUCommandList* list, resource_slice_t resource, D3D12_RE
 	list->ResourcesStateTracker.Transition(resource, after);
 }
 
+void BeginTransitionBarrier(GPUCommandList* list, resource_slice_t resource, D3D12_RESOURCE_STATES after) {
+	list->ResourcesStateTracker.BeginTransition(resource, after);
+}
+
 void FlushBarriers(GPUCommandList* list) {
 	list->ResourcesStateTracker.FireBarriers();
 }
@@ -3464,7 +3441,7 @@ void SetRWTexture2D(GPUCommandList* list, TextId slot, resource_uav_t uav) {
 void ShutdownRenderingEngines() {
 	WaitForCompletion();
 
-	call_destructor(&ConstantsAllocator);
+	FreeUploadAllocator(&ConstantsAllocator);
 	call_destructor(&GpuDescriptorsAllocator);
 	call_destructor(&CpuConstantsDescriptorsCacheAllocator);
 
@@ -3487,6 +3464,10 @@ void ShutdownRenderingEngines() {
 	}
 	FreeMemory(PipelineByHash);
 	FreeMemory(PipelineDescriptors);
+	FreePipelineDependencies(&ShaderDependents);
+
+	SavePipelineCache(&GPipelineCache);
+	FreePipelineCache(&GPipelineCache);
 
 	for (auto kv : VertexFactoryByHash) {
 		GetMallocAllocator()->Free(VertexFactories[kv.value].Elements);
@@ -3500,8 +3481,7 @@ void ShutdownRenderingEngines() {
 		_delete(ptr);
 	}
 	FreeMemory(GPUQueues);
-	FreeMemory(GResourceState);
-	FreeMemory(GSubresourceState);
+	FreeResourceStates(&GResourceStates);
 }
 
 d12_stats_t const* GetLastFrameStats() {
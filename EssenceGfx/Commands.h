@@ -62,6 +62,9 @@ vertex_factory_handle		GetVertexFactory(std::initializer_list<input_layout_eleme
 void						CopyBufferRegion(GPUCommandList*, resource_handle dst, u64 srcOffset, resource_handle src, u64 dstOffset, u64 size);
 void						CopyResource(GPUCommandList*, resource_handle dst, resource_handle src);
 void						TransitionBarrier(GPUCommandList*, resource_slice_t slice, D3D12_RESOURCE_STATES after);
+// split barrier, ended by the next use of the resource in the list or at Close
+// only splits when flushed with other work recorded before the end, otherwise it merges into a plain transition
+void						BeginTransitionBarrier(GPUCommandList*, resource_slice_t slice, D3D12_RESOURCE_STATES after);
 void						FlushBarriers(GPUCommandList*);
 void						ClearRenderTarget(GPUCommandList*, resource_rtv_t, float4 = float4(0, 0, 0, 0));
 
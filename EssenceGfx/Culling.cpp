@@ -0,0 +1,192 @@
+#include "Culling.h"
+#include "Essence.h"
+#include "Array.h"
+#include "Scheduler.h"
+#include <DirectXMath.h>
+#include <xmmintrin.h>
+#include <emmintrin.h>
+using namespace DirectX;
+
+namespace Essence {
+
+const u32 CULL_BLOCKS_PER_BATCH = 256;
+
+void ExtractFrustum(xmmatrix viewProj, frustum_t* outFrustum) {
+	// planes from columns of the row vector view projection
+	auto columns = XMMatrixTranspose(viewProj);
+	xmvec planes[6] = {
+		XMVectorAdd(columns.r[3], columns.r[0]),
+		XMVectorSubtract(columns.r[3], columns.r[0]),
+		XMVectorAdd(columns.r[3], columns.r[1]),
+		XMVectorSubtract(columns.r[3], columns.r[1]),
+		columns.r[2],
+		XMVectorSubtract(columns.r[3], columns.r[2])
+	};
+	for (auto i : MakeRange(6)) {
+		XMStoreFloat4(&outFrustum->planes[i], XMPlaneNormalize(planes[i]));
+	}
+}
+
+void SetCullBounds(cull_bounds4_t* blocks, u32 index, xmmatrix world, object_bounds_t const& bounds) {
+	auto boxMin = XMLoadFloat3(&bounds.box_min);
+	auto boxMax = XMLoadFloat3(&bounds.box_max);
+	auto localCenter = XMVectorScale(XMVectorAdd(boxMin, boxMax), 0.5f);
+	auto localExtent = XMVectorScale(XMVectorSubtract(boxMax, boxMin), 0.5f);
+
+	// box that encloses the transformed box
+	auto extent = XMVectorAdd(XMVectorAdd(
+		XMVectorMultiply(XMVectorAbs(world.r[0]), XMVectorSplatX(localExtent)),
+		XMVectorMultiply(XMVectorAbs(world.r[1]), XMVectorSplatY(localExtent))),
+		XMVectorMultiply(XMVectorAbs(world.r[2]), XMVectorSplatZ(localExtent)));
+	auto scale = max(max(XMVectorGetX(XMVector3Length(world.r[0])), XMVectorGetX(XMVector3Length(world.r[1]))), XMVectorGetX(XMVector3Length(world.r[2])));
+
+	float3 boxCenter, boxExtent, sphereCenter;
+	XMStoreFloat3(&boxCenter, XMVector3TransformCoord(localCenter, world));
+	XMStoreFloat3(&boxExtent, extent);
+	XMStoreFloat3(&sphereCenter, XMVector3TransformCoord(XMLoadFloat3(&bounds.sphere_center), world));
+
+	auto& block = blocks[index / CULL_BLOCK_SIZE];
+	auto lane = index % CULL_BLOCK_SIZE;
+	block.box_center[0][lane] = boxCenter.x;
+	block.box_center[1][lane] = boxCenter.y;
+	block.box_center[2][lane] = boxCenter.z;
+	block.box_extent[0][lane] = boxExtent.x;
+	block.box_extent[1][lane] = boxExtent.y;
+	block.box_extent[2][lane] = boxExtent.z;
+	block.sphere_center[0][lane] = sphereCenter.x;
+	block.sphere_center[1][lane] = sphereCenter.y;
+	block.sphere_center[2][lane] = sphereCenter.z;
+	block.sphere_radius[lane] = bounds.sphere_radius * scale;
+}
+
+u32 CullBlocks(frustum_t const& frustum, cull_bounds4_t const* blocks, u32 fromBlock, u32 toBlock, u32 objectsNum, u32* outVisible) {
+	__m128 planes[6][4];
+	__m128 absPlanes[6][3];
+	auto signMask = _mm_set1_ps(-0.f);
+	for (auto p : MakeRange(6)) {
+		auto const& plane = frustum.planes[p];
+		planes[p][0] = _mm_set1_ps(plane.x);
+		planes[p][1] = _mm_set1_ps(plane.y);
+		planes[p][2] = _mm_set1_ps(plane.z);
+		planes[p][3] = _mm_set1_ps(plane.w);
+		for (auto i : MakeRange(3)) {
+			absPlanes[p][i] = _mm_andnot_ps(signMask, planes[p][i]);
+		}
+	}
+
+	auto zero = _mm_setzero_ps();
+	u32 visibleNum = 0;
+	for (auto b : MakeRange(fromBlock, toBlock)) {
+		auto const& block = blocks[b];
+
+		__m128 boxCenter[3], boxExtent[3], sphereCenter[3];
+		for (auto i : MakeRange(3)) {
+			boxCenter[i] = _mm_loadu_ps(block.box_center[i]);
+			boxExtent[i] = _mm_loadu_ps(block.box_extent[i]);
+			sphereCenter[i] = _mm_loadu_ps(block.sphere_center[i]);
+		}
+		auto sphereRadius = _mm_loadu_ps(block.sphere_radius);
+
+		// either volume fully behind one plane is enough to reject
+		auto outside = zero;
+		for (auto p : MakeRange(6)) {
+			auto sphereDistance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(planes[p][0], sphereCenter[0]), _mm_mul_ps(planes[p][1], sphereCenter[1])),
+				_mm_add_ps(_mm_mul_ps(planes[p][2], sphereCenter[2]), planes[p][3]));
+			auto boxDistance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(planes[p][0], boxCenter[0]), _mm_mul_ps(planes[p][1], boxCenter[1])),
+				_mm_add_ps(_mm_mul_ps(planes[p][2], boxCenter[2]), planes[p][3]));
+			auto boxRadius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(absPlanes[p][0], boxExtent[0]), _mm_mul_ps(absPlanes[p][1], boxExtent[1])),
+				_mm_mul_ps(absPlanes[p][2], boxExtent[2]));
+
+			outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(sphereDistance, sphereRadius), zero));
+			outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(boxDistance, boxRadius), zero));
+		}
+
+		u32 visible = ~_mm_movemask_ps(outside);
+		u32 first = b * CULL_BLOCK_SIZE;
+		u32 lanes = min(CULL_BLOCK_SIZE, objectsNum - first);
+		for (auto l : MakeRange(lanes)) {
+			outVisible[visibleNum] = first + l;
+			visibleNum += (visible >> l) & 1;
+		}
+	}
+	return visibleNum;
+}
+
+u32 CullBounds(frustum_t const& frustum, cull_bounds4_t const* blocks, u32 objectsNum, u32* outVisible) {
+	return CullBlocks(frustum, blocks, 0, (objectsNum + CULL_BLOCK_SIZE - 1) / CULL_BLOCK_SIZE, objectsNum, outVisible);
+}
+
+struct ParallelCullRange_Payload {
+	frustum_t const*		frustum;
+	cull_bounds4_t const*	blocks;
+	u32						objectsNum;
+	u32						fromBlock;
+	u32						toBlock;
+	u32*					visible;
+	u32						visibleNum;
+};
+
+struct ParallelCullRoot_Payload {
+	Array<ParallelCullRange_Payload>*	SubtasksData;
+};
+
+void ParallelCullRange(const void* InArgs, Job*) {
+	PROFILE_SCOPE(cull_bounds_range);
+
+	auto Args = *(ParallelCullRange_Payload*)InArgs;
+	// every range compacts into its own part of the output, read back once all ranges are done
+	((ParallelCullRange_Payload*)InArgs)->visibleNum = CullBlocks(*Args.frustum, Args.blocks, Args.fromBlock, Args.toBlock, Args.objectsNum,
+		Args.visible + Args.fromBlock * CULL_BLOCK_SIZE);
+}
+
+void ParallelCullRoot(const void* InArgs, Job* job) {
+	auto Args = *(ParallelCullRoot_Payload*)InArgs;
+
+	Job* children[512];
+	Check(Size(*Args.SubtasksData) < _countof(children));
+
+	for (auto i : MakeRange(Size(*Args.SubtasksData))) {
+		children[i] = CreateChildJob(job, ParallelCullRange, &(*Args.SubtasksData)[i]);
+	}
+
+	RunJobs(children, (u32)Size(*Args.SubtasksData));
+}
+
+u32 ParallelCullBounds(frustum_t const& frustum, cull_bounds4_t const* blocks, u32 objectsNum, u32* outVisible) {
+	PROFILE_SCOPE(cull_bounds);
+
+	u32 blocksNum = (objectsNum + CULL_BLOCK_SIZE - 1) / CULL_BLOCK_SIZE;
+	// keep within the root job fan-out
+	u32 blocksPerBatch = max(CULL_BLOCKS_PER_BATCH, (blocksNum + 510) / 511);
+
+	Array<ParallelCullRange_Payload> childWorkspaces(GetMallocAllocator());
+	Reserve(childWorkspaces, blocksNum / blocksPerBatch + 1);
+
+	for (u32 i = 0; i < blocksNum; i += blocksPerBatch) {
+		ParallelCullRange_Payload payload = {};
+		payload.frustum = &frustum;
+		payload.blocks = blocks;
+		payload.objectsNum = objectsNum;
+		payload.fromBlock = i;
+		payload.toBlock = min(blocksNum, i + blocksPerBatch);
+		payload.visible = outVisible;
+		PushBack(childWorkspaces, payload);
+	}
+
+	ParallelCullRoot_Payload payload = {};
+	payload.SubtasksData = &childWorkspaces;
+
+	auto rootJob = CreateJob(ParallelCullRoot, &payload);
+	RunJobs(&rootJob, 1);
+
+	WaitFor(rootJob, true);
+
+	u32 visibleNum = 0;
+	for (auto& range : childWorkspaces) {
+		memmove(outVisible + visibleNum, outVisible + range.fromBlock * CULL_BLOCK_SIZE, sizeof(u32) * range.visibleNum);
+		visibleNum += range.visibleNum;
+	}
+	return visibleNum;
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "Types.h"
+#include "Maths.h"
+
+namespace Essence {
+
+const u32 CULL_BLOCK_SIZE = 4;
+
+struct frustum_t {
+	float4	planes[6];	// normalized, positive inside: left, right, bottom, top, near, far
+};
+
+// model space bounds, the sphere doesn't have to share the box center
+struct object_bounds_t {
+	float3	box_min;
+	float3	box_max;
+	float3	sphere_center;
+	float	sphere_radius;
+};
+
+// world bounds of four objects in SoA, box kept axis aligned as center and half extents
+struct cull_bounds4_t {
+	float	box_center[3][4];
+	float	box_extent[3][4];
+	float	sphere_center[3][4];
+	float	sphere_radius[4];
+};
+
+void	ExtractFrustum(xmmatrix viewProj, frustum_t* outFrustum);
+// writes lane index % 4 of block index / 4
+void	SetCullBounds(cull_bounds4_t* blocks, u32 index, xmmatrix world, object_bounds_t const& bounds);
+
+// indices of objects intersecting the frustum in increasing order, returns their count
+u32		CullBounds(frustum_t const& frustum, cull_bounds4_t const* blocks, u32 objectsNum, u32* outVisible);
+u32		ParallelCullBounds(frustum_t const& frustum, cull_bounds4_t const* blocks, u32 objectsNum, u32* outVisible);
+
+}
\ No newline at end of file
@@ -16,14 +16,10 @@ DescriptorAllocator& DescriptorAllocator::operator=(DescriptorAllocator&& other)
 	TemporaryBlocks = std::move(other.TemporaryBlocks);
 	PendingTemporaryBlocks = std::move(other.PendingTemporaryBlocks);
 	NextBlockIndex = other.NextBlockIndex;
+	Ranges = std::move(other.Ranges);
 
 	D12DescriptorHeap = std::move(other.D12DescriptorHeap);
 
-	for (auto i : u32Range(BucketsNum)) {
-		SuballocatedBlock[i] = other.SuballocatedBlock[i];
-		FreeRanges[i] = std::move(other.FreeRanges[i]);
-	}
-	
 	return *this;
 }
 
@@ -58,53 +54,47 @@ DescriptorAllocator::DescriptorAllocator(u32 size, D3D12_DESCRIPTOR_HEAP_TYPE ty
 		Blocks[i].next_allocation_offset = 0;
 	}
 
-	for (auto i : u32Range(BucketsNum)) {
-		SuballocatedBlock[i] = NULL_BLOCK;
-	}
+	InitRangeAllocator(&Ranges, size);
 }
 
 DescriptorAllocator::~DescriptorAllocator() {
-	for (auto i : i32Range(BucketsNum)) {
-		FreeMemory(FreeRanges[i]);
-	}
+	FreeRangeAllocator(&Ranges);
 	FreeMemory(TemporaryBlocks);
 	FreeMemory(PendingTemporaryBlocks);
 	FreeMemory(Blocks);
 }
 
+// temporary blocks are never given back, they cycle through pending until the allocator dies
 u16 DescriptorAllocator::AllocateBlock() {
 	Check(NextBlockIndex < BlocksNum);
+
+	range_allocation_t range;
+	{
+		ScopeLock lock(&RangesCS);
+		range = AllocateRange(&Ranges, BlockSize);
+	}
+	Check(range.node != NULL_RANGE);
+
+	Blocks[NextBlockIndex].heap_offset = range.offset;
+	Blocks[NextBlockIndex].range_node = range.node;
 	return NextBlockIndex++;
 }
 
 descriptor_allocation_t DescriptorAllocator::Allocate(u32 num) {
-	Check(num < BlockSize);
+	Check(num > 0);
 
-	auto bucket = find_log_2(num);
-	auto m = pad_pow_2(num);
-
-	u32 heapOffset = 0;
-	if (Size(FreeRanges[bucket])) {
-		heapOffset = Back(FreeRanges[bucket]).heap_offset;
-		PopBack(FreeRanges[bucket]);
-	}
-	else {
-		if (SuballocatedBlock[bucket] == NULL_BLOCK) {
-			SuballocatedBlock[bucket] = AllocateBlock();
-		}
-
-		heapOffset = SuballocatedBlock[bucket] * BlockSize + Blocks[SuballocatedBlock[bucket]].next_allocation_offset;
-		Blocks[SuballocatedBlock[bucket]].next_allocation_offset += m;
-
-		if (Blocks[SuballocatedBlock[bucket]].next_allocation_offset == BlockSize) {
-			SuballocatedBlock[bucket] = NULL_BLOCK;
-		}
+	range_allocation_t range;
+	{
+		ScopeLock lock(&RangesCS);
+		range = AllocateRange(&Ranges, num);
 	}
+	Check(range.node != NULL_RANGE);
 
 	descriptor_allocation_t allocation = {};
 	allocation.allocator = this;
-	allocation.heap_offset = heapOffset;
+	allocation.heap_offset = range.offset;
 	allocation.size = num;
+	allocation.range_node = range.node;
 
 	return allocation;
 }
@@ -124,11 +114,13 @@ void DescriptorAllocator::Free(descriptor_allocation_t allocation) {
 		return;
 	}
 	Check(allocation.allocator == this);
-	auto bucket = find_log_2(allocation.size);
 
-	block_suballocation_t range;
-	range.heap_offset = allocation.heap_offset;
-	PushBack(FreeRanges[bucket], range);
+	range_allocation_t range;
+	range.offset = allocation.heap_offset;
+	range.node = allocation.range_node;
+
+	ScopeLock lock(&RangesCS);
+	FreeRange(&Ranges, range);
 }
 
 descriptor_allocation_t DescriptorAllocator::AllocateTemporary(u32 num) {
@@ -162,7 +154,7 @@ descriptor_allocation_t DescriptorAllocator::AllocateTemporary(u32 num) {
 		if (blockNextAllocation + num <= BlockSize) {
 			auto expected = blockNextAllocation;
 			if (Blocks[blockToTry].next_allocation_offset.compare_exchange_strong(expected, blockNextAllocation + num)) {
-				allocation.heap_offset = blockToTry * BlockSize + blockNextAllocation;
+				allocation.heap_offset = Blocks[blockToTry].heap_offset + blockNextAllocation;
 				break;
 			}
 			blockNextAllocation = expected;
@@ -214,6 +206,11 @@ void DescriptorAllocator::FreeTemporaryAllocations() {
 	CurrentTemporaryBlockIndex = 0;
 }
 
+range_allocator_stats_t DescriptorAllocator::GetStats() {
+	ScopeLock lock(&RangesCS);
+	return GetRangeAllocatorStats(Ranges);
+}
+
 CPU_DESC_HANDLE DescriptorAllocator::GetCPUHandle(descriptor_allocation_t location, i32 offset = 0) {
 	return offseted_handle(location.allocator->D12DescriptorHeap->GetCPUDescriptorHandleForHeapStart(), location.heap_offset + offset, IncrementSize);
 }
@@ -2,6 +2,7 @@
 #include "Device.h"
 #include "Commands.h"
 #include "Ringbuffer.h"
+#include "RangeAllocator.h"
 
 namespace Essence {
 
@@ -11,6 +12,7 @@ struct descriptor_allocation_t {
 	u32						heap_offset;
 	u32						size;
 	DescriptorAllocator*	allocator;
+	u32						range_node;
 };
 
 class DescriptorAllocator {
@@ -21,10 +23,11 @@ public:
 	public:
 		au32			next_allocation_offset;
 		GPUFenceHandle	fence;
+		u32				heap_offset;
+		u32				range_node;
 	};
 
 	u32									MaxDescriptors;
-	static const u32					BucketsNum = 16;
 	Array<BlockData>					Blocks;
 	u32									BlocksNum;
 
@@ -35,14 +38,9 @@ public:
 	bool								IsShaderVisibleHeap;
 	u32									IncrementSize;
 
-	struct block_suballocation_t {
-		u32 heap_offset;
-	};
-
-	static const u16 NULL_BLOCK = 0xFFFFu;
-
-	u16								SuballocatedBlock[BucketsNum];
-	Array<block_suballocation_t>	FreeRanges[BucketsNum];
+	// persistent allocations and temporary blocks share the heap through it
+	range_allocator_t				Ranges;
+	CriticalSection					RangesCS;
 
 	Array<u16>						TemporaryBlocks;
 	au16							CurrentTemporaryBlockIndex;
@@ -62,6 +60,7 @@ public:
 	descriptor_allocation_t AllocateTemporary(u32 num);
 	void FenceTemporaryAllocations(GPUFenceHandle);
 	void FreeTemporaryAllocations();
+	range_allocator_stats_t GetStats();
 
 	CPU_DESC_HANDLE GetCPUHandle(descriptor_allocation_t location, i32 offset);
 	GPU_DESC_HANDLE GetGPUHandle(descriptor_allocation_t location, i32 offset);
@@ -187,6 +187,19 @@ void PrintAdapterInfo(IDXGIAdapter3* adapter) {
 		Megabytes(desc.SharedSystemMemory)));
 }
 
+u64 GetDriverStamp() {
+	DXGI_ADAPTER_DESC2 desc;
+	VerifyHr(GDXGIAdapter->GetDesc2(&desc));
+	u32 ids[] = { desc.VendorId, desc.DeviceId, desc.SubSysId, desc.Revision };
+	u64 stamp = Hash::MurmurHash2_64(ids, sizeof(ids), 0);
+
+	LARGE_INTEGER umdVersion = {};
+	if (SUCCEEDED(GDXGIAdapter->CheckInterfaceSupport(__uuidof(IDXGIDevice), &umdVersion))) {
+		stamp = Hash::Combine_64(stamp, (u64)umdVersion.QuadPart);
+	}
+	return stamp;
+}
+
 void CreateSwapChain(ID3D12CommandQueue* queue) {
 	for (auto i : i32Range(MaxSwapBuffersNum)) {
 		if (SwapChainBuffer[i]) {
@@ -32,6 +32,8 @@ void							SetStablePower(bool enable);
 HANDLE							CreateEvent();
 void							DestroyEvent(HANDLE h);
 void							SetDebugName(ID3D12DeviceChild* child, const char* name);
+// changes with adapter or driver, for data only the same driver can read back
+u64								GetDriverStamp();
 
 
 inline D3D12_CPU_DESCRIPTOR_HANDLE offseted_handle(D3D12_CPU_DESCRIPTOR_HANDLE handle, INT offsetInDescriptors, UINT descriptorIncrementSize) {
@@ -0,0 +1,649 @@
+#include "DynamicBvh.h"
+#include "Essence.h"
+#include <float.h>
+
+namespace Essence {
+
+const u32 DYNAMIC_BVH_BINS_NUM = 16;
+const u32 DYNAMIC_BVH_MAX_SAH_DEPTH = 40;
+// cost is checked after this many modifications or a quarter of the proxies, whichever is more
+const u32 DYNAMIC_BVH_MIN_CHECK_INTERVAL = 32;
+// batches smaller than proxies over this reinsert one by one
+const u32 DYNAMIC_BVH_REINSERT_FRACTION = 8;
+
+inline bool IsLeaf(dynamic_bvh_node_t const& node) {
+	return node.children[0] == DYNAMIC_BVH_NULL;
+}
+
+inline void SetBounds(dynamic_bvh_node_t* node, Vec3f const& bmin, Vec3f const& bmax) {
+	memcpy(node->bounds_min, bmin.data, sizeof(node->bounds_min));
+	memcpy(node->bounds_max, bmax.data, sizeof(node->bounds_max));
+}
+
+inline float HalfArea(float const* bmin, float const* bmax) {
+	float x = bmax[0] - bmin[0];
+	float y = bmax[1] - bmin[1];
+	float z = bmax[2] - bmin[2];
+	return x * y + y * z + z * x;
+}
+
+inline float UnionHalfArea(dynamic_bvh_node_t const& a, dynamic_bvh_node_t const& b) {
+	float bmin[3], bmax[3];
+	for (i32 i = 0; i < 3; ++i) {
+		bmin[i] = min(a.bounds_min[i], b.bounds_min[i]);
+		bmax[i] = max(a.bounds_max[i], b.bounds_max[i]);
+	}
+	return HalfArea(bmin, bmax);
+}
+
+inline bool ContainsBounds(dynamic_bvh_node_t const& node, Vec3f const& bmin, Vec3f const& bmax) {
+	for (i32 i = 0; i < 3; ++i) {
+		if (bmin.data[i] < node.bounds_min[i] || bmax.data[i] > node.bounds_max[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// true when the bounds changed
+bool RefitNode(dynamic_bvh_t* bvh, u32 index) {
+	auto& node = bvh->nodes[index];
+	auto const& a = bvh->nodes[node.children[0]];
+	auto const& b = bvh->nodes[node.children[1]];
+
+	bool changed = false;
+	for (i32 i = 0; i < 3; ++i) {
+		float bmin = min(a.bounds_min[i], b.bounds_min[i]);
+		float bmax = max(a.bounds_max[i], b.bounds_max[i]);
+		changed |= bmin != node.bounds_min[i] || bmax != node.bounds_max[i];
+		node.bounds_min[i] = bmin;
+		node.bounds_max[i] = bmax;
+	}
+	return changed;
+}
+
+void RefitAncestors(dynamic_bvh_t* bvh, u32 index, bool stopWhenUnchanged) {
+	while (index != DYNAMIC_BVH_NULL) {
+		if (!RefitNode(bvh, index) && stopWhenUnchanged) {
+			return;
+		}
+		index = bvh->nodes[index].parent;
+	}
+}
+
+u32 AllocateNode(dynamic_bvh_t* bvh) {
+	u32 index = bvh->free_list;
+	if (index != DYNAMIC_BVH_NULL) {
+		bvh->free_list = bvh->nodes[index].parent;
+	}
+	else {
+		index = (u32)Size(bvh->nodes);
+		PushBack(bvh->nodes, {});
+	}
+
+	auto& node = bvh->nodes[index];
+	node = {};
+	node.parent = DYNAMIC_BVH_NULL;
+	node.user_data = DYNAMIC_BVH_NULL;
+	node.children[0] = DYNAMIC_BVH_NULL;
+	node.children[1] = DYNAMIC_BVH_NULL;
+	return index;
+}
+
+void FreeNode(dynamic_bvh_t* bvh, u32 index) {
+	bvh->nodes[index].parent = bvh->free_list;
+	bvh->free_list = index;
+}
+
+void InsertLeaf(dynamic_bvh_t* bvh, u32 leaf) {
+	if (bvh->root == DYNAMIC_BVH_NULL) {
+		bvh->root = leaf;
+		bvh->nodes[leaf].parent = DYNAMIC_BVH_NULL;
+		return;
+	}
+
+	// descend towards the sibling that grows the tree surface the least
+	auto const& leafNode = bvh->nodes[leaf];
+	u32 index = bvh->root;
+	while (!IsLeaf(bvh->nodes[index])) {
+		auto const& node = bvh->nodes[index];
+		float area = HalfArea(node.bounds_min, node.bounds_max);
+		float combinedArea = UnionHalfArea(node, leafNode);
+
+		// pairing with this node makes a new parent, going deeper grows this one anyway
+		float cost = combinedArea;
+		float inheritedCost = combinedArea - area;
+
+		float childCosts[2];
+		for (i32 c = 0; c < 2; ++c) {
+			auto const& child = bvh->nodes[node.children[c]];
+			childCosts[c] = UnionHalfArea(child, leafNode) + inheritedCost;
+			if (!IsLeaf(child)) {
+				childCosts[c] -= HalfArea(child.bounds_min, child.bounds_max);
+			}
+		}
+
+		if (cost < childCosts[0] && cost < childCosts[1]) {
+			break;
+		}
+		index = node.children[childCosts[0] <= childCosts[1] ? 0 : 1];
+	}
+
+	u32 sibling = index;
+	u32 oldParent = bvh->nodes[sibling].parent;
+	u32 newParent = AllocateNode(bvh);
+
+	auto& parentNode = bvh->nodes[newParent];
+	parentNode.parent = oldParent;
+	parentNode.children[0] = sibling;
+	parentNode.children[1] = leaf;
+	bvh->nodes[sibling].parent = newParent;
+	bvh->nodes[leaf].parent = newParent;
+
+	if (oldParent != DYNAMIC_BVH_NULL) {
+		auto& oldParentNode = bvh->nodes[oldParent];
+		oldParentNode.children[oldParentNode.children[0] == sibling ? 0 : 1] = newParent;
+	}
+	else {
+		bvh->root = newParent;
+	}
+
+	RefitAncestors(bvh, newParent, false);
+}
+
+void RemoveLeaf(dynamic_bvh_t* bvh, u32 leaf) {
+	if (leaf == bvh->root) {
+		bvh->root = DYNAMIC_BVH_NULL;
+		return;
+	}
+
+	u32 parent = bvh->nodes[leaf].parent;
+	auto const& parentNode = bvh->nodes[parent];
+	u32 grandParent = parentNode.parent;
+	u32 sibling = parentNode.children[parentNode.children[0] == leaf ? 1 : 0];
+
+	if (grandParent != DYNAMIC_BVH_NULL) {
+		auto& grandParentNode = bvh->nodes[grandParent];
+		grandParentNode.children[grandParentNode.children[0] == parent ? 0 : 1] = sibling;
+		bvh->nodes[sibling].parent = grandParent;
+		FreeNode(bvh, parent);
+		RefitAncestors(bvh, grandParent, true);
+	}
+	else {
+		bvh->root = sibling;
+		bvh->nodes[sibling].parent = DYNAMIC_BVH_NULL;
+		FreeNode(bvh, parent);
+	}
+}
+
+void SetLooseBounds(dynamic_bvh_t* bvh, u32 leaf, Vec3f boundsMin, Vec3f boundsMax) {
+	SetBounds(&bvh->nodes[leaf], boundsMin - bvh->margin, boundsMax + bvh->margin);
+}
+
+void CheckRebuild(dynamic_bvh_t* bvh) {
+	if (bvh->modifications < max(DYNAMIC_BVH_MIN_CHECK_INTERVAL, bvh->proxies_num / 4)) {
+		return;
+	}
+	bvh->modifications = 0;
+
+	if (GetDynamicBvhCost(*bvh) > bvh->rebuild_cost * bvh->rebuild_ratio) {
+		RebuildDynamicBvh(bvh);
+	}
+}
+
+void InitDynamicBvh(dynamic_bvh_t* bvh, float margin, float rebuildRatio) {
+	Clear(bvh->nodes);
+	bvh->root = DYNAMIC_BVH_NULL;
+	bvh->free_list = DYNAMIC_BVH_NULL;
+	bvh->proxies_num = 0;
+	bvh->margin = margin;
+	bvh->rebuild_ratio = rebuildRatio;
+	bvh->rebuild_cost = 0.f;
+	bvh->modifications = 0;
+}
+
+void FreeDynamicBvh(dynamic_bvh_t* bvh) {
+	FreeMemory(bvh->nodes);
+	bvh->root = DYNAMIC_BVH_NULL;
+	bvh->free_list = DYNAMIC_BVH_NULL;
+	bvh->proxies_num = 0;
+	bvh->rebuild_cost = 0.f;
+	bvh->modifications = 0;
+}
+
+u32 InsertProxy(dynamic_bvh_t* bvh, Vec3f boundsMin, Vec3f boundsMax, u32 userData) {
+	u32 leaf = AllocateNode(bvh);
+	bvh->nodes[leaf].user_data = userData;
+	SetLooseBounds(bvh, leaf, boundsMin, boundsMax);
+	InsertLeaf(bvh, leaf);
+
+	bvh->proxies_num++;
+	bvh->modifications++;
+	CheckRebuild(bvh);
+	return leaf;
+}
+
+void RemoveProxy(dynamic_bvh_t* bvh, u32 proxy) {
+	Check(IsLeaf(bvh->nodes[proxy]));
+
+	RemoveLeaf(bvh, proxy);
+	FreeNode(bvh, proxy);
+
+	bvh->proxies_num--;
+	bvh->modifications++;
+	CheckRebuild(bvh);
+}
+
+bool MoveProxy(dynamic_bvh_t* bvh, u32 proxy, Vec3f boundsMin, Vec3f boundsMax) {
+	Check(IsLeaf(bvh->nodes[proxy]));
+
+	if (ContainsBounds(bvh->nodes[proxy], boundsMin, boundsMax)) {
+		return false;
+	}
+
+	RemoveLeaf(bvh, proxy);
+	SetLooseBounds(bvh, proxy, boundsMin, boundsMax);
+	InsertLeaf(bvh, proxy);
+
+	bvh->modifications++;
+	CheckRebuild(bvh);
+	return true;
+}
+
+void MoveProxies(dynamic_bvh_t* bvh, u32 const* proxies, Vec3f const* boundsMin, Vec3f const* boundsMax, u32 proxiesNum) {
+	PROFILE_SCOPE(move_bvh_proxies);
+
+	if (proxiesNum * DYNAMIC_BVH_REINSERT_FRACTION < bvh->proxies_num) {
+		for (auto i : MakeRange(proxiesNum)) {
+			MoveProxy(bvh, proxies[i], boundsMin[i], boundsMax[i]);
+		}
+		return;
+	}
+
+	// leaves first so every walk up sees final children
+	Array<u32> moved(GetThreadScratchAllocator());
+	Reserve(moved, proxiesNum);
+	for (auto i : MakeRange(proxiesNum)) {
+		auto proxy = proxies[i];
+		Check(IsLeaf(bvh->nodes[proxy]));
+		if (!ContainsBounds(bvh->nodes[proxy], boundsMin[i], boundsMax[i])) {
+			SetLooseBounds(bvh, proxy, boundsMin[i], boundsMax[i]);
+			PushBack(moved, proxy);
+		}
+	}
+
+	// shared ancestors stop the walk once a refit leaves them as they were
+	for (auto proxy : moved) {
+		RefitAncestors(bvh, bvh->nodes[proxy].parent, true);
+	}
+
+	bvh->modifications += (u32)Size(moved);
+	CheckRebuild(bvh);
+}
+
+struct dynamic_bvh_build_t {
+	dynamic_bvh_t*	bvh;
+	u32*			leaves;
+};
+
+inline float LeafCentroid(dynamic_bvh_node_t const& node, i32 axis) {
+	return (node.bounds_min[axis] + node.bounds_max[axis]) * 0.5f;
+}
+
+u32 BuildDynamicBvhNode(dynamic_bvh_build_t* build, u32 begin, u32 end, u32 depth) {
+	auto bvh = build->bvh;
+	auto leaves = build->leaves;
+	if (end - begin == 1) {
+		return leaves[begin];
+	}
+
+	float centroidMin[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+	float centroidMax[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	for (u32 i = begin; i < end; ++i) {
+		auto const& node = bvh->nodes[leaves[i]];
+		for (i32 a = 0; a < 3; ++a) {
+			centroidMin[a] = min(centroidMin[a], LeafCentroid(node, a));
+			centroidMax[a] = max(centroidMax[a], LeafCentroid(node, a));
+		}
+	}
+
+	i32 bestAxis = -1;
+	u32 bestBin = 0;
+	float bestCost = FLT_MAX;
+
+	if (depth < DYNAMIC_BVH_MAX_SAH_DEPTH) {
+		for (i32 axis = 0; axis < 3; ++axis) {
+			float extent = centroidMax[axis] - centroidMin[axis];
+			if (extent <= 0.f) {
+				continue;
+			}
+			float scale = DYNAMIC_BVH_BINS_NUM / extent;
+
+			dynamic_bvh_node_t bins[DYNAMIC_BVH_BINS_NUM];
+			u32 counts[DYNAMIC_BVH_BINS_NUM] = {};
+			for (auto& bin : bins) {
+				for (i32 a = 0; a < 3; ++a) {
+					bin.bounds_min[a] = FLT_MAX;
+					bin.bounds_max[a] = -FLT_MAX;
+				}
+			}
+
+			for (u32 i = begin; i < end; ++i) {
+				auto const& node = bvh->nodes[leaves[i]];
+				u32 b = min((u32)((LeafCentroid(node, axis) - centroidMin[axis]) * scale), DYNAMIC_BVH_BINS_NUM - 1);
+				for (i32 a = 0; a < 3; ++a) {
+					bins[b].bounds_min[a] = min(bins[b].bounds_min[a], node.bounds_min[a]);
+					bins[b].bounds_max[a] = max(bins[b].bounds_max[a], node.bounds_max[a]);
+				}
+				counts[b]++;
+			}
+
+			float leftCost[DYNAMIC_BVH_BINS_NUM - 1];
+			auto acc = bins[0];
+			u32 accCount = 0;
+			for (u32 b = 0; b < DYNAMIC_BVH_BINS_NUM - 1; ++b) {
+				for (i32 a = 0; a < 3; ++a) {
+					acc.bounds_min[a] = min(acc.bounds_min[a], bins[b].bounds_min[a]);
+					acc.bounds_max[a] = max(acc.bounds_max[a], bins[b].bounds_max[a]);
+				}
+				accCount += counts[b];
+				leftCost[b] = accCount ? HalfArea(acc.bounds_min, acc.bounds_max) * accCount : FLT_MAX;
+			}
+
+			acc = bins[DYNAMIC_BVH_BINS_NUM - 1];
+			accCount = 0;
+			for (u32 b = DYNAMIC_BVH_BINS_NUM - 1; b > 0; --b) {
+				for (i32 a = 0; a < 3; ++a) {
+					acc.bounds_min[a] = min(acc.bounds_min[a], bins[b].bounds_min[a]);
+					acc.bounds_max[a] = max(acc.bounds_max[a], bins[b].bounds_max[a]);
+				}
+				accCount += counts[b];
+				if (!accCount || leftCost[b - 1] == FLT_MAX) {
+					continue;
+				}
+				float cost = leftCost[b - 1] + HalfArea(acc.bounds_min, acc.bounds_max) * accCount;
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestBin = b - 1;
+				}
+			}
+		}
+	}
+
+	u32 mid;
+	if (bestAxis >= 0) {
+		float scale = DYNAMIC_BVH_BINS_NUM / (centroidMax[bestAxis] - centroidMin[bestAxis]);
+		u32 i = begin;
+		u32 j = end;
+		while (i < j) {
+			auto leaf = leaves[i];
+			u32 b = min((u32)((LeafCentroid(bvh->nodes[leaf], bestAxis) - centroidMin[bestAxis]) * scale), DYNAMIC_BVH_BINS_NUM - 1);
+			if (b <= bestBin) {
+				++i;
+			}
+			else {
+				--j;
+				leaves[i] = leaves[j];
+				leaves[j] = leaf;
+			}
+		}
+		mid = i;
+	}
+	else {
+		// centroids coincide or tree got too deep, any split is as good
+		mid = begin + (end - begin) / 2;
+	}
+	Check(mid > begin && mid < end);
+
+	u32 index = AllocateNode(bvh);
+	u32 left = BuildDynamicBvhNode(build, begin, mid, depth + 1);
+	u32 right = BuildDynamicBvhNode(build, mid, end, depth + 1);
+
+	auto& node = bvh->nodes[index];
+	node.children[0] = left;
+	node.children[1] = right;
+	bvh->nodes[left].parent = index;
+	bvh->nodes[right].parent = index;
+	RefitNode(bvh, index);
+	return index;
+}
+
+void RebuildDynamicBvh(dynamic_bvh_t* bvh) {
+	PROFILE_SCOPE(rebuild_dynamic_bvh);
+
+	Array<u32> leaves(GetThreadScratchAllocator());
+	Reserve(leaves, bvh->proxies_num);
+
+	// leaves keep their indices, inner nodes go back to the free list
+	if (bvh->root != DYNAMIC_BVH_NULL) {
+		Array<u32> stack(GetThreadScratchAllocator());
+		PushBack(stack, bvh->root);
+		while (Size(stack)) {
+			auto index = Back(stack);
+			PopBack(stack);
+
+			auto const& node = bvh->nodes[index];
+			if (IsLeaf(node)) {
+				PushBack(leaves, index);
+				continue;
+			}
+			PushBack(stack, node.children[0]);
+			PushBack(stack, node.children[1]);
+			FreeNode(bvh, index);
+		}
+	}
+	Check(Size(leaves) == bvh->proxies_num);
+
+	bvh->root = DYNAMIC_BVH_NULL;
+	if (Size(leaves)) {
+		dynamic_bvh_build_t build;
+		build.bvh = bvh;
+		build.leaves = leaves.DataPtr;
+		bvh->root = BuildDynamicBvhNode(&build, 0, (u32)Size(leaves), 0);
+		bvh->nodes[bvh->root].parent = DYNAMIC_BVH_NULL;
+	}
+
+	bvh->rebuild_cost = GetDynamicBvhCost(*bvh);
+	bvh->modifications = 0;
+}
+
+float GetDynamicBvhCost(dynamic_bvh_t const& bvh) {
+	if (bvh.root == DYNAMIC_BVH_NULL || IsLeaf(bvh.nodes[bvh.root])) {
+		return 0.f;
+	}
+
+	Array<u32> stack(GetThreadScratchAllocator());
+	PushBack(stack, bvh.root);
+	float area = 0.f;
+	while (Size(stack)) {
+		auto const& node = bvh.nodes[Back(stack)];
+		PopBack(stack);
+		if (!IsLeaf(node)) {
+			area += HalfArea(node.bounds_min, node.bounds_max);
+			PushBack(stack, node.children[0]);
+			PushBack(stack, node.children[1]);
+		}
+	}
+
+	auto const& root = bvh.nodes[bvh.root];
+	return area / max(HalfArea(root.bounds_min, root.bounds_max), FLT_MIN);
+}
+
+void CollectLeaves(dynamic_bvh_t const& bvh, u32 index, Array<u32>& stack, Array<u32>* outUserData) {
+	u32 bottom = (u32)Size(stack);
+	PushBack(stack, index);
+	while (Size(stack) > bottom) {
+		auto const& node = bvh.nodes[Back(stack)];
+		PopBack(stack);
+		if (IsLeaf(node)) {
+			PushBack(*outUserData, node.user_data);
+		}
+		else {
+			PushBack(stack, node.children[0]);
+			PushBack(stack, node.children[1]);
+		}
+	}
+}
+
+void QueryFrustum(dynamic_bvh_t const& bvh, frustum_t const& frustum, Array<u32>* outUserData) {
+	if (bvh.root == DYNAMIC_BVH_NULL) {
+		return;
+	}
+
+	Array<u32> stack(GetThreadScratchAllocator());
+	Reserve(stack, 64);
+	PushBack(stack, bvh.root);
+
+	while (Size(stack)) {
+		auto index = Back(stack);
+		PopBack(stack);
+		auto const& node = bvh.nodes[index];
+
+		bool outside = false;
+		bool inside = true;
+		for (auto const& plane : frustum.planes) {
+			float center = 0.f;
+			float radius = 0.f;
+			for (i32 a = 0; a < 3; ++a) {
+				float n = (&plane.x)[a];
+				center += n * (node.bounds_min[a] + node.bounds_max[a]) * 0.5f;
+				radius += fabsf(n) * (node.bounds_max[a] - node.bounds_min[a]) * 0.5f;
+			}
+			float distance = center + plane.w;
+			if (distance + radius < 0.f) {
+				outside = true;
+				break;
+			}
+			inside &= distance - radius >= 0.f;
+		}
+
+		if (outside) {
+			continue;
+		}
+		// whole subtree passes without further plane tests
+		if (inside || IsLeaf(node)) {
+			CollectLeaves(bvh, index, stack, outUserData);
+			continue;
+		}
+		PushBack(stack, node.children[0]);
+		PushBack(stack, node.children[1]);
+	}
+}
+
+void QuerySphere(dynamic_bvh_t const& bvh, Vec3f center, float radius, Array<u32>* outUserData) {
+	if (bvh.root == DYNAMIC_BVH_NULL) {
+		return;
+	}
+
+	Array<u32> stack(GetThreadScratchAllocator());
+	Reserve(stack, 64);
+	PushBack(stack, bvh.root);
+
+	float radiusSq = radius * radius;
+	while (Size(stack)) {
+		auto const& node = bvh.nodes[Back(stack)];
+		PopBack(stack);
+
+		float distanceSq = 0.f;
+		for (i32 a = 0; a < 3; ++a) {
+			float d = max(max(node.bounds_min[a] - center.data[a], center.data[a] - node.bounds_max[a]), 0.f);
+			distanceSq += d * d;
+		}
+		if (distanceSq > radiusSq) {
+			continue;
+		}
+
+		if (IsLeaf(node)) {
+			PushBack(*outUserData, node.user_data);
+		}
+		else {
+			PushBack(stack, node.children[0]);
+			PushBack(stack, node.children[1]);
+		}
+	}
+}
+
+inline bool IntersectNodeBounds(dynamic_bvh_node_t const& node, Vec3f const& origin, Vec3f const& invDirection, float tmin, float tmax, float* outEntry) {
+	for (i32 a = 0; a < 3; ++a) {
+		float t0 = (node.bounds_min[a] - origin.data[a]) * invDirection.data[a];
+		float t1 = (node.bounds_max[a] - origin.data[a]) * invDirection.data[a];
+		tmin = max(tmin, min(t0, t1));
+		tmax = min(tmax, max(t0, t1));
+	}
+	*outEntry = tmin;
+	return tmin <= tmax;
+}
+
+struct dynamic_bvh_stack_entry_t {
+	u32		node;
+	float	entry;
+};
+
+u32 QueryRayClosest(dynamic_bvh_t const& bvh, ray_t const& ray, bvh_primitive_test_t test, void* context, float* outT) {
+	ray_t testRay = ray;
+	u32 closest = BVH_NULL_INDEX;
+	*outT = ray.tmax;
+
+	if (bvh.root == DYNAMIC_BVH_NULL) {
+		return closest;
+	}
+
+	Vec3f invDirection;
+	for (i32 a = 0; a < 3; ++a) {
+		float d = ray.direction.data[a];
+		invDirection.data[a] = 1.f / (fabsf(d) < 1e-20f ? (d < 0.f ? -1e-20f : 1e-20f) : d);
+	}
+
+	float entry;
+	if (!IntersectNodeBounds(bvh.nodes[bvh.root], ray.origin, invDirection, ray.tmin, ray.tmax, &entry)) {
+		return closest;
+	}
+
+	Array<dynamic_bvh_stack_entry_t> stack(GetThreadScratchAllocator());
+	Reserve(stack, 64);
+	PushBack(stack, { bvh.root, entry });
+
+	while (Size(stack)) {
+		auto top = Back(stack);
+		PopBack(stack);
+		// nodes behind the closest hit so far
+		if (top.entry > testRay.tmax) {
+			continue;
+		}
+
+		auto const& node = bvh.nodes[top.node];
+		if (IsLeaf(node)) {
+			float t = test(context, node.user_data, testRay);
+			if (t >= ray.tmin && t < testRay.tmax) {
+				testRay.tmax = t;
+				closest = node.user_data;
+			}
+			continue;
+		}
+
+		dynamic_bvh_stack_entry_t children[2];
+		u32 hits = 0;
+		for (auto child : node.children) {
+			float childEntry;
+			if (IntersectNodeBounds(bvh.nodes[child], ray.origin, invDirection, ray.tmin, testRay.tmax, &childEntry)) {
+				children[hits++] = { child, childEntry };
+			}
+		}
+		// near child goes on top
+		if (hits == 2 && children[0].entry < children[1].entry) {
+			PushBack(stack, children[1]);
+			PushBack(stack, children[0]);
+		}
+		else {
+			for (u32 i = 0; i < hits; ++i) {
+				PushBack(stack, children[i]);
+			}
+		}
+	}
+
+	*outT = testRay.tmax;
+	return closest;
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "Types.h"
+#include "Array.h"
+#include "VectorMath.h"
+#include "Bvh.h"
+#include "Culling.h"
+
+namespace Essence {
+
+const u32 DYNAMIC_BVH_NULL = 0xFFFFFFFF;
+
+struct dynamic_bvh_node_t {
+	float	bounds_min[3];
+	u32		parent;			// next free node while on the free list
+	float	bounds_max[3];
+	u32		user_data;		// leaves only
+	u32		children[2];	// DYNAMIC_BVH_NULL for leaves
+};
+
+// incrementally updated bvh over loose boxes, one leaf per proxy
+// proxy is the index of its leaf, it stays valid through moves and rebuilds
+struct dynamic_bvh_t {
+	Array<dynamic_bvh_node_t>	nodes;
+	u32							root;
+	u32							free_list;
+	u32							proxies_num;
+	float						margin;			// leaves are grown by it so small moves don't touch the tree
+	float						rebuild_ratio;	// rebuild once cost grows past this times the cost after the last rebuild
+	float						rebuild_cost;
+	u32							modifications;	// leaves inserted, removed or refit since cost was last checked
+};
+
+void	InitDynamicBvh(dynamic_bvh_t* bvh, float margin = 0.1f, float rebuildRatio = 1.5f);
+void	FreeDynamicBvh(dynamic_bvh_t* bvh);
+
+u32		InsertProxy(dynamic_bvh_t* bvh, Vec3f boundsMin, Vec3f boundsMax, u32 userData);
+void	RemoveProxy(dynamic_bvh_t* bvh, u32 proxy);
+// true when the box left the loose bounds and the proxy was reinserted
+bool	MoveProxy(dynamic_bvh_t* bvh, u32 proxy, Vec3f boundsMin, Vec3f boundsMax);
+// small batches reinsert, large ones refit the touched branches and leave quality to the rebuild heuristic
+void	MoveProxies(dynamic_bvh_t* bvh, u32 const* proxies, Vec3f const* boundsMin, Vec3f const* boundsMax, u32 proxiesNum);
+// binned sah over the current leaves
+void	RebuildDynamicBvh(dynamic_bvh_t* bvh);
+// sum of inner node areas over root area
+float	GetDynamicBvhCost(dynamic_bvh_t const& bvh);
+
+// queries return user data of proxies whose loose bounds pass, exact tests are left to the caller
+void	QueryFrustum(dynamic_bvh_t const& bvh, frustum_t const& frustum, Array<u32>* outUserData);
+void	QuerySphere(dynamic_bvh_t const& bvh, Vec3f center, float radius, Array<u32>* outUserData);
+// test gets user data as primitive, returns user data of the closest hit or BVH_NULL_INDEX
+u32		QueryRayClosest(dynamic_bvh_t const& bvh, ray_t const& ray, bvh_primitive_test_t test, void* context, float* outT);
+
+}
\ No newline at end of file
@@ -0,0 +1,168 @@
+#include "Meshlets.h"
+
+namespace Essence {
+
+const u8 MESHLET_UNUSED_VERTEX = 0xFF;
+
+void ComputeMeshletSphere(meshlet_t* meshlet, Vec3f const* positions, u32 const* vertices) {
+	// ritter: start from the widest of the axis extreme pairs, then grow to enclose every point
+	u32 minIndex[3] = { 0, 0, 0 };
+	u32 maxIndex[3] = { 0, 0, 0 };
+	for (u32 i = 1; i < meshlet->vertex_count; ++i) {
+		Vec3f p = positions[vertices[i]];
+		for (i32 a = 0; a < 3; ++a) {
+			if (p[a] < positions[vertices[minIndex[a]]][a]) {
+				minIndex[a] = i;
+			}
+			if (p[a] > positions[vertices[maxIndex[a]]][a]) {
+				maxIndex[a] = i;
+			}
+		}
+	}
+
+	i32 axis = 0;
+	float axisDistance = -1.f;
+	for (i32 a = 0; a < 3; ++a) {
+		Vec3f d = positions[vertices[maxIndex[a]]] - positions[vertices[minIndex[a]]];
+		float distance = dot(d, d);
+		if (distance > axisDistance) {
+			axisDistance = distance;
+			axis = a;
+		}
+	}
+
+	Vec3f center = (positions[vertices[minIndex[axis]]] + positions[vertices[maxIndex[axis]]]) * 0.5f;
+	float radius = sqrtf(axisDistance) * 0.5f;
+
+	for (u32 i = 0; i < meshlet->vertex_count; ++i) {
+		Vec3f d = positions[vertices[i]] - center;
+		float distance = sqrtf(dot(d, d));
+		if (distance > radius) {
+			float shift = (distance - radius) * 0.5f;
+			center += d * (shift / distance);
+			radius += shift;
+		}
+	}
+
+	meshlet->center = center;
+	meshlet->radius = radius;
+}
+
+void ComputeMeshletCone(meshlet_t* meshlet, Vec3f const* positions, u32 const* vertices, u8 const* triangles) {
+	Array<Vec3f> normals(GetThreadScratchAllocator());
+	Reserve(normals, meshlet->triangle_count);
+
+	Vec3f axis = Vec3f(0.f);
+	for (u32 t = 0; t < meshlet->triangle_count; ++t) {
+		Vec3f p0 = positions[vertices[triangles[t * 3 + 0]]];
+		Vec3f p1 = positions[vertices[triangles[t * 3 + 1]]];
+		Vec3f p2 = positions[vertices[triangles[t * 3 + 2]]];
+
+		Vec3f n = cross(p1 - p0, p2 - p0);
+		float area = length(n);
+		// degenerate triangles are never visible, they can't constrain the cone
+		if (area == 0.f) {
+			continue;
+		}
+		n /= area;
+		PushBack(normals, n);
+		axis += n;
+	}
+
+	meshlet->cone_axis = Vec3f(0.f, 0.f, 0.f);
+	meshlet->cone_cutoff = 1.f;
+
+	float axisLength = length(axis);
+	if (Size(normals) == 0 || axisLength == 0.f) {
+		return;
+	}
+	axis /= axisLength;
+
+	float minDot = 1.f;
+	for (auto& n : normals) {
+		minDot = min(minDot, dot(n, axis));
+	}
+
+	meshlet->cone_axis = axis;
+	// normals spread over more than a hemisphere, every view direction sees something
+	if (minDot <= 0.f) {
+		return;
+	}
+	meshlet->cone_cutoff = sqrtf(1.f - minDot * minDot);
+}
+
+void FinishMeshlet(meshlet_t* meshlet, Vec3f const* positions, Array<u32> const& vertices, Array<u8> const& triangles) {
+	ComputeMeshletSphere(meshlet, positions, vertices.DataPtr + meshlet->vertex_offset);
+	ComputeMeshletCone(meshlet, positions, vertices.DataPtr + meshlet->vertex_offset, triangles.DataPtr + meshlet->triangle_offset);
+}
+
+u32 BuildMeshlets(
+	Array<meshlet_t> *outMeshlets,
+	Array<u32> *outVertices,
+	Array<u8> *outTriangles,
+	Vec3f const* positions,
+	u32 verticesNum,
+	u32 const* indices,
+	u32 indicesNum,
+	u32 maxVertices,
+	u32 maxTriangles) {
+
+	Check(maxVertices >= 3 && maxVertices < MESHLET_UNUSED_VERTEX);
+	Check(maxTriangles >= 1);
+	Check(indicesNum % 3 == 0);
+
+	auto& meshlets = *outMeshlets;
+	auto& vertices = *outVertices;
+	auto& triangles = *outTriangles;
+
+	auto firstMeshlet = (u32)Size(meshlets);
+
+	Array<u8> localIndices(GetThreadScratchAllocator());
+	Resize(localIndices, verticesNum);
+	memset(localIndices.DataPtr, MESHLET_UNUSED_VERTEX, verticesNum);
+
+	meshlet_t meshlet = {};
+	meshlet.vertex_offset = (u32)Size(vertices);
+	meshlet.triangle_offset = (u32)Size(triangles);
+
+	for (u32 t = 0; t < indicesNum; t += 3) {
+		u32 a = indices[t + 0];
+		u32 b = indices[t + 1];
+		u32 c = indices[t + 2];
+		Check(a < verticesNum && b < verticesNum && c < verticesNum);
+
+		u32 newVertices = (localIndices[a] == MESHLET_UNUSED_VERTEX) + (localIndices[b] == MESHLET_UNUSED_VERTEX) + (localIndices[c] == MESHLET_UNUSED_VERTEX);
+
+		if (meshlet.vertex_count + newVertices > maxVertices || meshlet.triangle_count + 1u > maxTriangles) {
+			FinishMeshlet(&meshlet, positions, vertices, triangles);
+			PushBack(meshlets, meshlet);
+
+			for (u32 i = meshlet.vertex_offset; i < Size(vertices); ++i) {
+				localIndices[vertices[i]] = MESHLET_UNUSED_VERTEX;
+			}
+
+			meshlet = {};
+			meshlet.vertex_offset = (u32)Size(vertices);
+			meshlet.triangle_offset = (u32)Size(triangles);
+		}
+
+		u32 triangle[3] = { a, b, c };
+		for (auto v : triangle) {
+			if (localIndices[v] == MESHLET_UNUSED_VERTEX) {
+				localIndices[v] = (u8)meshlet.vertex_count++;
+				PushBack(vertices, v);
+			}
+			PushBack(triangles, localIndices[v]);
+		}
+		meshlet.triangle_count++;
+	}
+
+	if (meshlet.triangle_count) {
+		FinishMeshlet(&meshlet, positions, vertices, triangles);
+		PushBack(meshlets, meshlet);
+	}
+
+	return (u32)Size(meshlets) - firstMeshlet;
+}
+
+}
\ No newline at end of file
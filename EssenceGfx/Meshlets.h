@@ -0,0 +1,43 @@
+#pragma once
+
+#include "Types.h"
+#include "Array.h"
+#include "VectorMath.h"
+
+namespace Essence {
+
+const u32 MESHLET_MAX_VERTICES = 64;
+const u32 MESHLET_MAX_TRIANGLES = 124;
+
+struct meshlet_t {
+	u32		vertex_offset;		// into meshlet vertices
+	u32		triangle_offset;	// into meshlet triangles, 3 local u8 indices per triangle
+	u16		vertex_count;
+	u16		triangle_count;
+
+	Vec3f	center;
+	float	radius;
+	Vec3f	cone_axis;
+	float	cone_cutoff;		// sin of cone half angle, 1 when cone can't reject anything
+};
+
+// appends meshlets for one submesh, vertex indices are stored as they appear in the index buffer
+// returns number of meshlets created
+u32 BuildMeshlets(
+	Array<meshlet_t> *outMeshlets,
+	Array<u32> *outVertices,
+	Array<u8> *outTriangles,
+	Vec3f const* positions,
+	u32 verticesNum,
+	u32 const* indices,
+	u32 indicesNum,
+	u32 maxVertices = MESHLET_MAX_VERTICES,
+	u32 maxTriangles = MESHLET_MAX_TRIANGLES);
+
+// true when all triangles of the meshlet face away from the viewer
+inline bool IsMeshletBackfacing(meshlet_t const& meshlet, Vec3f viewPosition) {
+	Vec3f toCenter = meshlet.center - viewPosition;
+	return dot(toCenter, meshlet.cone_axis) >= meshlet.cone_cutoff * length(toCenter) + meshlet.radius;
+}
+
+}
\ No newline at end of file
@@ -3,13 +3,15 @@
 #include "Hashmap.h"
 #include <DirectXMath.h>
 #include "Commands.h"
+#include "Debug.h"
 using namespace DirectX;
 #include <Windows.h>
 #include "../ModelImporterDLL/ModelImporterDLL.h"
 
 namespace Essence {
 
-const u16 SHORT_NULL_INDEX = 0xFFFF;
+// measures and prints how far each compressed animation strays, costs load time
+const bool GVerboseAnimationCompression = false;
 
 Hashmap<ResourceNameId, model_handle>	ModelsByName;
 Freelist<model_t, model_handle>			Models;
@@ -20,17 +22,21 @@ void FreeModelsMemory() {
 		GetMallocAllocator()->Free(Models[kv.value].submeshes.elements);
 		GetMallocAllocator()->Free(Models[kv.value].raw_positions.elements);
 		GetMallocAllocator()->Free(Models[kv.value].raw_indices.elements);
+		GetMallocAllocator()->Free(Models[kv.value].skin_vertices.elements);
+		GetMallocAllocator()->Free(Models[kv.value].meshlets.elements);
+		GetMallocAllocator()->Free(Models[kv.value].meshlet_vertices.elements);
+		GetMallocAllocator()->Free(Models[kv.value].meshlet_triangles.elements);
+		FreeBvh(&Models[kv.value].bvh);
 
 		GetMallocAllocator()->Free(Models[kv.value].skeleton.bone_offsets);
 		GetMallocAllocator()->Free(Models[kv.value].skeleton.bone_node_indices);
 		GetMallocAllocator()->Free(Models[kv.value].skeleton.node_local_transforms);
 		GetMallocAllocator()->Free(Models[kv.value].skeleton.node_parents);
 		GetMallocAllocator()->Free(Models[kv.value].skeleton.node_channel_indices);
+		FreeSkeletonPoseData(&Models[kv.value].skeleton);
 
 		for (auto i : MakeRange(Models[kv.value].animations.num)) {
-			GetMallocAllocator()->Free(Models[kv.value].animations[i].channels);
-			GetMallocAllocator()->Free(Models[kv.value].animations[i].position_keys);
-			GetMallocAllocator()->Free(Models[kv.value].animations[i].rotation_keys);
+			FreeAnimation(&Models[kv.value].animations[i]);
 		}
 
 		GetMallocAllocator()->Free(Models[kv.value].animations.elements);
@@ -70,6 +76,9 @@ void LoadModel(ResourceNameId name) {
 		vertexStride = sizeof(vertex);
 		vertexLayout = GetVertexFactory({ VertexInput::POSITION_3_32F, VertexInput::NORMAL_32F, VertexInput::TEXCOORD_32F, 
 			VertexInput::TANGENT_3_32F, VertexInput::BITANGENT_3_32F });
+		model.instanced_vertex_layout = GetVertexFactory({ VertexInput::POSITION_3_32F, VertexInput::NORMAL_32F, VertexInput::TEXCOORD_32F,
+			VertexInput::TANGENT_3_32F, VertexInput::BITANGENT_3_32F,
+			VertexInput::INSTANCE_WORLD_0, VertexInput::INSTANCE_WORLD_1, VertexInput::INSTANCE_WORLD_2 });
 
 		for (auto i = 0u; i < modelData.verticesNum; ++i) {
 			model.raw_positions[i] = Vec3f(&modelData.positions[i].x);
@@ -101,6 +110,9 @@ void LoadModel(ResourceNameId name) {
 			vertex.boneWeights = modelData.boneWeights[i];
 			Append(Vertices, (u8*)&vertex, sizeof(vertex));
 		}
+
+		allocate_array(&model.skin_vertices, modelData.verticesNum, GetMallocAllocator());
+		memcpy(model.skin_vertices.elements, Vertices.DataPtr, Size(Vertices));
 	}
 
 	auto copyCommands = GetCommandList(GGPUCopyQueue, NAME_("Copy"));
@@ -113,9 +125,12 @@ void LoadModel(ResourceNameId name) {
 	model.index_stride = (u32)sizeof(u32);
 	model.vertices_num = modelData.verticesNum;
 	model.indices_num = modelData.indicesNum;
-	model.submeshes.num = modelData.submeshesNum;
-	model.submeshes.elements = (mesh_draw_t*)GetMallocAllocator()->Allocate(sizeof(modelData.submeshes[0]) * modelData.submeshesNum, 8);
+	allocate_array(&model.submeshes, modelData.submeshesNum, GetMallocAllocator());
 	model.vertex_layout = vertexLayout;
+	model.bounds.box_min = modelData.boundingBoxMin;
+	model.bounds.box_max = modelData.boundingBoxMax;
+	model.bounds.sphere_center = modelData.boundingSphereCenter;
+	model.bounds.sphere_radius = modelData.boundingSphereRadius;
 
 	Execute(copyCommands);
 
@@ -125,6 +140,34 @@ void LoadModel(ResourceNameId name) {
 		model.submeshes[i].start_index = modelData.submeshes[i].startIndex;
 	}
 
+	Array<meshlet_t> meshlets(GetThreadScratchAllocator());
+	Array<u32> meshletVertices(GetThreadScratchAllocator());
+	Array<u8> meshletTriangles(GetThreadScratchAllocator());
+	for (auto i = 0u; i < model.submeshes.num; ++i) {
+		auto& submesh = model.submeshes[i];
+		submesh.meshlet_offset = (u32)Size(meshlets);
+		submesh.meshlet_count = BuildMeshlets(&meshlets, &meshletVertices, &meshletTriangles,
+			model.raw_positions.elements + submesh.base_vertex, model.vertices_num - submesh.base_vertex,
+			model.raw_indices.elements + submesh.start_index, submesh.index_count);
+	}
+
+	allocate_array(&model.meshlets, (u32)Size(meshlets), GetMallocAllocator());
+	allocate_array(&model.meshlet_vertices, (u32)Size(meshletVertices), GetMallocAllocator());
+	allocate_array(&model.meshlet_triangles, (u32)Size(meshletTriangles), GetMallocAllocator());
+	memcpy(model.meshlets.elements, meshlets.DataPtr, sizeof(meshlet_t) * Size(meshlets));
+	memcpy(model.meshlet_vertices.elements, meshletVertices.DataPtr, sizeof(u32) * Size(meshletVertices));
+	memcpy(model.meshlet_triangles.elements, meshletTriangles.DataPtr, sizeof(u8) * Size(meshletTriangles));
+
+	Array<u32> bvhIndices(GetThreadScratchAllocator());
+	Reserve(bvhIndices, model.indices_num);
+	for (auto i = 0u; i < model.submeshes.num; ++i) {
+		auto submesh = model.submeshes[i];
+		for (auto j = 0u; j < submesh.index_count; ++j) {
+			PushBack(bvhIndices, model.raw_indices[submesh.start_index + j] + submesh.base_vertex);
+		}
+	}
+	BuildTriangleBvh(&model.bvh, model.raw_positions.elements, bvhIndices.DataPtr, (u32)Size(bvhIndices) / 3, true);
+
 	if (modelData.animationsNum) {
 		allocate_array(&model.animations, modelData.animationsNum, GetMallocAllocator());
 		zero_array(&model.animations);
@@ -149,52 +192,41 @@ void LoadModel(ResourceNameId name) {
 			skeleton.bone_offsets[i] = XMLoadFloat4x4(&modelData.bones[i].offset_matrix);
 		}
 
+		BuildSkeletonPoseData(&skeleton);
+
 		model.skeleton = skeleton;
 	}
 
 	for (auto a : MakeRange(modelData.animationsNum)) {
-		animation_t animation = {};
-		allocate_c_array(animation.channels, GetMallocAllocator(), modelData.animations[a].channels_num);
-
-		allocate_c_array(animation.position_keys, GetMallocAllocator(), modelData.animations[a].position_keys_num);
-		allocate_c_array(animation.rotation_keys, GetMallocAllocator(), modelData.animations[a].rotation_keys_num);
-
-		animation.channels_num = modelData.animations[a].channels_num;
-		animation.duration = modelData.animations[a].duration;
-		animation.ticks_per_second = modelData.animations[a].ticks_per_second;
-
-		auto positionsOffset = 0u;
-		auto rotationsOffset = 0u;
-		for (auto i = 0u; i < animation.channels_num; ++i) {
-			auto importedChannel = modelData.animationChannels[modelData.animations[a].channels_offset + i];
-
-			for (auto j = 0u; j < importedChannel.positions_num; ++j) {
-				auto outerIndex = importedChannel.positions_offset + j;
-				auto innerIndex = positionsOffset + j;
-
-				animation.position_keys[innerIndex].time = modelData.animationPositionKeys[outerIndex].time;
-				animation.position_keys[innerIndex].value = modelData.animationPositionKeys[outerIndex].value;
-			}
+		auto importedAnimation = modelData.animations[a];
+
+		// imported keys share the layout of runtime keys, channels point straight into them
+		Array<animation_channel_t> channels(GetThreadScratchAllocator());
+		Resize(channels, importedAnimation.channels_num);
+		for (auto i = 0u; i < importedAnimation.channels_num; ++i) {
+			auto importedChannel = modelData.animationChannels[importedAnimation.channels_offset + i];
+
+			channels[i].position_keys = (position_key_t const*)(modelData.animationPositionKeys + importedChannel.positions_offset);
+			channels[i].position_keys_num = importedChannel.positions_num;
+			channels[i].rotation_keys = (rotation_key_t const*)(modelData.animationRotationKeys + importedChannel.rotations_offset);
+			channels[i].rotation_keys_num = importedChannel.rotations_num;
+		}
 
-			for (auto j = 0u; j < importedChannel.rotations_num; ++j) {
-				auto outerIndex = importedChannel.rotations_offset + j;
-				auto innerIndex = rotationsOffset + j;
+		Array<animation_channel_weight_t> weights(GetThreadScratchAllocator());
+		Resize(weights, importedAnimation.channels_num);
+		auto skeletonSize = ComputeChannelWeights(&model.skeleton, importedAnimation.channels_num, weights.DataPtr);
 
-				animation.rotation_keys[innerIndex].time = modelData.animationRotationKeys[outerIndex].time;
-				animation.rotation_keys[innerIndex].value = modelData.animationRotationKeys[outerIndex].value;
-			}
+		animation_compression_stats_t stats;
+		BuildAnimation(&model.animations[a], channels.DataPtr, importedAnimation.channels_num, importedAnimation.duration, importedAnimation.ticks_per_second,
+			weights.DataPtr, ANIMATION_ERROR_BUDGET * skeletonSize, GVerboseAnimationCompression ? &stats : nullptr);
 
-			animation.channels[i].position_keys = animation.position_keys + positionsOffset;
-			animation.channels[i].position_keys_num = importedChannel.positions_num;
-			animation.channels[i].rotation_keys = animation.rotation_keys + rotationsOffset;
-			animation.channels[i].rotation_keys_num = importedChannel.rotations_num;
+		if (GVerboseAnimationCompression) {
+			MeasureAnimationError(&model.skeleton, &model.animations[a], channels.DataPtr, &stats);
 
-			positionsOffset += importedChannel.positions_num;
-			rotationsOffset += importedChannel.rotations_num;
+			ConsolePrint(Format("%s animation %u: %u keys -> %u (%u sampled), %u KB -> %u KB, error max %f avg %f (budget %f)\n",
+				(const char*)GetString(name), a, stats.raw_keys_num, stats.keys_num, stats.sampled_keys_num,
+				stats.raw_size / 1024, stats.compressed_size / 1024, stats.max_error, stats.average_error, ANIMATION_ERROR_BUDGET * skeletonSize));
 		}
-
-
-		model.animations[a] = animation;
 	}
 
 	auto handle = Create(Models);
@@ -213,16 +245,52 @@ model_t const*	GetModelRenderData(model_handle handle) {
 	return &Models[handle];
 }
 
+void PackInstanceTransform(instance_transform_t* outInstance, xmmatrix world) {
+	auto transposed = XMMatrixTranspose(world);
+	XMStoreFloat4(&outInstance->rows[0], transposed.r[0]);
+	XMStoreFloat4(&outInstance->rows[1], transposed.r[1]);
+	XMStoreFloat4(&outInstance->rows[2], transposed.r[2]);
+}
+
+void DrawModelInstances(GPUCommandList* list, model_handle model, instance_transform_t const* instances, u32 instancesNum) {
+	Check(instancesNum <= MAX_INSTANCES_PER_DRAW);
+	auto renderData = GetModelRenderData(model);
+	Check(IsValid(renderData->instanced_vertex_layout));
+
+	// transforms live in the frame's upload memory, released with the frame fence
+	auto upload = AllocateSmallUploadMemory(list, sizeof(instance_transform_t) * instancesNum, 16);
+	memcpy(upload.write_ptr, instances, sizeof(instance_transform_t) * instancesNum);
+
+	buffer_location_t vb;
+	vb.address = GetResourceFast(renderData->vertex_buffer)->resource->GetGPUVirtualAddress();
+	vb.size = renderData->vertices_num * renderData->vertex_stride;
+	vb.stride = renderData->vertex_stride;
+	SetVertexStream(list, 0, vb);
+
+	buffer_location_t instanceStream;
+	instanceStream.address = upload.virtual_address;
+	instanceStream.size = sizeof(instance_transform_t) * instancesNum;
+	instanceStream.stride = sizeof(instance_transform_t);
+	SetVertexStream(list, 1, instanceStream);
+
+	buffer_location_t ib;
+	ib.address = GetResourceFast(renderData->index_buffer)->resource->GetGPUVirtualAddress();
+	ib.size = renderData->indices_num * renderData->index_stride;
+	ib.stride = renderData->index_stride;
+	SetIndexBuffer(list, ib);
+
+	for (auto i : MakeRange(renderData->submeshes.num)) {
+		auto submesh = renderData->submeshes[i];
+		DrawIndexed(list, submesh.index_count, submesh.start_index, submesh.base_vertex, instancesNum);
+	}
+}
+
 void InitAnimationState(animation_state_t* AnimationState, model_t const* Model, u32 index) {
-	allocate_c_array(AnimationState->last_position_keys, GetMallocAllocator(), Model->animations[index].channels_num);
-	allocate_c_array(AnimationState->last_rotation_keys, GetMallocAllocator(), Model->animations[index].channels_num);
-	ZeroMemory(AnimationState->last_position_keys, Model->animations[index].channels_num * sizeof(AnimationState->last_position_keys[0]));
-	ZeroMemory(AnimationState->last_rotation_keys, Model->animations[index].channels_num * sizeof(AnimationState->last_rotation_keys[0]));
+	// key lookup needs no per state cache, last_time is set by the caller
+	AnimationState->last_scaled_time = 0.f;
 }
 
 void FreeAnimationState(animation_state_t* AnimationState) {
-	GetMallocAllocator()->Free(AnimationState->last_position_keys);
-	GetMallocAllocator()->Free(AnimationState->last_rotation_keys);
 	(*AnimationState) = {};
 }
 
@@ -230,150 +298,4 @@ model_t const* GetModelRenderData(ResourceNameId name) {
 	return &Models[ModelsByName[name]];
 }
 
-void calculate_animation_frames(
-	animation_t const* Animation,
-	animation_state_t* AnimationState,
-	float Time,
-	Array<xmmatrix> *outTransforms
-	) {
-	Array<xmmatrix>& transforms = *outTransforms;
-
-	auto channelsNum = Animation->channels_num;
-	Resize(transforms, channelsNum);
-
-	auto duration = Animation->duration;
-	float time = duration ? fmodf(Time * Animation->ticks_per_second, duration) : 0;
-
-	for (auto c = 0u; c < channelsNum; ++c) {
-		auto channel = Animation->channels[c];
-
-		xmvec position;
-		auto p = time > AnimationState->last_scaled_time ? AnimationState->last_position_keys[c] : 0u;
-		while ((p + 1) < channel.position_keys_num && channel.position_keys[p + 1].time < time) {
-			++p;
-		}
-		AnimationState->last_position_keys[c] = p;
-		{
-			auto next = min(p + 1, channel.position_keys_num - 1);
-
-			auto key = channel.position_keys[p];
-			auto nextKey = channel.position_keys[next];
-			auto diffTime = nextKey.time - key.time;
-			float blend = diffTime > 0 ? (time - key.time) / diffTime : 0;
-			position = XMVectorLerp(XMLoadFloat3A(&channel.position_keys[p].value), XMLoadFloat3A(&channel.position_keys[next].value), blend);
-			position = XMVectorSetW(position, 1.f);
-		}
-
-		xmvec qrotation;
-		auto r = time > AnimationState->last_scaled_time ? AnimationState->last_rotation_keys[c] : 0u;
-		while ((r + 1) < channel.rotation_keys_num && channel.rotation_keys[r + 1].time < time) {
-			++r;
-		}
-		AnimationState->last_rotation_keys[c] = r;
-		{
-			auto next = min(r + 1, channel.rotation_keys_num - 1);
-
-			auto key = channel.rotation_keys[r];
-			auto nextKey = channel.rotation_keys[next];
-			auto diffTime = nextKey.time - key.time;
-			float blend = diffTime > 0 ? (time - key.time) / diffTime : 0;
-			qrotation = XMQuaternionSlerp(XMLoadFloat4(&channel.rotation_keys[r].value), XMLoadFloat4(&channel.rotation_keys[next].value), blend);
-			//qrotation = XMQuaternionNormalizeEst(XMVectorLerp(XMLoadFloat4(&channel.rotation_keys[r].value), XMLoadFloat4(&channel.rotation_keys[next].value), blend));
-			
-		}
-		transforms[c] = XMMatrixRotationQuaternion(qrotation);
-		transforms[c].r[3] = position;
-	}
-
-	AnimationState->last_scaled_time = time;
-}
-
-void calculate_animation(
-	animation_skeleton_t const* Skeleton,
-	animation_t const* Animation,
-	animation_state_t* AnimationState,
-	float Time,
-	Array<xmmatrix> *outNodeTransforms,
-	Array<xmmatrix> *outTransforms) {
-
-	Array<xmmatrix> localTransformationMatrices(GetThreadScratchAllocator());
-	Resize(localTransformationMatrices, Skeleton->nodes_num);
-
-	Array<xmmatrix> fallbackNodeTransforms(GetThreadScratchAllocator());
-	if (outNodeTransforms == nullptr) {
-		outNodeTransforms = &fallbackNodeTransforms;
-	}
-	auto &globalTransformationMatrices = *outNodeTransforms;
-	Resize(globalTransformationMatrices, Skeleton->nodes_num);
-
-	Array<xmmatrix> animationMatrices(GetThreadScratchAllocator());
-	calculate_animation_frames(Animation, AnimationState, Time, &animationMatrices);
-
-	auto nodesNum = Skeleton->nodes_num;
-	// calculate channels
-	for (auto i = 0u; i < nodesNum; ++i) {
-		localTransformationMatrices[i] = Skeleton->node_channel_indices[i] != SHORT_NULL_INDEX ? animationMatrices[Skeleton->node_channel_indices[i]] : Skeleton->node_local_transforms[i];
-	}
-
-	// calculate all nodes starting from root
-	globalTransformationMatrices[0] = localTransformationMatrices[0];
-	for (auto i = 1u; i < nodesNum; ++i) {
-		globalTransformationMatrices[i] = localTransformationMatrices[i] * globalTransformationMatrices[Skeleton->node_parents[i]];
-	}
-
-	xmvec determinant;
-	xmmatrix globalInverseMatrix = XMMatrixInverse(&determinant, globalTransformationMatrices[0]);
-	auto& transformationMatrices = *outTransforms;
-	Resize(transformationMatrices, Skeleton->bones_num);
-
-	auto bonesNum = Skeleton->bones_num;
-	for (auto i = 0u; i < bonesNum; ++i) {
-		transformationMatrices[i] = Skeleton->bone_offsets[i] * globalTransformationMatrices[Skeleton->bone_node_indices[i]] * globalInverseMatrix;
-	}
-}
-
-
-void calculate_animation(
-	animation_skeleton_t const* Skeleton,
-	animation_t const* Animation,
-	animation_state_t* AnimationState,
-	float Time,
-	xmmatrix *outTransforms) {
-
-	Array<xmmatrix> localTransformationMatrices(GetThreadScratchAllocator());
-	Resize(localTransformationMatrices, Skeleton->nodes_num);
-
-	Array<xmmatrix> nodeTransforms(GetThreadScratchAllocator());
-
-	Array<xmmatrix> animationMatrices(GetThreadScratchAllocator());
-	calculate_animation_frames(Animation, AnimationState, Time, &animationMatrices);
-
-	Array<xmmatrix> globalTransformationMatrices(GetThreadScratchAllocator());
-	Resize(globalTransformationMatrices, Skeleton->nodes_num);
-
-	auto nodesNum = Skeleton->nodes_num;
-	// calculate channels
-	for (auto i = 0u; i < nodesNum; ++i) {
-		localTransformationMatrices[i] = Skeleton->node_channel_indices[i] != SHORT_NULL_INDEX ? animationMatrices[Skeleton->node_channel_indices[i]] : Skeleton->node_local_transforms[i];
-	}
-
-	// calculate all nodes starting from root
-	globalTransformationMatrices[0] = localTransformationMatrices[0];
-	for (auto i = 1u; i < nodesNum; ++i) {
-		globalTransformationMatrices[i] = localTransformationMatrices[i] * globalTransformationMatrices[Skeleton->node_parents[i]];
-	}
-
-	xmvec determinant;
-	xmmatrix globalInverseMatrix = XMMatrixInverse(&determinant, globalTransformationMatrices[0]);
-
-	auto bonesNum = Skeleton->bones_num;
-	for (auto i = 0u; i < bonesNum; ++i) {
-		outTransforms[i] = Skeleton->bone_offsets[i] * globalTransformationMatrices[Skeleton->bone_node_indices[i]] * globalInverseMatrix;
-	}
-
-	for (auto i = 0u; i < bonesNum; ++i) {
-		outTransforms[i] = XMMatrixTranspose(outTransforms[i]);
-	}
-}
-
-}
+}
\ No newline at end of file
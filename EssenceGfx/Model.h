@@ -6,6 +6,11 @@
 #include "Hash.h"
 
 #include "VectorMath.h"
+#include "Meshlets.h"
+#include "Bvh.h"
+#include "Animation.h"
+#include "Skinning.h"
+#include "Culling.h"
 
 namespace Essence {
 
@@ -25,70 +30,19 @@ struct mesh_vertex_t {
 	float3	bitangent;
 };
 
-struct animated_mesh_vertex_t {
-	float3	position;
-	float3	normal;
-	float2	texcoord0;
-	float3	tangent;
-	float3	bitangent;
-	u32		boneIndices;
-	float4	boneWeights;
-};
-
-struct animation_skeleton_t {
-	u32					nodes_num;
-	u32					bones_num;
-
-	xmmatrix*			node_local_transforms;
-	u16*				node_parents;
-	u16*				node_channel_indices;
-	u16*				bone_node_indices;
-	xmmatrix*			bone_offsets;
-};
-
-struct position_key_t {
-	float3a	value;
-	float	time;
-};
-
-struct rotation_key_t {
-	float4	value;
-	float	time;
-};
-
-struct animation_channel_t {
-	u32						position_keys_num;
-	u32						rotation_keys_num;
-	position_key_t*			position_keys;
-	rotation_key_t*			rotation_keys;
-};
-
-struct animation_t {
-	float					ticks_per_second;
-	float					duration; // in ticks
-	u32						channels_num;
-	animation_channel_t*	channels;
-	position_key_t*			position_keys;
-	rotation_key_t*			rotation_keys;
-};
-
-struct animation_state_t {
-	float	last_time;
-	float	last_scaled_time;
-	u16*	last_position_keys;
-	u16*	last_rotation_keys;
-};
-
 struct mesh_draw_t {
 	u32 index_count;
 	u32 start_index;
 	u32 base_vertex;
+	u32 meshlet_offset;
+	u32 meshlet_count;
 };
 
 struct model_t {
 	resource_handle				vertex_buffer;
 	resource_handle				index_buffer;
 	vertex_factory_handle		vertex_layout;
+	vertex_factory_handle		instanced_vertex_layout;	// static models only, adds the instance stream
 
 	u32							vertex_stride : 16;
 	u32							index_stride : 16;
@@ -102,8 +56,28 @@ struct model_t {
 
 	array_view<Vec3f>			raw_positions;
 	array_view<u32>				raw_indices;
+	array_view<animated_mesh_vertex_t>	skin_vertices;	// animated models only, input of cpu skinning
+
+	array_view<meshlet_t>		meshlets;
+	array_view<u32>				meshlet_vertices;
+	array_view<u8>				meshlet_triangles;
+
+	bvh_t						bvh;
+	object_bounds_t				bounds;
+};
+
+// stream 1 of instanced layouts
+struct instance_transform_t {
+	float4	rows[3];	// of the transposed world matrix
 };
 
+// one instance stream allocation per draw
+const u32 MAX_INSTANCES_PER_DRAW = 4096;
+
+void PackInstanceTransform(instance_transform_t* outInstance, xmmatrix world);
+// shader state is left to the caller, it has to read the instanced layout
+void DrawModelInstances(GPUCommandList* list, model_handle model, instance_transform_t const* instances, u32 instancesNum);
+
 void FreeModelsMemory();
 void LoadModel(ResourceNameId name);
 
@@ -114,8 +88,4 @@ void FreeAnimationState(animation_state_t* AnimationState);
 model_handle		GetModel(ResourceNameId);
 model_t const*		GetModelRenderData(model_handle);
 
-void calculate_animation_frames(animation_t const* Animation, animation_state_t* AnimationState, float Time, Array<xmmatrix> *outTransforms);
-void calculate_animation(animation_skeleton_t const* Skeleton, animation_t const* Animation, animation_state_t* AnimationState, float Time, Array<xmmatrix> *outNodeTransforms, Array<xmmatrix> *outTransforms);
-void calculate_animation(animation_skeleton_t const* Skeleton, animation_t const* Animation, animation_state_t* AnimationState, float Time, xmmatrix *outTransforms);
-
 }
\ No newline at end of file
@@ -0,0 +1,219 @@
+#include "PipelineCache.h"
+#include "Essence.h"
+#include "Hash.h"
+#include "Files.h"
+#include "Scheduler.h"
+
+namespace Essence {
+
+const u32 PIPELINE_CACHE_MAGIC = 0x43535045;	// EPSC
+const u32 PIPELINE_CACHE_FORMAT = 1;
+
+// followed by entries with offsets from the blobs start, then blobs
+struct pipeline_cache_header_t {
+	u32		magic;
+	u32		format;
+	u64		stamp;
+	u64		checksum;	// of everything after the header
+	u32		entries_num;
+	u32		_reserved;
+	u64		blobs_bytesize;
+};
+
+bool ReadCacheFile(void* user, Array<u8>* outData) {
+	auto read = ReadEntireFile((const char*)user);
+	if (read.result != Success) {
+		return false;
+	}
+	// read adds a terminating zero
+	Resize(*outData, read.bytesize - 1);
+	memcpy(outData->DataPtr, read.data_ptr, read.bytesize - 1);
+	FreeMemory(read);
+	return true;
+}
+
+bool WriteCacheFile(void* user, const void* data, u64 bytesize) {
+	return WriteEntireFile((const char*)user, data, bytesize);
+}
+
+cache_storage_t MakeFileCacheStorage(const char* path) {
+	cache_storage_t storage;
+	storage.user = (void*)path;
+	storage.read = ReadCacheFile;
+	storage.write = WriteCacheFile;
+	return storage;
+}
+
+u64 GetCachedBlobKey(u32 kind, u64 key) {
+	return Hash::Combine_64(key, kind);
+}
+
+void InitPipelineCache(pipeline_cache_t* cache, cache_storage_t storage, u64 stamp) {
+	cache->storage = storage;
+	cache->stamp = stamp;
+	Clear(cache->blob_by_key);
+	Clear(cache->entries);
+	Clear(cache->blobs);
+	cache->load_job = nullptr;
+	cache->dirty = false;
+}
+
+void FreePipelineCache(pipeline_cache_t* cache) {
+	WaitForPipelineCache(cache);
+	FreeMemory(cache->blob_by_key);
+	FreeMemory(cache->entries);
+	FreeMemory(cache->blobs);
+}
+
+// anything off leaves the cache empty, it is rebuilt as pipelines get created
+bool ParsePipelineCache(pipeline_cache_t* cache, Array<u8> const& data) {
+	if (Size(data) < sizeof(pipeline_cache_header_t)) {
+		return false;
+	}
+	pipeline_cache_header_t header;
+	memcpy(&header, data.DataPtr, sizeof(header));
+	if (header.magic != PIPELINE_CACHE_MAGIC || header.format != PIPELINE_CACHE_FORMAT || header.stamp != cache->stamp) {
+		return false;
+	}
+
+	u64 entriesBytesize = (u64)header.entries_num * sizeof(cached_blob_t);
+	if (Size(data) != sizeof(header) + entriesBytesize + header.blobs_bytesize) {
+		return false;
+	}
+	auto payload = data.DataPtr + sizeof(header);
+	if (Hash::MurmurHash2_64(payload, entriesBytesize + header.blobs_bytesize, 0) != header.checksum) {
+		return false;
+	}
+
+	Resize(cache->entries, header.entries_num);
+	memcpy(cache->entries.DataPtr, payload, entriesBytesize);
+	Resize(cache->blobs, header.blobs_bytesize);
+	memcpy(cache->blobs.DataPtr, payload + entriesBytesize, header.blobs_bytesize);
+
+	for (u32 i = 0; i < header.entries_num; ++i) {
+		auto const& entry = cache->entries[i];
+		if (entry.offset + entry.bytesize > header.blobs_bytesize) {
+			Clear(cache->entries);
+			Clear(cache->blobs);
+			Clear(cache->blob_by_key);
+			return false;
+		}
+		Set(cache->blob_by_key, GetCachedBlobKey(entry.kind, entry.key), i);
+	}
+	return true;
+}
+
+bool LoadPipelineCache(pipeline_cache_t* cache) {
+	Array<u8> data;
+	bool loaded = cache->storage.read(cache->storage.user, &data) && ParsePipelineCache(cache, data);
+	FreeMemory(data);
+	return loaded;
+}
+
+void LoadPipelineCacheTask(const void* args, Job* job) {
+	LoadPipelineCache((pipeline_cache_t*)args);
+}
+
+void BeginLoadPipelineCache(pipeline_cache_t* cache) {
+	Check(!cache->load_job);
+	cache->load_job = CreateJob(LoadPipelineCacheTask, cache);
+	RunJobs(&cache->load_job, 1);
+}
+
+void WaitForPipelineCache(pipeline_cache_t* cache) {
+	ScopeLock lock(&cache->lock);
+	if (cache->load_job) {
+		WaitFor(cache->load_job, true);
+		cache->load_job = nullptr;
+	}
+}
+
+bool FindCachedBlob(pipeline_cache_t* cache, u32 kind, u64 key, Array<u8>* outBlob) {
+	WaitForPipelineCache(cache);
+
+	ScopeLock lock(&cache->lock);
+	auto index = Get(cache->blob_by_key, GetCachedBlobKey(kind, key));
+	if (!index) {
+		return false;
+	}
+	auto const& entry = cache->entries[*index];
+	// different key with the same combined hash
+	if (entry.key != key || entry.kind != kind) {
+		return false;
+	}
+	Resize(*outBlob, entry.bytesize);
+	memcpy(outBlob->DataPtr, cache->blobs.DataPtr + entry.offset, entry.bytesize);
+	return true;
+}
+
+void StoreCachedBlob(pipeline_cache_t* cache, u32 kind, u64 key, const void* data, u64 bytesize) {
+	WaitForPipelineCache(cache);
+	Check(bytesize <= 0xFFFFFFFF);
+
+	ScopeLock lock(&cache->lock);
+	cached_blob_t entry;
+	entry.key = key;
+	entry.kind = kind;
+	entry.bytesize = (u32)bytesize;
+	entry.offset = Size(cache->blobs);
+	Append(cache->blobs, (const u8*)data, bytesize);
+
+	// replaced bytes stay until the next save
+	auto index = Get(cache->blob_by_key, GetCachedBlobKey(kind, key));
+	if (index) {
+		cache->entries[*index] = entry;
+	}
+	else {
+		Set(cache->blob_by_key, GetCachedBlobKey(kind, key), (u32)Size(cache->entries));
+		PushBack(cache->entries, entry);
+	}
+	cache->dirty = true;
+}
+
+bool SavePipelineCache(pipeline_cache_t* cache) {
+	WaitForPipelineCache(cache);
+
+	ScopeLock lock(&cache->lock);
+	if (!cache->dirty) {
+		return true;
+	}
+
+	u32 entriesNum = (u32)Size(cache->entries);
+	u64 blobsBytesize = 0;
+	for (auto const& entry : cache->entries) {
+		blobsBytesize += entry.bytesize;
+	}
+	u64 entriesBytesize = entriesNum * sizeof(cached_blob_t);
+
+	Array<u8> data;
+	Resize(data, sizeof(pipeline_cache_header_t) + entriesBytesize + blobsBytesize);
+	auto payload = data.DataPtr + sizeof(pipeline_cache_header_t);
+	auto outEntries = (cached_blob_t*)payload;
+	auto outBlobs = payload + entriesBytesize;
+
+	// live blobs only, packed in entry order
+	u64 offset = 0;
+	for (u32 i = 0; i < entriesNum; ++i) {
+		auto entry = cache->entries[i];
+		memcpy(outBlobs + offset, cache->blobs.DataPtr + entry.offset, entry.bytesize);
+		entry.offset = offset;
+		memcpy(outEntries + i, &entry, sizeof(entry));
+		offset += entry.bytesize;
+	}
+
+	pipeline_cache_header_t header = {};
+	header.magic = PIPELINE_CACHE_MAGIC;
+	header.format = PIPELINE_CACHE_FORMAT;
+	header.stamp = cache->stamp;
+	header.entries_num = entriesNum;
+	header.blobs_bytesize = blobsBytesize;
+	header.checksum = Hash::MurmurHash2_64(payload, entriesBytesize + blobsBytesize, 0);
+	memcpy(data.DataPtr, &header, sizeof(header));
+
+	bool written = cache->storage.write(cache->storage.user, data.DataPtr, Size(data));
+	FreeMemory(data);
+	cache->dirty = !written;
+	return written;
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "Types.h"
+#include "Array.h"
+#include "Hashmap.h"
+#include "Thread.h"
+
+namespace Essence {
+
+struct Job;
+
+// where the cache lives between runs, read gives back everything write got last time
+struct cache_storage_t {
+	void*	user;
+	bool	(*read)(void* user, Array<u8>* outData);
+	bool	(*write)(void* user, const void* data, u64 bytesize);
+};
+
+// path isn't copied
+cache_storage_t	MakeFileCacheStorage(const char* path);
+
+enum CachedBlobEnum {
+	CACHED_ROOT_SIGNATURE,
+	CACHED_PIPELINE_STATE
+};
+
+struct cached_blob_t {
+	u64		key;
+	u32		kind;		// CachedBlobEnum
+	u32		bytesize;
+	u64		offset;		// into blobs
+};
+
+// blobs by persistent hash, anything stored under a different stamp (driver, format) is dropped on load
+struct pipeline_cache_t {
+	cache_storage_t			storage;
+	u64						stamp;
+	Hashmap<u64, u32>		blob_by_key;
+	Array<cached_blob_t>	entries;
+	Array<u8>				blobs;
+	Job*					load_job;
+	bool					dirty;
+	CriticalSection			lock;
+};
+
+void	InitPipelineCache(pipeline_cache_t* cache, cache_storage_t storage, u64 stamp);
+void	FreePipelineCache(pipeline_cache_t* cache);
+// false when storage had nothing usable
+bool	LoadPipelineCache(pipeline_cache_t* cache);
+// loads on a job, first lookup waits for it
+void	BeginLoadPipelineCache(pipeline_cache_t* cache);
+void	WaitForPipelineCache(pipeline_cache_t* cache);
+// copies out, blobs move as others get stored
+bool	FindCachedBlob(pipeline_cache_t* cache, u32 kind, u64 key, Array<u8>* outBlob);
+// replaces blob stored under the same key
+void	StoreCachedBlob(pipeline_cache_t* cache, u32 kind, u64 key, const void* data, u64 bytesize);
+// writes only when something was stored since the load
+bool	SavePipelineCache(pipeline_cache_t* cache);
+
+}
\ No newline at end of file
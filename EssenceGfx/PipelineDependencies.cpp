@@ -0,0 +1,46 @@
+#include "PipelineDependencies.h"
+#include "Essence.h"
+#include "Hash.h"
+
+namespace Essence {
+
+void AddPipelineDependency(pipeline_dependencies_t* dependencies, u32 shaderIndex, u32 kind, u64 key) {
+	u64 edgeHash = Hash::Combine_64(Hash::Combine_64(key, kind), shaderIndex);
+	if (Contains(dependencies->known, edgeHash)) {
+		return;
+	}
+	Set(dependencies->known, edgeHash, (u8)1);
+
+	if (Size(dependencies->heads) <= shaderIndex) {
+		auto oldSize = Size(dependencies->heads);
+		Resize(dependencies->heads, shaderIndex + 1);
+		memset(dependencies->heads.DataPtr + oldSize, 0, sizeof(u32) * (shaderIndex + 1 - oldSize));
+	}
+
+	pipeline_dependent_t edge;
+	edge.key = key;
+	edge.kind = kind;
+	edge.next = dependencies->heads[shaderIndex];
+	PushBack(dependencies->edges, edge);
+	dependencies->heads[shaderIndex] = (u32)Size(dependencies->edges);
+}
+
+void GatherPipelineDependents(pipeline_dependencies_t const& dependencies, u32 shaderIndex, u32 kind, Array<u64>* outKeys) {
+	if (Size(dependencies.heads) <= shaderIndex) {
+		return;
+	}
+	for (u32 edge = dependencies.heads[shaderIndex]; edge; edge = dependencies.edges[edge - 1].next) {
+		auto const& dependent = dependencies.edges[edge - 1];
+		if (dependent.kind == kind) {
+			PushBack(*outKeys, dependent.key);
+		}
+	}
+}
+
+void FreePipelineDependencies(pipeline_dependencies_t* dependencies) {
+	FreeMemory(dependencies->heads);
+	FreeMemory(dependencies->edges);
+	FreeMemory(dependencies->known);
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "Types.h"
+#include "Array.h"
+#include "Hashmap.h"
+
+namespace Essence {
+
+enum PipelineDependentEnum {
+	DEPENDENT_PIPELINE,				// pipeline query hash
+	DEPENDENT_GRAPHICS_BINDINGS,	// vs and ps handle bits
+	DEPENDENT_COMPUTE_BINDINGS		// cs handle bits
+};
+
+struct pipeline_dependent_t {
+	u64		key;
+	u32		kind;		// PipelineDependentEnum
+	u32		next;		// edge + 1 of the same shader, 0 ends the list
+};
+
+// what was built from each shader, lists by shader index share one edges array
+// edges are only added, dependents that went away are skipped by whoever looks them up
+struct pipeline_dependencies_t {
+	Array<u32>						heads;		// by shader index, edge + 1
+	Array<pipeline_dependent_t>		edges;
+	Hashmap<u64, u8>				known;		// keeps lists free of repeats
+};
+
+void	AddPipelineDependency(pipeline_dependencies_t* dependencies, u32 shaderIndex, u32 kind, u64 key);
+// appends keys of the kind built from the shader, repeats across shaders are up to the caller
+void	GatherPipelineDependents(pipeline_dependencies_t const& dependencies, u32 shaderIndex, u32 kind, Array<u64>* outKeys);
+void	FreePipelineDependencies(pipeline_dependencies_t* dependencies);
+
+}
\ No newline at end of file
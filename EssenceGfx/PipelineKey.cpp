@@ -0,0 +1,75 @@
+#include "PipelineKey.h"
+#include "Essence.h"
+#include "Hash.h"
+
+namespace Essence {
+
+// -0 and 0 are the same bias
+float NormalizeZero(float x) {
+	return x == 0.f ? 0.f : x;
+}
+
+void NormalizePipelineKey(graphics_pipeline_key_t* key) {
+	Check(key->num_render_targets <= MAX_PIPELINE_RENDER_TARGETS);
+	u32 rtsNum = key->num_render_targets;
+
+	for (u32 i = rtsNum; i < MAX_PIPELINE_RENDER_TARGETS; ++i) {
+		key->rtv_formats[i] = 0;
+	}
+
+	for (u32 i = 0; i < MAX_PIPELINE_RENDER_TARGETS; ++i) {
+		auto& blend = key->blend[i];
+		if (!blend.blend_enable) {
+			blend.src_blend = 0;
+			blend.dest_blend = 0;
+			blend.blend_op = 0;
+			blend.src_blend_alpha = 0;
+			blend.dest_blend_alpha = 0;
+			blend.blend_op_alpha = 0;
+		}
+		if (!blend.logic_op_enable) {
+			blend.logic_op = 0;
+		}
+	}
+
+	// independent blend that repeats the first target is the same as shared blend
+	if (key->independent_blend_enable) {
+		bool same = true;
+		for (u32 i = 1; i < rtsNum; ++i) {
+			same &= memcmp(&key->blend[i], &key->blend[0], sizeof(key->blend[0])) == 0;
+		}
+		key->independent_blend_enable = !same;
+	}
+	// without independent blend only the first description is read
+	u32 blendsNum = key->independent_blend_enable ? rtsNum : min(rtsNum, 1u);
+	for (u32 i = blendsNum; i < MAX_PIPELINE_RENDER_TARGETS; ++i) {
+		key->blend[i] = {};
+	}
+
+	if (!key->depth_enable) {
+		key->depth_write_mask = 0;
+		key->depth_func = 0;
+	}
+	if (!key->stencil_enable) {
+		key->stencil_read_mask = 0;
+		key->stencil_write_mask = 0;
+		key->front_face = {};
+		key->back_face = {};
+	}
+
+	key->depth_bias_clamp = NormalizeZero(key->depth_bias_clamp);
+	key->slope_scaled_depth_bias = NormalizeZero(key->slope_scaled_depth_bias);
+	key->_reserved[0] = 0;
+	key->_reserved[1] = 0;
+	key->_reserved[2] = 0;
+}
+
+u64 HashPipelineKey(graphics_pipeline_key_t const& key) {
+	return Hash::MurmurHash2_64(&key, sizeof(key), 0);
+}
+
+u64 HashPipelineKey(compute_pipeline_key_t const& key) {
+	return Hash::MurmurHash2_64(&key, sizeof(key), 0);
+}
+
+}
\ No newline at end of file
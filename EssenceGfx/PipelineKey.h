@@ -0,0 +1,86 @@
+#pragma once
+
+#include "Types.h"
+
+namespace Essence {
+
+// pipeline state without pointers or padding, only what changes the compiled pso
+// fields hold the backend enum values, zero everywhere the state is ignored
+
+struct pipeline_blend_key_t {
+	u8		blend_enable;
+	u8		logic_op_enable;
+	u8		src_blend;
+	u8		dest_blend;
+	u8		blend_op;
+	u8		src_blend_alpha;
+	u8		dest_blend_alpha;
+	u8		blend_op_alpha;
+	u8		logic_op;
+	u8		write_mask;
+};
+
+struct pipeline_stencil_key_t {
+	u8		fail_op;
+	u8		depth_fail_op;
+	u8		pass_op;
+	u8		func;
+};
+
+const u32 MAX_PIPELINE_RENDER_TARGETS = 8;
+
+struct graphics_pipeline_key_t {
+	u32						vs;					// shader and vertex factory handle bits
+	u32						ps;
+	u32						vertex_factory;
+	u32						sample_mask;
+	u32						sample_count;
+	u32						sample_quality;
+	u32						rtv_formats[MAX_PIPELINE_RENDER_TARGETS];
+	u32						dsv_format;
+	u32						ib_strip_cut_value;
+	u32						forced_sample_count;
+	u32						node_mask;
+	u32						flags;
+	i32						depth_bias;
+	float					depth_bias_clamp;
+	float					slope_scaled_depth_bias;
+
+	u8						fill_mode;
+	u8						cull_mode;
+	u8						front_counter_clockwise;
+	u8						depth_clip_enable;
+	u8						multisample_enable;
+	u8						antialiased_line_enable;
+	u8						conservative_raster;
+	u8						alpha_to_coverage_enable;
+	u8						independent_blend_enable;
+	u8						depth_enable;
+	u8						depth_write_mask;
+	u8						depth_func;
+	u8						stencil_enable;
+	u8						stencil_read_mask;
+	u8						stencil_write_mask;
+	u8						topology_type;
+	u8						num_render_targets;
+	u8						_reserved[3];		// kept zero so the key hashes as bytes
+	pipeline_stencil_key_t	front_face;
+	pipeline_stencil_key_t	back_face;
+	pipeline_blend_key_t	blend[MAX_PIPELINE_RENDER_TARGETS];
+};
+
+struct compute_pipeline_key_t {
+	u32		cs;
+	u32		node_mask;
+	u32		flags;
+};
+
+static_assert(sizeof(graphics_pipeline_key_t) == 22 * 4 + 20 + 8 + 10 * MAX_PIPELINE_RENDER_TARGETS, "graphics_pipeline_key_t can't have padding");
+static_assert(sizeof(compute_pipeline_key_t) == 12, "compute_pipeline_key_t can't have padding");
+
+// zeroes what the rest of the key makes irrelevant, keys describing the same pso become equal
+void	NormalizePipelineKey(graphics_pipeline_key_t* key);
+u64		HashPipelineKey(graphics_pipeline_key_t const& key);
+u64		HashPipelineKey(compute_pipeline_key_t const& key);
+
+}
\ No newline at end of file
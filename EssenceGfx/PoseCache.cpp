@@ -0,0 +1,60 @@
+#include "PoseCache.h"
+#include "Essence.h"
+#include "Hash.h"
+
+namespace Essence {
+
+void Clear(pose_cache_t& cache) {
+	Clear(cache.owners);
+}
+
+void FreeMemory(pose_cache_t& cache) {
+	FreeMemory(cache.owners);
+}
+
+pose_cache_key_t MakePoseCacheKey(pose_cache_t const& cache, pose_cache_query_t const& query) {
+	auto ticks = query.duration > 0.f ? fmodf(query.time * query.ticks_per_second, query.duration) : 0.f;
+	if (ticks < 0.f) {
+		ticks += query.duration;
+	}
+
+	pose_cache_key_t key;
+	memset(&key, 0, sizeof(key));
+	key.model = query.model;
+	key.animation_index = query.animation_index;
+	key.time_step = (u32)(ticks / (cache.step * query.ticks_per_second));
+	key.lod = query.lod;
+	return key;
+}
+
+u64 GetPoseCacheHash(pose_cache_key_t const& key) {
+	return Hash::MurmurHash2_64(&key, sizeof(key), 0);
+}
+
+PoseCacheResultEnum SharePose(pose_cache_t& cache, pose_cache_query_t const& query, u32 owner, u32* outOwner, float* outStepTime) {
+	if (cache.step <= 0.f || query.blended) {
+		return POSE_CACHE_UNSHARED;
+	}
+
+	auto key = MakePoseCacheKey(cache, query);
+	auto hash = GetPoseCacheHash(key);
+
+	auto existing = Get(cache.owners, hash);
+	if (existing) {
+		if (memcmp(&existing->key, &key, sizeof(key)) != 0) {
+			return POSE_CACHE_UNSHARED;
+		}
+		*outOwner = existing->owner;
+		return POSE_CACHE_SHARED;
+	}
+
+	pose_cache_owner_t entry;
+	entry.key = key;
+	entry.owner = owner;
+	Set(cache.owners, hash, entry);
+	// owner evaluates at the start of the step so the pose doesn't depend on which state got there first
+	*outStepTime = key.time_step * cache.step;
+	return POSE_CACHE_OWNER;
+}
+
+}
\ No newline at end of file
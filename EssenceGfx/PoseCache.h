@@ -0,0 +1,52 @@
+#pragma once
+
+#include "Types.h"
+#include "Hashmap.h"
+
+namespace Essence {
+
+// hashed as raw bytes, padding must be zeroed
+struct pose_cache_key_t {
+	u32		model;				// handle bits
+	u32		animation_index;
+	u32		time_step;
+	u32		lod;
+};
+
+// what a state would evaluate this frame
+struct pose_cache_query_t {
+	u32		model;
+	u32		animation_index;
+	u32		lod;
+	float	time;				// seconds, lookahead included
+	float	duration;			// in ticks
+	float	ticks_per_second;
+	bool	blended;			// fading or layered, the pose is its own
+};
+
+// key is kept to tell hash collisions from the same pose
+struct pose_cache_owner_t {
+	pose_cache_key_t	key;
+	u32					owner;
+};
+
+// poses of plain animations at the same quantized time are evaluated once, step is in seconds, 0 disables sharing
+struct pose_cache_t {
+	float								step;
+	Hashmap<u64, pose_cache_owner_t>	owners;
+};
+
+enum PoseCacheResultEnum {
+	POSE_CACHE_UNSHARED,		// evaluates on its own as usual
+	POSE_CACHE_OWNER,			// evaluates at outStepTime, later equal queries copy it
+	POSE_CACHE_SHARED			// copies the pose of outOwner
+};
+
+void					Clear(pose_cache_t& cache);
+void					FreeMemory(pose_cache_t& cache);
+pose_cache_key_t		MakePoseCacheKey(pose_cache_t const& cache, pose_cache_query_t const& query);
+u64						GetPoseCacheHash(pose_cache_key_t const& key);
+// a colliding hash with another key is unshared, the slot stays with the first one
+PoseCacheResultEnum		SharePose(pose_cache_t& cache, pose_cache_query_t const& query, u32 owner, u32* outOwner, float* outStepTime);
+
+}
\ No newline at end of file
@@ -0,0 +1,236 @@
+#include "RangeAllocator.h"
+#include "Essence.h"
+#include <intrin.h>
+
+namespace Essence {
+
+u32 FindLowestBit(u32 mask) {
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+}
+
+u32 FindHighestBit(u32 mask) {
+	unsigned long index;
+	_BitScanReverse(&index, mask);
+	return index;
+}
+
+void MapRangeSize(u32 size, u32* outFl, u32* outSl) {
+	if (size < RANGE_SL_NUM) {
+		*outFl = 0;
+		*outSl = size;
+		return;
+	}
+	u32 log2 = FindHighestBit(size);
+	*outFl = log2 - RANGE_SL_BITS + 1;
+	*outSl = (size >> (log2 - RANGE_SL_BITS)) ^ RANGE_SL_NUM;
+}
+
+u32 AcquireRangeNode(range_allocator_t* allocator) {
+	if (allocator->unused_nodes != NULL_RANGE) {
+		u32 index = allocator->unused_nodes;
+		allocator->unused_nodes = allocator->nodes[index].next_free;
+		return index;
+	}
+	PushBack(allocator->nodes, range_node_t());
+	return (u32)Size(allocator->nodes) - 1;
+}
+
+void ReleaseRangeNode(range_allocator_t* allocator, u32 index) {
+	allocator->nodes[index].next_free = allocator->unused_nodes;
+	allocator->unused_nodes = index;
+}
+
+void InsertFreeRange(range_allocator_t* allocator, u32 index) {
+	auto& node = allocator->nodes[index];
+	u32 fl, sl;
+	MapRangeSize(node.size, &fl, &sl);
+
+	node.is_free = 1;
+	node.prev_free = NULL_RANGE;
+	node.next_free = allocator->heads[fl][sl];
+	if (node.next_free != NULL_RANGE) {
+		allocator->nodes[node.next_free].prev_free = index;
+	}
+	allocator->heads[fl][sl] = index;
+	allocator->fl_bitmap |= 1u << fl;
+	allocator->sl_bitmap[fl] |= 1u << sl;
+	allocator->free_ranges_num++;
+}
+
+void RemoveFreeRange(range_allocator_t* allocator, u32 index) {
+	auto& node = allocator->nodes[index];
+	u32 fl, sl;
+	MapRangeSize(node.size, &fl, &sl);
+
+	if (node.prev_free != NULL_RANGE) {
+		allocator->nodes[node.prev_free].next_free = node.next_free;
+	}
+	else {
+		allocator->heads[fl][sl] = node.next_free;
+		if (node.next_free == NULL_RANGE) {
+			allocator->sl_bitmap[fl] &= ~(1u << sl);
+			if (!allocator->sl_bitmap[fl]) {
+				allocator->fl_bitmap &= ~(1u << fl);
+			}
+		}
+	}
+	if (node.next_free != NULL_RANGE) {
+		allocator->nodes[node.next_free].prev_free = node.prev_free;
+	}
+	node.is_free = 0;
+	allocator->free_ranges_num--;
+}
+
+void InitRangeAllocator(range_allocator_t* allocator, u32 capacity) {
+	Check(capacity > 0);
+
+	allocator->capacity = capacity;
+	allocator->used = 0;
+	allocator->allocations_num = 0;
+	allocator->free_ranges_num = 0;
+	allocator->fl_bitmap = 0;
+	for (u32 fl = 0; fl < RANGE_FL_NUM; ++fl) {
+		allocator->sl_bitmap[fl] = 0;
+		for (u32 sl = 0; sl < RANGE_SL_NUM; ++sl) {
+			allocator->heads[fl][sl] = NULL_RANGE;
+		}
+	}
+	Clear(allocator->nodes);
+	allocator->unused_nodes = NULL_RANGE;
+
+	u32 index = AcquireRangeNode(allocator);
+	auto& node = allocator->nodes[index];
+	node.offset = 0;
+	node.size = capacity;
+	node.prev_physical = NULL_RANGE;
+	node.next_physical = NULL_RANGE;
+	InsertFreeRange(allocator, index);
+}
+
+void FreeRangeAllocator(range_allocator_t* allocator) {
+	FreeMemory(allocator->nodes);
+	allocator->unused_nodes = NULL_RANGE;
+}
+
+range_allocation_t AllocateRange(range_allocator_t* allocator, u32 size) {
+	Check(size > 0);
+
+	range_allocation_t allocation;
+	allocation.offset = 0;
+	allocation.node = NULL_RANGE;
+	if (size > allocator->capacity - allocator->used) {
+		return allocation;
+	}
+
+	// round up to the next class start, any range listed there fits
+	u64 searchSize = size;
+	if (size >= RANGE_SL_NUM) {
+		searchSize += (1ull << (FindHighestBit(size) - RANGE_SL_BITS)) - 1;
+	}
+	if (searchSize > 0xFFFFFFFF) {
+		return allocation;
+	}
+	u32 fl, sl;
+	MapRangeSize((u32)searchSize, &fl, &sl);
+	if (fl >= RANGE_FL_NUM) {
+		return allocation;
+	}
+
+	u32 slMap = allocator->sl_bitmap[fl] & (~0u << sl);
+	if (!slMap) {
+		u32 flMap = fl + 1 < 32 ? allocator->fl_bitmap & (~0u << (fl + 1)) : 0;
+		if (!flMap) {
+			return allocation;
+		}
+		fl = FindLowestBit(flMap);
+		slMap = allocator->sl_bitmap[fl];
+	}
+	sl = FindLowestBit(slMap);
+
+	u32 index = allocator->heads[fl][sl];
+	RemoveFreeRange(allocator, index);
+
+	// rest goes back as a free range right after
+	if (allocator->nodes[index].size > size) {
+		u32 restIndex = AcquireRangeNode(allocator);
+		auto& node = allocator->nodes[index];
+		auto& rest = allocator->nodes[restIndex];
+		rest.offset = node.offset + size;
+		rest.size = node.size - size;
+		rest.prev_physical = index;
+		rest.next_physical = node.next_physical;
+		if (rest.next_physical != NULL_RANGE) {
+			allocator->nodes[rest.next_physical].prev_physical = restIndex;
+		}
+		node.next_physical = restIndex;
+		node.size = size;
+		InsertFreeRange(allocator, restIndex);
+	}
+
+	allocator->used += size;
+	allocator->allocations_num++;
+
+	allocation.offset = allocator->nodes[index].offset;
+	allocation.node = index;
+	return allocation;
+}
+
+// keeps the range before, drops the one after
+void MergeWithNextRange(range_allocator_t* allocator, u32 index) {
+	auto& node = allocator->nodes[index];
+	u32 nextIndex = node.next_physical;
+	auto const& next = allocator->nodes[nextIndex];
+	node.size += next.size;
+	node.next_physical = next.next_physical;
+	if (node.next_physical != NULL_RANGE) {
+		allocator->nodes[node.next_physical].prev_physical = index;
+	}
+	ReleaseRangeNode(allocator, nextIndex);
+}
+
+void FreeRange(range_allocator_t* allocator, range_allocation_t allocation) {
+	u32 index = allocation.node;
+	Check(index < Size(allocator->nodes));
+	Check(!allocator->nodes[index].is_free);
+	Check(allocator->nodes[index].offset == allocation.offset);
+
+	allocator->used -= allocator->nodes[index].size;
+	allocator->allocations_num--;
+
+	u32 next = allocator->nodes[index].next_physical;
+	if (next != NULL_RANGE && allocator->nodes[next].is_free) {
+		RemoveFreeRange(allocator, next);
+		MergeWithNextRange(allocator, index);
+	}
+	u32 prev = allocator->nodes[index].prev_physical;
+	if (prev != NULL_RANGE && allocator->nodes[prev].is_free) {
+		RemoveFreeRange(allocator, prev);
+		MergeWithNextRange(allocator, prev);
+		index = prev;
+	}
+	InsertFreeRange(allocator, index);
+}
+
+range_allocator_stats_t GetRangeAllocatorStats(range_allocator_t const& allocator) {
+	range_allocator_stats_t stats = {};
+	stats.capacity = allocator.capacity;
+	stats.used = allocator.used;
+	stats.allocations_num = allocator.allocations_num;
+	stats.free_ranges_num = allocator.free_ranges_num;
+
+	if (allocator.fl_bitmap) {
+		u32 fl = FindHighestBit(allocator.fl_bitmap);
+		u32 sl = FindHighestBit(allocator.sl_bitmap[fl]);
+		for (u32 index = allocator.heads[fl][sl]; index != NULL_RANGE; index = allocator.nodes[index].next_free) {
+			stats.largest_free = max(stats.largest_free, allocator.nodes[index].size);
+		}
+	}
+
+	u32 freeSize = allocator.capacity - allocator.used;
+	stats.fragmentation = freeSize ? 1.f - (float)stats.largest_free / (float)freeSize : 0.f;
+	return stats;
+}
+
+}
\ No newline at end of file
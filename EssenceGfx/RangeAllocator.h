@@ -0,0 +1,59 @@
+#pragma once
+
+#include "Types.h"
+#include "Array.h"
+
+namespace Essence {
+
+// two level segregated fit over [0, capacity), first level by log2 of size, second splits it in RANGE_SL_NUM
+// sizes below RANGE_SL_NUM get exact classes
+const u32 RANGE_SL_BITS = 4;
+const u32 RANGE_SL_NUM = 1 << RANGE_SL_BITS;
+const u32 RANGE_FL_NUM = 32 - RANGE_SL_BITS + 1;
+const u32 NULL_RANGE = 0xFFFFFFFF;
+
+struct range_node_t {
+	u32		offset;
+	u32		size;
+	u32		prev_physical;	// neighbours by offset, NULL_RANGE at the ends
+	u32		next_physical;
+	u32		prev_free;		// size class list while free, unused nodes chain through next_free
+	u32		next_free;
+	u32		is_free;
+};
+
+struct range_allocation_t {
+	u32		offset;
+	u32		node;		// NULL_RANGE when nothing fit
+};
+
+struct range_allocator_stats_t {
+	u32		capacity;
+	u32		used;
+	u32		allocations_num;
+	u32		free_ranges_num;
+	u32		largest_free;
+	float	fragmentation;	// 1 - largest free / all free, 0 when free space is one range
+};
+
+// free neighbours are merged as soon as either is freed, so no two free ranges touch
+struct range_allocator_t {
+	u32						capacity;
+	u32						used;
+	u32						allocations_num;
+	u32						free_ranges_num;
+	u32						fl_bitmap;
+	u32						sl_bitmap[RANGE_FL_NUM];
+	u32						heads[RANGE_FL_NUM][RANGE_SL_NUM];
+	Array<range_node_t>		nodes;
+	u32						unused_nodes;
+};
+
+void					InitRangeAllocator(range_allocator_t* allocator, u32 capacity);
+void					FreeRangeAllocator(range_allocator_t* allocator);
+range_allocation_t		AllocateRange(range_allocator_t* allocator, u32 size);
+void					FreeRange(range_allocator_t* allocator, range_allocation_t allocation);
+// walks one size class list for the largest free range
+range_allocator_stats_t	GetRangeAllocatorStats(range_allocator_t const& allocator);
+
+}
\ No newline at end of file
@@ -0,0 +1,128 @@
+#include "RenderQueue.h"
+#include "Essence.h"
+
+namespace Essence {
+
+u64 FoldRenderState(u64 id) {
+	// small ids like handle indices pass through unchanged
+	id ^= id >> 32;
+	id ^= id >> 24;
+	id ^= id >> 12;
+	return id & RENDER_KEY_STATE_MASK;
+}
+
+u64 MakeRenderSortKey(RenderQueuePassEnum pass, u64 pipeline, u64 material, u64 mesh, float depth) {
+	depth = min(max(depth, 0.f), 1.f);
+	u64 depthBits = (u64)(depth * RENDER_KEY_DEPTH_MASK + 0.5f);
+	if (pass == RENDER_PASS_TRANSPARENT) {
+		depthBits = RENDER_KEY_DEPTH_MASK - depthBits;
+	}
+
+	return ((u64)pass << RENDER_KEY_PASS_SHIFT)
+		| (FoldRenderState(pipeline) << RENDER_KEY_PIPELINE_SHIFT)
+		| (FoldRenderState(material) << RENDER_KEY_MATERIAL_SHIFT)
+		| (FoldRenderState(mesh) << RENDER_KEY_MESH_SHIFT)
+		| depthBits;
+}
+
+void Clear(render_queue_t& queue) {
+	Clear(queue.keys);
+	Clear(queue.items);
+}
+
+void FreeMemory(render_queue_t& queue) {
+	FreeMemory(queue.keys);
+	FreeMemory(queue.items);
+}
+
+void PushRenderItem(render_queue_t& queue, u64 key, u32 item) {
+	PushBack(queue.keys, key);
+	PushBack(queue.items, item);
+}
+
+void BuildRenderBatches(render_queue_t const& queue, u32 maxCount, render_batch_match_t match, void* user, Array<render_batch_t>* outBatches) {
+	Check(maxCount > 0);
+
+	u32 num = (u32)Size(queue.keys);
+	u32 first = 0;
+	while (first < num) {
+		// depth is the only field allowed to differ
+		auto state = queue.keys[first] >> RENDER_KEY_MESH_SHIFT;
+		u32 last = first + 1;
+		while (last < num && last - first < maxCount && (queue.keys[last] >> RENDER_KEY_MESH_SHIFT) == state
+			&& (!match || match(user, queue.items[first], queue.items[last]))) {
+			++last;
+		}
+
+		render_batch_t batch;
+		batch.first = first;
+		batch.count = last - first;
+		PushBack(*outBatches, batch);
+
+		first = last;
+	}
+}
+
+void RadixSortKeys(u64* keys, u32* values, u32 num, u64* tmpKeys, u32* tmpValues) {
+	// all eight histograms in one read
+	u32 histograms[8][256] = {};
+	for (auto i : MakeRange(num)) {
+		auto key = keys[i];
+		for (auto d : MakeRange(8)) {
+			histograms[d][(key >> (d * 8)) & 0xFF]++;
+		}
+	}
+
+	auto srcKeys = keys;
+	auto srcValues = values;
+	auto dstKeys = tmpKeys;
+	auto dstValues = tmpValues;
+
+	for (auto d : MakeRange(8)) {
+		auto& histogram = histograms[d];
+		// one bucket holding everything, this byte doesn't change the order
+		if (histogram[(srcKeys[0] >> (d * 8)) & 0xFF] == num) {
+			continue;
+		}
+
+		u32 offset = 0;
+		for (auto& count : histogram) {
+			auto bucketSize = count;
+			count = offset;
+			offset += bucketSize;
+		}
+
+		for (auto i : MakeRange(num)) {
+			auto key = srcKeys[i];
+			auto position = histogram[(key >> (d * 8)) & 0xFF]++;
+			dstKeys[position] = key;
+			dstValues[position] = srcValues[i];
+		}
+
+		swap(srcKeys, dstKeys);
+		swap(srcValues, dstValues);
+	}
+
+	if (srcKeys != keys) {
+		memcpy(keys, srcKeys, sizeof(u64) * num);
+		memcpy(values, srcValues, sizeof(u32) * num);
+	}
+}
+
+void SortRenderQueue(render_queue_t& queue) {
+	PROFILE_SCOPE(sort_render_queue);
+
+	u32 num = (u32)Size(queue.keys);
+	if (num < 2) {
+		return;
+	}
+
+	Array<u64> tmpKeys(GetThreadScratchAllocator());
+	Array<u32> tmpItems(GetThreadScratchAllocator());
+	Resize(tmpKeys, num);
+	Resize(tmpItems, num);
+
+	RadixSortKeys(queue.keys.DataPtr, queue.items.DataPtr, num, tmpKeys.DataPtr, tmpItems.DataPtr);
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "Types.h"
+#include "Array.h"
+
+namespace Essence {
+
+enum RenderQueuePassEnum {
+	RENDER_PASS_OPAQUE,
+	RENDER_PASS_TRANSPARENT		// depth is inverted so far things come first
+};
+
+// sort key, most significant first: pass 4 | pipeline 12 | material 12 | mesh 12 | depth 24
+const u32 RENDER_KEY_PASS_SHIFT = 60;
+const u32 RENDER_KEY_PIPELINE_SHIFT = 48;
+const u32 RENDER_KEY_MATERIAL_SHIFT = 36;
+const u32 RENDER_KEY_MESH_SHIFT = 24;
+const u32 RENDER_KEY_STATE_MASK = 0xFFF;
+const u32 RENDER_KEY_DEPTH_MASK = 0xFFFFFF;
+
+// state ids wider than 12 bits are folded, a collision only costs a redundant state change
+// depth is view distance over far plane, clamped to [0, 1]
+u64		MakeRenderSortKey(RenderQueuePassEnum pass, u64 pipeline, u64 material, u64 mesh, float depth);
+
+struct render_queue_t {
+	Array<u64>	keys;
+	Array<u32>	items;		// caller's index, e.g. into the visible list
+};
+
+void	Clear(render_queue_t& queue);
+void	FreeMemory(render_queue_t& queue);
+void	PushRenderItem(render_queue_t& queue, u64 key, u32 item);
+// stable, equal keys keep submission order
+void	SortRenderQueue(render_queue_t& queue);
+
+struct render_batch_t {
+	u32		first;		// into the sorted queue
+	u32		count;
+};
+
+// exact check behind the folded key fields, false closes the batch before item, both are caller's indices
+typedef bool (*render_batch_match_t)(void* user, u32 firstItem, u32 item);
+
+// runs of sorted items sharing pass, pipeline, material and mesh, at most maxCount long
+// keys alone can merge folded ids that collide, match tells them apart when given
+void	BuildRenderBatches(render_queue_t const& queue, u32 maxCount, render_batch_match_t match, void* user, Array<render_batch_t>* outBatches);
+
+// lsd radix sort over bytes, skips bytes shared by all keys, result ends up in keys and values
+void	RadixSortKeys(u64* keys, u32* values, u32 num, u64* tmpKeys, u32* tmpValues);
+
+}
\ No newline at end of file
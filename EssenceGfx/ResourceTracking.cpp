@@ -0,0 +1,399 @@
+#include "ResourceTracking.h"
+#include "Essence.h"
+
+namespace Essence {
+
+// index of the run holding subresource
+u32 FindRun(state_run_t const* runs, u32 runsNum, u32 subresource) {
+	u32 low = 0;
+	u32 high = runsNum;
+	while (high - low > 1) {
+		u32 mid = (low + high) / 2;
+		if (runs[mid].first <= subresource) {
+			low = mid;
+		}
+		else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+u32 GetRunState(state_run_t const* runs, u32 runsNum, u32 subresource) {
+	Check(runsNum > 0);
+	return runs[FindRun(runs, runsNum, subresource)].state;
+}
+
+u32 SetRunState(state_run_t* runs, u32 runsNum, u32 subresourcesNum, u32 first, u32 count, u32 state) {
+	Check(runsNum > 0 && count > 0);
+	u32 end = first + count;
+	Check(end <= subresourcesNum);
+
+	// state resuming after the range
+	u32 tailState = end < subresourcesNum ? GetRunState(runs, runsNum, end) : RESOURCE_STATE_UNKNOWN;
+
+	// runs starting inside the range or right at its end get replaced
+	u32 begin = 0;
+	while (begin < runsNum && runs[begin].first < first) {
+		++begin;
+	}
+	u32 last = begin;
+	while (last < runsNum && runs[last].first <= end) {
+		++last;
+	}
+
+	state_run_t replacement[2];
+	u32 replacementNum = 0;
+	if (begin == 0 || runs[begin - 1].state != state) {
+		replacement[replacementNum++] = { first, state };
+	}
+	if (end < subresourcesNum && tailState != state) {
+		replacement[replacementNum++] = { end, tailState };
+	}
+
+	u32 newNum = runsNum - (last - begin) + replacementNum;
+	Check(newNum <= subresourcesNum);
+	memmove(runs + begin + replacementNum, runs + last, sizeof(state_run_t) * (runsNum - last));
+	memcpy(runs + begin, replacement, sizeof(state_run_t) * replacementNum);
+	return newNum;
+}
+
+void InitStateTracker(state_tracker_t* tracker, state_rules_t const* rules) {
+	tracker->rules = rules;
+	Clear(tracker->slots);
+	Clear(tracker->entries);
+	Clear(tracker->runs);
+}
+
+void FreeStateTracker(state_tracker_t* tracker) {
+	FreeMemory(tracker->slots);
+	FreeMemory(tracker->entries);
+	FreeMemory(tracker->runs);
+}
+
+void ResetStateTracker(state_tracker_t* tracker) {
+	for (auto const& entry : tracker->entries) {
+		tracker->slots[entry.resource] = 0;
+	}
+	Clear(tracker->entries);
+	Clear(tracker->runs);
+}
+
+state_runs_t AllocateRuns(Array<state_run_t>& runs, u32 capacity, u32 state) {
+	state_runs_t result;
+	result.offset = (u32)Size(runs);
+	result.num = 1;
+	Resize(runs, Size(runs) + capacity);
+	runs[result.offset] = { 0, state };
+	return result;
+}
+
+tracked_resource_t* GetTrackedEntry(state_tracker_t* tracker, u32 resource, u32 subresourcesNum) {
+	if (Size(tracker->slots) <= resource) {
+		auto oldSize = Size(tracker->slots);
+		Resize(tracker->slots, resource + 1);
+		memset(tracker->slots.DataPtr + oldSize, 0, sizeof(u32) * (resource + 1 - oldSize));
+	}
+
+	auto slot = tracker->slots[resource];
+	if (slot) {
+		auto entry = &tracker->entries[slot - 1];
+		Check(entry->subresources_num == subresourcesNum);
+		return entry;
+	}
+
+	tracked_resource_t entry;
+	entry.resource = resource;
+	entry.subresources_num = subresourcesNum;
+	entry.expected = AllocateRuns(tracker->runs, subresourcesNum, RESOURCE_STATE_UNKNOWN);
+	entry.current = AllocateRuns(tracker->runs, subresourcesNum, RESOURCE_STATE_UNKNOWN);
+	entry.pending = AllocateRuns(tracker->runs, subresourcesNum, RESOURCE_STATE_UNKNOWN);
+	entry.has_pending = false;
+	PushBack(tracker->entries, entry);
+	tracker->slots[resource] = (u32)Size(tracker->entries);
+	return &Back(tracker->entries);
+}
+
+void PushTransitions(Array<state_transition_t>* outTransitions, u32 resource, u32 subresourcesNum, u32 first, u32 end, u32 before, u32 after, u32 split = TRANSITION_FULL) {
+	state_transition_t transition;
+	transition.resource = resource;
+	transition.before = before;
+	transition.after = after;
+	transition.split = split;
+
+	if (first == 0 && end == subresourcesNum) {
+		transition.subresource = ALL_SUBRESOURCES;
+		PushBack(*outTransitions, transition);
+		return;
+	}
+	for (u32 s = first; s < end; ++s) {
+		transition.subresource = s;
+		PushBack(*outTransitions, transition);
+	}
+}
+
+// ends all splits of the resource at once so ends pair with begins subresource for subresource
+void EndPendingTransitions(state_tracker_t* tracker, tracked_resource_t* entry, Array<state_transition_t>* outTransitions) {
+	if (!entry->has_pending) {
+		return;
+	}
+
+	auto pending = tracker->runs.DataPtr + entry->pending.offset;
+	auto current = tracker->runs.DataPtr + entry->current.offset;
+	u32 num = entry->subresources_num;
+
+	// a split begun over the whole resource in one state ends the same way
+	u32 p = 0;
+	u32 c = 0;
+	u32 s = 0;
+	while (s < num) {
+		u32 pendingEnd = p + 1 < entry->pending.num ? pending[p + 1].first : num;
+		u32 currentEnd = c + 1 < entry->current.num ? current[c + 1].first : num;
+		u32 pieceEnd = min(pendingEnd, currentEnd);
+
+		if (pending[p].state != RESOURCE_STATE_UNKNOWN) {
+			PushTransitions(outTransitions, entry->resource, num, s, pieceEnd, pending[p].state, current[c].state, TRANSITION_END);
+		}
+
+		s = pieceEnd;
+		p += s == pendingEnd;
+		c += s == currentEnd;
+	}
+
+	entry->pending.num = 1;
+	pending[0] = { 0, RESOURCE_STATE_UNKNOWN };
+	entry->has_pending = false;
+}
+
+void TrackTransition(state_tracker_t* tracker, u32 resource, u32 subresourcesNum, u32 subresource, u32 desired, Array<state_transition_t>* outTransitions, bool split) {
+	Check(desired != RESOURCE_STATE_UNKNOWN);
+
+	auto entry = GetTrackedEntry(tracker, resource, subresourcesNum);
+	auto expected = tracker->runs.DataPtr + entry->expected.offset;
+	auto current = tracker->runs.DataPtr + entry->current.offset;
+	auto pending = tracker->runs.DataPtr + entry->pending.offset;
+
+	EndPendingTransitions(tracker, entry, outTransitions);
+
+	u32 first = subresource == ALL_SUBRESOURCES ? 0 : subresource;
+	u32 end = subresource == ALL_SUBRESOURCES ? subresourcesNum : subresource + 1;
+	Check(end <= subresourcesNum);
+
+	// one step per run of the current state inside the range
+	u32 s = first;
+	while (s < end) {
+		u32 run = FindRun(current, entry->current.num, s);
+		u32 runEnd = run + 1 < entry->current.num ? min(current[run + 1].first, end) : end;
+		u32 before = current[run].state;
+
+		u32 after = before;
+		if (before == RESOURCE_STATE_UNKNOWN) {
+			// first use, whatever state the list starts in is the glue's problem
+			after = desired;
+			entry->expected.num = SetRunState(expected, entry->expected.num, subresourcesNum, s, runEnd - s, desired);
+		}
+		else if (tracker->rules->need_change(before, desired, false)) {
+			after = tracker->rules->next_state(before, desired);
+			PushTransitions(outTransitions, resource, subresourcesNum, s, runEnd, before, after, split ? TRANSITION_BEGIN : TRANSITION_FULL);
+			if (split) {
+				entry->pending.num = SetRunState(pending, entry->pending.num, subresourcesNum, s, runEnd - s, before);
+				entry->has_pending = true;
+			}
+		}
+
+		if (after != before) {
+			entry->current.num = SetRunState(current, entry->current.num, subresourcesNum, s, runEnd - s, after);
+		}
+		s = runEnd;
+	}
+}
+
+void TrackTransition(state_tracker_t* tracker, u32 resource, u32 subresourcesNum, u32 subresource, u32 desired, Array<state_transition_t>* outTransitions) {
+	TrackTransition(tracker, resource, subresourcesNum, subresource, desired, outTransitions, false);
+}
+
+void BeginTrackedTransition(state_tracker_t* tracker, u32 resource, u32 subresourcesNum, u32 subresource, u32 desired, Array<state_transition_t>* outTransitions) {
+	TrackTransition(tracker, resource, subresourcesNum, subresource, desired, outTransitions, true);
+}
+
+void EndTrackedTransitions(state_tracker_t* tracker, Array<state_transition_t>* outTransitions) {
+	for (auto& entry : tracker->entries) {
+		EndPendingTransitions(tracker, &entry, outTransitions);
+	}
+}
+
+u32 GetTrackedState(state_tracker_t const& tracker, u32 resource, u32 subresource) {
+	if (Size(tracker.slots) <= resource || !tracker.slots[resource]) {
+		return RESOURCE_STATE_UNKNOWN;
+	}
+	auto const& entry = tracker.entries[tracker.slots[resource] - 1];
+	return GetRunState(tracker.runs.DataPtr + entry.current.offset, entry.current.num, subresource);
+}
+
+bool SameSubresources(state_transition_t const& a, state_transition_t const& b) {
+	return a.resource == b.resource && a.subresource == b.subresource;
+}
+
+bool OverlapsSubresources(state_transition_t const& a, state_transition_t const& b) {
+	return a.resource == b.resource && (a.subresource == b.subresource || a.subresource == ALL_SUBRESOURCES || b.subresource == ALL_SUBRESOURCES);
+}
+
+void MergeTransitions(Array<state_transition_t>& transitions) {
+	const u32 DROPPED = 0xFFFFFFFF;
+
+	u32 num = (u32)Size(transitions);
+	for (u32 i = 1; i < num; ++i) {
+		auto& next = transitions[i];
+
+		// closest earlier barrier touching the same subresources decides
+		for (u32 j = i; j-- > 0;) {
+			auto& prev = transitions[j];
+			if (prev.resource == DROPPED || !OverlapsSubresources(prev, next)) {
+				continue;
+			}
+			if (!SameSubresources(prev, next)) {
+				break;
+			}
+
+			if (prev.split == TRANSITION_FULL && next.split == TRANSITION_FULL && prev.after == next.before) {
+				prev.after = next.after;
+				next.resource = DROPPED;
+				// went somewhere and came back
+				if (prev.before == prev.after) {
+					prev.resource = DROPPED;
+				}
+			}
+			else if (prev.split == TRANSITION_BEGIN && next.split == TRANSITION_END && prev.before == next.before && prev.after == next.after) {
+				prev.split = TRANSITION_FULL;
+				next.resource = DROPPED;
+			}
+			break;
+		}
+	}
+
+	u32 kept = 0;
+	for (u32 i = 0; i < num; ++i) {
+		if (transitions[i].resource != DROPPED) {
+			transitions[kept++] = transitions[i];
+		}
+	}
+	Resize(transitions, kept);
+}
+
+global_resource_state_t* RegisterGlobalState(resource_states_table_t* table, u32 resource, u32 subresourcesNum, u32 state) {
+	if (Size(table->resources) <= resource) {
+		auto oldSize = Size(table->resources);
+		Resize(table->resources, resource + 1);
+		memset(table->resources.DataPtr + oldSize, 0, sizeof(global_resource_state_t) * (resource + 1 - oldSize));
+	}
+
+	auto& global = table->resources[resource];
+	if (global.capacity < subresourcesNum) {
+		if (global.capacity) {
+			PushBack(table->free_regions, state_runs_region_t{ global.runs.offset, global.capacity });
+		}
+
+		// smallest released region that fits, appended only when none does
+		i64 best = -1;
+		for (u64 i = 0; i < Size(table->free_regions); ++i) {
+			auto capacity = table->free_regions[i].capacity;
+			if (capacity >= subresourcesNum && (best == -1 || capacity < table->free_regions[best].capacity)) {
+				best = (i64)i;
+			}
+		}
+
+		if (best != -1) {
+			auto region = table->free_regions[best];
+			table->free_regions[best] = Back(table->free_regions);
+			PopBack(table->free_regions);
+
+			global.capacity = region.capacity;
+			global.runs.offset = region.offset;
+			global.runs.num = 1;
+			table->runs[region.offset] = { 0, state };
+		}
+		else {
+			global.capacity = subresourcesNum;
+			global.runs = AllocateRuns(table->runs, subresourcesNum, state);
+		}
+	}
+	else {
+		global.runs.num = 1;
+		table->runs[global.runs.offset] = { 0, state };
+	}
+	global.subresources_num = subresourcesNum;
+	return &global;
+}
+
+void SetResourceState(resource_states_table_t* table, u32 resource, u32 subresourcesNum, u32 state) {
+	RegisterGlobalState(table, resource, subresourcesNum, state);
+}
+
+u32 GetResourceState(resource_states_table_t const& table, u32 resource, u32 subresource) {
+	if (Size(table.resources) <= resource || !table.resources[resource].subresources_num) {
+		return RESOURCE_STATE_UNKNOWN;
+	}
+	auto const& global = table.resources[resource];
+	return GetRunState(table.runs.DataPtr + global.runs.offset, global.runs.num, subresource);
+}
+
+void FreeResourceStates(resource_states_table_t* table) {
+	FreeMemory(table->resources);
+	FreeMemory(table->runs);
+	FreeMemory(table->free_regions);
+}
+
+void ResolveTrackedStates(resource_states_table_t* table, state_tracker_t const& tracker, Array<state_transition_t>* outTransitions) {
+	for (auto const& entry : tracker.entries) {
+		Check(!entry.has_pending);
+		u32 num = entry.subresources_num;
+		auto expected = tracker.runs.DataPtr + entry.expected.offset;
+		auto current = tracker.runs.DataPtr + entry.current.offset;
+
+		global_resource_state_t* global = nullptr;
+		if (Size(table->resources) > entry.resource && table->resources[entry.resource].subresources_num == num) {
+			global = &table->resources[entry.resource];
+		}
+		else {
+			// never registered, the list's expectations are taken as they are
+			global = RegisterGlobalState(table, entry.resource, num, RESOURCE_STATE_UNKNOWN);
+		}
+		auto globalRuns = table->runs.DataPtr + global->runs.offset;
+
+		// both run lists at once, each piece where neither changes is one step
+		u32 e = 0;
+		u32 g = 0;
+		u32 s = 0;
+		while (s < num) {
+			u32 expectedEnd = e + 1 < entry.expected.num ? expected[e + 1].first : num;
+			u32 globalEnd = g + 1 < global->runs.num ? globalRuns[g + 1].first : num;
+			u32 pieceEnd = min(expectedEnd, globalEnd);
+
+			u32 before = globalRuns[g].state;
+			u32 after = expected[e].state;
+			if (before != RESOURCE_STATE_UNKNOWN && after != RESOURCE_STATE_UNKNOWN && tracker.rules->need_change(before, after, true)) {
+				PushTransitions(outTransitions, entry.resource, num, s, pieceEnd, before, after);
+			}
+
+			s = pieceEnd;
+			e += s == expectedEnd;
+			g += s == globalEnd;
+		}
+
+		// untouched subresources keep their global state
+		if (entry.current.num == 1 && current[0].state != RESOURCE_STATE_UNKNOWN) {
+			globalRuns[0] = current[0];
+			global->runs.num = 1;
+			continue;
+		}
+		for (u32 r = 0; r < entry.current.num; ++r) {
+			if (current[r].state == RESOURCE_STATE_UNKNOWN) {
+				continue;
+			}
+			u32 runEnd = r + 1 < entry.current.num ? current[r + 1].first : num;
+			global->runs.num = SetRunState(globalRuns, global->runs.num, num, current[r].first, runEnd - current[r].first, current[r].state);
+		}
+	}
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "Types.h"
+#include "Array.h"
+
+namespace Essence {
+
+const u32 RESOURCE_STATE_UNKNOWN = 0xFFFFFFFF;
+const u32 ALL_SUBRESOURCES = 0xFFFFFFFF;
+
+// run lasts from first until the next one starts, lists start at 0 and neighbours differ
+// so a resource never needs more runs than it has subresources
+struct state_run_t {
+	u32		first;
+	u32		state;
+};
+
+struct state_runs_t {
+	u32		offset;		// into the owner's runs, room for subresources_num of them
+	u32		num;
+};
+
+enum StateTransitionSplitEnum {
+	TRANSITION_FULL,
+	TRANSITION_BEGIN,		// resource can't be used until the matching end
+	TRANSITION_END
+};
+
+struct state_transition_t {
+	u32		resource;		// handle index
+	u32		subresource;	// ALL_SUBRESOURCES when the whole resource moves at once
+	u32		before;
+	u32		after;
+	u32		split;			// StateTransitionSplitEnum
+};
+
+// backend meaning of state bits, exclusive asks for an exact match
+struct state_rules_t {
+	bool	(*need_change)(u32 before, u32 after, bool exclusive);
+	u32		(*next_state)(u32 before, u32 after);
+};
+
+struct tracked_resource_t {
+	u32				resource;
+	u32				subresources_num;
+	state_runs_t	expected;	// what the list needs at its start, unknown where it doesn't care
+	state_runs_t	current;	// after the last recorded transition, split ones included
+	state_runs_t	pending;	// state before a begun split transition, unknown where none is in flight
+	bool			has_pending;
+};
+
+// one per command list, nothing here touches the backend or global state
+struct state_tracker_t {
+	state_rules_t const*		rules;
+	Array<u32>					slots;		// by handle index, entry + 1, 0 while untouched
+	Array<tracked_resource_t>	entries;	// in first use order
+	Array<state_run_t>			runs;
+};
+
+struct global_resource_state_t {
+	u32				subresources_num;	// 0 until registered
+	u32				capacity;			// runs reserved, kept when the index is registered again
+	state_runs_t	runs;
+};
+
+struct state_runs_region_t {
+	u32		offset;
+	u32		capacity;
+};
+
+// states between command lists, by handle index
+// regions left behind by a resource registered again with more subresources are reused by later ones
+struct resource_states_table_t {
+	Array<global_resource_state_t>	resources;
+	Array<state_run_t>				runs;
+	Array<state_runs_region_t>		free_regions;
+};
+
+void	InitStateTracker(state_tracker_t* tracker, state_rules_t const* rules);
+void	FreeStateTracker(state_tracker_t* tracker);
+// resets slots of touched resources only
+void	ResetStateTracker(state_tracker_t* tracker);
+// appends barriers needed inside the list, first use of a subresource only records what the list expects
+void	TrackTransition(state_tracker_t* tracker, u32 resource, u32 subresourcesNum, u32 subresource, u32 desired, Array<state_transition_t>* outTransitions);
+// begins a split transition now so the wait happens at the next use, which ends it
+// first use can't be split, it is left to the glue like any other first use
+void	BeginTrackedTransition(state_tracker_t* tracker, u32 resource, u32 subresourcesNum, u32 subresource, u32 desired, Array<state_transition_t>* outTransitions);
+// ends every split still in flight, lists must not close with one
+void	EndTrackedTransitions(state_tracker_t* tracker, Array<state_transition_t>* outTransitions);
+u32		GetTrackedState(state_tracker_t const& tracker, u32 resource, u32 subresource);
+
+// folds a batch flushed together: chained full transitions of a subresource become one or vanish,
+// a begin and end meeting in one batch become a full transition
+void	MergeTransitions(Array<state_transition_t>& transitions);
+
+void	SetResourceState(resource_states_table_t* table, u32 resource, u32 subresourcesNum, u32 state);
+u32		GetResourceState(resource_states_table_t const& table, u32 resource, u32 subresource);
+void	FreeResourceStates(resource_states_table_t* table);
+// barriers bringing global states to what the list expects, global then takes the states the list ends with
+// walks only resources the list touched
+void	ResolveTrackedStates(resource_states_table_t* table, state_tracker_t const& tracker, Array<state_transition_t>* outTransitions);
+
+u32		GetRunState(state_run_t const* runs, u32 runsNum, u32 subresource);
+// returns new number of runs
+u32		SetRunState(state_run_t* runs, u32 runsNum, u32 subresourcesNum, u32 first, u32 count, u32 state);
+
+}
\ No newline at end of file
@@ -78,6 +78,10 @@ resource_fast_t* GetResourceFast(resource_handle handle) {
 	return &ResourcesFastTable[handle.GetIndex()];
 }
 
+resource_fast_t* GetResourceFastByIndex(u32 index) {
+	return &ResourcesFastTable[index];
+}
+
 resource_transition_t*	GetResourceTransitionInfo(resource_handle handle) {
 	Check(Contains(ResourcesTable, handle));
 	return &ResourcesTransitionTable[handle.GetIndex()];
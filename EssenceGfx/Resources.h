@@ -14,6 +14,9 @@ class GPUCommandList;
 struct input_layout_element_t {
 	DXGI_FORMAT		format;
 	const char*		semantic_name;
+	u32				semantic_index;
+	u32				input_slot;
+	u32				instance_step_rate;	// 0 for per vertex data
 };
 
 enum class ResourceLoadEnum : u8 {
@@ -39,6 +42,10 @@ static const input_layout_element_t BONE_WEIGHTS_32F= { DXGI_FORMAT_R32G32B32A32
 static const input_layout_element_t COLOR_RGBA_8U =	  { DXGI_FORMAT_R8G8B8A8_UNORM		, "COLOR" };
 static const input_layout_element_t TANGENT_3_32F = { DXGI_FORMAT_R32G32B32_FLOAT		, "TANGENT" };
 static const input_layout_element_t BITANGENT_3_32F = { DXGI_FORMAT_R32G32B32_FLOAT		, "BITANGENT" };
+// rows of a transposed 3x4 world matrix from stream 1, one per instance
+static const input_layout_element_t INSTANCE_WORLD_0 = { DXGI_FORMAT_R32G32B32A32_FLOAT	, "INSTANCE_WORLD", 0, 1, 1 };
+static const input_layout_element_t INSTANCE_WORLD_1 = { DXGI_FORMAT_R32G32B32A32_FLOAT	, "INSTANCE_WORLD", 1, 1, 1 };
+static const input_layout_element_t INSTANCE_WORLD_2 = { DXGI_FORMAT_R32G32B32A32_FLOAT	, "INSTANCE_WORLD", 2, 1, 1 };
 };
 
 struct buffer_location_t {
@@ -178,6 +185,8 @@ extern CPU_DESC_HANDLE	G_NULL_TEXTURE2D_UAV_DESCRIPTOR;
 
 resource_t*				GetResourceInfo(resource_handle);
 resource_fast_t*		GetResourceFast(resource_handle);
+// by handle index, for tables that are indexed the same way
+resource_fast_t*		GetResourceFastByIndex(u32 index);
 resource_transition_t*	GetResourceTransitionInfo(resource_handle);
 
 resource_rtv_t			GetRTV(resource_handle resource);
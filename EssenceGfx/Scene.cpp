@@ -2,18 +2,38 @@
 #include "Application.h"
 #include "Camera.h"
 #include "Scheduler.h"
+#include "RenderQueue.h"
+#include <float.h>
 
 namespace Essence {
 
+void FreeAnimationLayer(Scene::scene_animation_state_t& animState) {
+	if (animState.layer_mask.weights.elements) {
+		FreeChannelMask(&animState.layer_mask, GetMallocAllocator());
+	}
+	if (animState.layer_reference.groups.elements) {
+		FreePose(&animState.layer_reference, GetMallocAllocator());
+	}
+	animState.layer_weight = 0.f;
+}
+
 Scene::~Scene() {
 	for (auto &state : AnimationStates) {
-		GetMallocAllocator()->Free(state.transformations.elements);
+		GetMallocAllocator()->Free(state.bone_buffers.elements);
+		FreeAnimationLayer(state);
 		FreeAnimationState(&state.state);
 	}
 	FreeMemory(AnimationStates);
+	FreeMemory(PoseCache);
 
 	FreeMemory(Entities);
 
+	if (EntitiesTreeInitialized) {
+		FreeDynamicBvh(&EntitiesTree);
+	}
+	FreeMemory(EntitiesTreeHandles);
+	FreeMemory(MovedEntities);
+
 	EntitiesNum = 0;
 }
 
@@ -27,21 +47,40 @@ scene_entity_handle SpawnEntity(Scene& Scene, model_handle model) {
 	ref.qrotation = float4(0, 0, 0, 1);
 	ref.scale = float3(1, 1, 1);
 	ref.model = model;
+	// inserted into the tree with the next batch of moves
+	ref.spatial_proxy = DYNAMIC_BVH_NULL;
+	ref.spatial_moved = true;
+	PushBack(Scene.MovedEntities, handle);
 
 	return handle;
 }
 
+void MarkEntityMoved(Scene& Scene, scene_entity_handle handle) {
+	auto& entity = Scene.Entities[handle];
+	if (!entity.spatial_moved) {
+		entity.spatial_moved = true;
+		PushBack(Scene.MovedEntities, handle);
+	}
+}
+
 void SetScale(Scene& Scene, scene_entity_handle entity, float val) {
 	Scene.Entities[entity].scale = float3(val, val, val);
+	MarkEntityMoved(Scene, entity);
 }
 
 void SetPosition(Scene& Scene, scene_entity_handle entity, float3 position) {
 	Scene.Entities[entity].position = position;
+	MarkEntityMoved(Scene, entity);
 }
 
 void KillEntity(Scene& Scene, scene_entity_handle entity) {
 	KillAnimation(Scene, entity);
 
+	auto proxy = Scene.Entities[entity].spatial_proxy;
+	if (proxy != DYNAMIC_BVH_NULL) {
+		RemoveProxy(&Scene.EntitiesTree, proxy);
+	}
+
 	Delete(Scene.Entities, entity);
 	Scene.EntitiesNum--;
 }
@@ -52,6 +91,7 @@ void KillAnimation(Scene& Scene, scene_entity_handle entity) {
 	if (IsValid(animHandle)) {
 		Scene.AnimationStates[animHandle].use_counter--;
 		if (Scene.AnimationStates[animHandle].use_counter == 0) {
+			FreeAnimationLayer(Scene.AnimationStates[animHandle]);
 			FreeAnimationState(&Scene.AnimationStates[animHandle].state);
 		}
 	}
@@ -76,12 +116,61 @@ void SetAnimation(Scene& Scene, scene_entity_handle entity, u32 index, float sta
 
 		Scene.Entities[entity].animation = animHandle;
 
-		allocate_array(&Scene.AnimationStates[animHandle].transformations, GetModelRenderData(Scene.Entities[entity].model)->skeleton.bones_num, GetMallocAllocator());
+		auto bonesNum = GetModelRenderData(Scene.Entities[entity].model)->skeleton.bones_num;
+		allocate_array(&Scene.AnimationStates[animHandle].bone_buffers, bonesNum * 3, GetMallocAllocator());
+		Scene.AnimationStates[animHandle].transformations = array_view<bone_transform_t>(Scene.AnimationStates[animHandle].bone_buffers.elements, bonesNum);
 	}
 
 	InitAnimationState(&Scene.AnimationStates[animHandle].state, pRenderData, index);
 }
 
+void CrossfadeAnimation(Scene& Scene, scene_entity_handle entity, u32 index, float duration, float startTime) {
+	auto animHandle = Scene.Entities[entity].animation;
+	if (!IsValid(animHandle) || duration <= 0.f) {
+		SetAnimation(Scene, entity, index, startTime);
+		return;
+	}
+
+	auto& animState = Scene.AnimationStates[animHandle];
+	Check(GetModelRenderData(animState.model)->animations.num > index);
+
+	// fading out of an unfinished fade drops its source, the pose jump is hidden by the new fade
+	animState.fade_animation_index = animState.animation_index;
+	animState.fade_time = animState.state.last_time;
+	animState.fade_elapsed = 0.f;
+	animState.fade_duration = duration;
+
+	animState.animation_index = index;
+	animState.state.last_time = startTime;
+	InitAnimationState(&animState.state, GetModelRenderData(animState.model), index);
+}
+
+void SetAnimationLayer(Scene& Scene, scene_entity_handle entity, u32 index, float weight, bool additive, u32 maskNode) {
+	auto animHandle = Scene.Entities[entity].animation;
+	Check(IsValid(animHandle));
+
+	auto& animState = Scene.AnimationStates[animHandle];
+	FreeAnimationLayer(animState);
+	if (weight <= 0.f) {
+		return;
+	}
+
+	auto pRenderData = GetModelRenderData(animState.model);
+	Check(pRenderData->animations.num > index);
+
+	animState.layer_animation_index = index;
+	animState.layer_time = 0.f;
+	animState.layer_weight = weight;
+	animState.layer_additive = additive;
+	if (maskNode) {
+		BuildChannelMask(&pRenderData->skeleton, maskNode, 1.f, &animState.layer_mask, GetMallocAllocator());
+	}
+	if (additive) {
+		InitPose(&animState.layer_reference, pRenderData->skeleton.channels_num, GetMallocAllocator());
+		sample_animation(&pRenderData->skeleton, &pRenderData->animations[index], 0.f, &animState.layer_reference);
+	}
+}
+
 void MirrorAnimation(Scene& Scene, scene_entity_handle dstEntity, scene_entity_handle srcEntity) {
 	Check(Scene.Entities[dstEntity].model == Scene.Entities[srcEntity].model);
 
@@ -99,20 +188,510 @@ void GetSceneAnimations(Scene* pScene, Array<animation_handle>* handlesAcc) {
 	}
 }
 
-void UpdateAnimations(Scene& Scene, float dt) {
+xmmatrix GetEntityWorldMatrix(scene_entity_t const& entity) {
+	using namespace DirectX;
+
+	return XMMatrixAffineTransformation(
+		XMLoadFloat3((XMFLOAT3*)&entity.scale),
+		XMVectorZero(),
+		XMLoadFloat4((XMFLOAT4*)&entity.qrotation),
+		XMLoadFloat3((XMFLOAT3*)&entity.position));
+}
+
+void GetEntityWorldBounds(scene_entity_t const& entity, Vec3f* outMin, Vec3f* outMax) {
+	using namespace DirectX;
+
+	auto const& bounds = GetModelRenderData(entity.model)->bounds;
+	auto world = GetEntityWorldMatrix(entity);
+
+	xmvec worldMin = XMVectorReplicate(FLT_MAX);
+	xmvec worldMax = XMVectorReplicate(-FLT_MAX);
+	for (auto c : MakeRange(8)) {
+		xmvec corner = XMVectorSet(
+			c & 1 ? bounds.box_max.x : bounds.box_min.x,
+			c & 2 ? bounds.box_max.y : bounds.box_min.y,
+			c & 4 ? bounds.box_max.z : bounds.box_min.z,
+			1.f);
+		corner = XMVector3TransformCoord(corner, world);
+		worldMin = XMVectorMin(worldMin, corner);
+		worldMax = XMVectorMax(worldMax, corner);
+	}
+
+	XMStoreFloat3((XMFLOAT3*)outMin, worldMin);
+	XMStoreFloat3((XMFLOAT3*)outMax, worldMax);
+}
+
+void UpdateSceneSpatial(Scene& Scene) {
+	if (!Scene.EntitiesTreeInitialized) {
+		InitDynamicBvh(&Scene.EntitiesTree);
+		Scene.EntitiesTreeInitialized = true;
+	}
+	if (!Size(Scene.MovedEntities)) {
+		return;
+	}
+
+	PROFILE_SCOPE(update_scene_spatial);
+
+	Array<u32> proxies(GetThreadScratchAllocator());
+	Array<Vec3f> boundsMin(GetThreadScratchAllocator());
+	Array<Vec3f> boundsMax(GetThreadScratchAllocator());
+	Reserve(proxies, Size(Scene.MovedEntities));
+	Reserve(boundsMin, Size(Scene.MovedEntities));
+	Reserve(boundsMax, Size(Scene.MovedEntities));
+
+	for (auto handle : Scene.MovedEntities) {
+		// killed after it moved
+		if (!Contains(Scene.Entities, handle)) {
+			continue;
+		}
+
+		auto& entity = Scene.Entities[handle];
+		entity.spatial_moved = false;
+
+		Vec3f bmin, bmax;
+		GetEntityWorldBounds(entity, &bmin, &bmax);
+
+		if (entity.spatial_proxy == DYNAMIC_BVH_NULL) {
+			auto index = handle.GetIndex();
+			entity.spatial_proxy = InsertProxy(&Scene.EntitiesTree, bmin, bmax, index);
+			if (Size(Scene.EntitiesTreeHandles) <= index) {
+				Resize(Scene.EntitiesTreeHandles, index + 1);
+			}
+			Scene.EntitiesTreeHandles[index] = handle;
+			continue;
+		}
+
+		PushBack(proxies, entity.spatial_proxy);
+		PushBack(boundsMin, bmin);
+		PushBack(boundsMax, bmax);
+	}
+
+	MoveProxies(&Scene.EntitiesTree, proxies.DataPtr, boundsMin.DataPtr, boundsMax.DataPtr, (u32)Size(proxies));
+	Clear(Scene.MovedEntities);
+}
+
+void BuildSceneBvh(Scene& Scene) {
+	PROFILE_SCOPE(build_scene_bvh);
+
+	UpdateSceneSpatial(Scene);
+	RebuildDynamicBvh(&Scene.EntitiesTree);
+}
+
+struct scene_raycast_t {
+	Scene*		pScene;
+	ray_hit_t	hit;
+};
+
+float RaycastSceneEntity(void* userData, u32 primitive, ray_t const& ray) {
+	using namespace DirectX;
+
+	auto data = (scene_raycast_t*)userData;
+	auto const& entity = data->pScene->Entities[data->pScene->EntitiesTreeHandles[primitive]];
+	auto renderData = GetModelRenderData(entity.model);
+	if (!renderData->bvh.nodes.num) {
+		return -1.f;
+	}
+
+	xmvec determinant;
+	xmmatrix invWorld = XMMatrixInverse(&determinant, GetEntityWorldMatrix(entity));
+
+	// direction stays unnormalized so distances along local ray match the world ray
+	ray_t localRay = ray;
+	XMStoreFloat3((XMFLOAT3*)&localRay.origin, XMVector3TransformCoord(XMLoadFloat3((XMFLOAT3*)&ray.origin), invWorld));
+	XMStoreFloat3((XMFLOAT3*)&localRay.direction, XMVector3TransformNormal(XMLoadFloat3((XMFLOAT3*)&ray.direction), invWorld));
+
+	ray_hit_t hit;
+	if (!IntersectClosest(renderData->bvh, localRay, &hit)) {
+		return -1.f;
+	}
+	data->hit = hit;
+	return hit.t;
+}
+
+bool RaycastScene(Scene& Scene, ray_t const& ray, scene_ray_hit_t* outHit) {
+	PROFILE_SCOPE(raycast_scene);
+
+	UpdateSceneSpatial(Scene);
+
+	scene_raycast_t data = {};
+	data.pScene = &Scene;
+
+	float t;
+	auto primitive = QueryRayClosest(Scene.EntitiesTree, ray, RaycastSceneEntity, &data, &t);
+	if (primitive == BVH_NULL_INDEX) {
+		return false;
+	}
+
+	outHit->entity = Scene.EntitiesTreeHandles[primitive];
+	outHit->hit = data.hit;
+	return true;
+}
+
+void CullScene(Scene& Scene, xmmatrix viewProj, Array<scene_entity_handle>* outVisible, bool parallel) {
+	PROFILE_SCOPE(cull_scene);
+
+	UpdateSceneSpatial(Scene);
+
+	frustum_t frustum;
+	ExtractFrustum(viewProj, &frustum);
+
+	// the tree rejects whole regions on loose boxes, survivors get the exact test
+	Array<u32> candidates(GetThreadScratchAllocator());
+	QueryFrustum(Scene.EntitiesTree, frustum, &candidates);
+
+	// flagged by handle index so the output keeps entity order
+	Array<u8> candidateFlags(GetThreadScratchAllocator());
+	Resize(candidateFlags, Size(Scene.EntitiesTreeHandles));
+	memset(candidateFlags.DataPtr, 0, Size(candidateFlags));
+	for (auto index : candidates) {
+		candidateFlags[index] = 1;
+	}
+
+	u32 candidatesNum = (u32)Size(candidates);
+	Array<scene_entity_handle> handles(GetMallocAllocator());
+	Array<cull_bounds4_t> bounds(GetMallocAllocator());
+	Array<u32> visible(GetMallocAllocator());
+	Reserve(handles, candidatesNum);
+	Resize(bounds, (candidatesNum + CULL_BLOCK_SIZE - 1) / CULL_BLOCK_SIZE);
+	Resize(visible, candidatesNum);
+
+	for (auto handle : Scene.Entities.Keys()) {
+		if (!candidateFlags[handle.GetIndex()]) {
+			continue;
+		}
+		auto const& entity = Scene.Entities[handle];
+		SetCullBounds(bounds.DataPtr, (u32)Size(handles), GetEntityWorldMatrix(entity), GetModelRenderData(entity.model)->bounds);
+		PushBack(handles, handle);
+	}
+
+	auto visibleNum = parallel
+		? ParallelCullBounds(frustum, bounds.DataPtr, (u32)Size(handles), visible.DataPtr)
+		: CullBounds(frustum, bounds.DataPtr, (u32)Size(handles), visible.DataPtr);
+
+	Reserve(*outVisible, Size(*outVisible) + visibleNum);
+	for (auto i : MakeRange(visibleNum)) {
+		PushBack(*outVisible, handles[visible[i]]);
+	}
+	Scene.VisibleEntitiesNum = visibleNum;
+}
+
+void QuerySceneSphere(Scene& Scene, float3 center, float radius, Array<scene_entity_handle>* outEntities) {
+	UpdateSceneSpatial(Scene);
+
+	Array<u32> indices(GetThreadScratchAllocator());
+	QuerySphere(Scene.EntitiesTree, Vec3f(center.x, center.y, center.z), radius, &indices);
+
+	Reserve(*outEntities, Size(*outEntities) + Size(indices));
+	for (auto index : indices) {
+		PushBack(*outEntities, Scene.EntitiesTreeHandles[index]);
+	}
+}
+
+const u32 SCENE_ANIMATION_LOD_CULLED = 0xFFFFFFFF;
+// projected radius over distance where lods end, anything smaller gets the last one
+const float SceneAnimationLodSizes[ANIMATION_LODS - 1] = { 0.1f, 0.05f, 0.025f };
+const u32 SceneAnimationLodIntervals[ANIMATION_LODS] = { 1, 2, 4, 8 };
+
+void SetAnimationLodView(Scene& Scene, xmmatrix viewProj, float3 viewPosition) {
+	ExtractFrustum(viewProj, &Scene.AnimationLodFrustum);
+	Scene.AnimationLodPosition = viewPosition;
+	Scene.AnimationLodEnabled = true;
+}
+
+void DisableAnimationLod(Scene& Scene) {
+	Scene.AnimationLodEnabled = false;
+}
+
+// lod of every state from the closest visible entity that uses it
+void AssignAnimationLods(Scene& Scene) {
+	using namespace DirectX;
+
 	for (auto& animState : Scene.AnimationStates) {
-		auto pRenderData = GetModelRenderData(animState.model);
+		animState.frame_lod = Scene.AnimationLodEnabled ? SCENE_ANIMATION_LOD_CULLED : 0;
+	}
+	if (!Scene.AnimationLodEnabled) {
+		return;
+	}
+
+	auto viewPosition = XMLoadFloat3(&Scene.AnimationLodPosition);
+	for (auto& entity : Scene.Entities) {
+		if (!IsValid(entity.animation)) {
+			continue;
+		}
+		auto& animState = Scene.AnimationStates[entity.animation];
+
+		// bind pose bounds, animated vertices rarely leave a sphere around them
+		auto const& bounds = GetModelRenderData(entity.model)->bounds;
+		auto scale = max(max(entity.scale.x, entity.scale.y), entity.scale.z);
+		auto center = XMVector3TransformCoord(XMLoadFloat3(&bounds.sphere_center), GetEntityWorldMatrix(entity));
+		auto radius = bounds.sphere_radius * scale;
+
+		bool visible = true;
+		for (auto i : MakeRange(6)) {
+			if (XMVectorGetX(XMPlaneDotCoord(XMLoadFloat4(&Scene.AnimationLodFrustum.planes[i]), center)) < -radius) {
+				visible = false;
+				break;
+			}
+		}
+		if (!visible) {
+			continue;
+		}
+
+		auto distance = XMVectorGetX(XMVector3Length(XMVectorSubtract(center, viewPosition)));
+		auto size = distance > radius ? radius / distance : 1.f;
+		auto lod = 0u;
+		while (lod + 1 < ANIMATION_LODS && size < SceneAnimationLodSizes[lod]) {
+			++lod;
+		}
+		animState.frame_lod = min(animState.frame_lod, lod);
+	}
+}
+
+void AdvanceAnimationState(Scene::scene_animation_state_t& animState, float dt) {
+	animState.state.last_time += dt;
+
+	if (animState.fade_duration > 0.f) {
+		animState.fade_time += dt;
+		animState.fade_elapsed += dt;
+		if (animState.fade_elapsed >= animState.fade_duration) {
+			animState.fade_duration = 0.f;
+		}
+	}
+	if (animState.layer_weight > 0.f) {
+		animState.layer_time += dt;
+	}
+}
 
-		float currentAnimTime = animState.state.last_time + dt;
-		animState.state.last_time += dt;
+// lookahead moves every time of the state without advancing it
+void EvaluateAnimationState(Scene::scene_animation_state_t& animState, float lookahead, u32 lod, bone_transform_t* outTransforms) {
+	auto pRenderData = GetModelRenderData(animState.model);
+	auto skeleton = &pRenderData->skeleton;
 
+	bool fading = animState.fade_duration > 0.f;
+	bool layered = animState.layer_weight > 0.f;
+
+	if (!fading && !layered) {
 		calculate_animation(
-			&pRenderData->skeleton,
+			skeleton,
 			&pRenderData->animations[animState.animation_index],
 			&animState.state,
-			currentAnimTime,
-			animState.transformations.elements);
+			animState.state.last_time + lookahead,
+			outTransforms,
+			lod);
+		return;
+	}
+
+	animation_pose_t pose, other;
+	InitPose(&pose, skeleton->channels_num, GetThreadScratchAllocator());
+	InitPose(&other, skeleton->channels_num, GetThreadScratchAllocator());
+
+	animState.state.last_scaled_time = sample_animation(skeleton, &pRenderData->animations[animState.animation_index], animState.state.last_time + lookahead, &pose, lod);
+
+	if (fading) {
+		sample_animation(skeleton, &pRenderData->animations[animState.fade_animation_index], animState.fade_time + lookahead, &other, lod);
+
+		float blend = min((animState.fade_elapsed + lookahead) / animState.fade_duration, 1.f);
+		animation_pose_t const* poses[] = { &other, &pose };
+		float weights[] = { 1.f - blend, blend };
+		blend_poses(poses, weights, 2, &pose);
+	}
+
+	if (layered) {
+		sample_animation(skeleton, &pRenderData->animations[animState.layer_animation_index], animState.layer_time + lookahead, &other, lod);
+
+		auto mask = animState.layer_mask.weights.num ? &animState.layer_mask : nullptr;
+		if (animState.layer_additive) {
+			make_additive_pose(&other, &animState.layer_reference, &other);
+			add_pose_layer(&pose, &other, animState.layer_weight, mask);
+		}
+		else {
+			blend_pose_layer(&pose, &other, animState.layer_weight, mask);
+		}
 	}
+
+	calculate_pose_transforms(skeleton, &pose, outTransforms, lod);
+
+	FreePose(&other, GetThreadScratchAllocator());
+	FreePose(&pose, GetThreadScratchAllocator());
+}
+
+void SetPoseCacheStep(Scene& Scene, float step) {
+	Scene.PoseCache.step = max(step, 0.f);
+}
+
+bone_transform_t* EvaluatedBones(Scene::scene_animation_state_t const& animState) {
+	auto bonesNum = GetModelRenderData(animState.model)->skeleton.bones_num;
+	return animState.bone_buffers.elements + bonesNum * animState.lod_next_buffer;
+}
+
+// picks what the state does this frame and points transformations at the buffer it ends up in
+void PlanAnimationState(Scene::scene_animation_state_t& animState, u32 stateIndex, u32 frame, float dt) {
+	auto bonesNum = GetModelRenderData(animState.model)->skeleton.bones_num;
+
+	animState.frame_source = {};
+	animState.frame_lookahead = 0.f;
+
+	if (animState.frame_lod == SCENE_ANIMATION_LOD_CULLED) {
+		// pose is rebuilt once it shows up again
+		animState.lod_interval = 0;
+		animState.frame_update = ANIMATION_UPDATE_CULLED;
+		return;
+	}
+
+	auto interval = SceneAnimationLodIntervals[animState.frame_lod];
+	// states of one lod update on different frames
+	auto step = (frame + stateIndex) % interval;
+
+	if (interval == 1 || animState.lod_interval != interval) {
+		animState.lod_interval = interval;
+		animState.frame_update = ANIMATION_UPDATE_RESET;
+		animState.transformations = array_view<bone_transform_t>(EvaluatedBones(animState), bonesNum);
+		return;
+	}
+
+	if (step == 0) {
+		// next pose is sampled one interval ahead, interpolation reaches it when the following update comes
+		animState.transformations = array_view<bone_transform_t>(EvaluatedBones(animState), bonesNum);
+		animState.lod_next_buffer ^= 1;
+		animState.frame_update = ANIMATION_UPDATE_EVALUATE;
+		animState.frame_lookahead = dt * interval;
+		return;
+	}
+
+	animState.frame_update = ANIMATION_UPDATE_INTERPOLATE;
+	animState.transformations = array_view<bone_transform_t>(animState.bone_buffers.elements + bonesNum * 2, bonesNum);
+}
+
+// states evaluating a plain animation at the same quantized time share the first one's result
+void SharePoseCache(Scene& Scene, animation_handle handle) {
+	auto& animState = Scene.AnimationStates[handle];
+
+	if (Scene.PoseCache.step <= 0.f || animState.frame_update == ANIMATION_UPDATE_CULLED || animState.frame_update == ANIMATION_UPDATE_INTERPOLATE) {
+		return;
+	}
+
+	auto const& animation = GetModelRenderData(animState.model)->animations[animState.animation_index];
+
+	pose_cache_query_t query;
+	memcpy(&query.model, &animState.model, sizeof(query.model));
+	query.animation_index = animState.animation_index;
+	query.lod = animState.frame_lod;
+	query.time = animState.state.last_time + animState.frame_lookahead;
+	query.duration = animation.duration;
+	query.ticks_per_second = animation.ticks_per_second;
+	query.blended = animState.fade_duration > 0.f || animState.layer_weight > 0.f;
+
+	u32 handleBits;
+	memcpy(&handleBits, &handle, sizeof(handleBits));
+
+	u32 ownerBits;
+	float stepTime;
+	auto result = SharePose(Scene.PoseCache, query, handleBits, &ownerBits, &stepTime);
+	if (result == POSE_CACHE_SHARED) {
+		memcpy(&animState.frame_source, &ownerBits, sizeof(ownerBits));
+	}
+	else if (result == POSE_CACHE_OWNER) {
+		animState.frame_lookahead = stepTime - animState.state.last_time;
+	}
+}
+
+void PlanAnimationUpdates(Scene& Scene, float dt) {
+	AssignAnimationLods(Scene);
+	Clear(Scene.PoseCache);
+
+	for (auto handle : Scene.AnimationStates.Keys()) {
+		auto& animState = Scene.AnimationStates[handle];
+		AdvanceAnimationState(animState, dt);
+		PlanAnimationState(animState, handle.GetIndex(), Scene.AnimationFrame, dt);
+		SharePoseCache(Scene, handle);
+	}
+}
+
+// shared states are left for ResolveSharedPoses, their source may not be done yet
+void ExecuteAnimationState(Scene::scene_animation_state_t& animState, u32 stateIndex, u32 frame, scene_animation_stats_t* stats) {
+	auto skeleton = &GetModelRenderData(animState.model)->skeleton;
+	auto bonesNum = skeleton->bones_num;
+	auto lod = animState.frame_lod;
+
+	if (animState.frame_update == ANIMATION_UPDATE_CULLED) {
+		stats->culled_states++;
+		stats->skipped_bones += bonesNum;
+		return;
+	}
+
+	auto next = animState.bone_buffers.elements + bonesNum * animState.lod_next_buffer;
+	auto previous = animState.bone_buffers.elements + bonesNum * (animState.lod_next_buffer ^ 1);
+	auto interpolated = animState.bone_buffers.elements + bonesNum * 2;
+
+	if (animState.frame_update == ANIMATION_UPDATE_INTERPOLATE) {
+		auto interval = animState.lod_interval;
+		auto blend = _mm_set1_ps((float)((frame + stateIndex) % interval) / interval);
+		for (auto b = 0u; b < bonesNum; ++b) {
+			for (auto i = 0u; i < 3; ++i) {
+				interpolated[b].columns[i] = _mm_add_ps(previous[b].columns[i], _mm_mul_ps(_mm_sub_ps(next[b].columns[i], previous[b].columns[i]), blend));
+			}
+		}
+
+		stats->interpolated_states++;
+		stats->skipped_bones += bonesNum;
+		return;
+	}
+
+	if (IsValid(animState.frame_source)) {
+		return;
+	}
+
+	EvaluateAnimationState(animState, animState.frame_lookahead, lod, next);
+	if (animState.frame_update == ANIMATION_UPDATE_RESET && animState.lod_interval > 1) {
+		memcpy(previous, next, sizeof(bone_transform_t) * bonesNum);
+	}
+
+	stats->evaluated_states++;
+	stats->evaluated_bones += skeleton->lod_bones_num[lod];
+	stats->skipped_bones += bonesNum - skeleton->lod_bones_num[lod];
+}
+
+// runs after every source is evaluated
+void ResolveSharedPoses(Scene& Scene, scene_animation_stats_t* stats) {
+	if (Scene.PoseCache.step <= 0.f) {
+		return;
+	}
+
+	for (auto& animState : Scene.AnimationStates) {
+		if (!IsValid(animState.frame_source)) {
+			continue;
+		}
+
+		auto bonesNum = GetModelRenderData(animState.model)->skeleton.bones_num;
+		auto source = EvaluatedBones(Scene.AnimationStates[animState.frame_source]);
+		auto next = animState.bone_buffers.elements + bonesNum * animState.lod_next_buffer;
+		auto previous = animState.bone_buffers.elements + bonesNum * (animState.lod_next_buffer ^ 1);
+
+		if (animState.lod_interval == 1) {
+			// nothing interpolates from it, the source buffer is drawn directly
+			animState.transformations = array_view<bone_transform_t>(source, bonesNum);
+		}
+		else {
+			memcpy(next, source, sizeof(bone_transform_t) * bonesNum);
+			if (animState.frame_update == ANIMATION_UPDATE_RESET) {
+				memcpy(previous, source, sizeof(bone_transform_t) * bonesNum);
+			}
+		}
+
+		stats->shared_states++;
+		stats->skipped_bones += bonesNum;
+	}
+}
+
+void UpdateAnimations(Scene& Scene, float dt) {
+	PlanAnimationUpdates(Scene, dt);
+
+	Scene.AnimationStats = {};
+	for (auto handle : Scene.AnimationStates.Keys()) {
+		ExecuteAnimationState(Scene.AnimationStates[handle], handle.GetIndex(), Scene.AnimationFrame, &Scene.AnimationStats);
+	}
+	ResolveSharedPoses(Scene, &Scene.AnimationStats);
+	Scene.AnimationFrame++;
 }
 
 struct ParallelUpdateAnimationsRange_Payload {
@@ -120,7 +699,7 @@ struct ParallelUpdateAnimationsRange_Payload {
 	animation_handle*	workspace;
 	u32				from;
 	u32				to;
-	float			dt;
+	scene_animation_stats_t	stats;
 };
 
 struct ParallelUpdateAnimationsRoot_Payload {
@@ -132,22 +711,14 @@ void ParallelUpdateAnimationsRange(const void* InArgs, Job*) {
 
 	auto Args = *(ParallelUpdateAnimationsRange_Payload*)InArgs;
 
-	auto dt = Args.dt;
+	auto frame = Args.pScene->AnimationFrame;
 
+	scene_animation_stats_t stats = {};
 	for (auto i : MakeRange(Args.from, Args.to)) {
-		auto& animState = Args.pScene->AnimationStates[Args.workspace[i]];
-		auto pRenderData = GetModelRenderData(animState.model);
-
-		float currentAnimTime = animState.state.last_time + dt;
-		animState.state.last_time += dt;
-
-		calculate_animation(
-			&pRenderData->skeleton,
-			&pRenderData->animations[animState.animation_index],
-			&animState.state,
-			currentAnimTime,
-			animState.transformations.elements);
+		ExecuteAnimationState(Args.pScene->AnimationStates[Args.workspace[i]], Args.workspace[i].GetIndex(), frame, &stats);
 	}
+	// read back by ParallelUpdateAnimations once all ranges are done
+	((ParallelUpdateAnimationsRange_Payload*)InArgs)->stats = stats;
 }
 
 void ParallelUpdateAnimationsRoot(const void* InArgs, Job* job) {
@@ -169,6 +740,9 @@ void ParallelUpdateAnimations(Scene& Scene, float dt) {
 	Array<animation_handle> workspace(GetMallocAllocator());
 	Reserve(workspace, 512);
 
+	// lods, times and shared poses are decided up front, range jobs only evaluate
+	PlanAnimationUpdates(Scene, dt);
+
 	for (auto animHandle : Scene.AnimationStates.Keys()) {
 		PushBack(workspace, animHandle);
 	}
@@ -183,7 +757,6 @@ void ParallelUpdateAnimations(Scene& Scene, float dt) {
 		payload.pScene = &Scene;
 		payload.from = i;
 		payload.to = min(N, i + animationsPerBatch);
-		payload.dt = dt;
 		payload.workspace = workspace.DataPtr;
 		PushBack(childWorkspaces, payload);
 	}
@@ -195,6 +768,17 @@ void ParallelUpdateAnimations(Scene& Scene, float dt) {
 	RunJobs(&rootJob, 1);
 
 	WaitFor(rootJob, true);
+
+	Scene.AnimationStats = {};
+	for (auto& range : childWorkspaces) {
+		Scene.AnimationStats.evaluated_states += range.stats.evaluated_states;
+		Scene.AnimationStats.interpolated_states += range.stats.interpolated_states;
+		Scene.AnimationStats.culled_states += range.stats.culled_states;
+		Scene.AnimationStats.evaluated_bones += range.stats.evaluated_bones;
+		Scene.AnimationStats.skipped_bones += range.stats.skipped_bones;
+	}
+	ResolveSharedPoses(Scene, &Scene.AnimationStats);
+	Scene.AnimationFrame++;
 }
 
 void UpdateScene(Scene &Scene, float dt) {
@@ -202,6 +786,98 @@ void UpdateScene(Scene &Scene, float dt) {
 	ParallelUpdateAnimations(Scene, dt);
 }
 
+// static entities draw instanced, skinned ones need their own bone constants
+bool IsEntityInstanced(scene_entity_t const& entity) {
+	return !IsValid(entity.animation) && IsValid(GetModelRenderData(entity.model)->instanced_vertex_layout);
+}
+
+struct scene_batch_match_t {
+	Scene*									scene;
+	Array<scene_entity_handle> const*		entities;
+};
+
+// batches are drawn with the model and path of their first entity, folded key ids can't be trusted for that
+bool IsSameSceneDraw(void* user, u32 firstItem, u32 item) {
+	auto match = (scene_batch_match_t*)user;
+	auto const& first = match->scene->Entities[(*match->entities)[firstItem]];
+	auto const& entity = match->scene->Entities[(*match->entities)[item]];
+	return first.model == entity.model && IsEntityInstanced(first) == IsEntityInstanced(entity);
+}
+
+// orders entities by pipeline, mesh and depth so that consecutive draws share most of their state
+// batches, when requested, are runs that can go out as one instanced draw
+void SortSceneDraws(Scene& Scene, xmmatrix view, Array<scene_entity_handle>& entities, Array<render_batch_t>* outBatches = nullptr) {
+	PROFILE_SCOPE(sort_scene_draws);
+
+	using namespace DirectX;
+
+	u32 N = (u32)Size(entities);
+	render_queue_t queue;
+	queue.keys = Array<u64>(GetThreadScratchAllocator());
+	queue.items = Array<u32>(GetThreadScratchAllocator());
+	Reserve(queue.keys, N);
+	Reserve(queue.items, N);
+
+	for (auto i : MakeRange(N)) {
+		auto entity = Scene.Entities[entities[i]];
+		auto renderData = GetModelRenderData(entity.model);
+
+		// same far plane as the scene projection
+		float depth = XMVectorGetZ(XMVector3TransformCoord(XMLoadFloat3((XMFLOAT3*)&entity.position), view)) / 1000.f;
+		auto layout = IsEntityInstanced(entity) ? renderData->instanced_vertex_layout : renderData->vertex_layout;
+		// models have no materials, their buffers are told apart by the mesh field
+		PushRenderItem(queue, MakeRenderSortKey(RENDER_PASS_OPAQUE, layout.GetIndex(), 0, entity.model.GetIndex(), depth), i);
+	}
+
+	SortRenderQueue(queue);
+	if (outBatches) {
+		scene_batch_match_t match;
+		match.scene = &Scene;
+		match.entities = &entities;
+		BuildRenderBatches(queue, MAX_INSTANCES_PER_DRAW, IsSameSceneDraw, &match, outBatches);
+	}
+
+	Array<scene_entity_handle> sorted(GetThreadScratchAllocator());
+	Resize(sorted, N);
+	for (auto i : MakeRange(N)) {
+		sorted[i] = entities[queue.items[i]];
+	}
+	memcpy(entities.DataPtr, sorted.DataPtr, sizeof(scene_entity_handle) * N);
+}
+
+void RenderSceneInstances(GPUCommandList* drawCmds, Scene& Scene, forward_render_scene_setup const* setup,
+	Array<scene_entity_handle> const& entities, Array<render_batch_t> const& batches) {
+	PROFILE_SCOPE(render_scene_instances);
+	GPU_PROFILE_SCOPE(drawCmds, render_scene_instances);
+
+	using namespace DirectX;
+
+	auto viewProjMatrix = XMMatrixTranspose(
+		setup->pcamera->GetViewMatrix()
+		* XMMatrixPerspectiveFovLH(3.14f * 0.25f, (float)GDisplaySettings.resolution.x / (float)GDisplaySettings.resolution.y, 0.01f, 1000.f));
+
+	SetRenderTarget(drawCmds, 0, GetRTV(setup->buffer));
+	SetDepthStencil(drawCmds, GetDSV(setup->depthbuffer));
+	SetViewport(drawCmds, (float)GDisplaySettings.resolution.x, (float)GDisplaySettings.resolution.y);
+	SetTopology(drawCmds, D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+
+	Array<instance_transform_t> instances(GetThreadScratchAllocator());
+	Reserve(instances, MAX_INSTANCES_PER_DRAW);
+
+	for (auto batch : batches) {
+		Resize(instances, batch.count);
+		for (auto i : MakeRange(batch.count)) {
+			PackInstanceTransform(&instances[i], GetEntityWorldMatrix(Scene.Entities[entities[batch.first + i]]));
+		}
+
+		auto model = Scene.Entities[entities[batch.first]].model;
+		SetShaderState(drawCmds, SHADER_(Model, VShaderInstanced, VS_5_1), SHADER_(Model, PShader, PS_5_1), GetModelRenderData(model)->instanced_vertex_layout);
+		SetConstant(drawCmds, TEXT_("ViewProj"), viewProjMatrix);
+
+		DrawModelInstances(drawCmds, model, instances.DataPtr, batch.count);
+	}
+}
+
 struct ParallelRenderSceneRange_Payload {
 	Array<scene_entity_handle>const*			pEntityHandles;
 	u32									from;
@@ -245,6 +921,8 @@ void ParallelRenderSceneRange(const void* InArgs, Job*) {
 	SetViewport(drawCmds, (float)GDisplaySettings.resolution.x, (float)GDisplaySettings.resolution.y);
 	SetTopology(drawCmds, D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
 
+	// entities come sorted, buffers and shaders only change between runs of the same model
+	model_handle prevModel = {};
 	for (auto i : MakeRange(Args.from, Args.to)) {
 		auto entity = Args.pScene->Entities[(*Args.pEntityHandles)[i]];
 
@@ -258,25 +936,29 @@ void ParallelRenderSceneRange(const void* InArgs, Job*) {
 
 		auto renderData = GetModelRenderData(entity.model);
 
-		buffer_location_t vb;
-		vb.address = GetResourceFast(renderData->vertex_buffer)->resource->GetGPUVirtualAddress();
-		vb.size = renderData->vertices_num * sizeof(mesh_vertex_t);
-		vb.stride = sizeof(mesh_vertex_t);
+		if (entity.model != prevModel) {
+			prevModel = entity.model;
+
+			buffer_location_t vb;
+			vb.address = GetResourceFast(renderData->vertex_buffer)->resource->GetGPUVirtualAddress();
+			vb.size = renderData->vertices_num * sizeof(mesh_vertex_t);
+			vb.stride = sizeof(mesh_vertex_t);
 
-		SetVertexStream(drawCmds, 0, vb);
+			SetVertexStream(drawCmds, 0, vb);
 
-		buffer_location_t ib;
-		ib.address = GetResourceFast(renderData->index_buffer)->resource->GetGPUVirtualAddress();
-		ib.size = renderData->indices_num * sizeof(u32);
-		ib.stride = sizeof(u32);
+			buffer_location_t ib;
+			ib.address = GetResourceFast(renderData->index_buffer)->resource->GetGPUVirtualAddress();
+			ib.size = renderData->indices_num * sizeof(u32);
+			ib.stride = sizeof(u32);
 
-		SetIndexBuffer(drawCmds, ib);
+			SetIndexBuffer(drawCmds, ib);
 
-		SetShaderState(drawCmds, SHADER_(Model, VShader, VS_5_1), SHADER_(Model, PShader, PS_5_1), renderData->vertex_layout);
+			SetShaderState(drawCmds, SHADER_(Model, VShader, VS_5_1), SHADER_(Model, PShader, PS_5_1), renderData->vertex_layout);
+		}
 
 		SetConstant(drawCmds, TEXT_("World"), worldMatrix);
 		auto transformations = Scene.AnimationStates[entity.animation].transformations;
-		SetConstant(drawCmds, TEXT_("BoneTransform"), transformations.elements, sizeof(xmmatrix) * transformations.num);
+		SetConstant(drawCmds, TEXT_("BoneTransform"), transformations.elements, sizeof(bone_transform_t) * transformations.num);
 
 		for (auto j : MakeRange(renderData->submeshes.num)) {
 			auto submesh = renderData->submeshes[j];
@@ -301,25 +983,47 @@ void ParallelRenderSceneRoot(const void* InArgs, Job* job) {
 void ParallelRenderScene(GPUQueue* queue, Scene &Scene, forward_render_scene_setup const* setup) {
 	PROFILE_SCOPE(render_scene);
 
+	using namespace DirectX;
+
+	auto viewProjMatrix = setup->pcamera->GetViewMatrix()
+		* XMMatrixPerspectiveFovLH(3.14f * 0.25f, (float)GDisplaySettings.resolution.x / (float)GDisplaySettings.resolution.y, 0.01f, 1000.f);
+
+	// render jobs only see what passed culling, in state order
 	Array<scene_entity_handle> workspace(GetMallocAllocator());
-	Reserve(workspace, 2048);
+	CullScene(Scene, viewProjMatrix, &workspace, true);
+	Array<render_batch_t> batches(GetMallocAllocator());
+	SortSceneDraws(Scene, setup->pcamera->GetViewMatrix(), workspace, &batches);
+
+	// static batches collapse into instanced draws, skinned entities keep a draw each
+	Array<render_batch_t> instancedBatches(GetMallocAllocator());
+	Array<scene_entity_handle> skinned(GetMallocAllocator());
+	for (auto batch : batches) {
+		if (IsEntityInstanced(Scene.Entities[workspace[batch.first]])) {
+			PushBack(instancedBatches, batch);
+		}
+		else {
+			Append(skinned, workspace.DataPtr + batch.first, batch.count);
+		}
+	}
 
-	for (auto entityHandle : Scene.Entities.Keys()) {
-		PushBack(workspace, entityHandle);
+	if (Size(instancedBatches)) {
+		auto instancesCmds = GetCommandList(queue, NAME_("RenderWork"));
+		RenderSceneInstances(instancesCmds, Scene, setup, workspace, instancedBatches);
+		Execute(instancesCmds);
 	}
 
 	const auto objectsPerBatch = 128;
 	Array<ParallelRenderSceneRange_Payload> childWorkspaces(GetMallocAllocator());
-	Reserve(childWorkspaces, Size(workspace) / objectsPerBatch + 1);
+	Reserve(childWorkspaces, Size(skinned) / objectsPerBatch + 1);
 
-	u32 N = (u32)Size(workspace);
+	u32 N = (u32)Size(skinned);
 	for (u32 i = 0; i < N; i += objectsPerBatch) {
 		ParallelRenderSceneRange_Payload payload = {};
 		payload.pScene = &Scene;
 		payload.from = i;
 		payload.to = min(N, i + objectsPerBatch);
 		payload.Setup = setup;
-		payload.pEntityHandles = &workspace;
+		payload.pEntityHandles = &skinned;
 		payload.CommandList = GetCommandList(queue, NAME_("RenderWork"));
 		PushBack(childWorkspaces, payload);
 	}
@@ -345,7 +1049,13 @@ void RenderScene(Scene &Scene, GPUCommandList* drawCmds, forward_render_scene_se
 
 	using namespace DirectX;
 
-	for (auto entity : Scene.Entities) {
+	Array<scene_entity_handle> visible(GetThreadScratchAllocator());
+	CullScene(Scene, setup->pcamera->GetViewMatrix()
+		* XMMatrixPerspectiveFovLH(3.14f * 0.25f, (float)GDisplaySettings.resolution.x / (float)GDisplaySettings.resolution.y, 0.01f, 1000.f), &visible);
+	SortSceneDraws(Scene, setup->pcamera->GetViewMatrix(), visible);
+
+	for (auto handle : visible) {
+		auto entity = Scene.Entities[handle];
 
 		auto worldMatrix = XMMatrixTranspose(
 			XMMatrixAffineTransformation(
@@ -370,7 +1080,7 @@ void RenderScene(Scene &Scene, GPUCommandList* drawCmds, forward_render_scene_se
 
 
 			auto transformations = Scene.AnimationStates[entity.animation].transformations;
-			SetConstant(drawCmds, TEXT_("BoneTransform"), transformations.elements, sizeof(xmmatrix) * transformations.num);
+			SetConstant(drawCmds, TEXT_("BoneTransform"), transformations.elements, sizeof(bone_transform_t) * transformations.num);
 			SetConstant(drawCmds, TEXT_("ViewProj"), viewProjMatrix);
 
 			buffer_location_t vb;
@@ -3,6 +3,9 @@
 #include "Commands.h"
 #include "Resources.h"
 #include "Model.h"
+#include "Hashmap.h"
+#include "DynamicBvh.h"
+#include "PoseCache.h"
 
 namespace Essence {
 
@@ -16,6 +19,25 @@ struct scene_entity_t {
 	float3				position;
 	float4				qrotation;
 	float3				scale;
+
+	u32					spatial_proxy;
+	bool				spatial_moved;		// queued in MovedEntities
+};
+
+struct scene_animation_stats_t {
+	u32		evaluated_states;
+	u32		interpolated_states;
+	u32		culled_states;
+	u32		shared_states;		// copied from a state with the same pose this frame
+	u32		evaluated_bones;
+	u32		skipped_bones;		// interpolated, shared, culled or frozen by lod
+};
+
+enum SceneAnimationUpdateEnum {
+	ANIMATION_UPDATE_CULLED,
+	ANIMATION_UPDATE_EVALUATE,
+	ANIMATION_UPDATE_RESET,			// evaluate and restart interpolation from the result
+	ANIMATION_UPDATE_INTERPOLATE
 };
 
 class Scene {
@@ -25,7 +47,29 @@ public:
 		model_handle									model;
 		u32												animation_index;
 		u32												use_counter;
-		array_view<DirectX::XMMATRIX>					transformations;
+		array_view<bone_transform_t>					transformations;	// copied as is to BoneTransform, points into bone_buffers
+		// two evaluated poses for lod interpolation followed by the interpolated one
+		array_view<bone_transform_t>					bone_buffers;
+		u32												lod_next_buffer;
+		u32												lod_interval;		// 0 until bone buffers hold an evaluated pose
+		u32												frame_lod;			// closest entity using the state this frame
+		u32												frame_update;		// SceneAnimationUpdateEnum
+		float											frame_lookahead;
+		animation_handle								frame_source;		// valid when another state evaluates the same pose this frame
+
+		// previous animation fading out while fade_elapsed < fade_duration
+		u32												fade_animation_index;
+		float											fade_time;
+		float											fade_elapsed;
+		float											fade_duration;
+
+		// layer on top of the result, active while weight > 0
+		u32												layer_animation_index;
+		float											layer_time;
+		float											layer_weight;
+		bool											layer_additive;
+		animation_mask_t								layer_mask;
+		animation_pose_t								layer_reference;	// start of additive layers
 	};
 
 	Freelist<scene_entity_t, scene_entity_handle>		Entities;
@@ -33,6 +77,23 @@ public:
 
 	u32													EntitiesNum;
 
+	// animation lod view, every state is updated at full rate when disabled
+	bool												AnimationLodEnabled;
+	frustum_t											AnimationLodFrustum;
+	float3												AnimationLodPosition;
+	u32													AnimationFrame;
+	scene_animation_stats_t								AnimationStats;
+	// states with the same model, animation, lod and quantized time evaluate once
+	pose_cache_t										PoseCache;
+
+	u32													VisibleEntitiesNum;	// passed culling in the last render
+
+	// loose world bounds of entities, leaves hold handle index
+	dynamic_bvh_t										EntitiesTree;
+	bool												EntitiesTreeInitialized;
+	Array<scene_entity_handle>							EntitiesTreeHandles;	// by handle index
+	Array<scene_entity_handle>							MovedEntities;			// applied to the tree in one batch by UpdateSceneSpatial
+
 	~Scene();
 };
 
@@ -44,12 +105,36 @@ void			SetPosition(Scene& Scene, scene_entity_handle entity, float3 position);
 void			KillEntity(Scene& Scene, scene_entity_handle entity);
 void			KillAnimation(Scene& Scene, scene_entity_handle entity);
 void			SetAnimation(Scene& Scene, scene_entity_handle entity, u32 index, float startTime = 0.f);
+void			CrossfadeAnimation(Scene& Scene, scene_entity_handle entity, u32 index, float duration, float startTime = 0.f);
+// additive layers apply their difference to their first frame, maskNode limits the layer to a subtree
+void			SetAnimationLayer(Scene& Scene, scene_entity_handle entity, u32 index, float weight, bool additive = false, u32 maskNode = 0);
 void			MirrorAnimation(Scene& Scene, scene_entity_handle dstEntity, scene_entity_handle srcEntity);
+// states get lod by projected size of their closest entity, entities outside the view don't animate
+void			SetAnimationLodView(Scene& Scene, xmmatrix viewProj, float3 viewPosition);
+void			DisableAnimationLod(Scene& Scene);
+// step in seconds, shared poses snap to it
+void			SetPoseCacheStep(Scene& Scene, float step);
 void			UpdateAnimations(Scene& Scene, float dt);
 void			UpdateScene(Scene &Scene, float dt);
 
 void			GetSceneAnimations(Scene* pScene, Array<animation_handle>* handlesAcc);
 
+struct scene_ray_hit_t {
+	scene_entity_handle	entity;
+	ray_hit_t			hit;	// primitive is the triangle of entity model
+};
+
+// moves entity proxies queued by SetPosition and SetScale, queries call it themselves
+void			UpdateSceneSpatial(Scene& Scene);
+// full rebuild of the entity tree, it otherwise rebuilds itself when its cost degrades
+void			BuildSceneBvh(Scene& Scene);
+bool			RaycastScene(Scene& Scene, ray_t const& ray, scene_ray_hit_t* outHit);
+// entities whose world bounds may touch the sphere, in no particular order
+void			QuerySceneSphere(Scene& Scene, float3 center, float radius, Array<scene_entity_handle>* outEntities);
+
+// entities whose model bounds intersect the view, in entity order
+void			CullScene(Scene& Scene, xmmatrix viewProj, Array<scene_entity_handle>* outVisible, bool parallel = false);
+
 struct forward_render_scene_setup {
 	viewport_t			viewport;
 	ICameraControler*	pcamera;
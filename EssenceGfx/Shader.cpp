@@ -6,29 +6,12 @@
 #include "Files.h"
 #include "Debug.h"
 #include "Commands.h"
+#include "ShaderCompiler.h"
+#include "ShaderCache.h"
+#include "ShaderPermutations.h"
 
 namespace Essence {
 
-struct shader_macro_t {
-	const char*	name;
-	const char* define;
-};
-
-struct ShaderDefines {
-	ShaderDefines() {}
-	ShaderDefines(std::initializer_list<shader_macro_t> macros) {
-		Array<shader_macro_t> list(GetThreadScratchAllocator());
-		Reserve(list, macros.size());
-		for (auto item : macros) {
-			PushBack(list, item);
-		}
-		quicksort(list.DataPtr, 0, Size(list), [](shader_macro_t a, shader_macro_t b) {
-			return strcmp(a.name, b.name) < 0;
-		});
-		
-	}
-};
-
 const char *GetProfileStr(ShaderProfileEnum profile) {
 	switch (profile) {
 	case VS_5_0:
@@ -47,25 +30,49 @@ const char *GetProfileStr(ShaderProfileEnum profile) {
 	return "";
 }
 
+bool GetProfileFromStr(const char* str, ShaderProfileEnum* outProfile) {
+	for (auto profile : { VS_5_0, VS_5_1, PS_5_0, PS_5_1, CS_5_0, CS_5_1 }) {
+		if (strcmp(GetProfileStr(profile), str) == 0) {
+			*outProfile = profile;
+			return true;
+		}
+	}
+	return false;
+}
+
+// no padding, hashed as bytes
 struct shader_key_t {
 	ResourceNameId		file;
 	TextId				function;
 	ShaderProfileEnum	profile;
+	u32					permutation;
 };
 
 struct shader_record_t {
-	shader_key_t		key;
-	shader_metadata_t	metadata;
+	shader_key_t			key;
+	shader_metadata_t		metadata;
+	shader_compile_handle	compile;	// last requested, done once the service lets it go
+	shader_reflection_t		reflection;
 };
 
-void Compile(shader_handle handle, shader_key_t const& desc);
-
 Hashmap<shader_key_t, shader_handle>		ShadersIndex;
+// same as the index, read without the lock
+permutation_table_t							ShadersLookup;
+Hashmap<u64, shader_features_t>				FeaturesIndex;
 Freelist<shader_record_t, shader_handle>	ShadersTable;
 Array<shader_bytecode_t>					ShadersFastData;
 RWLock										ReadWriteLock;
 
 IAllocator*									BytecodeAllocator = GetMallocAllocator();
+shader_compile_service_t					CompileService;
+shader_cache_t								BytecodeCache;
+shader_include_graph_t						ShaderIncludes;
+
+const u64 BYTECODE_CACHE_BUDGET = 128ull << 20;
+
+bool	CompileCached(void* user, shader_compile_desc_t const& desc, IAllocator* allocator, shader_compile_output_t* output);
+bool	CompileWithD3D(void* user, shader_compile_desc_t const& desc, IAllocator* allocator, shader_compile_output_t* output);
+void	PublishShader(void* user, u64 key, shader_compile_output_t const& output);
 
 shader_handle		Create(shader_key_t const& key) {
 	auto handle = Create(ShadersTable);
@@ -82,85 +89,207 @@ shader_handle		Create(shader_key_t const& key) {
 	return handle;
 }
 
-shader_handle		GetShader(ResourceNameId file, TextId function, ShaderProfileEnum profile) {
+void*	Copy(IAllocator* allocator, const void* src, u64 bytesize) {
+	auto dst = allocator->Allocate(bytesize, 1);
+	memcpy(dst, src, bytesize);
+	return dst;
+}
+
+u64		GetFeaturesKey(ResourceNameId file, TextId function) {
+	return Hash::Combine_64(file.key, function.index);
+}
+
+u64		GetCompileKey(shader_handle handle) {
+	return ((u64)handle.GetGeneration() << 32) | handle.GetIndex();
+}
+
+shader_handle	GetCompiledShader(u64 key) {
+	shader_handle handle;
+	handle.index = (u32)key;
+	handle.generation = (u32)(key >> 32);
+	return handle;
+}
+
+// cache file is read here once, not under the table lock on the first request
+void	InitShaders() {
+	InitShaderCache(&BytecodeCache, MakeFileCacheStorage("shaders.cache"), BYTECODE_CACHE_BUDGET);
+	LoadShaderCache(&BytecodeCache);
+	InitShaderCompileService(&CompileService, { nullptr, CompileCached }, BytecodeAllocator, PublishShader, nullptr);
+}
+
+// under exclusive lock, only queues the work
+void	RequestCompile(shader_handle handle) {
+	Check(CompileService.compiler.compile);
+
+	auto& record = ShadersTable[handle];
+	auto file = GetString(record.key.file);
+	auto function = GetString(record.key.function);
+
+	shader_macro_t defines[MAX_SHADER_FEATURES];
+	shader_compile_desc_t desc;
+	desc.file = file;
+	desc.function = function;
+	desc.profile = GetProfileStr(record.key.profile);
+	desc.defines = defines;
+	desc.defines_num = 0;
+	if (record.key.permutation) {
+		auto features = Get(FeaturesIndex, GetFeaturesKey(record.key.file, record.key.function));
+		desc.defines_num = GetPermutationDefines(*features, record.key.permutation, defines);
+	}
+	record.compile = RequestShaderCompile(&CompileService, GetCompileKey(handle), desc);
+}
+
+void	DeclareShaderFeatures(ResourceNameId file, TextId function, std::initializer_list<const char*> features) {
+	Check(features.size() <= MAX_SHADER_FEATURES);
+
+	ReadWriteLock.LockExclusive();
+
+	auto declared = Get(FeaturesIndex, GetFeaturesKey(file, function));
+	if (declared) {
+		// permutations already made mean the bits can't change
+		Check(declared->num == features.size());
+		u32 bit = 0;
+		for (auto name : features) {
+			Check(strcmp(declared->names[bit++], name) == 0);
+		}
+	}
+	else {
+		shader_features_t copy = {};
+		for (auto name : features) {
+			copy.names[copy.num++] = (const char*)Copy(BytecodeAllocator, name, strlen(name) + 1);
+		}
+		Set(FeaturesIndex, GetFeaturesKey(file, function), copy);
+	}
+
+	ReadWriteLock.UnlockExclusive();
+}
+
+// under lock
+bool	IsPermutationDeclared(shader_key_t const& key) {
+	if (!key.permutation) {
+		return true;
+	}
+	auto features = Get(FeaturesIndex, GetFeaturesKey(key.file, key.function));
+	return features && (features->num == MAX_SHADER_FEATURES || (key.permutation >> features->num) == 0);
+}
+
+u32		GetHandleBits(shader_handle handle) {
+	u32 bits;
+	memcpy(&bits, &handle, sizeof(bits));
+	return bits;
+}
+
+shader_handle	GetHandleFromBits(u32 bits) {
+	shader_handle handle;
+	memcpy(&handle, &bits, sizeof(handle));
+	return handle;
+}
+
+shader_handle		GetShaderAsync(ResourceNameId file, TextId function, ShaderProfileEnum profile, u32 permutation) {
 	shader_key_t key;
 	key.file = file;
 	key.function = function;
 	key.profile = profile;
+	key.permutation = permutation;
 
-	ReadWriteLock.LockShared();
+	u64 lookupKey = Hash::MurmurHash2_64(&key, sizeof(key), 0);
+	u32 handleBits;
+	if (FindPermutation(ShadersLookup, lookupKey, &handleBits)) {
+		return GetHandleFromBits(handleBits);
+	}
 
+	ReadWriteLock.LockExclusive();
+
+	// could have been added since the lookup
 	auto handlePtr = Get(ShadersIndex, key);
 	if (handlePtr) {
 		auto handle = *handlePtr;
-		ReadWriteLock.UnlockShared();
+		ReadWriteLock.UnlockExclusive();
 		return handle;
 	}
-	ReadWriteLock.UnlockShared();
-	ReadWriteLock.LockExclusive();
 
-	auto handle = Create(key);
+	Check(IsPermutationDeclared(key));
 
-	Compile(handle, key);
+	auto handle = Create(key);
+	RequestCompile(handle);
+	InsertPermutation(&ShadersLookup, lookupKey, GetHandleBits(handle));
 
 	ReadWriteLock.UnlockExclusive();
 
 	return handle;
 }
 
+void				WaitForShader(shader_handle shader) {
+	// compiled before, nothing to wait for or lock
+	if (GetShaderBytecode(shader).bytecode) {
+		return;
+	}
+
+	shader_compile_handle compile;
+	{
+		ReaderScope readScope(&ReadWriteLock);
+		compile = ShadersTable[shader].compile;
+	}
+	WaitForShaderCompile(&CompileService, compile);
+}
+
+shader_handle		GetShader(ResourceNameId file, TextId function, ShaderProfileEnum profile, u32 permutation) {
+	auto handle = GetShaderAsync(file, function, profile, permutation);
+	WaitForShader(handle);
+	return handle;
+}
+
 shader_bytecode_t	GetShaderBytecode(shader_handle shader) {
 	Check(Contains(ShadersTable, shader));
 	return ShadersFastData[shader.GetIndex()];
 }
 
 AString	GetShaderDisplayString(shader_handle shader) {
-	return Format("%s:%s()", (cstr)GetString(ShadersTable[shader].key.file), (cstr)GetString(ShadersTable[shader].key.function));
-}
-
-void*	Copy(IAllocator* allocator, const void* src, u64 bytesize) {
-	auto dst = allocator->Allocate(bytesize, 1);
-	memcpy(dst, src, bytesize);
-	return dst;
+	auto const& key = ShadersTable[shader].key;
+	if (key.permutation) {
+		return Format("%s:%s()[%08x]", (cstr)GetString(key.file), (cstr)GetString(key.function), key.permutation);
+	}
+	return Format("%s:%s()", (cstr)GetString(key.file), (cstr)GetString(key.function));
 }
 
-void Compile(shader_handle handle, shader_key_t const& desc) {
+bool CompileWithD3D(void* user, shader_compile_desc_t const& desc, IAllocator* allocator, shader_compile_output_t* output) {
 	ID3DBlob *codeBlob = nullptr;
 	ID3DBlob *errBlob = nullptr;
 
-	auto shaderCode = ReadEntireFile(GetString(desc.file));
+	auto shaderCode = ReadEntireFile(desc.file);
 
-	auto compileHresult = D3DCompile2(shaderCode.data_ptr, shaderCode.bytesize, GetString(desc.file), nullptr, D3D_COMPILE_STANDARD_FILE_INCLUDE, GetString(desc.function), GetProfileStr(desc.profile),
-		0, 0, 0, nullptr, 0, &codeBlob, &errBlob);
-
-	Check(Contains(ShadersTable, handle));
+	D3D_SHADER_MACRO macros[MAX_SHADER_FEATURES + 1] = {};
+	Check(desc.defines_num <= MAX_SHADER_FEATURES);
+	for (u32 i = 0; i < desc.defines_num; ++i) {
+		macros[i].Name = desc.defines[i].name;
+		macros[i].Definition = desc.defines[i].definition;
+	}
 
-	auto& record = ShadersTable[handle];
-	auto& fast = ShadersFastData[handle.GetIndex()];
+	auto compileHresult = D3DCompile2(shaderCode.data_ptr, shaderCode.bytesize, desc.file, macros, D3D_COMPILE_STANDARD_FILE_INCLUDE, desc.function, desc.profile,
+		0, 0, 0, nullptr, 0, &codeBlob, &errBlob);
 
 	if (codeBlob != nullptr) {
-		if (fast.bytecode) {
-			BytecodeAllocator->Free(fast.bytecode);
-			fast = {};
-
-			record.metadata.recompiled = 1;
-		}
-
-		fast.bytecode = Copy(BytecodeAllocator, codeBlob->GetBufferPointer(), codeBlob->GetBufferSize());
-		fast.bytesize = codeBlob->GetBufferSize();
-		fast.bytecode_hash = Hash::MurmurHash2_64(fast.bytecode, (i32)codeBlob->GetBufferSize(), 0);
-
+		output->bytecode = Copy(allocator, codeBlob->GetBufferPointer(), codeBlob->GetBufferSize());
+		output->bytesize = codeBlob->GetBufferSize();
 
 		ID3D12ShaderReflection* pReflection;
-		VerifyHr(D3DReflect(fast.bytecode, fast.bytesize, IID_PPV_ARGS(&pReflection)));
+		VerifyHr(D3DReflect(output->bytecode, output->bytesize, IID_PPV_ARGS(&pReflection)));
 
 		D3D12_SHADER_DESC shaderDesc;
 		VerifyHr(pReflection->GetDesc(&shaderDesc));
 
+		output->reflection.constant_buffers = shaderDesc.ConstantBuffers;
+		output->reflection.bound_resources = shaderDesc.BoundResources;
+		output->reflection.input_parameters = shaderDesc.InputParameters;
+		output->reflection.output_parameters = shaderDesc.OutputParameters;
+		output->reflection.instructions = shaderDesc.InstructionCount;
+		pReflection->GetThreadGroupSize(&output->reflection.thread_group[0], &output->reflection.thread_group[1], &output->reflection.thread_group[2]);
+
 		ComRelease(pReflection);
 	}
 
 	if (errBlob != nullptr) {
-		auto shaderString = Format("%s(%s)", (const char*)GetString(desc.file), (const char*)GetString(desc.function));
+		auto shaderString = Format("%s(%s)", desc.file, desc.function);
 
 		if (codeBlob != nullptr) {
 			debugf(Format("%s compilation warnings!\n%s", (const char*)shaderString, (char*)errBlob->GetBufferPointer()));
@@ -172,8 +301,56 @@ void Compile(shader_handle handle, shader_key_t const& desc) {
 
 	FreeMemory(shaderCode);
 
+	bool compiled = codeBlob != nullptr;
 	ComRelease(codeBlob);
 	ComRelease(errBlob);
+
+	return compiled;
+}
+
+// bytecode of sources seen before comes from disk, the include graph learns what each root pulls in
+bool CompileCached(void* user, shader_compile_desc_t const& desc, IAllocator* allocator, shader_compile_output_t* output) {
+	shader_sources_t sources;
+	GatherShaderSources(MakeFileSourceReader(), desc.file, &sources);
+	TrackShaderSources(&ShaderIncludes, sources);
+	u64 key = GetShaderCacheKey(sources, desc, D3D_COMPILER_VERSION);
+	FreeShaderSources(&sources);
+
+	if (FindCachedShader(&BytecodeCache, key, allocator, output)) {
+		return true;
+	}
+	if (!CompileWithD3D(user, desc, allocator, output)) {
+		return false;
+	}
+	StoreCachedShader(&BytecodeCache, key, *output);
+	return true;
+}
+
+// failed compile keeps the previous bytecode
+void PublishShader(void* user, u64 key, shader_compile_output_t const& output) {
+	u64 bytecodeHash = output.bytecode ? Hash::MurmurHash2_64(output.bytecode, (i32)output.bytesize, 0) : 0;
+	auto handle = GetCompiledShader(key);
+
+	ReadWriteLock.LockExclusive();
+
+	Check(Contains(ShadersTable, handle));
+
+	auto& record = ShadersTable[handle];
+	auto& fast = ShadersFastData[handle.GetIndex()];
+
+	if (output.bytecode) {
+		if (fast.bytecode) {
+			BytecodeAllocator->Free(fast.bytecode);
+			record.metadata.recompiled = 1;
+		}
+
+		fast.bytecode = output.bytecode;
+		fast.bytesize = output.bytesize;
+		fast.bytecode_hash = bytecodeHash;
+		record.reflection = output.reflection;
+	}
+
+	ReadWriteLock.UnlockExclusive();
 }
 
 shader_metadata_t	GetShaderMetadata(shader_handle shader) {
@@ -181,15 +358,41 @@ shader_metadata_t	GetShaderMetadata(shader_handle shader) {
 	return ShadersTable[shader].metadata;
 }
 
+shader_reflection_t	GetShaderReflection(shader_handle shader) {
+	ReaderScope readScope(&ReadWriteLock);
+	return ShadersTable[shader].reflection;
+}
+
+void GetRecompiledShaders(Array<shader_handle>* outShaders) {
+	ReaderScope readScope(&ReadWriteLock);
+	for (auto kv : ShadersIndex) {
+		if (ShadersTable[kv.value].metadata.recompiled) {
+			PushBack(*outShaders, kv.value);
+		}
+	}
+}
+
+// recompiles shaders whose file or any of its includes changed
 void ReloadShaders() {
+	Array<u64> changedFiles(GetThreadScratchAllocator());
+	FindChangedShaderRoots(&ShaderIncludes, MakeFileSourceReader(), &changedFiles);
+
 	ReadWriteLock.LockExclusive();
 
 	for (auto kv : ShadersIndex) {
-		Compile(kv.value, kv.key);
+		auto fileHash = GetShaderPathHash(GetString(kv.key.file));
+		for (auto changed : changedFiles) {
+			if (changed == fileHash) {
+				RequestCompile(kv.value);
+				break;
+			}
+		}
 	}
 
 	ReadWriteLock.UnlockExclusive();
 
+	WaitForShaderCompiles(&CompileService);
+
 	FlushShaderChanges();
 
 	ReadWriteLock.LockExclusive();
@@ -201,12 +404,82 @@ void ReloadShaders() {
 	ReadWriteLock.UnlockExclusive();
 }
 
+bool SaveShaderPermutationList(const char* path) {
+	Array<char> text;
+	{
+		ReaderScope readScope(&ReadWriteLock);
+		for (auto kv : ShadersIndex) {
+			auto file = GetString(kv.key.file);
+			auto function = GetString(kv.key.function);
+
+			shader_permutation_entry_t entry;
+			entry.file = file;
+			entry.function = function;
+			entry.profile = GetProfileStr(kv.key.profile);
+			entry.permutation = kv.key.permutation;
+			WriteShaderPermutationList(&entry, 1, &text);
+		}
+	}
+	bool written = WriteEntireFile(path, text.DataPtr, Size(text));
+	FreeMemory(text);
+	return written;
+}
+
+void PrecompileShaders(const char* path) {
+	auto read = ReadEntireFile(path);
+	if (read.result != Success) {
+		return;
+	}
+
+	Array<shader_permutation_entry_t> entries;
+	Array<char> strings;
+	// read adds a terminating zero
+	ParseShaderPermutationList((const char*)read.data_ptr, read.bytesize - 1, &entries, &strings);
+	FreeMemory(read);
+
+	for (auto const& entry : entries) {
+		shader_key_t key;
+		key.file = NAME_(entry.file);
+		key.function = TEXT_(entry.function);
+		key.permutation = entry.permutation;
+		if (!GetProfileFromStr(entry.profile, &key.profile)) {
+			continue;
+		}
+
+		// list can be older than the feature declarations
+		bool declared;
+		{
+			ReaderScope readScope(&ReadWriteLock);
+			declared = IsPermutationDeclared(key);
+		}
+		if (declared) {
+			GetShaderAsync(key.file, key.function, key.profile, key.permutation);
+		}
+	}
+
+	FreeMemory(entries);
+	FreeMemory(strings);
+}
+
 void FreeShadersMemory() {
+	FreeShaderCompileService(&CompileService);
+	SaveShaderCache(&BytecodeCache);
+	FreeShaderCache(&BytecodeCache);
+	FreeShaderIncludeGraph(&ShaderIncludes);
+
 	for (auto &f : ShadersFastData) {
 		BytecodeAllocator->Free(f.bytecode);
 	}
 
+	for (auto kv : FeaturesIndex) {
+		for (u32 i = 0; i < kv.value.num; ++i) {
+			BytecodeAllocator->Free((void*)kv.value.names[i]);
+		}
+	}
+
 	FreeMemory(ShadersIndex);
+	FreePermutationTable(&ShadersLookup);
+	FreeMemory(FeaturesIndex);
 	FreeMemory(ShadersTable);
 	FreeMemory(ShadersFastData);
 }
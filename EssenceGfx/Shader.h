@@ -3,11 +3,14 @@
 #include "Essence.h"
 #include "Freelist.h"
 #include "Hash.h"
+#include "ShaderCompiler.h"
 
 #pragma comment(lib,"d3dcompiler.lib")
 #include <d3d12.h>
 
 #define SHADER_(FILE, FUNC, PROFILE) Essence::GetShader(NAME_("shaders/" #FILE ".hlsl"), TEXT_(#FUNC), PROFILE)
+#define SHADER_PERMUTATION_(FILE, FUNC, PROFILE, PERMUTATION) Essence::GetShader(NAME_("shaders/" #FILE ".hlsl"), TEXT_(#FUNC), PROFILE, PERMUTATION)
+#define SHADER_FEATURES_(FILE, FUNC, ...) Essence::DeclareShaderFeatures(NAME_("shaders/" #FILE ".hlsl"), TEXT_(#FUNC), { __VA_ARGS__ })
 
 namespace Essence {
 
@@ -32,12 +35,31 @@ struct shader_metadata_t {
 	u32		recompiled : 1;
 };
 
-shader_handle		GetShader(ResourceNameId file, TextId function, ShaderProfileEnum profile);
+// loads the bytecode cache and starts the compile service, before any shader is asked for
+void				InitShaders();
+
+// bit i of a permutation defines the i-th feature name as 1, declare before asking for permutations
+// declaring again is fine as long as the names stay the same
+void				DeclareShaderFeatures(ResourceNameId file, TextId function, std::initializer_list<const char*> features);
+
+// waits for the compile, other compiles keep running while it does
+// shaders asked for before are found without locking
+shader_handle		GetShader(ResourceNameId file, TextId function, ShaderProfileEnum profile, u32 permutation = 0);
+// only queues the compile, bytecode is there after WaitForShader
+shader_handle		GetShaderAsync(ResourceNameId file, TextId function, ShaderProfileEnum profile, u32 permutation = 0);
+void				WaitForShader(shader_handle shader);
 shader_bytecode_t	GetShaderBytecode(shader_handle shader);
 AString				GetShaderDisplayString(shader_handle shader);
 shader_metadata_t	GetShaderMetadata(shader_handle shader);
+shader_reflection_t	GetShaderReflection(shader_handle shader);
+// shaders flagged by the last reload, valid until it finishes
+void				GetRecompiledShaders(Array<shader_handle>* outShaders);
 
 void ReloadShaders();
+// every shader asked for so far, one per line
+bool SaveShaderPermutationList(const char* path);
+// queues compiles of a saved list without waiting, entries with undeclared features are skipped
+void PrecompileShaders(const char* path);
 void FreeShadersMemory();
 
 }
\ No newline at end of file
@@ -0,0 +1,405 @@
+#include "ShaderCache.h"
+#include "Essence.h"
+#include "Hash.h"
+#include "Files.h"
+#include "Algorithms.h"
+
+namespace Essence {
+
+const u32 SHADER_CACHE_MAGIC = 0x43485345;	// ESHC
+const u32 SHADER_CACHE_FORMAT = 1;
+
+static_assert(sizeof(cached_shader_t) == 64, "cached_shader_t is written as is");
+
+// followed by entries with offsets from the blobs start, then blobs
+struct shader_cache_header_t {
+	u32		magic;
+	u32		format;
+	u64		session;
+	u64		checksum;	// of everything after the header
+	u32		entries_num;
+	u32		_reserved;
+	u64		blobs_bytesize;
+};
+
+bool ReadSourceFile(void* user, const char* path, Array<u8>* outData) {
+	auto read = ReadEntireFile(path);
+	if (read.result != Success) {
+		return false;
+	}
+	// read adds a terminating zero
+	Resize(*outData, read.bytesize - 1);
+	memcpy(outData->DataPtr, read.data_ptr, read.bytesize - 1);
+	FreeMemory(read);
+	return true;
+}
+
+shader_source_reader_t MakeFileSourceReader() {
+	shader_source_reader_t reader;
+	reader.user = nullptr;
+	reader.read = ReadSourceFile;
+	return reader;
+}
+
+u64 GetShaderPathHash(const char* path) {
+	return Hash::MurmurHash2_64(path, strlen(path), 0);
+}
+
+bool IsIncludeSpace(char c) {
+	return c == ' ' || c == '\t';
+}
+
+// calls back with names of #include "name" and #include <name>, comments aren't skipped
+template<typename F>
+void ScanIncludes(const char* text, u64 length, F&& onInclude) {
+	const char* end = text + length;
+	const char* line = text;
+	while (line < end) {
+		auto c = line;
+		while (c < end && IsIncludeSpace(*c)) {
+			++c;
+		}
+		if (c < end && *c == '#') {
+			++c;
+			while (c < end && IsIncludeSpace(*c)) {
+				++c;
+			}
+			const u64 directiveLen = sizeof("include") - 1;
+			if ((u64)(end - c) > directiveLen && strncmp(c, "include", directiveLen) == 0) {
+				c += directiveLen;
+				while (c < end && IsIncludeSpace(*c)) {
+					++c;
+				}
+				if (c < end && (*c == '"' || *c == '<')) {
+					char closing = *c == '"' ? '"' : '>';
+					auto nameStart = ++c;
+					while (c < end && *c != closing && *c != '\n') {
+						++c;
+					}
+					if (c < end && *c == closing) {
+						onInclude(nameStart, (u64)(c - nameStart));
+					}
+				}
+			}
+		}
+		while (line < end && *line != '\n') {
+			++line;
+		}
+		++line;
+	}
+}
+
+void AddShaderSource(shader_sources_t* sources, const char* dir, u64 dirLen, const char* name, u64 nameLen) {
+	Array<char> path(GetThreadScratchAllocator());
+	Append(path, dir, dirLen);
+	Append(path, name, nameLen);
+	PushBack(path, '\0');
+
+	auto pathHash = GetShaderPathHash(path.DataPtr);
+	for (auto known : sources->path_hashes) {
+		if (known == pathHash) {
+			return;
+		}
+	}
+	PushBack(sources->path_hashes, pathHash);
+	PushBack(sources->content_hashes, (u64)0);
+	PushBack(sources->path_offsets, (u32)Size(sources->paths));
+	Append(sources->paths, path.DataPtr, Size(path));
+}
+
+void GatherShaderSources(shader_source_reader_t reader, const char* file, shader_sources_t* outSources) {
+	Clear(outSources->path_hashes);
+	Clear(outSources->content_hashes);
+	Clear(outSources->path_offsets);
+	Clear(outSources->paths);
+
+	AddShaderSource(outSources, "", 0, file, strlen(file));
+
+	Array<u8> text(GetThreadScratchAllocator());
+	Array<char> dir(GetThreadScratchAllocator());
+	// grows while walked, each file gets read once
+	for (u32 i = 0; i < Size(outSources->path_hashes); ++i) {
+		Clear(text);
+		if (!reader.read(reader.user, outSources->paths.DataPtr + outSources->path_offsets[i], &text)) {
+			continue;
+		}
+		// an empty file still differs from a missing one
+		outSources->content_hashes[i] = Hash::Combine_64(Hash::MurmurHash2_64(text.DataPtr, Size(text), 0), 1);
+
+		const char* path = outSources->paths.DataPtr + outSources->path_offsets[i];
+		u64 dirLen = 0;
+		for (u64 c = 0; path[c]; ++c) {
+			if (path[c] == '/' || path[c] == '\\') {
+				dirLen = c + 1;
+			}
+		}
+		Clear(dir);
+		Append(dir, path, dirLen);
+
+		ScanIncludes((const char*)text.DataPtr, Size(text), [&](const char* name, u64 nameLen) {
+			AddShaderSource(outSources, dir.DataPtr, Size(dir), name, nameLen);
+		});
+	}
+}
+
+void FreeShaderSources(shader_sources_t* sources) {
+	FreeMemory(sources->path_hashes);
+	FreeMemory(sources->content_hashes);
+	FreeMemory(sources->path_offsets);
+	FreeMemory(sources->paths);
+}
+
+u64 GetShaderCacheKey(shader_sources_t const& sources, shader_compile_desc_t const& desc, u64 compilerVersion) {
+	u64 key = Hash::Combine_64(compilerVersion, SHADER_CACHE_FORMAT);
+	key = Hash::Combine_64(key, Hash::MurmurHash2_64(desc.function, strlen(desc.function), 0));
+	key = Hash::Combine_64(key, Hash::MurmurHash2_64(desc.profile, strlen(desc.profile), 0));
+	for (u32 i = 0; i < desc.defines_num; ++i) {
+		key = Hash::Combine_64(key, Hash::MurmurHash2_64(desc.defines[i].name, strlen(desc.defines[i].name), 0));
+		key = Hash::Combine_64(key, Hash::MurmurHash2_64(desc.defines[i].definition, strlen(desc.defines[i].definition), 0));
+	}
+	for (u32 i = 0; i < Size(sources.path_hashes); ++i) {
+		key = Hash::Combine_64(key, sources.path_hashes[i]);
+		key = Hash::Combine_64(key, sources.content_hashes[i]);
+	}
+	return key;
+}
+
+void InitShaderCache(shader_cache_t* cache, cache_storage_t storage, u64 budget) {
+	cache->storage = storage;
+	cache->budget = budget;
+	cache->session = 1;
+	Clear(cache->entry_by_key);
+	Clear(cache->entries);
+	Clear(cache->blobs);
+	cache->dirty = false;
+}
+
+void FreeShaderCache(shader_cache_t* cache) {
+	FreeMemory(cache->entry_by_key);
+	FreeMemory(cache->entries);
+	FreeMemory(cache->blobs);
+}
+
+// anything off leaves the cache empty, it refills as shaders compile
+bool ParseShaderCache(shader_cache_t* cache, Array<u8> const& data) {
+	if (Size(data) < sizeof(shader_cache_header_t)) {
+		return false;
+	}
+	shader_cache_header_t header;
+	memcpy(&header, data.DataPtr, sizeof(header));
+	if (header.magic != SHADER_CACHE_MAGIC || header.format != SHADER_CACHE_FORMAT) {
+		return false;
+	}
+
+	u64 entriesBytesize = (u64)header.entries_num * sizeof(cached_shader_t);
+	if (Size(data) != sizeof(header) + entriesBytesize + header.blobs_bytesize) {
+		return false;
+	}
+	auto payload = data.DataPtr + sizeof(header);
+	if (Hash::MurmurHash2_64(payload, entriesBytesize + header.blobs_bytesize, 0) != header.checksum) {
+		return false;
+	}
+
+	Resize(cache->entries, header.entries_num);
+	memcpy(cache->entries.DataPtr, payload, entriesBytesize);
+	Resize(cache->blobs, header.blobs_bytesize);
+	memcpy(cache->blobs.DataPtr, payload + entriesBytesize, header.blobs_bytesize);
+
+	for (u32 i = 0; i < header.entries_num; ++i) {
+		auto const& entry = cache->entries[i];
+		if (entry.offset + entry.bytesize > header.blobs_bytesize) {
+			Clear(cache->entries);
+			Clear(cache->blobs);
+			Clear(cache->entry_by_key);
+			return false;
+		}
+		Set(cache->entry_by_key, entry.key, i);
+	}
+	cache->session = header.session + 1;
+	return true;
+}
+
+bool LoadShaderCache(shader_cache_t* cache) {
+	Array<u8> data;
+	bool loaded = cache->storage.read(cache->storage.user, &data) && ParseShaderCache(cache, data);
+	FreeMemory(data);
+	return loaded;
+}
+
+bool FindCachedShader(shader_cache_t* cache, u64 key, IAllocator* allocator, shader_compile_output_t* output) {
+	ScopeLock lock(&cache->lock);
+	auto index = Get(cache->entry_by_key, key);
+	if (!index) {
+		return false;
+	}
+	auto& entry = cache->entries[*index];
+	entry.last_use = cache->session;
+
+	output->bytecode = allocator->Allocate(entry.bytesize, 1);
+	output->bytesize = entry.bytesize;
+	output->reflection = entry.reflection;
+	memcpy(output->bytecode, cache->blobs.DataPtr + entry.offset, entry.bytesize);
+	return true;
+}
+
+void StoreCachedShader(shader_cache_t* cache, u64 key, shader_compile_output_t const& output) {
+	Check(output.bytecode);
+	Check(output.bytesize <= 0xFFFFFFFF);
+
+	ScopeLock lock(&cache->lock);
+	// same address, same bytecode
+	auto index = Get(cache->entry_by_key, key);
+	if (index) {
+		cache->entries[*index].last_use = cache->session;
+		return;
+	}
+
+	cached_shader_t entry = {};
+	entry.key = key;
+	entry.last_use = cache->session;
+	entry.offset = Size(cache->blobs);
+	entry.bytesize = (u32)output.bytesize;
+	entry.reflection = output.reflection;
+	Append(cache->blobs, (const u8*)output.bytecode, output.bytesize);
+
+	Set(cache->entry_by_key, key, (u32)Size(cache->entries));
+	PushBack(cache->entries, entry);
+	cache->dirty = true;
+}
+
+bool SaveShaderCache(shader_cache_t* cache) {
+	ScopeLock lock(&cache->lock);
+	if (!cache->dirty) {
+		return true;
+	}
+
+	// most recent first, the tail past the budget goes
+	Array<cached_shader_t> kept;
+	Append(kept, cache->entries.DataPtr, Size(cache->entries));
+	quicksort(kept.DataPtr, 0, Size(kept), [](cached_shader_t const& a, cached_shader_t const& b) {
+		return a.last_use > b.last_use;
+	});
+	u64 blobsBytesize = 0;
+	u32 entriesNum = 0;
+	while (entriesNum < Size(kept) && blobsBytesize + kept[entriesNum].bytesize <= cache->budget) {
+		blobsBytesize += kept[entriesNum].bytesize;
+		++entriesNum;
+	}
+	u64 entriesBytesize = entriesNum * sizeof(cached_shader_t);
+
+	Array<u8> data;
+	Resize(data, sizeof(shader_cache_header_t) + entriesBytesize + blobsBytesize);
+	auto payload = data.DataPtr + sizeof(shader_cache_header_t);
+	auto outEntries = (cached_shader_t*)payload;
+	auto outBlobs = payload + entriesBytesize;
+
+	u64 offset = 0;
+	for (u32 i = 0; i < entriesNum; ++i) {
+		auto entry = kept[i];
+		memcpy(outBlobs + offset, cache->blobs.DataPtr + entry.offset, entry.bytesize);
+		entry.offset = offset;
+		memcpy(outEntries + i, &entry, sizeof(entry));
+		offset += entry.bytesize;
+	}
+
+	shader_cache_header_t header = {};
+	header.magic = SHADER_CACHE_MAGIC;
+	header.format = SHADER_CACHE_FORMAT;
+	header.session = cache->session;
+	header.entries_num = entriesNum;
+	header.blobs_bytesize = blobsBytesize;
+	header.checksum = Hash::MurmurHash2_64(payload, entriesBytesize + blobsBytesize, 0);
+	memcpy(data.DataPtr, &header, sizeof(header));
+
+	bool written = cache->storage.write(cache->storage.user, data.DataPtr, Size(data));
+	FreeMemory(data);
+	FreeMemory(kept);
+	cache->dirty = !written;
+	return written;
+}
+
+u32 GetIncludeGraphFile(shader_include_graph_t* graph, shader_sources_t const& sources, u32 source) {
+	auto pathHash = sources.path_hashes[source];
+	auto index = Get(graph->file_by_path, pathHash);
+	if (index) {
+		return *index;
+	}
+
+	auto path = sources.paths.DataPtr + sources.path_offsets[source];
+	shader_source_file_t file;
+	file.path_hash = pathHash;
+	file.content_hash = sources.content_hashes[source];
+	file.path_offset = (u32)Size(graph->paths);
+	file.roots = 0;
+	Append(graph->paths, path, strlen(path) + 1);
+
+	u32 fileIndex = (u32)Size(graph->files);
+	PushBack(graph->files, file);
+	Set(graph->file_by_path, pathHash, fileIndex);
+	return fileIndex;
+}
+
+void TrackShaderSources(shader_include_graph_t* graph, shader_sources_t const& sources) {
+	if (!Size(sources.path_hashes)) {
+		return;
+	}
+
+	ScopeLock lock(&graph->lock);
+	u32 root = GetIncludeGraphFile(graph, sources, 0);
+	for (u32 i = 0; i < Size(sources.path_hashes); ++i) {
+		u32 fileIndex = GetIncludeGraphFile(graph, sources, i);
+		graph->files[fileIndex].content_hash = sources.content_hashes[i];
+
+		u64 edgeHash = Hash::Combine_64(graph->files[root].path_hash, graph->files[fileIndex].path_hash);
+		if (Contains(graph->known, edgeHash)) {
+			continue;
+		}
+		Set(graph->known, edgeHash, (u8)1);
+
+		shader_include_edge_t edge;
+		edge.root = root;
+		edge.next = graph->files[fileIndex].roots;
+		PushBack(graph->edges, edge);
+		graph->files[fileIndex].roots = (u32)Size(graph->edges);
+	}
+}
+
+void FindChangedShaderRoots(shader_include_graph_t* graph, shader_source_reader_t reader, Array<u64>* outRootPathHashes) {
+	ScopeLock lock(&graph->lock);
+
+	Array<u8> text(GetThreadScratchAllocator());
+	Array<u8> rootReported(GetThreadScratchAllocator());
+	Resize(rootReported, Size(graph->files));
+	memset(rootReported.DataPtr, 0, Size(rootReported));
+
+	for (auto& file : graph->files) {
+		u64 contentHash = 0;
+		Clear(text);
+		if (reader.read(reader.user, graph->paths.DataPtr + file.path_offset, &text)) {
+			contentHash = Hash::Combine_64(Hash::MurmurHash2_64(text.DataPtr, Size(text), 0), 1);
+		}
+		if (contentHash == file.content_hash) {
+			continue;
+		}
+		// roots recompiling now record the new hash again
+		file.content_hash = contentHash;
+
+		for (u32 edge = file.roots; edge; edge = graph->edges[edge - 1].next) {
+			u32 root = graph->edges[edge - 1].root;
+			if (!rootReported[root]) {
+				rootReported[root] = 1;
+				PushBack(*outRootPathHashes, graph->files[root].path_hash);
+			}
+		}
+	}
+}
+
+void FreeShaderIncludeGraph(shader_include_graph_t* graph) {
+	FreeMemory(graph->file_by_path);
+	FreeMemory(graph->files);
+	FreeMemory(graph->paths);
+	FreeMemory(graph->edges);
+	FreeMemory(graph->known);
+}
+
+}
\ No newline at end of file
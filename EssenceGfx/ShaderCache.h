@@ -0,0 +1,94 @@
+#pragma once
+
+#include "Types.h"
+#include "Array.h"
+#include "Hashmap.h"
+#include "Thread.h"
+#include "PipelineCache.h"
+#include "ShaderCompiler.h"
+
+namespace Essence {
+
+// where shader sources come from, read fails for missing files
+struct shader_source_reader_t {
+	void*	user;
+	bool	(*read)(void* user, const char* path, Array<u8>* outData);
+};
+
+shader_source_reader_t	MakeFileSourceReader();
+
+// shader file with everything it includes, root first, each file once
+struct shader_sources_t {
+	Array<u64>		path_hashes;
+	Array<u64>		content_hashes;		// 0 for files that couldn't be read
+	Array<u32>		path_offsets;		// into paths, zero terminated
+	Array<char>		paths;
+};
+
+// includes resolve next to the file including them, like the standard d3d include handler
+void	GatherShaderSources(shader_source_reader_t reader, const char* file, shader_sources_t* outSources);
+void	FreeShaderSources(shader_sources_t* sources);
+// content address, sources hashed as written so edits in skipped #if blocks also miss
+u64		GetShaderCacheKey(shader_sources_t const& sources, shader_compile_desc_t const& desc, u64 compilerVersion);
+
+struct cached_shader_t {
+	u64					key;
+	u64					last_use;	// session it was last stored or found in
+	u64					offset;		// into blobs
+	u32					bytesize;
+	u32					_reserved;
+	shader_reflection_t	reflection;
+};
+
+// bytecode by content address, save drops least recently used entries to stay in budget
+// last use of entries only found rides along with the next save that has something new
+struct shader_cache_t {
+	cache_storage_t			storage;
+	u64						budget;		// bytes of bytecode kept
+	u64						session;	// one past the saved one
+	Hashmap<u64, u32>		entry_by_key;
+	Array<cached_shader_t>	entries;
+	Array<u8>				blobs;
+	bool					dirty;
+	CriticalSection			lock;
+};
+
+void	InitShaderCache(shader_cache_t* cache, cache_storage_t storage, u64 budget);
+void	FreeShaderCache(shader_cache_t* cache);
+// false when storage had nothing usable
+bool	LoadShaderCache(shader_cache_t* cache);
+// bytecode comes from the allocator
+bool	FindCachedShader(shader_cache_t* cache, u64 key, IAllocator* allocator, shader_compile_output_t* output);
+void	StoreCachedShader(shader_cache_t* cache, u64 key, shader_compile_output_t const& output);
+bool	SaveShaderCache(shader_cache_t* cache);
+
+struct shader_source_file_t {
+	u64		path_hash;
+	u64		content_hash;	// as last compiled
+	u32		path_offset;
+	u32		roots;			// edge + 1, 0 ends the list
+};
+
+struct shader_include_edge_t {
+	u32		root;		// file index
+	u32		next;		// edge + 1 of the same file
+};
+
+// which root files include each file, a root includes itself
+struct shader_include_graph_t {
+	Hashmap<u64, u32>				file_by_path;
+	Array<shader_source_file_t>		files;
+	Array<char>						paths;
+	Array<shader_include_edge_t>	edges;
+	Hashmap<u64, u8>				known;
+	CriticalSection					lock;
+};
+
+void	TrackShaderSources(shader_include_graph_t* graph, shader_sources_t const& sources);
+// rereads every file seen, appends path hashes of roots built from a file that changed since
+void	FindChangedShaderRoots(shader_include_graph_t* graph, shader_source_reader_t reader, Array<u64>* outRootPathHashes);
+void	FreeShaderIncludeGraph(shader_include_graph_t* graph);
+
+u64		GetShaderPathHash(const char* path);
+
+}
\ No newline at end of file
@@ -0,0 +1,144 @@
+#include "ShaderCompiler.h"
+#include "Essence.h"
+#include "Array.h"
+#include "Scheduler.h"
+
+namespace Essence {
+
+void InitShaderCompileService(shader_compile_service_t* service, shader_compiler_t compiler, IAllocator* allocator, shader_publish_function_t publish, void* publishUser) {
+	service->compiler = compiler;
+	service->allocator = allocator;
+	service->publish = publish;
+	service->publish_user = publishUser;
+	service->running_jobs = 0;
+	Clear(service->task_by_key);
+}
+
+void FreeShaderCompileService(shader_compile_service_t* service) {
+	WaitForShaderCompiles(service);
+	// handles are gone before their jobs let go of the service
+	while (service->running_jobs) {
+		_mm_pause();
+	}
+	FreeMemory(service->task_by_key);
+	FreeMemory(service->tasks);
+}
+
+char* CopyCompileString(char* dst, const char* src) {
+	auto len = strlen(src) + 1;
+	memcpy(dst, src, len);
+	return dst + len;
+}
+
+void ShaderCompileTask(const void* args, Job* job) {
+	auto task = (shader_compile_task_t*)args;
+	auto service = task->service;
+
+	while (true) {
+		{
+			ScopeLock lock(&service->lock);
+			task->compiled_requests = task->requests;
+		}
+
+		// nothing is locked while the backend works
+		shader_compile_output_t output = {};
+		if (!service->compiler.compile(service->compiler.user, task->desc, service->allocator, &output)) {
+			if (output.bytecode) {
+				service->allocator->Free(output.bytecode);
+			}
+			output = {};
+		}
+		service->publish(service->publish_user, task->key, output);
+
+		// requested again meanwhile, what was published can be older than the request
+		ScopeLock lock(&service->lock);
+		if (task->requests == task->compiled_requests) {
+			Remove(service->task_by_key, task->key);
+			Delete(service->tasks, task->handle);
+			break;
+		}
+	}
+
+	// job outlives the task, waiters only look at it through a live handle
+	service->allocator->Free(task);
+	service->running_jobs--;
+}
+
+shader_compile_handle RequestShaderCompile(shader_compile_service_t* service, u64 key, shader_compile_desc_t const& desc) {
+	ScopeLock lock(&service->lock);
+
+	auto inFlight = Get(service->task_by_key, key);
+	if (inFlight) {
+		service->tasks[*inFlight]->requests++;
+		return *inFlight;
+	}
+
+	auto stringsBytesize = strlen(desc.file) + strlen(desc.function) + strlen(desc.profile) + 3;
+	for (u32 i = 0; i < desc.defines_num; ++i) {
+		stringsBytesize += strlen(desc.defines[i].name) + strlen(desc.defines[i].definition) + 2;
+	}
+	auto definesBytesize = sizeof(shader_macro_t) * desc.defines_num;
+	auto task = (shader_compile_task_t*)service->allocator->Allocate(sizeof(shader_compile_task_t) + definesBytesize + stringsBytesize, alignof(shader_compile_task_t));
+	auto defines = (shader_macro_t*)(task + 1);
+	auto strings = (char*)(defines + desc.defines_num);
+	task->desc.file = strings;
+	strings = CopyCompileString(strings, desc.file);
+	task->desc.function = strings;
+	strings = CopyCompileString(strings, desc.function);
+	task->desc.profile = strings;
+	strings = CopyCompileString(strings, desc.profile);
+	for (u32 i = 0; i < desc.defines_num; ++i) {
+		defines[i].name = strings;
+		strings = CopyCompileString(strings, desc.defines[i].name);
+		defines[i].definition = strings;
+		strings = CopyCompileString(strings, desc.defines[i].definition);
+	}
+	task->desc.defines = defines;
+	task->desc.defines_num = desc.defines_num;
+
+	task->service = service;
+	task->handle = Create(service->tasks);
+	task->key = key;
+	task->requests = 1;
+	task->compiled_requests = 0;
+	task->job = CreateJob(ShaderCompileTask, task);
+	service->tasks[task->handle] = task;
+	Set(service->task_by_key, key, task->handle);
+
+	service->running_jobs++;
+	RunJobs(&task->job, 1);
+
+	return task->handle;
+}
+
+bool IsShaderCompileDone(shader_compile_service_t* service, shader_compile_handle handle) {
+	ScopeLock lock(&service->lock);
+	return !IsValid(handle) || !Contains(service->tasks, handle);
+}
+
+void WaitForShaderCompile(shader_compile_service_t* service, shader_compile_handle handle) {
+	Job* job = nullptr;
+	{
+		ScopeLock lock(&service->lock);
+		if (!IsValid(handle) || !Contains(service->tasks, handle)) {
+			return;
+		}
+		job = service->tasks[handle]->job;
+	}
+	WaitFor(job, true);
+}
+
+void WaitForShaderCompiles(shader_compile_service_t* service) {
+	Array<Job*> jobs(GetThreadScratchAllocator());
+	{
+		ScopeLock lock(&service->lock);
+		for (auto kv : service->task_by_key) {
+			PushBack(jobs, service->tasks[kv.value]->job);
+		}
+	}
+	for (auto job : jobs) {
+		WaitFor(job, true);
+	}
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "Types.h"
+#include "Collections.h"
+#include "Freelist.h"
+#include "Hashmap.h"
+#include "Hash.h"
+#include "Thread.h"
+
+namespace Essence {
+
+struct Job;
+class IAllocator;
+
+struct shader_macro_t {
+	const char*	name;
+	const char*	definition;
+};
+
+struct shader_compile_desc_t {
+	const char*				file;
+	const char*				function;
+	const char*				profile;
+	shader_macro_t const*	defines;
+	u32						defines_num;
+};
+
+struct shader_reflection_t {
+	u32		constant_buffers;
+	u32		bound_resources;
+	u32		input_parameters;
+	u32		output_parameters;
+	u32		instructions;
+	u32		thread_group[3];	// compute only
+};
+
+struct shader_compile_output_t {
+	void*				bytecode;	// from the allocator given to compile, null when compilation failed
+	u64					bytesize;
+	shader_reflection_t	reflection;
+};
+
+// backend, compile gets called from many threads at once
+struct shader_compiler_t {
+	void*	user;
+	bool	(*compile)(void* user, shader_compile_desc_t const& desc, IAllocator* allocator, shader_compile_output_t* output);
+};
+
+// runs on the compiling thread, takes over the bytecode
+typedef void(*shader_publish_function_t)(void* user, u64 key, shader_compile_output_t const& output);
+
+typedef GenericHandle32<20, TYPE_ID(ShaderCompile)> shader_compile_handle;
+
+struct shader_compile_service_t;
+
+// desc defines and strings point past the task, they are copied on request
+struct shader_compile_task_t {
+	shader_compile_service_t*	service;
+	shader_compile_handle		handle;
+	u64							key;
+	shader_compile_desc_t		desc;
+	Job*						job;
+	u32							requests;			// under the service lock
+	u32							compiled_requests;	// requests seen when the last compile started
+};
+
+struct shader_compile_service_t {
+	shader_compiler_t											compiler;
+	IAllocator*													allocator;
+	shader_publish_function_t									publish;
+	void*														publish_user;
+	Hashmap<u64, shader_compile_handle>							task_by_key;	// in flight only
+	Freelist<shader_compile_task_t*, shader_compile_handle>		tasks;
+	ai32														running_jobs;	// still touching the service after the task is gone
+	CriticalSection												lock;
+};
+
+void					InitShaderCompileService(shader_compile_service_t* service, shader_compiler_t compiler, IAllocator* allocator, shader_publish_function_t publish, void* publishUser);
+// waits for everything in flight
+void					FreeShaderCompileService(shader_compile_service_t* service);
+// compiles on a job, a request for a key still in flight joins it instead
+// one that comes after the compile started makes it compile again, the sources may have been read already
+shader_compile_handle	RequestShaderCompile(shader_compile_service_t* service, u64 key, shader_compile_desc_t const& desc);
+// handle stays live until the output is published, waiting helps with queued jobs
+bool					IsShaderCompileDone(shader_compile_service_t* service, shader_compile_handle handle);
+void					WaitForShaderCompile(shader_compile_service_t* service, shader_compile_handle handle);
+void					WaitForShaderCompiles(shader_compile_service_t* service);
+
+}
\ No newline at end of file
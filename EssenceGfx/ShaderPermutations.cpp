@@ -0,0 +1,231 @@
+#include "ShaderPermutations.h"
+#include "Essence.h"
+#include "Hash.h"
+
+namespace Essence {
+
+u32 GetPermutationDefines(shader_features_t const& features, u32 permutation, shader_macro_t* outMacros) {
+	Check(features.num == MAX_SHADER_FEATURES || (permutation >> features.num) == 0);
+
+	u32 num = 0;
+	for (u32 bit = 0; bit < features.num; ++bit) {
+		if (permutation & (1u << bit)) {
+			outMacros[num].name = features.names[bit];
+			outMacros[num].definition = "1";
+			++num;
+		}
+	}
+	return num;
+}
+
+permutation_slots_t* AllocatePermutationSlots(u32 capacity) {
+	auto bytesize = sizeof(permutation_slots_t) + sizeof(permutation_slot_t) * (capacity - 1);
+	auto slots = (permutation_slots_t*)GetMallocAllocator()->Allocate(bytesize, alignof(permutation_slots_t));
+	slots->capacity = capacity;
+	slots->size = 0;
+	for (u32 i = 0; i < capacity; ++i) {
+		slots->slots[i].key.store(0, std::memory_order_relaxed);
+		slots->slots[i].value.store(0, std::memory_order_relaxed);
+	}
+	return slots;
+}
+
+void InitPermutationTable(permutation_table_t* table, u32 capacity) {
+	u32 powerOfTwo = 16;
+	while (powerOfTwo < capacity) {
+		powerOfTwo *= 2;
+	}
+	table->current.store(AllocatePermutationSlots(powerOfTwo), std::memory_order_release);
+	Clear(table->retired);
+}
+
+void FreePermutationTable(permutation_table_t* table) {
+	GetMallocAllocator()->Free(table->current.load(std::memory_order_relaxed));
+	table->current.store(nullptr, std::memory_order_relaxed);
+	for (auto slots : table->retired) {
+		GetMallocAllocator()->Free(slots);
+	}
+	FreeMemory(table->retired);
+}
+
+u64 GetPermutationSlotKey(u64 key) {
+	return key ? key : 1;
+}
+
+bool FindPermutation(permutation_table_t const& table, u64 key, u32* outValue) {
+	auto slots = table.current.load(std::memory_order_acquire);
+	if (!slots) {
+		return false;
+	}
+	key = GetPermutationSlotKey(key);
+
+	u32 mask = slots->capacity - 1;
+	for (u32 i = (u32)key & mask;; i = (i + 1) & mask) {
+		// value is written before the key is published
+		u64 slotKey = slots->slots[i].key.load(std::memory_order_acquire);
+		if (slotKey == key) {
+			*outValue = slots->slots[i].value.load(std::memory_order_relaxed);
+			return true;
+		}
+		if (slotKey == 0) {
+			return false;
+		}
+	}
+}
+
+void InsertIntoSlots(permutation_slots_t* slots, u64 key, u32 value) {
+	u32 mask = slots->capacity - 1;
+	for (u32 i = (u32)key & mask;; i = (i + 1) & mask) {
+		u64 slotKey = slots->slots[i].key.load(std::memory_order_relaxed);
+		if (slotKey == key) {
+			slots->slots[i].value.store(value, std::memory_order_release);
+			return;
+		}
+		if (slotKey == 0) {
+			slots->slots[i].value.store(value, std::memory_order_relaxed);
+			slots->slots[i].key.store(key, std::memory_order_release);
+			++slots->size;
+			return;
+		}
+	}
+}
+
+void InsertPermutation(permutation_table_t* table, u64 key, u32 value) {
+	auto slots = table->current.load(std::memory_order_relaxed);
+	if (!slots) {
+		InitPermutationTable(table, 0);
+		slots = table->current.load(std::memory_order_relaxed);
+	}
+	key = GetPermutationSlotKey(key);
+
+	// kept at most half full so probes stay short and always end
+	if ((slots->size + 1) * 2 > slots->capacity) {
+		auto grown = AllocatePermutationSlots(slots->capacity * 2);
+		for (u32 i = 0; i < slots->capacity; ++i) {
+			u64 slotKey = slots->slots[i].key.load(std::memory_order_relaxed);
+			if (slotKey) {
+				InsertIntoSlots(grown, slotKey, slots->slots[i].value.load(std::memory_order_relaxed));
+			}
+		}
+		table->current.store(grown, std::memory_order_release);
+		PushBack(table->retired, slots);
+		slots = grown;
+	}
+	InsertIntoSlots(slots, key, value);
+}
+
+void AppendListField(Array<char>* outText, const char* field) {
+	Append(*outText, field, strlen(field));
+}
+
+void WriteShaderPermutationList(shader_permutation_entry_t const* entries, u32 num, Array<char>* outText) {
+	for (u32 i = 0; i < num; ++i) {
+		char permutation[16];
+		snprintf(permutation, sizeof(permutation), "%08x", entries[i].permutation);
+
+		// path goes last, it runs to the end of the line and can hold spaces
+		AppendListField(outText, entries[i].function);
+		PushBack(*outText, ' ');
+		AppendListField(outText, entries[i].profile);
+		PushBack(*outText, ' ');
+		AppendListField(outText, permutation);
+		PushBack(*outText, ' ');
+		AppendListField(outText, entries[i].file);
+		PushBack(*outText, '\n');
+	}
+}
+
+bool IsListSpace(char c) {
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+void ParseShaderPermutationList(const char* text, u64 length, Array<shader_permutation_entry_t>* outEntries, Array<char>* outStrings) {
+	// offsets into strings until parsing is done, strings move as they grow
+	struct parsed_entry_t {
+		u64		fields[3];
+		u32		permutation;
+	};
+	Array<parsed_entry_t> parsed(GetThreadScratchAllocator());
+
+	const char* end = text + length;
+	const char* line = text;
+	while (line < end) {
+		const char* lineEnd = line;
+		while (lineEnd < end && *lineEnd != '\n') {
+			++lineEnd;
+		}
+
+		// function, profile and permutation, then the path
+		const char* fields[4];
+		u64 lengths[4];
+		u32 fieldsNum = 0;
+		auto c = line;
+		while (c < lineEnd && fieldsNum < 4) {
+			while (c < lineEnd && IsListSpace(*c)) {
+				++c;
+			}
+			if (c == lineEnd) {
+				break;
+			}
+			auto fieldStart = c;
+			if (fieldsNum < 3) {
+				while (c < lineEnd && !IsListSpace(*c)) {
+					++c;
+				}
+			}
+			else {
+				c = lineEnd;
+				while (IsListSpace(*(c - 1))) {
+					--c;
+				}
+			}
+			fields[fieldsNum] = fieldStart;
+			lengths[fieldsNum] = (u64)(c - fieldStart);
+			++fieldsNum;
+		}
+
+		u32 permutation = 0;
+		bool wellFormed = fieldsNum == 4 && lengths[2] <= 8;
+		for (u64 i = 0; wellFormed && i < lengths[2]; ++i) {
+			char digit = fields[2][i];
+			u32 value = 0;
+			if (digit >= '0' && digit <= '9') {
+				value = digit - '0';
+			}
+			else if (digit >= 'a' && digit <= 'f') {
+				value = digit - 'a' + 10;
+			}
+			else if (digit >= 'A' && digit <= 'F') {
+				value = digit - 'A' + 10;
+			}
+			else {
+				wellFormed = false;
+			}
+			permutation = (permutation << 4) | value;
+		}
+
+		if (wellFormed) {
+			const u32 stringFields[] = { 3, 0, 1 };
+			parsed_entry_t entry;
+			for (u32 i = 0; i < 3; ++i) {
+				entry.fields[i] = Size(*outStrings);
+				Append(*outStrings, fields[stringFields[i]], lengths[stringFields[i]]);
+				PushBack(*outStrings, '\0');
+			}
+			entry.permutation = permutation;
+			PushBack(parsed, entry);
+		}
+		line = lineEnd + 1;
+	}
+
+	for (auto const& entry : parsed) {
+		shader_permutation_entry_t out;
+		out.file = outStrings->DataPtr + entry.fields[0];
+		out.function = outStrings->DataPtr + entry.fields[1];
+		out.profile = outStrings->DataPtr + entry.fields[2];
+		out.permutation = entry.permutation;
+		PushBack(*outEntries, out);
+	}
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "Types.h"
+#include "Array.h"
+#include "Thread.h"
+#include "ShaderCompiler.h"
+
+namespace Essence {
+
+const u32 MAX_SHADER_FEATURES = 32;
+
+// define names by feature bit, a permutation sets each of its bits to 1
+struct shader_features_t {
+	const char*	names[MAX_SHADER_FEATURES];
+	u32			num;
+};
+
+// returns number of macros written, bits past the declared features are an error
+u32		GetPermutationDefines(shader_features_t const& features, u32 permutation, shader_macro_t* outMacros);
+
+// 0 is never a key, probing stops at it
+struct permutation_slot_t {
+	au64	key;
+	au32	value;
+};
+
+struct permutation_slots_t {
+	u32					capacity;	// power of two
+	u32					size;
+	permutation_slot_t	slots[1];
+};
+
+// open addressing map readers walk without locking, inserts are serialized by the owner
+// grown tables are only retired, readers may still be walking them, zeroed table is empty
+struct permutation_table_t {
+	std::atomic<permutation_slots_t*>	current;
+	Array<permutation_slots_t*>			retired;
+};
+
+void	InitPermutationTable(permutation_table_t* table, u32 capacity);
+void	FreePermutationTable(permutation_table_t* table);
+bool	FindPermutation(permutation_table_t const& table, u64 key, u32* outValue);
+void	InsertPermutation(permutation_table_t* table, u64 key, u32 value);
+
+// one requested shader per line: function profile permutation in hex, then the file up to the end of the line
+struct shader_permutation_entry_t {
+	const char*	file;
+	const char*	function;
+	const char*	profile;
+	u32			permutation;
+};
+
+void	WriteShaderPermutationList(shader_permutation_entry_t const* entries, u32 num, Array<char>* outText);
+// entries point into outStrings, malformed lines are skipped
+void	ParseShaderPermutationList(const char* text, u64 length, Array<shader_permutation_entry_t>* outEntries, Array<char>* outStrings);
+
+}
\ No newline at end of file
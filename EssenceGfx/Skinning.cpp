@@ -0,0 +1,222 @@
+#include "Skinning.h"
+#include "Essence.h"
+#include "Scheduler.h"
+#include <DirectXMath.h>
+#include <float.h>
+#include <xmmintrin.h>
+#include <emmintrin.h>
+using namespace DirectX;
+
+namespace Essence {
+
+const u32 SKINNING_VERTICES_PER_BATCH = 1024;
+const u32 SKINNING_INFLUENCES = 4;
+
+struct skinning_dual_quaternion_t {
+	xmvec	real;
+	xmvec	dual;
+};
+
+void BuildDualQuaternions(bone_transform_t const* bones, u32 bonesNum, skinning_dual_quaternion_t* outDualQuaternions) {
+	for (auto b : MakeRange(bonesNum)) {
+		xmmatrix m;
+		m.r[0] = bones[b].columns[0];
+		m.r[1] = bones[b].columns[1];
+		m.r[2] = bones[b].columns[2];
+		m.r[3] = XMVectorSet(0, 0, 0, 1);
+
+		xmvec scale, rotation, translation;
+		XMMatrixDecompose(&scale, &rotation, &translation, XMMatrixTranspose(m));
+		translation = XMVectorSetW(translation, 0.f);
+
+		// dual part is translation * rotation / 2
+		auto dual = XMVectorScale(XMVectorAdd(XMVectorMultiply(XMVectorSplatW(rotation), translation), XMVector3Cross(translation, rotation)), 0.5f);
+		outDualQuaternions[b].real = rotation;
+		outDualQuaternions[b].dual = XMVectorSetW(dual, -0.5f * XMVectorGetX(XMVector3Dot(translation, rotation)));
+	}
+}
+
+// (v, w) through the rows of an affine 3x4 matrix
+inline xmvec TransformRows(xmvec const* rows, xmvec v) {
+	auto x = _mm_mul_ps(rows[0], v);
+	auto y = _mm_mul_ps(rows[1], v);
+	auto z = _mm_mul_ps(rows[2], v);
+	auto w = _mm_setzero_ps();
+	_MM_TRANSPOSE4_PS(x, y, z, w);
+	return _mm_add_ps(_mm_add_ps(x, y), _mm_add_ps(z, w));
+}
+
+inline xmvec Normalize3(xmvec v) {
+	auto lengthSq = XMVector3Dot(v, v);
+	return _mm_div_ps(v, _mm_sqrt_ps(_mm_max_ps(lengthSq, _mm_set1_ps(FLT_MIN))));
+}
+
+void SkinVerticesLinear(animated_mesh_vertex_t const* vertices, u32 from, u32 to, bone_transform_t const* bones, u32 bonesNum, Vec3f* outPositions, Vec3f* outNormals) {
+	for (auto v : MakeRange(from, to)) {
+		auto const& vertex = vertices[v];
+		float const* weights = &vertex.boneWeights.x;
+
+		// blended matrix like the shader does, then one transform per stream
+		xmvec rows[3] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() };
+		for (auto k = 0u; k < SKINNING_INFLUENCES; ++k) {
+			if (weights[k] == 0.f) {
+				continue;
+			}
+			auto bone = (vertex.boneIndices >> (k * 8)) & 255;
+			Check(bone < bonesNum);
+
+			auto weight = _mm_set1_ps(weights[k]);
+			for (auto i = 0u; i < 3; ++i) {
+				rows[i] = _mm_add_ps(rows[i], _mm_mul_ps(bones[bone].columns[i], weight));
+			}
+		}
+
+		auto position = TransformRows(rows, _mm_setr_ps(vertex.position.x, vertex.position.y, vertex.position.z, 1.f));
+		XMStoreFloat3((XMFLOAT3*)&outPositions[v], position);
+		if (outNormals) {
+			auto normal = TransformRows(rows, _mm_setr_ps(vertex.normal.x, vertex.normal.y, vertex.normal.z, 0.f));
+			XMStoreFloat3((XMFLOAT3*)&outNormals[v], Normalize3(normal));
+		}
+	}
+}
+
+void SkinVerticesDualQuaternion(animated_mesh_vertex_t const* vertices, u32 from, u32 to, skinning_dual_quaternion_t const* dualQuaternions, u32 bonesNum, Vec3f* outPositions, Vec3f* outNormals) {
+	auto two = _mm_set1_ps(2.f);
+
+	for (auto v : MakeRange(from, to)) {
+		auto const& vertex = vertices[v];
+		float const* weights = &vertex.boneWeights.x;
+
+		// influences are flipped to the hemisphere of the first one, q and -q are the same rotation
+		auto pivot = dualQuaternions[vertex.boneIndices & 255].real;
+		auto real = _mm_setzero_ps();
+		auto dual = _mm_setzero_ps();
+		for (auto k = 0u; k < SKINNING_INFLUENCES; ++k) {
+			if (weights[k] == 0.f) {
+				continue;
+			}
+			auto bone = (vertex.boneIndices >> (k * 8)) & 255;
+			Check(bone < bonesNum);
+
+			auto const& dq = dualQuaternions[bone];
+			auto weight = _mm_set1_ps(XMVectorGetX(XMVector4Dot(dq.real, pivot)) < 0.f ? -weights[k] : weights[k]);
+			real = _mm_add_ps(real, _mm_mul_ps(dq.real, weight));
+			dual = _mm_add_ps(dual, _mm_mul_ps(dq.dual, weight));
+		}
+
+		auto length = _mm_sqrt_ps(_mm_max_ps(XMVector4Dot(real, real), _mm_set1_ps(FLT_MIN)));
+		real = _mm_div_ps(real, length);
+		dual = _mm_div_ps(dual, length);
+
+		auto realW = XMVectorSplatW(real);
+		auto dualW = XMVectorSplatW(dual);
+		auto translation = _mm_mul_ps(two, _mm_add_ps(_mm_sub_ps(_mm_mul_ps(realW, dual), _mm_mul_ps(dualW, real)), XMVector3Cross(real, dual)));
+
+		auto p = _mm_setr_ps(vertex.position.x, vertex.position.y, vertex.position.z, 0.f);
+		auto position = _mm_add_ps(p, _mm_mul_ps(two, XMVector3Cross(real, _mm_add_ps(XMVector3Cross(real, p), _mm_mul_ps(realW, p)))));
+		XMStoreFloat3((XMFLOAT3*)&outPositions[v], _mm_add_ps(position, translation));
+		if (outNormals) {
+			auto n = _mm_setr_ps(vertex.normal.x, vertex.normal.y, vertex.normal.z, 0.f);
+			auto normal = _mm_add_ps(n, _mm_mul_ps(two, XMVector3Cross(real, _mm_add_ps(XMVector3Cross(real, n), _mm_mul_ps(realW, n)))));
+			XMStoreFloat3((XMFLOAT3*)&outNormals[v], Normalize3(normal));
+		}
+	}
+}
+
+void SkinVertices(animated_mesh_vertex_t const* vertices, u32 verticesNum, bone_transform_t const* bones, u32 bonesNum, SkinningModeEnum mode,
+	Vec3f* outPositions, Vec3f* outNormals) {
+
+	if (mode == SKINNING_LINEAR) {
+		SkinVerticesLinear(vertices, 0, verticesNum, bones, bonesNum, outPositions, outNormals);
+		return;
+	}
+
+	skinning_dual_quaternion_t* dualQuaternions;
+	allocate_c_array(dualQuaternions, GetThreadScratchAllocator(), bonesNum);
+	BuildDualQuaternions(bones, bonesNum, dualQuaternions);
+	SkinVerticesDualQuaternion(vertices, 0, verticesNum, dualQuaternions, bonesNum, outPositions, outNormals);
+	GetThreadScratchAllocator()->Free(dualQuaternions);
+}
+
+struct ParallelSkinRange_Payload {
+	animated_mesh_vertex_t const*		vertices;
+	bone_transform_t const*				bones;
+	skinning_dual_quaternion_t const*	dualQuaternions;	// null for linear skinning
+	u32									bonesNum;
+	u32									from;
+	u32									to;
+	Vec3f*								positions;
+	Vec3f*								normals;
+};
+
+struct ParallelSkinRoot_Payload {
+	Array<ParallelSkinRange_Payload>*	SubtasksData;
+};
+
+void ParallelSkinRange(const void* InArgs, Job*) {
+	PROFILE_SCOPE(skin_vertices_range);
+
+	auto Args = *(ParallelSkinRange_Payload*)InArgs;
+	if (Args.dualQuaternions) {
+		SkinVerticesDualQuaternion(Args.vertices, Args.from, Args.to, Args.dualQuaternions, Args.bonesNum, Args.positions, Args.normals);
+	}
+	else {
+		SkinVerticesLinear(Args.vertices, Args.from, Args.to, Args.bones, Args.bonesNum, Args.positions, Args.normals);
+	}
+}
+
+void ParallelSkinRoot(const void* InArgs, Job* job) {
+	auto Args = *(ParallelSkinRoot_Payload*)InArgs;
+
+	Job* children[512];
+	Check(Size(*Args.SubtasksData) < _countof(children));
+
+	for (auto i : MakeRange(Size(*Args.SubtasksData))) {
+		children[i] = CreateChildJob(job, ParallelSkinRange, &(*Args.SubtasksData)[i]);
+	}
+
+	RunJobs(children, (u32)Size(*Args.SubtasksData));
+}
+
+void ParallelSkinVertices(animated_mesh_vertex_t const* vertices, u32 verticesNum, bone_transform_t const* bones, u32 bonesNum, SkinningModeEnum mode,
+	Vec3f* outPositions, Vec3f* outNormals) {
+	PROFILE_SCOPE(skin_vertices);
+
+	// bones are converted once, every range reads them
+	skinning_dual_quaternion_t* dualQuaternions = nullptr;
+	if (mode == SKINNING_DUAL_QUATERNION) {
+		allocate_c_array(dualQuaternions, GetMallocAllocator(), bonesNum);
+		BuildDualQuaternions(bones, bonesNum, dualQuaternions);
+	}
+
+	// keep within the root job fan-out
+	u32 verticesPerBatch = max(SKINNING_VERTICES_PER_BATCH, (verticesNum + 510) / 511);
+
+	Array<ParallelSkinRange_Payload> childWorkspaces(GetMallocAllocator());
+	Reserve(childWorkspaces, verticesNum / verticesPerBatch + 1);
+
+	for (u32 i = 0; i < verticesNum; i += verticesPerBatch) {
+		ParallelSkinRange_Payload payload = {};
+		payload.vertices = vertices;
+		payload.bones = bones;
+		payload.dualQuaternions = dualQuaternions;
+		payload.bonesNum = bonesNum;
+		payload.from = i;
+		payload.to = min(verticesNum, i + verticesPerBatch);
+		payload.positions = outPositions;
+		payload.normals = outNormals;
+		PushBack(childWorkspaces, payload);
+	}
+
+	ParallelSkinRoot_Payload payload = {};
+	payload.SubtasksData = &childWorkspaces;
+
+	auto rootJob = CreateJob(ParallelSkinRoot, &payload);
+	RunJobs(&rootJob, 1);
+
+	WaitFor(rootJob, true);
+
+	GetMallocAllocator()->Free(dualQuaternions);
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "Types.h"
+#include "Maths.h"
+#include "VectorMath.h"
+#include "Animation.h"
+
+namespace Essence {
+
+struct animated_mesh_vertex_t {
+	float3	position;
+	float3	normal;
+	float2	texcoord0;
+	float3	tangent;
+	float3	bitangent;
+	u32		boneIndices;	// four bytes, lowest is the first influence
+	float4	boneWeights;
+};
+
+enum SkinningModeEnum {
+	SKINNING_LINEAR,
+	SKINNING_DUAL_QUATERNION	// keeps volume at twisting joints, scale in bones is dropped
+};
+
+// same result as the vertex shader before world transform, normals come out normalized and can be null
+void SkinVertices(animated_mesh_vertex_t const* vertices, u32 verticesNum, bone_transform_t const* bones, u32 bonesNum, SkinningModeEnum mode,
+	Vec3f* outPositions, Vec3f* outNormals);
+void ParallelSkinVertices(animated_mesh_vertex_t const* vertices, u32 verticesNum, bone_transform_t const* bones, u32 bonesNum, SkinningModeEnum mode,
+	Vec3f* outPositions, Vec3f* outNormals);
+
+}
\ No newline at end of file
@@ -0,0 +1,242 @@
+#include "UploadAllocator.h"
+#include "Essence.h"
+
+namespace Essence {
+
+u64 AlignUploadOffset(u64 offset, u64 alignment) {
+	return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+void InitUploadAllocator(upload_allocator_t* allocator, upload_backend_t backend, upload_allocator_desc_t desc) {
+	Check(desc.block_size > 0);
+	Check(desc.large_size > 0);
+	Check(desc.history_frames > 0 && desc.history_frames <= MAX_UPLOAD_HISTORY);
+
+	allocator->backend = backend;
+	allocator->desc = desc;
+
+	allocator->ring = {};
+	if (desc.ring_size) {
+		Verify(backend.create_block(backend.user, desc.ring_size, &allocator->ring));
+	}
+	allocator->ring_head = 0;
+	allocator->ring_tail = 0;
+	allocator->ring_fenced_head = 0;
+	Clear(allocator->ring_fences);
+
+	allocator->current = nullptr;
+	Clear(allocator->frame_blocks);
+	Clear(allocator->pending_blocks);
+	Clear(allocator->free_blocks);
+	allocator->pooled_bytes = 0;
+
+	for (u32 i = 0; i < MAX_UPLOAD_HISTORY; ++i) {
+		allocator->history[i] = 0;
+	}
+	allocator->history_index = 0;
+	allocator->frame_overflow_bytes = 0;
+	allocator->frame_large_bytes = 0;
+	allocator->last_overflow_bytes = 0;
+	allocator->last_large_bytes = 0;
+}
+
+void DestroyUploadBlock(upload_allocator_t* allocator, upload_block_t* block) {
+	allocator->backend.destroy_block(allocator->backend.user, block->memory);
+	allocator->pooled_bytes -= block->size;
+	GetMallocAllocator()->Free(block);
+}
+
+void FreeUploadAllocator(upload_allocator_t* allocator) {
+	for (auto block : allocator->frame_blocks) {
+		DestroyUploadBlock(allocator, block);
+	}
+	for (auto block : allocator->pending_blocks) {
+		DestroyUploadBlock(allocator, block);
+	}
+	for (auto block : allocator->free_blocks) {
+		DestroyUploadBlock(allocator, block);
+	}
+	if (allocator->desc.ring_size) {
+		allocator->backend.destroy_block(allocator->backend.user, allocator->ring);
+	}
+	allocator->ring = {};
+	allocator->current = nullptr;
+
+	FreeMemory(allocator->ring_fences);
+	FreeMemory(allocator->frame_blocks);
+	FreeMemory(allocator->pending_blocks);
+	FreeMemory(allocator->free_blocks);
+}
+
+upload_t MakeUpload(upload_block_memory_t const& memory, u64 offset) {
+	upload_t upload;
+	upload.write_ptr = pointer_add(memory.mapped_ptr, offset);
+	upload.gpu_address = memory.gpu_address + offset;
+	upload.resource = memory.resource;
+	upload.offset = offset;
+	return upload;
+}
+
+bool AllocateFromRing(upload_allocator_t* allocator, u64 size, u64 alignment, upload_t* outUpload) {
+	u64 ringSize = allocator->desc.ring_size;
+	if (!ringSize || ringSize % alignment) {
+		return false;
+	}
+
+	u64 head = allocator->ring_head.load();
+	while (true) {
+		u64 start = AlignUploadOffset(head, alignment);
+		// allocations never wrap, the rest of the lap is skipped and comes back with the tail
+		if (start % ringSize + size > ringSize) {
+			start = (start / ringSize + 1) * ringSize;
+		}
+		u64 end = start + size;
+		if (end - allocator->ring_tail.load() > ringSize) {
+			return false;
+		}
+		if (allocator->ring_head.compare_exchange_weak(head, end)) {
+			*outUpload = MakeUpload(allocator->ring, start % ringSize);
+			return true;
+		}
+	}
+}
+
+// smallest free block that fits, blocks over twice the size are left for bigger requests
+upload_block_t* AcquireUploadBlock(upload_allocator_t* allocator, u64 size) {
+	i64 bestIndex = -1;
+	for (u64 i = 0; i < Size(allocator->free_blocks); ++i) {
+		auto block = allocator->free_blocks[i];
+		if (block->size >= size && block->size <= size * 2 && (bestIndex == -1 || block->size < allocator->free_blocks[bestIndex]->size)) {
+			bestIndex = (i64)i;
+		}
+	}
+
+	upload_block_t* block;
+	if (bestIndex != -1) {
+		block = allocator->free_blocks[bestIndex];
+		allocator->free_blocks[bestIndex] = Back(allocator->free_blocks);
+		PopBack(allocator->free_blocks);
+	}
+	else {
+		block = (upload_block_t*)GetMallocAllocator()->Allocate(sizeof(upload_block_t), alignof(upload_block_t));
+		Verify(allocator->backend.create_block(allocator->backend.user, size, &block->memory));
+		block->size = size;
+		allocator->pooled_bytes += size;
+	}
+	block->used = 0;
+	block->fence = 0;
+	PushBack(allocator->frame_blocks, block);
+	return block;
+}
+
+upload_t AllocateUpload(upload_allocator_t* allocator, u64 size, u64 alignment) {
+	Check(alignment > 0 && (alignment & (alignment - 1)) == 0);
+	Check(alignment <= UPLOAD_LARGE_GRANULARITY);
+
+	upload_t upload;
+	if (size < allocator->desc.large_size && AllocateFromRing(allocator, size, alignment, &upload)) {
+		return upload;
+	}
+
+	ScopeLock lock(&allocator->lock);
+
+	if (size >= allocator->desc.large_size) {
+		auto block = AcquireUploadBlock(allocator, AlignUploadOffset(size, UPLOAD_LARGE_GRANULARITY));
+		block->used = size;
+		allocator->frame_large_bytes += size;
+		return MakeUpload(block->memory, 0);
+	}
+
+	auto block = allocator->current;
+	u64 start = block ? AlignUploadOffset(block->used, alignment) : 0;
+	if (!block || start + size > block->size) {
+		// large_size can be above block_size, what's between gets a block that fits it
+		block = AcquireUploadBlock(allocator, max(allocator->desc.block_size, AlignUploadOffset(size, alignment)));
+		allocator->current = block;
+		start = 0;
+	}
+	block->used = start + size;
+	allocator->frame_overflow_bytes += size;
+	return MakeUpload(block->memory, start);
+}
+
+void FenceUploads(upload_allocator_t* allocator, u64 fence) {
+	u64 head = allocator->ring_head.load();
+	if (head != allocator->ring_fenced_head) {
+		upload_ring_fence_t ringFence;
+		ringFence.fence = fence;
+		ringFence.head = head;
+		PushBack(allocator->ring_fences, ringFence);
+		allocator->ring_fenced_head = head;
+	}
+
+	for (auto block : allocator->frame_blocks) {
+		block->fence = fence;
+		PushBack(allocator->pending_blocks, block);
+	}
+	Clear(allocator->frame_blocks);
+	allocator->current = nullptr;
+
+	u64 inFlight = 0;
+	for (auto block : allocator->pending_blocks) {
+		inFlight += block->size;
+	}
+	allocator->history[allocator->history_index % allocator->desc.history_frames] = inFlight;
+	allocator->history_index++;
+
+	allocator->last_overflow_bytes = allocator->frame_overflow_bytes;
+	allocator->last_large_bytes = allocator->frame_large_bytes;
+	allocator->frame_overflow_bytes = 0;
+	allocator->frame_large_bytes = 0;
+}
+
+void RetireUploads(upload_allocator_t* allocator) {
+	auto const& backend = allocator->backend;
+
+	while (Size(allocator->ring_fences) && backend.is_fence_completed(backend.user, Front(allocator->ring_fences).fence)) {
+		allocator->ring_tail = Front(allocator->ring_fences).head;
+		PopFront(allocator->ring_fences);
+	}
+
+	for (auto& block : allocator->pending_blocks) {
+		if (backend.is_fence_completed(backend.user, block->fence)) {
+			block->used = 0;
+			block->fence = 0;
+			PushBack(allocator->free_blocks, block);
+			block = nullptr;
+		}
+	}
+	RemoveAll(allocator->pending_blocks, [](upload_block_t* block) { return block == nullptr; });
+
+	// keep what the busiest recent frame had in flight, a spike ages out after history_frames
+	u64 keep = 0;
+	for (u32 i = 0; i < allocator->desc.history_frames; ++i) {
+		keep = max(keep, allocator->history[i]);
+	}
+	while (allocator->pooled_bytes > keep && Size(allocator->free_blocks)) {
+		u64 largest = 0;
+		for (u64 i = 1; i < Size(allocator->free_blocks); ++i) {
+			if (allocator->free_blocks[i]->size > allocator->free_blocks[largest]->size) {
+				largest = i;
+			}
+		}
+		auto block = allocator->free_blocks[largest];
+		allocator->free_blocks[largest] = Back(allocator->free_blocks);
+		PopBack(allocator->free_blocks);
+		DestroyUploadBlock(allocator, block);
+	}
+}
+
+upload_allocator_stats_t GetUploadAllocatorStats(upload_allocator_t const& allocator) {
+	upload_allocator_stats_t stats = {};
+	stats.ring_size = allocator.desc.ring_size;
+	stats.ring_used = allocator.ring_head.load() - allocator.ring_tail.load();
+	stats.pooled_bytes = allocator.pooled_bytes;
+	stats.blocks_num = (u32)(Size(allocator.frame_blocks) + Size(allocator.pending_blocks) + Size(allocator.free_blocks));
+	stats.free_blocks_num = (u32)Size(allocator.free_blocks);
+	stats.overflow_bytes = allocator.last_overflow_bytes;
+	stats.large_bytes = allocator.last_large_bytes;
+	return stats;
+}
+
+}
\ No newline at end of file
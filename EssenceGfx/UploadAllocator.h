@@ -0,0 +1,101 @@
+#pragma once
+
+#include "Types.h"
+#include "Array.h"
+#include "Ringbuffer.h"
+#include "Thread.h"
+
+namespace Essence {
+
+// mapped memory the cpu writes and the gpu reads
+struct upload_block_memory_t {
+	void*	resource;
+	void*	mapped_ptr;
+	u64		gpu_address;
+};
+
+// fences are opaque to the allocator, they only need to complete in the order they were passed
+struct upload_backend_t {
+	void*	user;
+	bool	(*create_block)(void* user, u64 size, upload_block_memory_t* outMemory);
+	void	(*destroy_block)(void* user, upload_block_memory_t const& memory);
+	bool	(*is_fence_completed)(void* user, u64 fence);
+};
+
+const u32 MAX_UPLOAD_HISTORY = 64;
+const u64 UPLOAD_LARGE_GRANULARITY = 64 * 1024;
+
+struct upload_allocator_desc_t {
+	u64		ring_size;			// persistent ring small allocations try first, 0 for none
+	u64		block_size;			// pooled blocks once the ring is full, bigger when one upload needs it
+	u64		large_size;			// from here an allocation gets a block of its own
+	u32		history_frames;		// pool is trimmed to the peak of this many frames
+};
+
+struct upload_block_t {
+	upload_block_memory_t	memory;
+	u64						size;
+	u64						used;
+	u64						fence;
+};
+
+struct upload_ring_fence_t {
+	u64		fence;
+	u64		head;
+};
+
+struct upload_t {
+	void*	write_ptr;
+	u64		gpu_address;
+	void*	resource;
+	u64		offset;		// into resource
+};
+
+struct upload_allocator_stats_t {
+	u64		ring_size;
+	u64		ring_used;
+	u64		pooled_bytes;		// blocks outside the ring, in flight or kept around
+	u32		blocks_num;
+	u32		free_blocks_num;
+	u64		overflow_bytes;		// small allocations that missed the ring last frame
+	u64		large_bytes;
+};
+
+// ring head and tail are byte counters that only grow, position is counter % ring_size
+// ring allocations are lock free, everything else takes the lock
+// fence and retire are called between frames with no allocations running
+struct upload_allocator_t {
+	upload_backend_t					backend;
+	upload_allocator_desc_t				desc;
+
+	upload_block_memory_t				ring;
+	au64								ring_head;
+	au64								ring_tail;
+	u64									ring_fenced_head;
+	Ringbuffer<upload_ring_fence_t>		ring_fences;
+
+	upload_block_t*						current;
+	Array<upload_block_t*>				frame_blocks;		// used since the last fence
+	Array<upload_block_t*>				pending_blocks;
+	Array<upload_block_t*>				free_blocks;
+	u64									pooled_bytes;
+
+	u64									history[MAX_UPLOAD_HISTORY];	// pooled bytes in flight at each fence
+	u32									history_index;
+	u64									frame_overflow_bytes;
+	u64									frame_large_bytes;
+	u64									last_overflow_bytes;
+	u64									last_large_bytes;
+
+	CriticalSection						lock;
+};
+
+void						InitUploadAllocator(upload_allocator_t* allocator, upload_backend_t backend, upload_allocator_desc_t desc);
+void						FreeUploadAllocator(upload_allocator_t* allocator);
+upload_t					AllocateUpload(upload_allocator_t* allocator, u64 size, u64 alignment);
+// everything allocated since the last call is in use until fence completes
+void						FenceUploads(upload_allocator_t* allocator, u64 fence);
+void						RetireUploads(upload_allocator_t* allocator);
+upload_allocator_stats_t	GetUploadAllocatorStats(upload_allocator_t const& allocator);
+
+}
\ No newline at end of file
@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+
+#include "Essence.h"
+#include "Scheduler.h"
+#include "Random.h"
+#include "Animation.h"
+#include "Skinning.h"
+#include <DirectXMath.h>
+
+using namespace Essence;
+using namespace DirectX;
+
+// every measurement repeats whole passes until it has run for at least this long
+const double BENCHMARK_MIN_SECONDS = 0.25;
+const u32 BENCHMARK_MIN_PASSES = 3;
+const u32 BENCHMARK_INSTANCES = 256;
+const u32 BENCHMARK_INSTANCES_PER_BATCH = 8;
+const u32 BENCHMARK_VERTICES = 50000;
+const float BENCHMARK_DURATION = 4.f;
+const float BENCHMARK_KEYS_PER_SECOND = 30.f;
+
+struct benchmark_skeleton_t {
+	Array<xmmatrix>				local_transforms;
+	Array<xmmatrix>				bone_offsets;
+	Array<u16>					parents;
+	Array<u16>					channel_indices;
+	Array<u16>					bone_node_indices;
+	Array<position_key_t>		position_keys;
+	Array<rotation_key_t>		rotation_keys;
+	Array<animation_channel_t>	channels;
+	animation_skeleton_t		skeleton;
+	animation_t					animation;
+};
+
+// branching chains, every node animated and skinned, keys are smooth like captured motion
+void BuildBenchmarkSkeleton(benchmark_skeleton_t* out, random_generator& rng, u32 nodesNum) {
+	Check(nodesNum <= 256);
+
+	for (u32 n = 0; n < nodesNum; ++n) {
+		// mostly continue the previous chain, sometimes branch off an earlier node
+		u16 parent = n == 0 ? SHORT_NULL_INDEX : (u16)(n - 1 - rng.u32Next(min(n, 4u)));
+		PushBack(out->parents, parent);
+		PushBack(out->channel_indices, (u16)n);
+		PushBack(out->bone_node_indices, (u16)n);
+		PushBack(out->local_transforms, XMMatrixTranslation(0.f, 1.f, 0.f));
+		PushBack(out->bone_offsets, XMMatrixTranslation(0.f, -(float)n, 0.f));
+	}
+
+	u32 keysNum = (u32)(BENCHMARK_DURATION * BENCHMARK_KEYS_PER_SECOND) + 1;
+	for (u32 n = 0; n < nodesNum; ++n) {
+		auto axis = XMVector3Normalize(XMVectorSet(rng.f32Next(-1.f, 1.f), rng.f32Next(-1.f, 1.f), rng.f32Next(-1.f, 1.f) + 0.01f, 0.f));
+		float amplitude = rng.f32Next(0.1f, 1.f);
+		float frequency = rng.f32Next(0.5f, 2.f);
+		float phase = rng.f32Next(0.f, 6.f);
+
+		for (u32 k = 0; k < keysNum; ++k) {
+			float time = BENCHMARK_KEYS_PER_SECOND * BENCHMARK_DURATION * k / (keysNum - 1);
+			float angle = amplitude * sinf(frequency * k / BENCHMARK_KEYS_PER_SECOND * 6.2831853f + phase);
+
+			position_key_t position;
+			position.time = time;
+			position.value = float3a(0.f, 1.f + 0.05f * angle, 0.f);
+			PushBack(out->position_keys, position);
+
+			rotation_key_t rotation;
+			rotation.time = time;
+			XMStoreFloat4(&rotation.value, XMQuaternionRotationAxis(axis, angle));
+			PushBack(out->rotation_keys, rotation);
+		}
+	}
+
+	for (u32 n = 0; n < nodesNum; ++n) {
+		animation_channel_t channel;
+		channel.position_keys = out->position_keys.DataPtr + n * keysNum;
+		channel.position_keys_num = keysNum;
+		channel.rotation_keys = out->rotation_keys.DataPtr + n * keysNum;
+		channel.rotation_keys_num = keysNum;
+		PushBack(out->channels, channel);
+	}
+
+	out->skeleton = {};
+	out->skeleton.nodes_num = nodesNum;
+	out->skeleton.bones_num = nodesNum;
+	out->skeleton.node_local_transforms = out->local_transforms.DataPtr;
+	out->skeleton.node_parents = out->parents.DataPtr;
+	out->skeleton.node_channel_indices = out->channel_indices.DataPtr;
+	out->skeleton.bone_node_indices = out->bone_node_indices.DataPtr;
+	out->skeleton.bone_offsets = out->bone_offsets.DataPtr;
+	BuildSkeletonPoseData(&out->skeleton);
+
+	Array<animation_channel_weight_t> weights;
+	Resize(weights, nodesNum);
+	ComputeChannelWeights(&out->skeleton, nodesNum, weights.DataPtr);
+	BuildAnimation(&out->animation, out->channels.DataPtr, nodesNum, BENCHMARK_DURATION * BENCHMARK_KEYS_PER_SECOND, BENCHMARK_KEYS_PER_SECOND,
+		weights.DataPtr, ANIMATION_ERROR_BUDGET);
+}
+
+void FreeBenchmarkSkeleton(benchmark_skeleton_t* skeleton) {
+	FreeAnimation(&skeleton->animation);
+	FreeSkeletonPoseData(&skeleton->skeleton);
+}
+
+void BuildBenchmarkVertices(Array<animated_mesh_vertex_t>* outVertices, random_generator& rng, u32 bonesNum) {
+	Resize(*outVertices, BENCHMARK_VERTICES);
+	for (auto& vertex : *outVertices) {
+		vertex = {};
+		vertex.position = float3(rng.f32Next(-1.f, 1.f), rng.f32Next(0.f, (float)bonesNum), rng.f32Next(-1.f, 1.f));
+		vertex.normal = float3(0.f, 0.f, 1.f);
+
+		float weights[4];
+		float sum = 0.f;
+		for (u32 k = 0; k < 4; ++k) {
+			vertex.boneIndices |= rng.u32Next(bonesNum) << (k * 8);
+			weights[k] = rng.f32Next(0.01f, 1.f);
+			sum += weights[k];
+		}
+		vertex.boneWeights = float4(weights[0] / sum, weights[1] / sum, weights[2] / sum, weights[3] / sum);
+	}
+}
+
+// independent characters sharing one skeleton and animation
+struct benchmark_instances_t {
+	benchmark_skeleton_t const*		data;
+	animation_state_t				states[BENCHMARK_INSTANCES];
+	animation_pose_t				poses[BENCHMARK_INSTANCES];
+	Array<bone_transform_t>			transforms;
+	float							time;
+};
+
+typedef void(*benchmark_range_t)(benchmark_instances_t* instances, u32 from, u32 to);
+
+void SampleRange(benchmark_instances_t* instances, u32 from, u32 to) {
+	for (auto i : MakeRange(from, to)) {
+		sample_animation(&instances->data->skeleton, &instances->data->animation, instances->time + i * 0.013f, &instances->poses[i]);
+	}
+}
+
+void HierarchyRange(benchmark_instances_t* instances, u32 from, u32 to) {
+	auto bonesNum = instances->data->skeleton.bones_num;
+	for (auto i : MakeRange(from, to)) {
+		calculate_pose_transforms(&instances->data->skeleton, &instances->poses[i], instances->transforms.DataPtr + i * bonesNum);
+	}
+}
+
+void AnimationRange(benchmark_instances_t* instances, u32 from, u32 to) {
+	auto bonesNum = instances->data->skeleton.bones_num;
+	for (auto i : MakeRange(from, to)) {
+		calculate_animation(&instances->data->skeleton, &instances->data->animation, &instances->states[i], instances->time + i * 0.013f,
+			instances->transforms.DataPtr + i * bonesNum);
+	}
+}
+
+struct BenchmarkRange_Payload {
+	benchmark_instances_t*	instances;
+	benchmark_range_t		function;
+	u32						from;
+	u32						to;
+};
+
+struct BenchmarkRoot_Payload {
+	Array<BenchmarkRange_Payload>*	SubtasksData;
+};
+
+void BenchmarkRange(const void* InArgs, Job*) {
+	auto Args = *(BenchmarkRange_Payload*)InArgs;
+	Args.function(Args.instances, Args.from, Args.to);
+}
+
+void BenchmarkRoot(const void* InArgs, Job* job) {
+	auto Args = *(BenchmarkRoot_Payload*)InArgs;
+
+	Job* children[512];
+	Check(Size(*Args.SubtasksData) < _countof(children));
+
+	for (auto i : MakeRange(Size(*Args.SubtasksData))) {
+		children[i] = CreateChildJob(job, BenchmarkRange, &(*Args.SubtasksData)[i]);
+	}
+
+	RunJobs(children, (u32)Size(*Args.SubtasksData));
+}
+
+void ParallelBenchmarkRange(benchmark_instances_t* instances, benchmark_range_t function) {
+	Array<BenchmarkRange_Payload> childWorkspaces(GetMallocAllocator());
+	Reserve(childWorkspaces, BENCHMARK_INSTANCES / BENCHMARK_INSTANCES_PER_BATCH + 1);
+
+	for (u32 i = 0; i < BENCHMARK_INSTANCES; i += BENCHMARK_INSTANCES_PER_BATCH) {
+		BenchmarkRange_Payload payload = {};
+		payload.instances = instances;
+		payload.function = function;
+		payload.from = i;
+		payload.to = min(BENCHMARK_INSTANCES, i + BENCHMARK_INSTANCES_PER_BATCH);
+		PushBack(childWorkspaces, payload);
+	}
+
+	BenchmarkRoot_Payload payload = {};
+	payload.SubtasksData = &childWorkspaces;
+
+	auto rootJob = CreateJob(BenchmarkRoot, &payload);
+	RunJobs(&rootJob, 1);
+
+	WaitFor(rootJob, true);
+}
+
+// one csv row per measurement, items are channels, bones or vertices as the unit column says
+template<typename F> void MeasureBenchmark(FILE* out, const char* name, const char* mode, u32 skeletonBones, const char* unit, u64 itemsPerPass, F pass) {
+	typedef std::chrono::high_resolution_clock clock;
+
+	// warm caches and lazily built data before timing
+	pass(0);
+
+	u32 passes = 0;
+	auto start = clock::now();
+	double seconds = 0.;
+	while (passes < BENCHMARK_MIN_PASSES || seconds < BENCHMARK_MIN_SECONDS) {
+		pass(passes + 1);
+		++passes;
+		seconds = std::chrono::duration<double>(clock::now() - start).count();
+	}
+
+	u64 items = itemsPerPass * passes;
+	fprintf(out, "%s,%s,%u,%s,%llu,%.6f,%.0f\n", name, mode, skeletonBones, unit, (unsigned long long)items, seconds, items / seconds);
+	fflush(out);
+}
+
+void BenchmarkSkeleton(FILE* out, random_generator& rng, u32 nodesNum) {
+	benchmark_skeleton_t data;
+	BuildBenchmarkSkeleton(&data, rng, nodesNum);
+	auto skeleton = &data.skeleton;
+
+	benchmark_instances_t instanceData;
+	auto instances = &instanceData;
+	instances->data = &data;
+	for (auto i : MakeRange(BENCHMARK_INSTANCES)) {
+		instances->states[i] = {};
+		InitPose(&instances->poses[i], skeleton->channels_num, GetMallocAllocator());
+	}
+	Resize(instances->transforms, BENCHMARK_INSTANCES * skeleton->bones_num);
+
+	u64 channels = (u64)skeleton->channels_num * BENCHMARK_INSTANCES;
+	u64 bones = (u64)skeleton->bones_num * BENCHMARK_INSTANCES;
+	auto frameTime = [&](u32 pass) { instances->time = pass / 60.f; };
+
+	benchmark_range_t stages[] = { SampleRange, HierarchyRange, AnimationRange };
+	const char* stageNames[] = { "sample", "hierarchy", "animation" };
+	// sampling works per animated channel, the others per output bone
+	const char* stageUnits[] = { "channels", "bones", "bones" };
+	u64 stageItems[] = { channels, bones, bones };
+	for (auto s : MakeRange(_countof(stages))) {
+		MeasureBenchmark(out, stageNames[s], "serial", skeleton->bones_num, stageUnits[s], stageItems[s], [&](u32 pass) {
+			frameTime(pass);
+			stages[s](instances, 0, BENCHMARK_INSTANCES);
+		});
+		MeasureBenchmark(out, stageNames[s], "scheduler", skeleton->bones_num, stageUnits[s], stageItems[s], [&](u32 pass) {
+			frameTime(pass);
+			ParallelBenchmarkRange(instances, stages[s]);
+		});
+	}
+
+	Array<animated_mesh_vertex_t> vertices;
+	BuildBenchmarkVertices(&vertices, rng, skeleton->bones_num);
+	Array<Vec3f> positions, normals;
+	Resize(positions, BENCHMARK_VERTICES);
+	Resize(normals, BENCHMARK_VERTICES);
+	auto bindBones = instances->transforms.DataPtr;
+
+	SkinningModeEnum modes[] = { SKINNING_LINEAR, SKINNING_DUAL_QUATERNION };
+	const char* modeNames[] = { "skin_linear", "skin_dual_quaternion" };
+	for (auto m : MakeRange(_countof(modes))) {
+		MeasureBenchmark(out, modeNames[m], "serial", skeleton->bones_num, "vertices", BENCHMARK_VERTICES, [&](u32) {
+			SkinVertices(vertices.DataPtr, BENCHMARK_VERTICES, bindBones, skeleton->bones_num, modes[m], positions.DataPtr, normals.DataPtr);
+		});
+		MeasureBenchmark(out, modeNames[m], "scheduler", skeleton->bones_num, "vertices", BENCHMARK_VERTICES, [&](u32) {
+			ParallelSkinVertices(vertices.DataPtr, BENCHMARK_VERTICES, bindBones, skeleton->bones_num, modes[m], positions.DataPtr, normals.DataPtr);
+		});
+	}
+
+	for (auto i : MakeRange(BENCHMARK_INSTANCES)) {
+		FreePose(&instances->poses[i], GetMallocAllocator());
+	}
+	FreeMemory(instances->transforms);
+
+	FreeBenchmarkSkeleton(&data);
+}
+
+// EssenceTest --bench [output.csv], results go to stdout without a file
+void RunBenchmarks(int argc, char * argv[]) {
+	FILE* out = stdout;
+	for (int i = 1; i + 1 < argc; ++i) {
+		if (strcmp(argv[i], "--bench") == 0) {
+			if (fopen_s(&out, argv[i + 1], "w") != 0) {
+				fprintf(stderr, "can't open %s\n", argv[i + 1]);
+				return;
+			}
+		}
+	}
+
+	Essence::InitMemoryAllocators();
+	InitScheduler();
+
+	fprintf(out, "benchmark,mode,skeleton_bones,unit,items,seconds,items_per_second\n");
+
+	random_generator rng(41);
+	u32 skeletonSizes[] = { 32, 64, 160 };
+	for (auto nodesNum : skeletonSizes) {
+		BenchmarkSkeleton(out, rng, nodesNum);
+	}
+
+	ShutdownScheduler();
+	Essence::ShutdownMemoryAllocators();
+
+	if (out != stdout) {
+		fclose(out);
+	}
+}
\ No newline at end of file
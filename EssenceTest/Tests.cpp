@@ -383,6 +383,3485 @@ void TestScheduler(int argc, char * argv[]) {
 	Essence::ShutdownMemoryAllocators();
 }
 
+#include "Meshlets.h"
+
+void BuildGridMesh(u32 size, Essence::Array<Vec3f>& positions, Essence::Array<u32>& indices) {
+	using namespace Essence;
+
+	for (u32 y = 0; y <= size; ++y) {
+		for (u32 x = 0; x <= size; ++x) {
+			PushBack(positions, Vec3f((float)x, (float)y, 0.f));
+		}
+	}
+	for (u32 y = 0; y < size; ++y) {
+		for (u32 x = 0; x < size; ++x) {
+			u32 i = y * (size + 1) + x;
+			u32 quad[6] = { i, i + 1, i + size + 1, i + 1, i + size + 2, i + size + 1 };
+			Append(indices, quad, 6);
+		}
+	}
+}
+
+void TestMeshlets(int argc, char * argv[]) {
+	using namespace Essence;
+
+	const lest::test specification[] = {
+		CASE("meshlets cover every triangle within limits") {
+			Array<Vec3f> positions;
+			Array<u32> indices;
+			BuildGridMesh(32, positions, indices);
+
+			Array<meshlet_t> meshlets;
+			Array<u32> vertices;
+			Array<u8> triangles;
+			auto num = BuildMeshlets(&meshlets, &vertices, &triangles, positions.DataPtr, (u32)Size(positions), indices.DataPtr, (u32)Size(indices));
+
+			EXPECT(num == Size(meshlets));
+			EXPECT(num > 1u);
+
+			Array<u32> rebuilt;
+			for (auto& meshlet : meshlets) {
+				EXPECT(meshlet.vertex_count <= MESHLET_MAX_VERTICES);
+				EXPECT(meshlet.triangle_count <= MESHLET_MAX_TRIANGLES);
+				EXPECT(meshlet.triangle_count > 0);
+
+				for (u32 t = 0; t < meshlet.triangle_count * 3u; ++t) {
+					u8 local = triangles[meshlet.triangle_offset + t];
+					EXPECT(local < meshlet.vertex_count);
+					PushBack(rebuilt, vertices[meshlet.vertex_offset + local]);
+				}
+
+				for (u32 v = 0; v < meshlet.vertex_count; ++v) {
+					Vec3f d = positions[vertices[meshlet.vertex_offset + v]] - meshlet.center;
+					EXPECT(length(d) <= meshlet.radius * 1.0001f);
+				}
+			}
+
+			EXPECT(Size(rebuilt) == Size(indices));
+			EXPECT(memcmp(rebuilt.DataPtr, indices.DataPtr, sizeof(u32) * Size(indices)) == 0);
+		},
+		CASE("meshlets are deterministic") {
+			Array<Vec3f> positions;
+			Array<u32> indices;
+			BuildGridMesh(20, positions, indices);
+
+			Array<meshlet_t> meshletsA, meshletsB;
+			Array<u32> verticesA, verticesB;
+			Array<u8> trianglesA, trianglesB;
+			BuildMeshlets(&meshletsA, &verticesA, &trianglesA, positions.DataPtr, (u32)Size(positions), indices.DataPtr, (u32)Size(indices));
+			BuildMeshlets(&meshletsB, &verticesB, &trianglesB, positions.DataPtr, (u32)Size(positions), indices.DataPtr, (u32)Size(indices));
+
+			EXPECT(Size(meshletsA) == Size(meshletsB));
+			EXPECT(memcmp(meshletsA.DataPtr, meshletsB.DataPtr, sizeof(meshlet_t) * Size(meshletsA)) == 0);
+			EXPECT(memcmp(verticesA.DataPtr, verticesB.DataPtr, sizeof(u32) * Size(verticesA)) == 0);
+			EXPECT(memcmp(trianglesA.DataPtr, trianglesB.DataPtr, Size(trianglesA)) == 0);
+		},
+		CASE("meshlet normal cone rejects backfacing views") {
+			Array<Vec3f> positions;
+			Array<u32> indices;
+			BuildGridMesh(4, positions, indices);
+
+			Array<meshlet_t> meshlets;
+			Array<u32> vertices;
+			Array<u8> triangles;
+			BuildMeshlets(&meshlets, &vertices, &triangles, positions.DataPtr, (u32)Size(positions), indices.DataPtr, (u32)Size(indices));
+
+			EXPECT(Size(meshlets) == 1);
+			EXPECT(meshlets[0].cone_axis.z > 0.999f);
+			EXPECT(meshlets[0].cone_cutoff < 0.001f);
+
+			EXPECT(IsMeshletBackfacing(meshlets[0], Vec3f(2.f, 2.f, -10.f)));
+			EXPECT(!IsMeshletBackfacing(meshlets[0], Vec3f(2.f, 2.f, 10.f)));
+		}
+	};
+
+	Essence::InitMemoryAllocators();
+	lest::run(specification, argc, argv);
+	Essence::ShutdownMemoryAllocators();
+}
+
+#include "Bvh.h"
+#include "Random.h"
+
+bool BruteForceIntersect(Essence::ray_t const& ray, Vec3f const* positions, u32 const* indices, u32 trianglesNum, float* outT) {
+	float closest = ray.tmax;
+	bool hit = false;
+	for (u32 i = 0; i < trianglesNum; ++i) {
+		Vec3f v0 = positions[indices[i * 3]];
+		Vec3f e1 = positions[indices[i * 3 + 1]] - v0;
+		Vec3f e2 = positions[indices[i * 3 + 2]] - v0;
+		Vec3f p = cross(ray.direction, e2);
+		float det = dot(e1, p);
+		if (det == 0.f) {
+			continue;
+		}
+		Vec3f tv = ray.origin - v0;
+		float u = dot(tv, p) / det;
+		Vec3f q = cross(tv, e1);
+		float v = dot(q, ray.direction) / det;
+		float t = dot(e2, q) / det;
+		if (u >= 0.f && v >= 0.f && u + v <= 1.f && t >= ray.tmin && t < closest) {
+			closest = t;
+			hit = true;
+		}
+	}
+	*outT = closest;
+	return hit;
+}
+
+void TestBvh(int argc, char * argv[]) {
+	using namespace Essence;
+
+	const lest::test specification[] = {
+		CASE("bvh closest and any hit match brute force") {
+			random_generator rng(17);
+
+			const u32 trianglesNum = 2000;
+			Array<Vec3f> positions;
+			Array<u32> indices;
+			for (u32 i = 0; i < trianglesNum; ++i) {
+				Vec3f center = Vec3f(rng.f32Next(-10.f, 10.f), rng.f32Next(-10.f, 10.f), rng.f32Next(-10.f, 10.f));
+				for (u32 k = 0; k < 3; ++k) {
+					PushBack(indices, (u32)Size(positions));
+					PushBack(positions, center + Vec3f(rng.f32Next(-1.f, 1.f), rng.f32Next(-1.f, 1.f), rng.f32Next(-1.f, 1.f)));
+				}
+			}
+
+			bvh_t bvh;
+			BuildTriangleBvh(&bvh, positions.DataPtr, indices.DataPtr, trianglesNum);
+			EXPECT(bvh.nodes.num <= trianglesNum * 2);
+
+			Array<ray_t> rays;
+			for (u32 i = 0; i < 500; ++i) {
+				ray_t ray;
+				ray.origin = Vec3f(rng.f32Next(-15.f, 15.f), rng.f32Next(-15.f, 15.f), -20.f);
+				ray.direction = normalize(Vec3f(rng.f32Next(-0.5f, 0.5f), rng.f32Next(-0.5f, 0.5f), 1.f));
+				ray.tmin = 0.f;
+				ray.tmax = i % 5 ? 100.f : 25.f;
+				PushBack(rays, ray);
+			}
+
+			Array<ray_hit_t> hits;
+			Resize(hits, Size(rays));
+			IntersectClosest(bvh, rays.DataPtr, hits.DataPtr, (u32)Size(rays));
+
+			u32 hitsNum = 0;
+			for (u32 i = 0; i < Size(rays); ++i) {
+				float t;
+				bool expected = BruteForceIntersect(rays[i], positions.DataPtr, indices.DataPtr, trianglesNum, &t);
+				EXPECT((hits[i].primitive != BVH_NULL_INDEX) == expected);
+				EXPECT(IntersectAny(bvh, rays[i]) == expected);
+				if (expected) {
+					EXPECT(fabsf(hits[i].t - t) < 1e-4f);
+					hitsNum++;
+				}
+			}
+			EXPECT(hitsNum > 0u);
+
+			FreeBvh(&bvh);
+		},
+		CASE("parallel bvh build gives the same hits") {
+			random_generator rng(5);
+
+			const u32 trianglesNum = 20000;
+			Array<Vec3f> positions;
+			Array<u32> indices;
+			for (u32 i = 0; i < trianglesNum; ++i) {
+				Vec3f center = Vec3f(rng.f32Next(-50.f, 50.f), rng.f32Next(-50.f, 50.f), rng.f32Next(-50.f, 50.f));
+				for (u32 k = 0; k < 3; ++k) {
+					PushBack(indices, (u32)Size(positions));
+					PushBack(positions, center + Vec3f(rng.f32Next(-1.f, 1.f), rng.f32Next(-1.f, 1.f), rng.f32Next(-1.f, 1.f)));
+				}
+			}
+
+			InitScheduler();
+
+			bvh_t serialBvh, parallelBvh;
+			BuildTriangleBvh(&serialBvh, positions.DataPtr, indices.DataPtr, trianglesNum, false);
+			BuildTriangleBvh(&parallelBvh, positions.DataPtr, indices.DataPtr, trianglesNum, true);
+			EXPECT(serialBvh.nodes.num == parallelBvh.nodes.num);
+
+			Array<ray_t> rays;
+			for (u32 i = 0; i < 2000; ++i) {
+				ray_t ray;
+				ray.origin = Vec3f(0.f);
+				ray.direction = normalize(Vec3f(rng.f32Next(-1.f, 1.f), rng.f32Next(-1.f, 1.f), rng.f32Next(-1.f, 1.f)));
+				ray.tmin = 0.f;
+				ray.tmax = 1000.f;
+				PushBack(rays, ray);
+			}
+
+			Array<ray_hit_t> serialHits, parallelHits;
+			Resize(serialHits, Size(rays));
+			Resize(parallelHits, Size(rays));
+			IntersectClosest(serialBvh, rays.DataPtr, serialHits.DataPtr, (u32)Size(rays));
+			ParallelIntersectClosest(parallelBvh, rays.DataPtr, parallelHits.DataPtr, (u32)Size(rays));
+
+			for (u32 i = 0; i < Size(rays); ++i) {
+				EXPECT(serialHits[i].primitive == parallelHits[i].primitive);
+				EXPECT(serialHits[i].t == parallelHits[i].t);
+			}
+
+			ShutdownScheduler();
+
+			FreeBvh(&serialBvh);
+			FreeBvh(&parallelBvh);
+		},
+		CASE("box bvh visits primitives front to back") {
+			Array<Vec3f> boundsMin, boundsMax;
+			for (u32 i = 0; i < 64; ++i) {
+				PushBack(boundsMin, Vec3f((float)i * 2.f, 0.f, 0.f));
+				PushBack(boundsMax, Vec3f((float)i * 2.f + 1.f, 1.f, 1.f));
+			}
+
+			bvh_t bvh;
+			BuildBoxBvh(&bvh, boundsMin.DataPtr, boundsMax.DataPtr, 64);
+			EXPECT(bvh.primitives.num == 64u);
+
+			struct box_test_t {
+				Array<Vec3f>* bmin;
+				u32 tested;
+			} userData = { &boundsMin, 0 };
+
+			auto test = [](void* userData, u32 primitive, ray_t const& ray) {
+				auto data = (box_test_t*)userData;
+				data->tested++;
+				return ((*data->bmin)[primitive].x - ray.origin.x) / ray.direction.x;
+			};
+
+			ray_t ray;
+			ray.origin = Vec3f(-1.f, 0.5f, 0.5f);
+			ray.direction = Vec3f(1.f, 0.f, 0.f);
+			ray.tmin = 0.f;
+			ray.tmax = 1000.f;
+
+			float t;
+			auto primitive = IntersectClosestPrimitive(bvh, ray, test, &userData, &t);
+			EXPECT(primitive == 0u);
+			EXPECT(t == 1.f);
+			EXPECT(userData.tested < 64u);
+
+			ray.origin = Vec3f(-1.f, 5.f, 0.5f);
+			EXPECT(IntersectClosestPrimitive(bvh, ray, test, &userData, &t) == BVH_NULL_INDEX);
+
+			FreeBvh(&bvh);
+		}
+	};
+
+	Essence::InitMemoryAllocators();
+	lest::run(specification, argc, argv);
+	Essence::ShutdownMemoryAllocators();
+}
+
+#include "Animation.h"
+#include <DirectXMath.h>
+
+struct test_animation_channels_t {
+	Essence::Array<Essence::position_key_t>		position_keys;
+	Essence::Array<Essence::rotation_key_t>		rotation_keys;
+	Essence::Array<Essence::animation_channel_t>	channels;
+};
+
+void BuildRandomChannels(test_animation_channels_t* out, Essence::random_generator& rng, u32 channelsNum, float duration, float maxStep) {
+	using namespace Essence;
+	using namespace DirectX;
+
+	Array<u32> positionsNum, rotationsNum;
+	for (u32 c = 0; c < channelsNum; ++c) {
+		u32 pn = 1 + rng.u32Next(40);
+		u32 rn = 1 + rng.u32Next(40);
+		PushBack(positionsNum, pn);
+		PushBack(rotationsNum, rn);
+
+		for (u32 k = 0; k < pn; ++k) {
+			position_key_t key;
+			key.time = duration * k / max(pn - 1, 1u);
+			key.value = float3a(rng.f32Next(-10.f, 10.f), rng.f32Next(-10.f, 10.f), rng.f32Next(-10.f, 10.f));
+			PushBack(out->position_keys, key);
+		}
+
+		xmvec q = XMQuaternionIdentity();
+		for (u32 k = 0; k < rn; ++k) {
+			auto axis = XMVectorSet(rng.f32Next(-1.f, 1.f), rng.f32Next(-1.f, 1.f), rng.f32Next(-1.f, 1.f) + 0.01f, 0.f);
+			q = XMQuaternionNormalize(XMQuaternionMultiply(q, XMQuaternionRotationAxis(axis, rng.f32Next(0.f, maxStep))));
+			// stored sign is arbitrary in imported data
+			auto stored = rng.u32Next(2) ? XMVectorNegate(q) : q;
+
+			rotation_key_t key;
+			key.time = duration * k / max(rn - 1, 1u);
+			XMStoreFloat4(&key.value, stored);
+			PushBack(out->rotation_keys, key);
+		}
+	}
+
+	u32 positionsOffset = 0;
+	u32 rotationsOffset = 0;
+	for (u32 c = 0; c < channelsNum; ++c) {
+		animation_channel_t channel;
+		channel.position_keys = out->position_keys.DataPtr + positionsOffset;
+		channel.position_keys_num = positionsNum[c];
+		channel.rotation_keys = out->rotation_keys.DataPtr + rotationsOffset;
+		channel.rotation_keys_num = rotationsNum[c];
+		PushBack(out->channels, channel);
+
+		positionsOffset += positionsNum[c];
+		rotationsOffset += rotationsNum[c];
+	}
+}
+
+Essence::xmmatrix ReferenceChannelTransform(Essence::animation_channel_t const& channel, float time) {
+	using namespace Essence;
+	using namespace DirectX;
+
+	u32 p = 0;
+	while (p + 1 < channel.position_keys_num && channel.position_keys[p + 1].time < time) {
+		++p;
+	}
+	u32 pn = min(p + 1, channel.position_keys_num - 1);
+	float pd = channel.position_keys[pn].time - channel.position_keys[p].time;
+	float pb = pd > 0 ? min(max((time - channel.position_keys[p].time) / pd, 0.f), 1.f) : 0;
+
+	u32 r = 0;
+	while (r + 1 < channel.rotation_keys_num && channel.rotation_keys[r + 1].time < time) {
+		++r;
+	}
+	u32 rn = min(r + 1, channel.rotation_keys_num - 1);
+	float rd = channel.rotation_keys[rn].time - channel.rotation_keys[r].time;
+	float rb = rd > 0 ? min(max((time - channel.rotation_keys[r].time) / rd, 0.f), 1.f) : 0;
+
+	auto position = XMVectorLerp(XMLoadFloat3A(&channel.position_keys[p].value), XMLoadFloat3A(&channel.position_keys[pn].value), pb);
+	auto rotation = XMQuaternionSlerp(XMLoadFloat4(&channel.rotation_keys[r].value), XMLoadFloat4(&channel.rotation_keys[rn].value), rb);
+
+	xmmatrix m = XMMatrixRotationQuaternion(rotation);
+	m.r[3] = XMVectorSetW(position, 1.f);
+	return m;
+}
+
+float MaxMatrixDifference(Essence::xmmatrix const& a, Essence::xmmatrix const& b) {
+	float difference = 0.f;
+	for (u32 r = 0; r < 4; ++r) {
+		Essence::float4 va, vb;
+		DirectX::XMStoreFloat4(&va, a.r[r]);
+		DirectX::XMStoreFloat4(&vb, b.r[r]);
+		difference = max(difference, max(max(fabsf(va.x - vb.x), fabsf(va.y - vb.y)), max(fabsf(va.z - vb.z), fabsf(va.w - vb.w))));
+	}
+	return difference;
+}
+
+void PoseChannel(Essence::animation_pose_t const& pose, u32 channel, Essence::xmvec* outTranslation, Essence::xmvec* outRotation) {
+	auto& key = pose.groups[channel / Essence::ANIMATION_GROUP_CHANNELS];
+	auto lane = channel % Essence::ANIMATION_GROUP_CHANNELS;
+
+	float t[3][4], r[4][4];
+	for (u32 i = 0; i < 3; ++i) {
+		_mm_storeu_ps(t[i], key.translation[i]);
+	}
+	for (u32 i = 0; i < 4; ++i) {
+		_mm_storeu_ps(r[i], key.rotation[i]);
+	}
+	*outTranslation = DirectX::XMVectorSet(t[0][lane], t[1][lane], t[2][lane], 0.f);
+	*outRotation = DirectX::XMVectorSet(r[0][lane], r[1][lane], r[2][lane], r[3][lane]);
+}
+
+// same rotation up to the sign
+float RotationDifference(Essence::xmvec a, Essence::xmvec b) {
+	return 1.f - fabsf(DirectX::XMVectorGetX(DirectX::XMVector4Dot(a, b)));
+}
+
+float TranslationDifference(Essence::xmvec a, Essence::xmvec b) {
+	return DirectX::XMVectorGetX(DirectX::XMVector3Length(DirectX::XMVectorSubtract(a, b)));
+}
+
+struct test_pose_skeleton_t {
+	static const u32 nodesNum = 6;
+
+	Essence::xmmatrix				local_transforms[nodesNum];
+	Essence::xmmatrix				bone_offsets[nodesNum];
+	u16								parents[nodesNum];
+	u16								channel_indices[nodesNum];
+	u16								bone_node_indices[nodesNum];
+	Essence::animation_skeleton_t	skeleton;
+};
+
+// chain with five animated nodes and a static tip, every node a bone
+void BuildTestPoseSkeleton(test_pose_skeleton_t* out) {
+	using namespace Essence;
+	using namespace DirectX;
+
+	for (u32 n = 0; n < test_pose_skeleton_t::nodesNum; ++n) {
+		out->local_transforms[n] = XMMatrixRotationAxis(XMVectorSet(1.f, (float)n, 0.5f, 0.f), 0.3f * n) * XMMatrixTranslation(0.f, 1.f, 0.1f * n);
+		out->bone_offsets[n] = XMMatrixTranslation(0.f, -1.f * n, 0.f);
+		out->parents[n] = n ? (u16)(n - 1) : SHORT_NULL_INDEX;
+		out->channel_indices[n] = n + 1 < test_pose_skeleton_t::nodesNum ? (u16)n : SHORT_NULL_INDEX;
+		out->bone_node_indices[n] = (u16)n;
+	}
+
+	out->skeleton = {};
+	out->skeleton.nodes_num = test_pose_skeleton_t::nodesNum;
+	out->skeleton.bones_num = test_pose_skeleton_t::nodesNum;
+	out->skeleton.node_local_transforms = out->local_transforms;
+	out->skeleton.node_parents = out->parents;
+	out->skeleton.node_channel_indices = out->channel_indices;
+	out->skeleton.bone_node_indices = out->bone_node_indices;
+	out->skeleton.bone_offsets = out->bone_offsets;
+	BuildSkeletonPoseData(&out->skeleton);
+}
+
+void TestAnimation(int argc, char * argv[]) {
+	using namespace Essence;
+
+	const lest::test specification[] = {
+		CASE("soa sampler matches slerp reference in any playback order") {
+			random_generator rng(3);
+
+			const u32 channelsNum = 11;
+			const float duration = 100.f;
+			test_animation_channels_t data;
+			BuildRandomChannels(&data, rng, channelsNum, duration, 1.5f);
+
+			animation_t animation;
+			BuildAnimation(&animation, data.channels.DataPtr, channelsNum, duration, 1.f, nullptr, 1e-4f);
+			EXPECT(animation.groups_num == 3u);
+
+			animation_state_t state = {};
+
+			Array<xmmatrix> transforms;
+			float maxDifference = 0.f;
+			for (u32 i = 0; i < 600; ++i) {
+				// forward playback, then random seeks
+				float time = i < 400 ? i * 0.25f : rng.f32Next(0.f, duration * 0.999f);
+				calculate_animation_frames(&animation, &state, time, &transforms);
+				EXPECT(Size(transforms) == channelsNum);
+
+				for (u32 c = 0; c < channelsNum; ++c) {
+					maxDifference = max(maxDifference, MaxMatrixDifference(transforms[c], ReferenceChannelTransform(data.channels[c], time)));
+				}
+			}
+			EXPECT(maxDifference < 2e-3f);
+
+			FreeAnimation(&animation);
+		},
+		CASE("wide rotation steps refine the group timeline") {
+			random_generator rng(8);
+
+			const float duration = 10.f;
+			test_animation_channels_t smallSteps, wideSteps;
+			BuildRandomChannels(&smallSteps, rng, 4, duration, 0.05f);
+			BuildRandomChannels(&wideSteps, rng, 4, duration, 2.5f);
+
+			animation_t smallAnimation, wideAnimation;
+			animation_compression_stats_t smallStats, wideStats;
+			BuildAnimation(&smallAnimation, smallSteps.channels.DataPtr, 4, duration, 1.f, nullptr, 1e-4f, &smallStats);
+			BuildAnimation(&wideAnimation, wideSteps.channels.DataPtr, 4, duration, 1.f, nullptr, 1e-4f, &wideStats);
+
+			u32 smallKeys = 0;
+			for (u32 c = 0; c < 4; ++c) {
+				smallKeys = max(smallKeys, max(smallSteps.channels[c].position_keys_num, smallSteps.channels[c].rotation_keys_num));
+			}
+			// union of key times is never smaller than the densest channel, small steps need no refinement
+			EXPECT(smallStats.sampled_keys_num >= smallKeys);
+			EXPECT(wideStats.sampled_keys_num > smallStats.sampled_keys_num);
+
+			FreeAnimation(&smallAnimation);
+			FreeAnimation(&wideAnimation);
+		},
+		CASE("key lookup doesn't depend on playback direction") {
+			using namespace DirectX;
+			random_generator rng(21);
+
+			// keys crowded at the start, sparse afterwards, so buckets can't all be one key wide
+			const float duration = 50.f;
+			Array<position_key_t> positionKeys;
+			Array<rotation_key_t> rotationKeys;
+			for (u32 k = 0; k < 60; ++k) {
+				float time = k < 40 ? k * 0.05f : 2.f + (k - 40) * (duration - 2.f) / 19.f;
+
+				position_key_t positionKey;
+				positionKey.time = time;
+				positionKey.value = float3a(rng.f32Next(-1.f, 1.f), rng.f32Next(-1.f, 1.f), rng.f32Next(-1.f, 1.f));
+				PushBack(positionKeys, positionKey);
+
+				rotation_key_t rotationKey;
+				rotationKey.time = time;
+				XMStoreFloat4(&rotationKey.value, XMQuaternionRotationAxis(XMVectorSet(0.f, 1.f, 0.f, 0.f), time * 0.1f));
+				PushBack(rotationKeys, rotationKey);
+			}
+
+			animation_channel_t channel;
+			channel.position_keys = positionKeys.DataPtr;
+			channel.position_keys_num = (u32)Size(positionKeys);
+			channel.rotation_keys = rotationKeys.DataPtr;
+			channel.rotation_keys_num = (u32)Size(rotationKeys);
+
+			animation_t animation;
+			BuildAnimation(&animation, &channel, 1, duration, 1.f, nullptr, 1e-5f);
+			EXPECT(animation.groups[0].buckets_num <= animation.groups[0].keys_num * ANIMATION_BUCKETS_PER_KEY);
+
+			const u32 samplesNum = 500;
+			Array<xmmatrix> forward, backward, transforms;
+			animation_state_t state = {};
+			for (u32 i = 0; i < samplesNum; ++i) {
+				calculate_animation_frames(&animation, &state, duration * i / samplesNum, &transforms);
+				PushBack(forward, transforms[0]);
+			}
+			Resize(backward, samplesNum);
+			for (u32 i = samplesNum; i-- > 0;) {
+				calculate_animation_frames(&animation, &state, duration * i / samplesNum, &transforms);
+				backward[i] = transforms[0];
+			}
+
+			float maxDifference = 0.f;
+			for (u32 i = 0; i < samplesNum; ++i) {
+				EXPECT(memcmp(&forward[i], &backward[i], sizeof(xmmatrix)) == 0);
+				maxDifference = max(maxDifference, MaxMatrixDifference(forward[i], ReferenceChannelTransform(channel, duration * i / samplesNum)));
+			}
+			EXPECT(maxDifference < 1e-3f);
+
+			FreeAnimation(&animation);
+		},
+		CASE("compression stays in the error budget at the bone tips") {
+			using namespace DirectX;
+
+			// six bone chain, every node animated by a smooth swing
+			const u32 nodesNum = 6;
+			const u32 keysNum = 121;
+			const float duration = 120.f;
+
+			xmmatrix localTransforms[nodesNum];
+			u16 parents[nodesNum];
+			u16 channelIndices[nodesNum];
+			for (u32 n = 0; n < nodesNum; ++n) {
+				localTransforms[n] = XMMatrixTranslation(0.f, 1.f, 0.f);
+				parents[n] = n ? (u16)(n - 1) : SHORT_NULL_INDEX;
+				channelIndices[n] = (u16)n;
+			}
+
+			animation_skeleton_t skeleton = {};
+			skeleton.nodes_num = nodesNum;
+			skeleton.node_local_transforms = localTransforms;
+			skeleton.node_parents = parents;
+			skeleton.node_channel_indices = channelIndices;
+
+			Array<position_key_t> positionKeys;
+			Array<rotation_key_t> rotationKeys;
+			for (u32 n = 0; n < nodesNum; ++n) {
+				for (u32 k = 0; k < keysNum; ++k) {
+					float time = duration * k / (keysNum - 1);
+
+					position_key_t positionKey;
+					positionKey.time = time;
+					positionKey.value = float3a(0.f, 1.f, 0.f);
+					PushBack(positionKeys, positionKey);
+
+					rotation_key_t rotationKey;
+					rotationKey.time = time;
+					XMStoreFloat4(&rotationKey.value, XMQuaternionRotationAxis(XMVectorSet(1.f, 0.f, (float)n, 0.f), 0.6f * sinf(time * 0.02f + n)));
+					PushBack(rotationKeys, rotationKey);
+				}
+			}
+
+			animation_channel_t channels[nodesNum];
+			for (u32 n = 0; n < nodesNum; ++n) {
+				channels[n].position_keys = positionKeys.DataPtr + n * keysNum;
+				channels[n].position_keys_num = keysNum;
+				channels[n].rotation_keys = rotationKeys.DataPtr + n * keysNum;
+				channels[n].rotation_keys_num = keysNum;
+			}
+
+			animation_channel_weight_t weights[nodesNum];
+			float size = ComputeChannelWeights(&skeleton, nodesNum, weights);
+			EXPECT(size == 6.f);
+			EXPECT(weights[0].tip_distance == 6.f);
+			EXPECT(weights[5].tip_distance == 1.f);
+			EXPECT(weights[3].budget_share == 1.f / 6.f);
+
+			const float budget = 0.01f * size;
+			animation_t animation;
+			animation_compression_stats_t stats;
+			BuildAnimation(&animation, channels, nodesNum, duration, 30.f, weights, budget, &stats);
+			MeasureAnimationError(&skeleton, &animation, channels, &stats);
+
+			EXPECT(stats.raw_keys_num == nodesNum * keysNum * 2);
+			EXPECT((stats.keys_num * 3) < stats.sampled_keys_num);
+			EXPECT((stats.compressed_size * 10) < stats.raw_size);
+			EXPECT(stats.max_error <= budget);
+			EXPECT(stats.average_error <= stats.max_error);
+
+			FreeAnimation(&animation);
+		},
+		CASE("sampled poses keep the bind pose and blend like nlerp") {
+			using namespace DirectX;
+			random_generator rng(5);
+
+			test_pose_skeleton_t data;
+			BuildTestPoseSkeleton(&data);
+			auto& skeleton = data.skeleton;
+			EXPECT(skeleton.channels_num == 5u);
+
+			const float duration = 20.f;
+			test_animation_channels_t channelsA, channelsB;
+			BuildRandomChannels(&channelsA, rng, 3, duration, 1.f);
+			BuildRandomChannels(&channelsB, rng, 5, duration, 1.f);
+
+			animation_t animationA, animationB;
+			BuildAnimation(&animationA, channelsA.channels.DataPtr, 3, duration, 1.f, nullptr, 1e-4f);
+			BuildAnimation(&animationB, channelsB.channels.DataPtr, 5, duration, 1.f, nullptr, 1e-4f);
+
+			animation_pose_t poseA, poseB, blended;
+			InitPose(&poseA, skeleton.channels_num, GetMallocAllocator());
+			InitPose(&poseB, skeleton.channels_num, GetMallocAllocator());
+			InitPose(&blended, skeleton.channels_num, GetMallocAllocator());
+
+			float sampleDifference = 0.f;
+			float bindDifference = 0.f;
+			float blendDifference = 0.f;
+			for (u32 i = 0; i < 50; ++i) {
+				float time = rng.f32Next(0.f, duration * 0.999f);
+				sample_animation(&skeleton, &animationA, time, &poseA);
+				sample_animation(&skeleton, &animationB, time, &poseB);
+
+				animation_pose_t const* poses[] = { &poseA, &poseB };
+				float weights[] = { 1.f, 3.f };
+				blend_poses(poses, weights, 2, &blended);
+
+				for (u32 c = 0; c < skeleton.channels_num; ++c) {
+					xmvec ta, qa, tb, qb, t, q;
+					PoseChannel(poseA, c, &ta, &qa);
+					PoseChannel(poseB, c, &tb, &qb);
+					PoseChannel(blended, c, &t, &q);
+
+					if (c < 3) {
+						xmmatrix m = XMMatrixRotationQuaternion(qa);
+						m.r[3] = XMVectorSetW(ta, 1.f);
+						sampleDifference = max(sampleDifference, MaxMatrixDifference(m, ReferenceChannelTransform(channelsA.channels[c], time)));
+					}
+					else {
+						xmvec scale, rotation, translation;
+						XMMatrixDecompose(&scale, &rotation, &translation, data.local_transforms[c]);
+						bindDifference = max(bindDifference, max(RotationDifference(qa, rotation), TranslationDifference(ta, translation)));
+					}
+
+					if (XMVectorGetX(XMVector4Dot(qa, qb)) < 0.f) {
+						qb = XMVectorNegate(qb);
+					}
+					auto expectedRotation = XMQuaternionNormalize(XMVectorLerp(qa, qb, 0.75f));
+					blendDifference = max(blendDifference, max(RotationDifference(q, expectedRotation), TranslationDifference(t, XMVectorLerp(ta, tb, 0.75f))));
+				}
+			}
+			EXPECT(sampleDifference < 2e-3f);
+			EXPECT(bindDifference < 1e-5f);
+			EXPECT(blendDifference < 1e-5f);
+
+			FreePose(&poseA, GetMallocAllocator());
+			FreePose(&poseB, GetMallocAllocator());
+			FreePose(&blended, GetMallocAllocator());
+			FreeAnimation(&animationA);
+			FreeAnimation(&animationB);
+			FreeSkeletonPoseData(&skeleton);
+		},
+		CASE("masked layers and additive poses") {
+			using namespace DirectX;
+			random_generator rng(13);
+
+			test_pose_skeleton_t data;
+			BuildTestPoseSkeleton(&data);
+			auto& skeleton = data.skeleton;
+
+			const float duration = 20.f;
+			test_animation_channels_t channelsA, channelsB;
+			BuildRandomChannels(&channelsA, rng, 5, duration, 1.f);
+			BuildRandomChannels(&channelsB, rng, 5, duration, 1.f);
+
+			animation_t animationA, animationB;
+			BuildAnimation(&animationA, channelsA.channels.DataPtr, 5, duration, 1.f, nullptr, 1e-4f);
+			BuildAnimation(&animationB, channelsB.channels.DataPtr, 5, duration, 1.f, nullptr, 1e-4f);
+
+			animation_pose_t poseA, poseB, layered, additive;
+			InitPose(&poseA, skeleton.channels_num, GetMallocAllocator());
+			InitPose(&poseB, skeleton.channels_num, GetMallocAllocator());
+			InitPose(&layered, skeleton.channels_num, GetMallocAllocator());
+			InitPose(&additive, skeleton.channels_num, GetMallocAllocator());
+			sample_animation(&skeleton, &animationA, 3.f, &poseA);
+			sample_animation(&skeleton, &animationB, 11.f, &poseB);
+
+			// upper part of the chain follows the layer
+			animation_mask_t mask;
+			BuildChannelMask(&skeleton, 2, 1.f, &mask, GetMallocAllocator());
+			EXPECT(mask.weights.num == 2u);
+			EXPECT(XMVectorGetX(mask.weights[0]) == 0.f);
+			EXPECT(XMVectorGetZ(mask.weights[0]) == 1.f);
+			EXPECT(XMVectorGetX(mask.weights[1]) == 1.f);
+
+			memcpy(layered.groups.elements, poseA.groups.elements, sizeof(animation_soa_key_t) * poseA.groups.num);
+			blend_pose_layer(&layered, &poseB, 1.f, &mask);
+
+			float layerDifference = 0.f;
+			for (u32 c = 0; c < skeleton.channels_num; ++c) {
+				xmvec t, q, te, qe;
+				PoseChannel(layered, c, &t, &q);
+				PoseChannel(c < 2 ? poseA : poseB, c, &te, &qe);
+				layerDifference = max(layerDifference, max(RotationDifference(q, qe), TranslationDifference(t, te)));
+			}
+			EXPECT(layerDifference < 1e-5f);
+
+			// full additive on top of its reference gives back the pose, half of it matches quaternion math
+			make_additive_pose(&poseB, &poseA, &additive);
+			memcpy(layered.groups.elements, poseA.groups.elements, sizeof(animation_soa_key_t) * poseA.groups.num);
+			add_pose_layer(&layered, &additive, 1.f, nullptr);
+
+			float additiveDifference = 0.f;
+			for (u32 c = 0; c < skeleton.channels_num; ++c) {
+				xmvec t, q, te, qe;
+				PoseChannel(layered, c, &t, &q);
+				PoseChannel(poseB, c, &te, &qe);
+				additiveDifference = max(additiveDifference, max(RotationDifference(q, qe), TranslationDifference(t, te)));
+			}
+			EXPECT(additiveDifference < 1e-5f);
+
+			memcpy(layered.groups.elements, poseA.groups.elements, sizeof(animation_soa_key_t) * poseA.groups.num);
+			add_pose_layer(&layered, &additive, 0.5f, nullptr);
+
+			float halfDifference = 0.f;
+			for (u32 c = 0; c < skeleton.channels_num; ++c) {
+				xmvec t, q, ta, qa, td, qd;
+				PoseChannel(layered, c, &t, &q);
+				PoseChannel(poseA, c, &ta, &qa);
+				PoseChannel(additive, c, &td, &qd);
+				auto halfRotation = XMQuaternionSlerp(XMQuaternionIdentity(), qd, 0.5f);
+				auto expectedTranslation = XMVectorAdd(ta, XMVectorScale(td, 0.5f));
+				halfDifference = max(halfDifference, max(RotationDifference(q, XMQuaternionMultiply(halfRotation, qa)), TranslationDifference(t, expectedTranslation)));
+			}
+			EXPECT(halfDifference < 1e-5f);
+
+			// bone matrices against a plain hierarchy walk, animated root included
+			bone_transform_t transforms[test_pose_skeleton_t::nodesNum];
+			calculate_pose_transforms(&skeleton, &poseB, transforms);
+
+			xmmatrix global[test_pose_skeleton_t::nodesNum];
+			for (u32 n = 0; n < skeleton.nodes_num; ++n) {
+				xmmatrix local = data.local_transforms[n];
+				if (n < skeleton.channels_num) {
+					xmvec t, q;
+					PoseChannel(poseB, n, &t, &q);
+					local = XMMatrixRotationQuaternion(q);
+					local.r[3] = XMVectorSetW(t, 1.f);
+				}
+				global[n] = n ? local * global[n - 1] : local;
+			}
+			xmvec determinant;
+			xmmatrix rootInverse = XMMatrixInverse(&determinant, global[0]);
+
+			float transformDifference = 0.f;
+			for (u32 b = 0; b < skeleton.bones_num; ++b) {
+				xmmatrix transform = XMMatrixTranspose(data.bone_offsets[b] * global[b] * rootInverse);
+				xmmatrix written = transform;
+				for (u32 r = 0; r < 3; ++r) {
+					written.r[r] = transforms[b].columns[r];
+				}
+				transformDifference = max(transformDifference, MaxMatrixDifference(written, transform));
+			}
+			EXPECT(transformDifference < 1e-4f);
+
+			FreeChannelMask(&mask, GetMallocAllocator());
+			FreePose(&poseA, GetMallocAllocator());
+			FreePose(&poseB, GetMallocAllocator());
+			FreePose(&layered, GetMallocAllocator());
+			FreePose(&additive, GetMallocAllocator());
+			FreeAnimation(&animationA);
+			FreeAnimation(&animationB);
+			FreeSkeletonPoseData(&skeleton);
+		},
+		CASE("lods freeze the deepest nodes in bind pose") {
+			using namespace DirectX;
+			random_generator rng(17);
+
+			test_pose_skeleton_t data;
+			BuildTestPoseSkeleton(&data);
+			auto& skeleton = data.skeleton;
+
+			// six levels deep chain, every lod keeps fewer levels
+			EXPECT(skeleton.lod_nodes_num[0] == 6u);
+			EXPECT(skeleton.lod_nodes_num[1] == 4u);
+			EXPECT(skeleton.lod_nodes_num[2] == 3u);
+			EXPECT(skeleton.lod_nodes_num[3] == 2u);
+			EXPECT(skeleton.lod_bones_num[2] == 3u);
+			EXPECT((u32)skeleton.group_lods[0] == 3u);
+			EXPECT((u32)skeleton.group_lods[1] == 0u);
+
+			const float duration = 20.f;
+			test_animation_channels_t channels;
+			BuildRandomChannels(&channels, rng, 5, duration, 1.f);
+			animation_t animation;
+			BuildAnimation(&animation, channels.channels.DataPtr, 5, duration, 1.f, nullptr, 1e-4f);
+
+			animation_pose_t pose, lodPose;
+			InitPose(&pose, skeleton.channels_num, GetMallocAllocator());
+			InitPose(&lodPose, skeleton.channels_num, GetMallocAllocator());
+			sample_animation(&skeleton, &animation, 7.f, &pose);
+			sample_animation(&skeleton, &animation, 7.f, &lodPose, 1);
+			EXPECT(memcmp(&lodPose.groups[0], &pose.groups[0], sizeof(animation_soa_key_t)) == 0);
+			EXPECT(memcmp(&lodPose.groups[1], &skeleton.bind_pose[1], sizeof(animation_soa_key_t)) == 0);
+
+			bone_transform_t transforms[test_pose_skeleton_t::nodesNum];
+			bone_transform_t lodTransforms[test_pose_skeleton_t::nodesNum];
+			calculate_pose_transforms(&skeleton, &pose, transforms);
+			calculate_pose_transforms(&skeleton, &pose, lodTransforms, 2);
+
+			// evaluated bones match the full skeleton, frozen ones follow them in bind pose
+			xmmatrix global[test_pose_skeleton_t::nodesNum];
+			for (u32 n = 0; n < skeleton.nodes_num; ++n) {
+				xmmatrix local = data.local_transforms[n];
+				if (n < skeleton.lod_nodes_num[2]) {
+					xmvec t, q;
+					PoseChannel(pose, n, &t, &q);
+					local = XMMatrixRotationQuaternion(q);
+					local.r[3] = XMVectorSetW(t, 1.f);
+				}
+				global[n] = n ? local * global[n - 1] : XMMatrixIdentity();
+			}
+
+			float frozenDifference = 0.f;
+			for (u32 b = 0; b < skeleton.bones_num; ++b) {
+				xmmatrix transform = XMMatrixTranspose(data.bone_offsets[b] * global[b]);
+				xmmatrix written = transform;
+				for (u32 r = 0; r < 3; ++r) {
+					written.r[r] = lodTransforms[b].columns[r];
+				}
+				frozenDifference = max(frozenDifference, MaxMatrixDifference(written, transform));
+
+				if (b < skeleton.lod_bones_num[2]) {
+					EXPECT(memcmp(&lodTransforms[b], &transforms[b], sizeof(bone_transform_t)) == 0);
+				}
+			}
+			EXPECT(frozenDifference < 1e-4f);
+
+			FreePose(&pose, GetMallocAllocator());
+			FreePose(&lodPose, GetMallocAllocator());
+			FreeAnimation(&animation);
+			FreeSkeletonPoseData(&skeleton);
+		}
+	};
+
+	Essence::InitMemoryAllocators();
+	lest::run(specification, argc, argv);
+	Essence::ShutdownMemoryAllocators();
+}
+
+#include "Skinning.h"
+
+Essence::bone_transform_t BoneTransformFromMatrix(Essence::xmmatrix m) {
+	auto columns = DirectX::XMMatrixTranspose(m);
+	Essence::bone_transform_t bone;
+	for (u32 i = 0; i < 3; ++i) {
+		bone.columns[i] = columns.r[i];
+	}
+	return bone;
+}
+
+void TestSkinning(int argc, char * argv[]) {
+	using namespace Essence;
+	using namespace DirectX;
+
+	const lest::test specification[] = {
+		CASE("rigid vertices follow their bone in both modes and in parallel") {
+			random_generator rng(29);
+
+			const u32 bonesNum = 5;
+			xmmatrix matrices[bonesNum];
+			bone_transform_t bones[bonesNum];
+			for (u32 b = 0; b < bonesNum; ++b) {
+				auto axis = XMVector3Normalize(XMVectorSet(rng.f32Next(-1.f, 1.f), rng.f32Next(-1.f, 1.f), rng.f32Next(-1.f, 1.f), 0.f));
+				matrices[b] = XMMatrixRotationAxis(axis, rng.f32Next(-3.f, 3.f))
+					* XMMatrixTranslation(rng.f32Next(-5.f, 5.f), rng.f32Next(-5.f, 5.f), rng.f32Next(-5.f, 5.f));
+				bones[b] = BoneTransformFromMatrix(matrices[b]);
+			}
+
+			// whole weight in one slot, the others point at a bone that must be ignored
+			const u32 verticesNum = 5000;
+			Array<animated_mesh_vertex_t> vertices;
+			Resize(vertices, verticesNum);
+			for (auto& vertex : vertices) {
+				vertex = {};
+				vertex.position = float3(rng.f32Next(-2.f, 2.f), rng.f32Next(-2.f, 2.f), rng.f32Next(-2.f, 2.f));
+				XMStoreFloat3(&vertex.normal, XMVector3Normalize(XMVectorSet(rng.f32Next(-1.f, 1.f), rng.f32Next(-1.f, 1.f), rng.f32Next(-1.f, 1.f), 0.f)));
+				auto slot = rng.u32Next() % 4;
+				auto bone = rng.u32Next() % bonesNum;
+				vertex.boneIndices = 0x01010101u & ~(0xFFu << (slot * 8));
+				vertex.boneIndices |= bone << (slot * 8);
+				(&vertex.boneWeights.x)[slot] = 1.f;
+			}
+
+			InitScheduler();
+
+			SkinningModeEnum modes[] = { SKINNING_LINEAR, SKINNING_DUAL_QUATERNION };
+			for (auto mode : modes) {
+				Array<Vec3f> positions, normals, parallelPositions, parallelNormals;
+				Resize(positions, verticesNum);
+				Resize(normals, verticesNum);
+				Resize(parallelPositions, verticesNum);
+				Resize(parallelNormals, verticesNum);
+
+				SkinVertices(vertices.DataPtr, verticesNum, bones, bonesNum, mode, positions.DataPtr, normals.DataPtr);
+				ParallelSkinVertices(vertices.DataPtr, verticesNum, bones, bonesNum, mode, parallelPositions.DataPtr, parallelNormals.DataPtr);
+
+				float maxDifference = 0.f;
+				for (u32 v = 0; v < verticesNum; ++v) {
+					auto const& vertex = vertices[v];
+					auto slot = vertex.boneWeights.x == 1.f ? 0 : vertex.boneWeights.y == 1.f ? 1 : vertex.boneWeights.z == 1.f ? 2 : 3;
+					auto const& matrix = matrices[(vertex.boneIndices >> (slot * 8)) & 255];
+
+					Vec3f expectedPosition, expectedNormal;
+					XMStoreFloat3((XMFLOAT3*)&expectedPosition, XMVector3TransformCoord(XMLoadFloat3(&vertex.position), matrix));
+					XMStoreFloat3((XMFLOAT3*)&expectedNormal, XMVector3TransformNormal(XMLoadFloat3(&vertex.normal), matrix));
+
+					maxDifference = max(maxDifference, length(positions[v] - expectedPosition));
+					maxDifference = max(maxDifference, length(normals[v] - expectedNormal));
+				}
+				EXPECT(maxDifference < 1e-4f);
+				EXPECT(memcmp(positions.DataPtr, parallelPositions.DataPtr, sizeof(Vec3f) * verticesNum) == 0);
+				EXPECT(memcmp(normals.DataPtr, parallelNormals.DataPtr, sizeof(Vec3f) * verticesNum) == 0);
+			}
+
+			ShutdownScheduler();
+		},
+		CASE("dual quaternions keep the distance from a twisting joint") {
+			bone_transform_t bones[2] = {
+				BoneTransformFromMatrix(XMMatrixIdentity()),
+				BoneTransformFromMatrix(XMMatrixRotationX(XM_PI * 2.f / 3.f))
+			};
+
+			animated_mesh_vertex_t vertex = {};
+			vertex.position = float3(0.f, 1.f, 0.f);
+			vertex.normal = float3(0.f, 1.f, 0.f);
+			vertex.boneIndices = 0x0100;
+			vertex.boneWeights = float4(0.5f, 0.5f, 0.f, 0.f);
+
+			Vec3f linearPosition, linearNormal, dqPosition, dqNormal;
+			SkinVertices(&vertex, 1, bones, 2, SKINNING_LINEAR, &linearPosition, &linearNormal);
+			SkinVertices(&vertex, 1, bones, 2, SKINNING_DUAL_QUATERNION, &dqPosition, &dqNormal);
+
+			// linear blend averages the endpoints and pulls the vertex towards the axis
+			EXPECT(lest::approx(length(linearPosition)) == 0.5f);
+			EXPECT(lest::approx(length(dqPosition)) == 1.f);
+			EXPECT(lest::approx(dqPosition[1]) == cosf(XM_PI / 3.f));
+			EXPECT(lest::approx(dqPosition[2]) == sinf(XM_PI / 3.f));
+			EXPECT(length(dqNormal - dqPosition) < 1e-5f);
+			EXPECT(lest::approx(length(linearNormal)) == 1.f);
+		}
+	};
+
+	Essence::InitMemoryAllocators();
+	lest::run(specification, argc, argv);
+	Essence::ShutdownMemoryAllocators();
+}
+
+#include "Culling.h"
+#include <float.h>
+
+void TestCulling(int argc, char * argv[]) {
+	using namespace Essence;
+	using namespace DirectX;
+
+	const lest::test specification[] = {
+		CASE("culled objects match a per plane reference, serial and parallel agree") {
+			random_generator rng(31);
+
+			auto viewProj = XMMatrixLookAtLH(XMVectorSet(3.f, 2.f, -40.f, 1.f), XMVectorSet(0.f, 0.f, 0.f, 1.f), XMVectorSet(0.f, 1.f, 0.f, 0.f))
+				* XMMatrixPerspectiveFovLH(XM_PI / 3.f, 16.f / 9.f, 1.f, 60.f);
+			frustum_t frustum;
+			ExtractFrustum(viewProj, &frustum);
+
+			// not a multiple of the block size so the last block is partial
+			const u32 objectsNum = 4999;
+			Array<cull_bounds4_t> blocks;
+			Resize(blocks, (objectsNum + CULL_BLOCK_SIZE - 1) / CULL_BLOCK_SIZE);
+			Array<float> margins;
+			Resize(margins, objectsNum);
+
+			for (u32 i = 0; i < objectsNum; ++i) {
+				object_bounds_t bounds;
+				bounds.box_min = float3(rng.f32Next(-2.f, 0.f), rng.f32Next(-2.f, 0.f), rng.f32Next(-2.f, 0.f));
+				bounds.box_max = float3(rng.f32Next(0.f, 2.f), rng.f32Next(0.f, 2.f), rng.f32Next(0.f, 2.f));
+				bounds.sphere_center = float3(rng.f32Next(-0.5f, 0.5f), rng.f32Next(-0.5f, 0.5f), rng.f32Next(-0.5f, 0.5f));
+				bounds.sphere_radius = rng.f32Next(1.f, 3.f);
+
+				auto axis = XMVector3Normalize(XMVectorSet(rng.f32Next(-1.f, 1.f), rng.f32Next(-1.f, 1.f), rng.f32Next(-1.f, 1.f), 0.f));
+				auto scale = rng.f32Next(0.5f, 2.f);
+				auto world = XMMatrixScaling(scale, scale, scale) * XMMatrixRotationAxis(axis, rng.f32Next(-3.f, 3.f))
+					* XMMatrixTranslation(rng.f32Next(-50.f, 50.f), rng.f32Next(-30.f, 30.f), rng.f32Next(-20.f, 80.f));
+				SetCullBounds(blocks.DataPtr, i, world, bounds);
+
+				// world box from the eight transformed corners
+				auto boxMin = XMVectorReplicate(FLT_MAX);
+				auto boxMax = XMVectorReplicate(-FLT_MAX);
+				for (u32 c = 0; c < 8; ++c) {
+					auto corner = XMVectorSet(c & 1 ? bounds.box_max.x : bounds.box_min.x, c & 2 ? bounds.box_max.y : bounds.box_min.y,
+						c & 4 ? bounds.box_max.z : bounds.box_min.z, 1.f);
+					corner = XMVector3TransformCoord(corner, world);
+					boxMin = XMVectorMin(boxMin, corner);
+					boxMax = XMVectorMax(boxMax, corner);
+				}
+				auto sphereCenter = XMVector3TransformCoord(XMLoadFloat3(&bounds.sphere_center), world);
+
+				// smallest distance by which either volume reaches into a plane, negative is culled
+				float margin = FLT_MAX;
+				for (auto const& plane : frustum.planes) {
+					auto planeVector = XMLoadFloat4(&plane);
+					auto boxRadius = XMVectorGetX(XMVector3Dot(XMVectorAbs(planeVector), XMVectorScale(XMVectorSubtract(boxMax, boxMin), 0.5f)));
+					auto boxDistance = XMVectorGetX(XMPlaneDotCoord(planeVector, XMVectorScale(XMVectorAdd(boxMin, boxMax), 0.5f)));
+					auto sphereDistance = XMVectorGetX(XMPlaneDotCoord(planeVector, sphereCenter));
+					margin = min(margin, min(boxDistance + boxRadius, sphereDistance + bounds.sphere_radius * scale));
+				}
+				margins[i] = margin;
+			}
+
+			Array<u32> visible, parallelVisible;
+			Resize(visible, objectsNum);
+			Resize(parallelVisible, objectsNum);
+
+			auto visibleNum = CullBounds(frustum, blocks.DataPtr, objectsNum, visible.DataPtr);
+
+			InitScheduler();
+			auto parallelVisibleNum = ParallelCullBounds(frustum, blocks.DataPtr, objectsNum, parallelVisible.DataPtr);
+			ShutdownScheduler();
+
+			u32 mismatches = 0;
+			u32 insideNum = 0;
+			u32 next = 0;
+			for (u32 i = 0; i < objectsNum; ++i) {
+				bool reported = next < visibleNum && visible[next] == i;
+				next += reported;
+				insideNum += margins[i] >= 0.f;
+				// rounding decides the ones touching a plane
+				if (fabsf(margins[i]) > 1e-3f) {
+					mismatches += reported != (margins[i] >= 0.f);
+				}
+			}
+			EXPECT(next == visibleNum);
+			EXPECT(mismatches == 0u);
+			EXPECT(insideNum > 0u);
+			EXPECT(insideNum < objectsNum);
+			EXPECT(parallelVisibleNum == visibleNum);
+			EXPECT(memcmp(visible.DataPtr, parallelVisible.DataPtr, sizeof(u32) * visibleNum) == 0);
+		}
+	};
+
+	Essence::InitMemoryAllocators();
+	lest::run(specification, argc, argv);
+	Essence::ShutdownMemoryAllocators();
+}
+
+#include "RenderQueue.h"
+
+void TestRenderQueue(int argc, char * argv[]) {
+	using namespace Essence;
+
+	const lest::test specification[] = {
+		CASE("radix sort orders keys and keeps equal keys in submission order") {
+			random_generator rng(37);
+
+			render_queue_t queue;
+			const u32 itemsNum = 10000;
+			for (u32 i = 0; i < itemsNum; ++i) {
+				// few distinct states so equal keys are common, depth spread over the low bits
+				auto key = MakeRenderSortKey(RENDER_PASS_OPAQUE, rng.u32Next() % 3, rng.u32Next() % 2, rng.u32Next() % 5, (rng.u32Next() % 16) / 16.f);
+				PushRenderItem(queue, key, i);
+			}
+
+			Array<u64> expected;
+			Append(expected, queue.keys.DataPtr, itemsNum);
+			quicksort(expected.DataPtr, 0, itemsNum, [](u64 a, u64 b) { return a < b; });
+
+			Array<u64> unsortedKeys;
+			Append(unsortedKeys, queue.keys.DataPtr, itemsNum);
+
+			SortRenderQueue(queue);
+
+			EXPECT(memcmp(queue.keys.DataPtr, expected.DataPtr, sizeof(u64) * itemsNum) == 0);
+			u32 unstable = 0;
+			u32 wrongItems = 0;
+			for (u32 i = 0; i < itemsNum; ++i) {
+				wrongItems += unsortedKeys[queue.items[i]] != queue.keys[i];
+				if (i > 0 && queue.keys[i] == queue.keys[i - 1]) {
+					unstable += queue.items[i] < queue.items[i - 1];
+				}
+			}
+			EXPECT(wrongItems == 0u);
+			EXPECT(unstable == 0u);
+
+			FreeMemory(queue);
+		},
+		CASE("key fields order by pass, pipeline, material, mesh then depth") {
+			EXPECT(MakeRenderSortKey(RENDER_PASS_OPAQUE, 5, 5, 5, 1.f) < MakeRenderSortKey(RENDER_PASS_TRANSPARENT, 0, 0, 0, 0.f));
+			EXPECT(MakeRenderSortKey(RENDER_PASS_OPAQUE, 1, 5, 5, 1.f) < MakeRenderSortKey(RENDER_PASS_OPAQUE, 2, 0, 0, 0.f));
+			EXPECT(MakeRenderSortKey(RENDER_PASS_OPAQUE, 1, 1, 5, 1.f) < MakeRenderSortKey(RENDER_PASS_OPAQUE, 1, 2, 0, 0.f));
+			EXPECT(MakeRenderSortKey(RENDER_PASS_OPAQUE, 1, 1, 1, 1.f) < MakeRenderSortKey(RENDER_PASS_OPAQUE, 1, 1, 2, 0.f));
+			// opaque front to back, transparent back to front
+			EXPECT(MakeRenderSortKey(RENDER_PASS_OPAQUE, 1, 1, 1, 0.25f) < MakeRenderSortKey(RENDER_PASS_OPAQUE, 1, 1, 1, 0.5f));
+			EXPECT(MakeRenderSortKey(RENDER_PASS_TRANSPARENT, 1, 1, 1, 0.5f) < MakeRenderSortKey(RENDER_PASS_TRANSPARENT, 1, 1, 1, 0.25f));
+			EXPECT(MakeRenderSortKey(RENDER_PASS_OPAQUE, 1, 1, 1, -3.f) == MakeRenderSortKey(RENDER_PASS_OPAQUE, 1, 1, 1, 0.f));
+		},
+		CASE("batches split on state changes and at the instance limit, depth doesn't split") {
+			render_queue_t queue;
+			for (u32 i = 0; i < 10; ++i) {
+				PushRenderItem(queue, MakeRenderSortKey(RENDER_PASS_OPAQUE, 1, 0, 3, i / 10.f), i);
+			}
+			PushRenderItem(queue, MakeRenderSortKey(RENDER_PASS_OPAQUE, 1, 0, 4, 0.f), 10);
+			PushRenderItem(queue, MakeRenderSortKey(RENDER_PASS_OPAQUE, 2, 0, 4, 0.f), 11);
+			SortRenderQueue(queue);
+
+			Array<render_batch_t> batches;
+			BuildRenderBatches(queue, 4, nullptr, nullptr, &batches);
+
+			EXPECT(Size(batches) == 5);
+			EXPECT(batches[0].first == 0u);
+			EXPECT(batches[0].count == 4u);
+			EXPECT(batches[1].count == 4u);
+			EXPECT(batches[2].first == 8u);
+			EXPECT(batches[2].count == 2u);
+			EXPECT(queue.items[batches[3].first] == 10u);
+			EXPECT(batches[3].count == 1u);
+			EXPECT(queue.items[batches[4].first] == 11u);
+			EXPECT(batches[4].count == 1u);
+
+			FreeMemory(queue);
+		},
+		CASE("ids folding to the same key are still drawn apart") {
+			// mesh 4096 folds onto 1, pipeline 4102 onto 7
+			u64 meshes[] = { 1, 4096, 1, 4096, 1 };
+			u64 pipelines[] = { 7, 7, 7, 4102, 4102 };
+			EXPECT(MakeRenderSortKey(RENDER_PASS_OPAQUE, 7, 0, 4096, 0.f) == MakeRenderSortKey(RENDER_PASS_OPAQUE, 7, 0, 1, 0.f));
+			EXPECT(MakeRenderSortKey(RENDER_PASS_OPAQUE, 4102, 0, 1, 0.f) == MakeRenderSortKey(RENDER_PASS_OPAQUE, 7, 0, 1, 0.f));
+
+			render_queue_t queue;
+			for (u32 i = 0; i < 5; ++i) {
+				PushRenderItem(queue, MakeRenderSortKey(RENDER_PASS_OPAQUE, pipelines[i], 0, meshes[i], 0.f), i);
+			}
+			SortRenderQueue(queue);
+
+			Array<render_batch_t> keysOnly;
+			BuildRenderBatches(queue, 16, nullptr, nullptr, &keysOnly);
+			EXPECT(Size(keysOnly) == 1);
+
+			struct draw_t {
+				u64 mesh;
+				u64 pipeline;
+			};
+			draw_t draws[5];
+			for (u32 i = 0; i < 5; ++i) {
+				draws[i] = { meshes[i], pipelines[i] };
+			}
+			auto sameDraw = [](void* user, u32 firstItem, u32 item) {
+				auto draws = (draw_t*)user;
+				return draws[firstItem].mesh == draws[item].mesh && draws[firstItem].pipeline == draws[item].pipeline;
+			};
+
+			Array<render_batch_t> batches;
+			BuildRenderBatches(queue, 16, sameDraw, draws, &batches);
+			bool exact = true;
+			u32 covered = 0;
+			for (auto batch : batches) {
+				auto first = queue.items[batch.first];
+				for (u32 i = 0; i < batch.count; ++i) {
+					exact = exact && sameDraw(draws, first, queue.items[batch.first + i]);
+				}
+				covered += batch.count;
+			}
+			EXPECT(exact);
+			EXPECT(covered == 5u);
+			// equal keys keep submission order, where no two neighbours match
+			EXPECT(Size(batches) == 5);
+
+			FreeMemory(batches);
+			FreeMemory(keysOnly);
+			FreeMemory(queue);
+		}
+	};
+
+	Essence::InitMemoryAllocators();
+	lest::run(specification, argc, argv);
+	Essence::ShutdownMemoryAllocators();
+}
+
+#include "DynamicBvh.h"
+
+struct dynamic_bvh_test_box_t {
+	Vec3f		bounds_min;
+	Vec3f		bounds_max;
+	u32			proxy;		// DYNAMIC_BVH_NULL when removed
+};
+
+// parents enclose children and link back to them, every live proxy is reached once
+bool ValidateDynamicBvh(Essence::dynamic_bvh_t const& bvh, Essence::Array<dynamic_bvh_test_box_t> const& boxes) {
+	using namespace Essence;
+
+	Array<u32> stack;
+	u32 leavesNum = 0;
+	if (bvh.root != DYNAMIC_BVH_NULL) {
+		if (bvh.nodes[bvh.root].parent != DYNAMIC_BVH_NULL) {
+			return false;
+		}
+		PushBack(stack, bvh.root);
+	}
+
+	while (Size(stack)) {
+		auto index = Back(stack);
+		PopBack(stack);
+		auto const& node = bvh.nodes[index];
+		if (node.children[0] == DYNAMIC_BVH_NULL) {
+			auto const& box = boxes[node.user_data];
+			if (box.proxy != index) {
+				return false;
+			}
+			for (u32 a = 0; a < 3; ++a) {
+				if (box.bounds_min[a] < node.bounds_min[a] || box.bounds_max[a] > node.bounds_max[a]) {
+					return false;
+				}
+			}
+			++leavesNum;
+			continue;
+		}
+		for (auto child : node.children) {
+			auto const& childNode = bvh.nodes[child];
+			if (childNode.parent != index) {
+				return false;
+			}
+			for (u32 a = 0; a < 3; ++a) {
+				if (childNode.bounds_min[a] < node.bounds_min[a] || childNode.bounds_max[a] > node.bounds_max[a]) {
+					return false;
+				}
+			}
+			PushBack(stack, child);
+		}
+	}
+	FreeMemory(stack);
+	return leavesNum == bvh.proxies_num;
+}
+
+float IntersectDynamicBvhTestBox(void* userData, u32 primitive, Essence::ray_t const& ray) {
+	auto const& box = ((dynamic_bvh_test_box_t const*)userData)[primitive];
+	float tmin = ray.tmin;
+	float tmax = ray.tmax;
+	for (u32 a = 0; a < 3; ++a) {
+		float t0 = (box.bounds_min[a] - ray.origin[a]) / ray.direction[a];
+		float t1 = (box.bounds_max[a] - ray.origin[a]) / ray.direction[a];
+		tmin = max(tmin, min(t0, t1));
+		tmax = min(tmax, max(t0, t1));
+	}
+	return tmin <= tmax ? tmin : -1.f;
+}
+
+void RandomDynamicBvhTestBox(Essence::random_generator& rng, dynamic_bvh_test_box_t* box) {
+	Vec3f center(rng.f32Next(-100.f, 100.f), rng.f32Next(-20.f, 20.f), rng.f32Next(-100.f, 100.f));
+	Vec3f extent(rng.f32Next(0.1f, 3.f), rng.f32Next(0.1f, 3.f), rng.f32Next(0.1f, 3.f));
+	box->bounds_min = center - extent;
+	box->bounds_max = center + extent;
+}
+
+void TestDynamicBvh(int argc, char * argv[]) {
+	using namespace Essence;
+	using namespace DirectX;
+
+	const lest::test specification[] = {
+		CASE("queries match brute force through inserts, batched moves, removals and rebuilds") {
+			random_generator rng(41);
+
+			dynamic_bvh_t bvh;
+			InitDynamicBvh(&bvh, 0.5f);
+
+			const u32 boxesNum = 3000;
+			Array<dynamic_bvh_test_box_t> boxes;
+			Resize(boxes, boxesNum);
+			for (u32 i = 0; i < boxesNum; ++i) {
+				RandomDynamicBvhTestBox(rng, &boxes[i]);
+				boxes[i].proxy = InsertProxy(&bvh, boxes[i].bounds_min, boxes[i].bounds_max, i);
+			}
+			EXPECT(ValidateDynamicBvh(bvh, boxes));
+
+			auto viewProj = XMMatrixLookAtLH(XMVectorSet(0.f, 10.f, -120.f, 1.f), XMVectorSet(0.f, 0.f, 0.f, 1.f), XMVectorSet(0.f, 1.f, 0.f, 0.f))
+				* XMMatrixPerspectiveFovLH(XM_PI / 4.f, 16.f / 9.f, 1.f, 150.f);
+			frustum_t frustum;
+			ExtractFrustum(viewProj, &frustum);
+
+			Array<u32> proxies;
+			Array<Vec3f> movedMin, movedMax;
+			Array<u32> found;
+			Array<u8> flags;
+			Resize(flags, boxesNum);
+
+			u32 sphereMismatches = 0;
+			u32 frustumMismatches = 0;
+			u32 rayMismatches = 0;
+			u32 sphereHits = 0;
+			u32 rayHits = 0;
+			bool valid = true;
+
+			for (u32 round = 0; round < 12; ++round) {
+				// alternate small jitter batches that stay mostly in the margin with large jumps of many boxes
+				Clear(proxies);
+				Clear(movedMin);
+				Clear(movedMax);
+				u32 movesNum = round & 1 ? boxesNum / 2 : boxesNum / 50;
+				for (u32 m = 0; m < movesNum; ++m) {
+					auto& box = boxes[rng.u32Next() % boxesNum];
+					if (box.proxy == DYNAMIC_BVH_NULL) {
+						continue;
+					}
+					Vec3f offset = round & 1
+						? Vec3f(rng.f32Next(-30.f, 30.f), rng.f32Next(-5.f, 5.f), rng.f32Next(-30.f, 30.f))
+						: Vec3f(rng.f32Next(-0.3f, 0.3f), 0.f, rng.f32Next(-0.3f, 0.3f));
+					box.bounds_min += offset;
+					box.bounds_max += offset;
+					PushBack(proxies, box.proxy);
+					PushBack(movedMin, box.bounds_min);
+					PushBack(movedMax, box.bounds_max);
+				}
+				// repeated boxes in one batch take their last bounds
+				MoveProxies(&bvh, proxies.DataPtr, movedMin.DataPtr, movedMax.DataPtr, (u32)Size(proxies));
+
+				for (u32 r = 0; r < 40; ++r) {
+					auto& box = boxes[rng.u32Next() % boxesNum];
+					if (box.proxy == DYNAMIC_BVH_NULL) {
+						RandomDynamicBvhTestBox(rng, &box);
+						box.proxy = InsertProxy(&bvh, box.bounds_min, box.bounds_max, (u32)(&box - boxes.DataPtr));
+					}
+					else {
+						RemoveProxy(&bvh, box.proxy);
+						box.proxy = DYNAMIC_BVH_NULL;
+					}
+				}
+				if (round == 8) {
+					RebuildDynamicBvh(&bvh);
+				}
+				valid &= ValidateDynamicBvh(bvh, boxes);
+
+				// sphere, loose bounds may add boxes within the margin but never drop one
+				Vec3f center(rng.f32Next(-80.f, 80.f), 0.f, rng.f32Next(-80.f, 80.f));
+				float radius = rng.f32Next(5.f, 30.f);
+				Clear(found);
+				QuerySphere(bvh, center, radius, &found);
+				memset(flags.DataPtr, 0, boxesNum);
+				for (auto index : found) {
+					flags[index] = 1;
+				}
+				for (u32 i = 0; i < boxesNum; ++i) {
+					auto const& box = boxes[i];
+					if (box.proxy == DYNAMIC_BVH_NULL) {
+						sphereMismatches += flags[i];
+						continue;
+					}
+					float distanceSq = 0.f;
+					for (u32 a = 0; a < 3; ++a) {
+						float d = max(max(box.bounds_min[a] - center[a], center[a] - box.bounds_max[a]), 0.f);
+						distanceSq += d * d;
+					}
+					bool inside = distanceSq <= radius * radius;
+					sphereHits += inside;
+					sphereMismatches += inside && !flags[i];
+					sphereMismatches += !inside && flags[i] && distanceSq > (radius + 1.f) * (radius + 1.f);
+				}
+
+				// frustum, same requirement with rounding allowed at the planes
+				Clear(found);
+				QueryFrustum(bvh, frustum, &found);
+				memset(flags.DataPtr, 0, boxesNum);
+				for (auto index : found) {
+					frustumMismatches += flags[index];
+					flags[index] = 1;
+				}
+				for (u32 i = 0; i < boxesNum; ++i) {
+					auto const& box = boxes[i];
+					if (box.proxy == DYNAMIC_BVH_NULL) {
+						frustumMismatches += flags[i];
+						continue;
+					}
+					float margin = FLT_MAX;
+					for (auto const& plane : frustum.planes) {
+						auto planeVector = XMLoadFloat4(&plane);
+						auto boxMin = XMLoadFloat3((XMFLOAT3*)&box.bounds_min);
+						auto boxMax = XMLoadFloat3((XMFLOAT3*)&box.bounds_max);
+						auto boxRadius = XMVectorGetX(XMVector3Dot(XMVectorAbs(planeVector), XMVectorScale(XMVectorSubtract(boxMax, boxMin), 0.5f)));
+						auto boxDistance = XMVectorGetX(XMPlaneDotCoord(planeVector, XMVectorScale(XMVectorAdd(boxMin, boxMax), 0.5f)));
+						margin = min(margin, boxDistance + boxRadius);
+					}
+					frustumMismatches += margin > 1e-3f && !flags[i];
+					frustumMismatches += margin < -1.f && flags[i];
+				}
+
+				// closest ray hit against a linear scan
+				for (u32 r = 0; r < 50; ++r) {
+					ray_t ray;
+					ray.origin = Vec3f(rng.f32Next(-120.f, 120.f), rng.f32Next(-30.f, 30.f), -130.f);
+					ray.direction = Vec3f(rng.f32Next(-0.5f, 0.5f), rng.f32Next(-0.1f, 0.1f), 1.f);
+					ray.tmin = 0.f;
+					ray.tmax = 1000.f;
+
+					float expectedT = ray.tmax;
+					u32 expected = BVH_NULL_INDEX;
+					for (u32 i = 0; i < boxesNum; ++i) {
+						if (boxes[i].proxy == DYNAMIC_BVH_NULL) {
+							continue;
+						}
+						float t = IntersectDynamicBvhTestBox(boxes.DataPtr, i, ray);
+						if (t >= 0.f && t < expectedT) {
+							expectedT = t;
+							expected = i;
+						}
+					}
+
+					float t;
+					auto hit = QueryRayClosest(bvh, ray, IntersectDynamicBvhTestBox, boxes.DataPtr, &t);
+					rayHits += expected != BVH_NULL_INDEX;
+					rayMismatches += hit != expected && t != expectedT;
+				}
+			}
+
+			EXPECT(valid);
+			EXPECT(sphereMismatches == 0u);
+			EXPECT(frustumMismatches == 0u);
+			EXPECT(rayMismatches == 0u);
+			EXPECT(sphereHits > 0u);
+			EXPECT(rayHits > 0u);
+
+			FreeDynamicBvh(&bvh);
+		},
+		CASE("small moves stay inside the margin, rebuild doesn't raise the cost") {
+			random_generator rng(43);
+
+			dynamic_bvh_t bvh;
+			InitDynamicBvh(&bvh, 1.f);
+
+			Array<dynamic_bvh_test_box_t> boxes;
+			Resize(boxes, 500);
+			for (u32 i = 0; i < 500; ++i) {
+				RandomDynamicBvhTestBox(rng, &boxes[i]);
+				boxes[i].proxy = InsertProxy(&bvh, boxes[i].bounds_min, boxes[i].bounds_max, i);
+			}
+
+			auto& box = boxes[7];
+			EXPECT(!MoveProxy(&bvh, box.proxy, box.bounds_min + 0.5f, box.bounds_max + 0.5f));
+			box.bounds_min += 50.f;
+			box.bounds_max += 50.f;
+			EXPECT(MoveProxy(&bvh, box.proxy, box.bounds_min, box.bounds_max));
+			EXPECT(ValidateDynamicBvh(bvh, boxes));
+
+			// sweep everything far along one axis so the refit tree degrades
+			for (u32 i = 0; i < 500; ++i) {
+				boxes[i].bounds_min.x += i * 2.f;
+				boxes[i].bounds_max.x += i * 2.f;
+				MoveProxy(&bvh, boxes[i].proxy, boxes[i].bounds_min, boxes[i].bounds_max);
+			}
+			auto cost = GetDynamicBvhCost(bvh);
+			RebuildDynamicBvh(&bvh);
+			EXPECT(GetDynamicBvhCost(bvh) <= cost);
+			EXPECT(ValidateDynamicBvh(bvh, boxes));
+
+			// proxies survive the rebuild
+			for (u32 i = 0; i < 500; i += 2) {
+				RemoveProxy(&bvh, boxes[i].proxy);
+				boxes[i].proxy = DYNAMIC_BVH_NULL;
+			}
+			EXPECT(ValidateDynamicBvh(bvh, boxes));
+			EXPECT(bvh.proxies_num == 250u);
+
+			FreeDynamicBvh(&bvh);
+		}
+	};
+
+	Essence::InitMemoryAllocators();
+	lest::run(specification, argc, argv);
+	Essence::ShutdownMemoryAllocators();
+}
+
+
+#include "ResourceTracking.h"
+
+// write is exclusive, reads combine
+const u32 TEST_STATE_WRITE = 1;
+const u32 TEST_STATE_READ_A = 2;
+const u32 TEST_STATE_READ_B = 4;
+
+bool TestNeedStateChange(u32 before, u32 after, bool exclusive) {
+	return after != before && ((after & before) == 0 || exclusive);
+}
+
+u32 TestNextState(u32 before, u32 after) {
+	if (before == TEST_STATE_WRITE || after == TEST_STATE_WRITE) {
+		return after;
+	}
+	return before | after;
+}
+
+const Essence::state_rules_t TestStateRules = { TestNeedStateChange, TestNextState };
+
+// applies transitions to per subresource states, false if one doesn't start where the resource is
+bool ApplyTestTransitions(Essence::Array<Essence::Array<u32>>& truth, Essence::Array<Essence::state_transition_t> const& transitions) {
+	for (auto const& transition : transitions) {
+		auto& states = truth[transition.resource];
+		u32 first = transition.subresource == Essence::ALL_SUBRESOURCES ? 0 : transition.subresource;
+		u32 end = transition.subresource == Essence::ALL_SUBRESOURCES ? (u32)Size(states) : first + 1;
+		for (u32 s = first; s < end; ++s) {
+			if (states[s] != transition.before) {
+				return false;
+			}
+			states[s] = transition.after;
+		}
+	}
+	return true;
+}
+
+// like ApplyTestTransitions, with inFlight holding the target of a begun split, false on anything the debug layer would reject
+bool ApplyTestBarrierLog(Essence::Array<Essence::Array<u32>>& truth, Essence::Array<Essence::Array<u32>>& inFlight, Essence::Array<Essence::state_transition_t> const& transitions) {
+	for (auto const& transition : transitions) {
+		auto& states = truth[transition.resource];
+		auto& targets = inFlight[transition.resource];
+		u32 first = transition.subresource == Essence::ALL_SUBRESOURCES ? 0 : transition.subresource;
+		u32 end = transition.subresource == Essence::ALL_SUBRESOURCES ? (u32)Size(states) : first + 1;
+		for (u32 s = first; s < end; ++s) {
+			if (states[s] != transition.before) {
+				return false;
+			}
+			if (transition.split == Essence::TRANSITION_END) {
+				if (targets[s] != transition.after) {
+					return false;
+				}
+				targets[s] = Essence::RESOURCE_STATE_UNKNOWN;
+				states[s] = transition.after;
+				continue;
+			}
+			if (targets[s] != Essence::RESOURCE_STATE_UNKNOWN) {
+				return false;
+			}
+			if (transition.split == Essence::TRANSITION_BEGIN) {
+				targets[s] = transition.after;
+			}
+			else {
+				states[s] = transition.after;
+			}
+		}
+	}
+	return true;
+}
+
+void TestResourceTracking(int argc, char * argv[]) {
+	using namespace Essence;
+
+	const lest::test specification[] = {
+		CASE("run lists match per subresource states and stay minimal") {
+			random_generator rng(47);
+
+			const u32 subresourcesNum = 24;
+			state_run_t runs[subresourcesNum];
+			u32 runsNum = 1;
+			runs[0] = { 0, 0 };
+			u32 reference[subresourcesNum] = {};
+
+			u32 mismatches = 0;
+			u32 brokenLists = 0;
+			for (u32 i = 0; i < 2000; ++i) {
+				u32 first = rng.u32Next() % subresourcesNum;
+				u32 count = 1 + rng.u32Next() % (i & 1 ? subresourcesNum - first : min(3u, subresourcesNum - first));
+				u32 state = rng.u32Next() % 3;
+				runsNum = SetRunState(runs, runsNum, subresourcesNum, first, count, state);
+				for (u32 s = first; s < first + count; ++s) {
+					reference[s] = state;
+				}
+
+				for (u32 s = 0; s < subresourcesNum; ++s) {
+					mismatches += GetRunState(runs, runsNum, s) != reference[s];
+				}
+				bool broken = runs[0].first != 0;
+				for (u32 r = 1; r < runsNum; ++r) {
+					broken |= runs[r].first <= runs[r - 1].first || runs[r].state == runs[r - 1].state;
+				}
+				brokenLists += broken;
+			}
+			EXPECT(mismatches == 0u);
+			EXPECT(brokenLists == 0u);
+		},
+		CASE("first use records expectations, later uses record barriers") {
+			state_tracker_t tracker;
+			InitStateTracker(&tracker, &TestStateRules);
+
+			Array<state_transition_t> transitions;
+			TrackTransition(&tracker, 5, 4, ALL_SUBRESOURCES, TEST_STATE_READ_A, &transitions);
+			EXPECT(Size(transitions) == 0);
+			// read on top of read merges without a barrier
+			TrackTransition(&tracker, 5, 4, 2, TEST_STATE_READ_A, &transitions);
+			EXPECT(Size(transitions) == 0);
+
+			TrackTransition(&tracker, 5, 4, 1, TEST_STATE_WRITE, &transitions);
+			EXPECT(Size(transitions) == 1);
+			EXPECT(transitions[0].subresource == 1u);
+			EXPECT(transitions[0].before == TEST_STATE_READ_A);
+			EXPECT(transitions[0].after == TEST_STATE_WRITE);
+
+			// back to one state, only subresources that differ move and they go one by one
+			Clear(transitions);
+			TrackTransition(&tracker, 5, 4, ALL_SUBRESOURCES, TEST_STATE_READ_B, &transitions);
+			EXPECT(Size(transitions) == 4);
+			EXPECT(GetTrackedState(tracker, 5, 0) == (TEST_STATE_READ_A | TEST_STATE_READ_B));
+			EXPECT(GetTrackedState(tracker, 5, 1) == TEST_STATE_READ_B);
+
+			// uniform again after the write, so the next barrier covers the whole resource
+			Clear(transitions);
+			TrackTransition(&tracker, 5, 4, ALL_SUBRESOURCES, TEST_STATE_WRITE, &transitions);
+			TrackTransition(&tracker, 5, 4, ALL_SUBRESOURCES, TEST_STATE_READ_A, &transitions);
+			EXPECT(Size(transitions) == 5);
+			EXPECT(transitions[4].subresource == ALL_SUBRESOURCES);
+			EXPECT(transitions[4].before == TEST_STATE_WRITE);
+
+			EXPECT(GetTrackedState(tracker, 9, 0) == RESOURCE_STATE_UNKNOWN);
+			ResetStateTracker(&tracker);
+			EXPECT(GetTrackedState(tracker, 5, 0) == RESOURCE_STATE_UNKNOWN);
+			EXPECT(Size(tracker.entries) == 0);
+
+			FreeStateTracker(&tracker);
+		},
+		CASE("registering again with more subresources reuses released runs") {
+			resource_states_table_t table = {};
+			SetResourceState(&table, 0, 4, TEST_STATE_READ_A);
+			SetResourceState(&table, 1, 2, TEST_STATE_READ_A);
+			auto runsNum = Size(table.runs);
+
+			// index 0 grows and leaves its 4 runs behind, index 1 growing to 3 takes them
+			SetResourceState(&table, 0, 8, TEST_STATE_WRITE);
+			SetResourceState(&table, 1, 3, TEST_STATE_READ_B);
+			EXPECT(Size(table.runs) == runsNum + 8);
+			EXPECT(GetResourceState(table, 0, 7) == TEST_STATE_WRITE);
+			EXPECT(GetResourceState(table, 1, 2) == TEST_STATE_READ_B);
+
+			// views recreated over and over with alternating sizes stop growing the table
+			for (u32 i = 0; i < 100; ++i) {
+				SetResourceState(&table, 2 + i % 2, 1 + (i * 7) % 16, TEST_STATE_READ_A);
+			}
+			auto settled = Size(table.runs);
+			for (u32 i = 0; i < 100; ++i) {
+				SetResourceState(&table, 2 + i % 2, 1 + (i * 7) % 16, TEST_STATE_READ_A);
+			}
+			EXPECT(Size(table.runs) == settled);
+
+			FreeResourceStates(&table);
+		},
+		CASE("glue and recorded barriers replayed in order always start from the actual state") {
+			random_generator rng(53);
+
+			const u32 resourcesNum = 40;
+			const u32 states[] = { TEST_STATE_WRITE, TEST_STATE_READ_A, TEST_STATE_READ_B };
+
+			resource_states_table_t table = {};
+			Array<Array<u32>> truth;
+			Resize(truth, resourcesNum);
+			for (u32 r = 0; r < resourcesNum; ++r) {
+				new (&truth[r]) Array<u32>();
+				// some buffers, some textures with mips and slices
+				u32 subresourcesNum = r % 3 ? 1 + rng.u32Next() % 12 : 1;
+				u32 state = states[rng.u32Next() % 3];
+				SetResourceState(&table, r, subresourcesNum, state);
+				for (u32 s = 0; s < subresourcesNum; ++s) {
+					PushBack(truth[r], state);
+				}
+			}
+
+			state_tracker_t tracker;
+			InitStateTracker(&tracker, &TestStateRules);
+			Array<state_transition_t> recorded;
+			Array<state_transition_t> glue;
+
+			u32 unsatisfied = 0;
+			u32 badReplays = 0;
+			u32 globalMismatches = 0;
+			u32 glueNum = 0;
+			for (u32 list = 0; list < 300; ++list) {
+				Clear(recorded);
+				Clear(glue);
+				// lists touch a handful of resources, sometimes all of a resource, sometimes one subresource
+				u32 usesNum = 1 + rng.u32Next() % 20;
+				for (u32 u = 0; u < usesNum; ++u) {
+					u32 r = rng.u32Next() % 8 + (list % 4) * 8;
+					u32 subresourcesNum = (u32)Size(truth[r]);
+					u32 subresource = rng.u32Next() % 2 ? ALL_SUBRESOURCES : rng.u32Next() % subresourcesNum;
+					u32 desired = states[rng.u32Next() % 3];
+					TrackTransition(&tracker, r, subresourcesNum, subresource, desired, &recorded);
+
+					u32 first = subresource == ALL_SUBRESOURCES ? 0 : subresource;
+					u32 end = subresource == ALL_SUBRESOURCES ? subresourcesNum : first + 1;
+					for (u32 s = first; s < end; ++s) {
+						unsatisfied += (GetTrackedState(tracker, r, s) & desired) != desired;
+					}
+				}
+
+				ResolveTrackedStates(&table, tracker, &glue);
+				glueNum += (u32)Size(glue);
+				ResetStateTracker(&tracker);
+
+				badReplays += !ApplyTestTransitions(truth, glue);
+				badReplays += !ApplyTestTransitions(truth, recorded);
+				for (u32 r = 0; r < resourcesNum; ++r) {
+					for (u32 s = 0; s < Size(truth[r]); ++s) {
+						globalMismatches += GetResourceState(table, r, s) != truth[r][s];
+					}
+				}
+			}
+
+			EXPECT(unsatisfied == 0u);
+			EXPECT(badReplays == 0u);
+			EXPECT(globalMismatches == 0u);
+			EXPECT(glueNum > 0u);
+
+			for (auto& states : truth) {
+				FreeMemory(states);
+			}
+			FreeMemory(truth);
+			FreeStateTracker(&tracker);
+			FreeResourceStates(&table);
+		},
+		CASE("split transitions end at the next use or when the list ends") {
+			state_tracker_t tracker;
+			InitStateTracker(&tracker, &TestStateRules);
+
+			Array<state_transition_t> transitions;
+			// first use can't be split, nothing is known about the state before it
+			BeginTrackedTransition(&tracker, 3, 2, ALL_SUBRESOURCES, TEST_STATE_WRITE, &transitions);
+			EXPECT(Size(transitions) == 0);
+
+			BeginTrackedTransition(&tracker, 3, 2, ALL_SUBRESOURCES, TEST_STATE_READ_A, &transitions);
+			EXPECT(Size(transitions) == 1);
+			EXPECT(transitions[0].split == (u32)TRANSITION_BEGIN);
+			EXPECT(transitions[0].subresource == ALL_SUBRESOURCES);
+			EXPECT(GetTrackedState(tracker, 3, 1) == TEST_STATE_READ_A);
+
+			// using another resource leaves the split alone
+			TrackTransition(&tracker, 4, 1, ALL_SUBRESOURCES, TEST_STATE_READ_B, &transitions);
+			EXPECT(Size(transitions) == 1);
+
+			// a read it already satisfies still has to wait for the end
+			TrackTransition(&tracker, 3, 2, 0, TEST_STATE_READ_A, &transitions);
+			EXPECT(Size(transitions) == 2);
+			EXPECT(transitions[1].split == (u32)TRANSITION_END);
+			EXPECT(transitions[1].subresource == ALL_SUBRESOURCES);
+			EXPECT(transitions[1].before == TEST_STATE_WRITE);
+			EXPECT(transitions[1].after == TEST_STATE_READ_A);
+
+			// one subresource split, ended when the list closes
+			BeginTrackedTransition(&tracker, 3, 2, 1, TEST_STATE_WRITE, &transitions);
+			EXPECT(Size(transitions) == 3);
+			EXPECT(transitions[2].subresource == 1u);
+			EndTrackedTransitions(&tracker, &transitions);
+			EXPECT(Size(transitions) == 4);
+			EXPECT(transitions[3].split == (u32)TRANSITION_END);
+			EXPECT(transitions[3].subresource == 1u);
+			EndTrackedTransitions(&tracker, &transitions);
+			EXPECT(Size(transitions) == 4);
+
+			FreeMemory(transitions);
+			FreeStateTracker(&tracker);
+		},
+		CASE("transitions flushed together merge") {
+			Array<state_transition_t> transitions;
+			auto push = [&](u32 resource, u32 subresource, u32 before, u32 after, u32 split) {
+				state_transition_t transition = { resource, subresource, before, after, split };
+				PushBack(transitions, transition);
+			};
+
+			// there and back again vanishes, other resources in between don't matter
+			push(1, 0, TEST_STATE_READ_A, TEST_STATE_WRITE, TRANSITION_FULL);
+			push(2, ALL_SUBRESOURCES, TEST_STATE_WRITE, TEST_STATE_READ_B, TRANSITION_FULL);
+			push(1, 0, TEST_STATE_WRITE, TEST_STATE_READ_A, TRANSITION_FULL);
+			MergeTransitions(transitions);
+			EXPECT(Size(transitions) == 1);
+			EXPECT(transitions[0].resource == 2u);
+
+			// chains fold into one
+			Clear(transitions);
+			push(1, 0, TEST_STATE_READ_A, TEST_STATE_WRITE, TRANSITION_FULL);
+			push(1, 0, TEST_STATE_WRITE, TEST_STATE_READ_A | TEST_STATE_READ_B, TRANSITION_FULL);
+			MergeTransitions(transitions);
+			EXPECT(Size(transitions) == 1);
+			EXPECT(transitions[0].before == TEST_STATE_READ_A);
+			EXPECT(transitions[0].after == (TEST_STATE_READ_A | TEST_STATE_READ_B));
+
+			// split with nothing in between is a plain transition
+			Clear(transitions);
+			push(1, ALL_SUBRESOURCES, TEST_STATE_WRITE, TEST_STATE_READ_B, TRANSITION_BEGIN);
+			push(1, ALL_SUBRESOURCES, TEST_STATE_WRITE, TEST_STATE_READ_B, TRANSITION_END);
+			MergeTransitions(transitions);
+			EXPECT(Size(transitions) == 1);
+			EXPECT(transitions[0].split == (u32)TRANSITION_FULL);
+
+			// a whole resource barrier in between keeps subresource ones apart
+			Clear(transitions);
+			push(1, 0, TEST_STATE_READ_A, TEST_STATE_WRITE, TRANSITION_FULL);
+			push(1, ALL_SUBRESOURCES, TEST_STATE_WRITE, TEST_STATE_READ_A, TRANSITION_FULL);
+			push(1, 0, TEST_STATE_READ_A, TEST_STATE_WRITE, TRANSITION_FULL);
+			MergeTransitions(transitions);
+			EXPECT(Size(transitions) == 3);
+
+			FreeMemory(transitions);
+		},
+		CASE("split flushed before other work keeps begin and end in their own batches") {
+			state_tracker_t tracker;
+			InitStateTracker(&tracker, &TestStateRules);
+
+			Array<state_transition_t> batch;
+			TrackTransition(&tracker, 1, 1, ALL_SUBRESOURCES, TEST_STATE_WRITE, &batch);
+			Clear(batch);
+
+			// like BeginTransitionBarrier followed by FlushBarriers
+			BeginTrackedTransition(&tracker, 1, 1, ALL_SUBRESOURCES, TEST_STATE_READ_A, &batch);
+			MergeTransitions(batch);
+			EXPECT(Size(batch) == 1);
+			EXPECT(batch[0].split == (u32)TRANSITION_BEGIN);
+			Clear(batch);
+
+			// independent work, then the list closes
+			TrackTransition(&tracker, 2, 1, ALL_SUBRESOURCES, TEST_STATE_WRITE, &batch);
+			TrackTransition(&tracker, 2, 1, ALL_SUBRESOURCES, TEST_STATE_READ_B, &batch);
+			EndTrackedTransitions(&tracker, &batch);
+			MergeTransitions(batch);
+
+			u32 ends = 0;
+			for (auto const& transition : batch) {
+				if (transition.resource == 1) {
+					EXPECT(transition.split == (u32)TRANSITION_END);
+					EXPECT(transition.before == TEST_STATE_WRITE);
+					EXPECT(transition.after == TEST_STATE_READ_A);
+					++ends;
+				}
+			}
+			EXPECT(ends == 1u);
+
+			FreeMemory(batch);
+			FreeStateTracker(&tracker);
+		},
+		CASE("barrier log with splits and merged batches replays cleanly") {
+			random_generator rng(59);
+
+			const u32 resourcesNum = 8;
+			const u32 states[] = { TEST_STATE_WRITE, TEST_STATE_READ_A, TEST_STATE_READ_B };
+
+			Array<Array<u32>> truth;
+			Array<Array<u32>> inFlight;
+			Resize(truth, resourcesNum);
+			Resize(inFlight, resourcesNum);
+			for (u32 r = 0; r < resourcesNum; ++r) {
+				new (&truth[r]) Array<u32>();
+				new (&inFlight[r]) Array<u32>();
+				u32 subresourcesNum = r % 2 ? 1 + rng.u32Next() % 6 : 1;
+				for (u32 s = 0; s < subresourcesNum; ++s) {
+					PushBack(truth[r], states[rng.u32Next() % 3]);
+					PushBack(inFlight[r], RESOURCE_STATE_UNKNOWN);
+				}
+			}
+
+			state_tracker_t tracker;
+			InitStateTracker(&tracker, &TestStateRules);
+			Array<state_transition_t> queued;
+
+			u32 badReplays = 0;
+			u32 unsatisfied = 0;
+			u32 leftInFlight = 0;
+			u32 begins = 0;
+			u32 queuedNum = 0;
+			u32 firedNum = 0;
+			for (u32 list = 0; list < 200; ++list) {
+				// first uses match what the resources are in, no glue needed
+				for (u32 r = 0; r < resourcesNum; ++r) {
+					for (u32 s = 0; s < Size(truth[r]); ++s) {
+						TrackTransition(&tracker, r, (u32)Size(truth[r]), s, truth[r][s], &queued);
+					}
+				}
+
+				for (u32 op = 0; op < 30; ++op) {
+					u32 r = rng.u32Next() % resourcesNum;
+					u32 subresourcesNum = (u32)Size(truth[r]);
+					u32 subresource = rng.u32Next() % 2 ? ALL_SUBRESOURCES : rng.u32Next() % subresourcesNum;
+					u32 desired = states[rng.u32Next() % 3];
+
+					if (rng.u32Next() % 3 == 0) {
+						BeginTrackedTransition(&tracker, r, subresourcesNum, subresource, desired, &queued);
+						continue;
+					}
+					TrackTransition(&tracker, r, subresourcesNum, subresource, desired, &queued);
+					if (rng.u32Next() % 2) {
+						// more bindings before the draw
+						continue;
+					}
+
+					// a draw, everything queued is flushed right before it and the last binding has to hold
+					queuedNum += (u32)Size(queued);
+					MergeTransitions(queued);
+					firedNum += (u32)Size(queued);
+					for (auto const& transition : queued) {
+						begins += transition.split == TRANSITION_BEGIN;
+					}
+					badReplays += !ApplyTestBarrierLog(truth, inFlight, queued);
+					Clear(queued);
+
+					u32 first = subresource == ALL_SUBRESOURCES ? 0 : subresource;
+					u32 end = subresource == ALL_SUBRESOURCES ? subresourcesNum : first + 1;
+					for (u32 s = first; s < end; ++s) {
+						unsatisfied += (truth[r][s] & desired) != desired || inFlight[r][s] != RESOURCE_STATE_UNKNOWN;
+					}
+				}
+
+				EndTrackedTransitions(&tracker, &queued);
+				MergeTransitions(queued);
+				badReplays += !ApplyTestBarrierLog(truth, inFlight, queued);
+				Clear(queued);
+				ResetStateTracker(&tracker);
+
+				for (u32 r = 0; r < resourcesNum; ++r) {
+					for (u32 s = 0; s < Size(truth[r]); ++s) {
+						leftInFlight += inFlight[r][s] != RESOURCE_STATE_UNKNOWN;
+					}
+				}
+			}
+
+			EXPECT(badReplays == 0u);
+			EXPECT(unsatisfied == 0u);
+			EXPECT(leftInFlight == 0u);
+			EXPECT(begins > 0u);
+			EXPECT(firedNum < queuedNum);
+
+			for (u32 r = 0; r < resourcesNum; ++r) {
+				FreeMemory(truth[r]);
+				FreeMemory(inFlight[r]);
+			}
+			FreeMemory(truth);
+			FreeMemory(inFlight);
+			FreeMemory(queued);
+			FreeStateTracker(&tracker);
+		}
+	};
+
+	Essence::InitMemoryAllocators();
+	lest::run(specification, argc, argv);
+	Essence::ShutdownMemoryAllocators();
+}
+
+#include "PipelineKey.h"
+
+// every state enabled so each field matters
+Essence::graphics_pipeline_key_t FullPipelineTestKey() {
+	Essence::graphics_pipeline_key_t key = {};
+	key.vs = 0x01000003;
+	key.ps = 0x01000004;
+	key.vertex_factory = 0x00100002;
+	key.sample_mask = 0xFFFFFFFF;
+	key.sample_count = 1;
+	key.num_render_targets = Essence::MAX_PIPELINE_RENDER_TARGETS;
+	for (u32 i = 0; i < Essence::MAX_PIPELINE_RENDER_TARGETS; ++i) {
+		key.rtv_formats[i] = 28 + i;
+		key.blend[i] = { 1, 1, (u8)(2 + i), 6, 1, 2, 6, 1, 4, 0xF };
+	}
+	key.independent_blend_enable = 1;
+	key.dsv_format = 40;
+	key.fill_mode = 3;
+	key.cull_mode = 3;
+	key.depth_bias = 4;
+	key.depth_bias_clamp = 1.f;
+	key.slope_scaled_depth_bias = 2.f;
+	key.depth_clip_enable = 1;
+	key.depth_enable = 1;
+	key.depth_write_mask = 1;
+	key.depth_func = 2;
+	key.stencil_enable = 1;
+	key.stencil_read_mask = 0xFF;
+	key.stencil_write_mask = 0xFF;
+	key.front_face = { 1, 1, 3, 8 };
+	key.back_face = { 1, 2, 1, 8 };
+	key.topology_type = 3;
+	return key;
+}
+
+void TestPipelineKey(int argc, char * argv[]) {
+	using namespace Essence;
+
+	const lest::test specification[] = {
+		CASE("states differing only where the pso ignores them hash the same") {
+			graphics_pipeline_key_t a = FullPipelineTestKey();
+			a.num_render_targets = 2;
+			a.independent_blend_enable = 0;
+			a.blend[0].blend_enable = 0;
+			a.blend[0].logic_op_enable = 0;
+			a.depth_enable = 0;
+			a.stencil_enable = 0;
+			a.depth_bias_clamp = 0.f;
+
+			graphics_pipeline_key_t b = a;
+			// leftovers of disabled states, targets past the bound ones and shared blend copies
+			b.blend[0].src_blend = 9;
+			b.blend[0].logic_op = 7;
+			b.blend[1] = { 1, 0, 5, 5, 2, 5, 5, 2, 0, 1 };
+			b.rtv_formats[5] = 2;
+			b.depth_func = 8;
+			b.depth_write_mask = 0;
+			b.front_face = { 2, 2, 2, 2 };
+			b.stencil_read_mask = 0x0F;
+			b.depth_bias_clamp = -0.f;
+
+			// independent blend repeating the first target
+			graphics_pipeline_key_t c = a;
+			c.independent_blend_enable = 1;
+			c.blend[1] = c.blend[0];
+
+			NormalizePipelineKey(&a);
+			NormalizePipelineKey(&b);
+			NormalizePipelineKey(&c);
+			EXPECT(memcmp(&a, &b, sizeof(a)) == 0);
+			EXPECT(memcmp(&a, &c, sizeof(a)) == 0);
+			EXPECT(HashPipelineKey(a) == HashPipelineKey(b));
+			EXPECT(HashPipelineKey(a) == HashPipelineKey(c));
+		},
+		CASE("any state the pso uses changes the hash") {
+			graphics_pipeline_key_t base = FullPipelineTestKey();
+			NormalizePipelineKey(&base);
+			u64 baseHash = HashPipelineKey(base);
+
+			u32 changed = 0;
+			u32 collisions = 0;
+			for (u32 i = 0; i < sizeof(base); ++i) {
+				// more targets than there can be isn't a state
+				if (i == offsetof(graphics_pipeline_key_t, num_render_targets)) {
+					continue;
+				}
+				graphics_pipeline_key_t key = base;
+				((u8*)&key)[i] ^= 1;
+				NormalizePipelineKey(&key);
+				if (memcmp(&key, &base, sizeof(key)) != 0) {
+					++changed;
+					collisions += HashPipelineKey(key) == baseHash;
+				}
+			}
+			// only the reserved bytes normalize away
+			EXPECT(changed == (u32)sizeof(base) - 4);
+			EXPECT(collisions == 0u);
+
+			compute_pipeline_key_t computeA = { 0x01000007, 0, 0 };
+			compute_pipeline_key_t computeB = { 0x02000007, 0, 0 };
+			EXPECT(HashPipelineKey(computeA) != HashPipelineKey(computeB));
+		},
+		CASE("random distinct states don't collide") {
+			random_generator rng(61);
+
+			Hashmap<u64, u32> byHash;
+			Array<graphics_pipeline_key_t> keys;
+			u32 collisions = 0;
+			for (u32 i = 0; i < 20000; ++i) {
+				graphics_pipeline_key_t key = FullPipelineTestKey();
+				key.vs = rng.u32Next() % 64;
+				key.ps = rng.u32Next() % 64;
+				key.num_render_targets = rng.u32Next() % 4;
+				key.independent_blend_enable = rng.u32Next() % 2;
+				key.blend[0].blend_enable = rng.u32Next() % 2;
+				key.blend[1].src_blend = rng.u32Next() % 4;
+				key.depth_enable = rng.u32Next() % 2;
+				key.depth_func = rng.u32Next() % 8;
+				key.cull_mode = rng.u32Next() % 3;
+				NormalizePipelineKey(&key);
+
+				u64 hash = HashPipelineKey(key);
+				auto found = Get(byHash, hash);
+				if (found) {
+					collisions += memcmp(&keys[*found], &key, sizeof(key)) != 0;
+					continue;
+				}
+				Set(byHash, hash, (u32)Size(keys));
+				PushBack(keys, key);
+			}
+
+			EXPECT(collisions == 0u);
+			// normalization folds plenty of the draws together
+			EXPECT(Size(keys) < 20000);
+			EXPECT(Size(keys) > 1000);
+
+			FreeMemory(keys);
+			FreeMemory(byHash);
+		}
+	};
+
+	Essence::InitMemoryAllocators();
+	lest::run(specification, argc, argv);
+	Essence::ShutdownMemoryAllocators();
+}
+
+#include "PipelineCache.h"
+
+// stands in for the cache file
+struct memory_cache_storage_t {
+	Essence::Array<u8>	data;
+	bool				written;
+	u32					writes_num;
+};
+
+bool ReadMemoryCacheStorage(void* user, Essence::Array<u8>* outData) {
+	auto storage = (memory_cache_storage_t*)user;
+	if (!storage->written) {
+		return false;
+	}
+	Clear(*outData);
+	Append(*outData, storage->data.DataPtr, Size(storage->data));
+	return true;
+}
+
+bool WriteMemoryCacheStorage(void* user, const void* data, u64 bytesize) {
+	auto storage = (memory_cache_storage_t*)user;
+	Clear(storage->data);
+	Append(storage->data, (const u8*)data, bytesize);
+	storage->written = true;
+	storage->writes_num++;
+	return true;
+}
+
+Essence::cache_storage_t MakeMemoryCacheStorage(memory_cache_storage_t* storage) {
+	Essence::cache_storage_t result;
+	result.user = storage;
+	result.read = ReadMemoryCacheStorage;
+	result.write = WriteMemoryCacheStorage;
+	return result;
+}
+
+bool CachedBlobEquals(Essence::pipeline_cache_t* cache, u32 kind, u64 key, const char* expected) {
+	Essence::Array<u8> blob;
+	bool found = Essence::FindCachedBlob(cache, kind, key, &blob);
+	bool equal = found && Size(blob) == strlen(expected) && memcmp(blob.DataPtr, expected, Size(blob)) == 0;
+	FreeMemory(blob);
+	return equal;
+}
+
+void TestPipelineCache(int argc, char * argv[]) {
+	using namespace Essence;
+
+	const lest::test specification[] = {
+		CASE("blobs survive a save and load") {
+			memory_cache_storage_t storage = {};
+			{
+				pipeline_cache_t cache;
+				InitPipelineCache(&cache, MakeMemoryCacheStorage(&storage), 7);
+				EXPECT(!LoadPipelineCache(&cache));
+				StoreCachedBlob(&cache, CACHED_ROOT_SIGNATURE, 1, "root", 4);
+				StoreCachedBlob(&cache, CACHED_PIPELINE_STATE, 1, "pso one", 7);
+				StoreCachedBlob(&cache, CACHED_PIPELINE_STATE, 2, "pso two", 7);
+				EXPECT(SavePipelineCache(&cache));
+				// nothing new, nothing written
+				EXPECT(SavePipelineCache(&cache));
+				EXPECT(storage.writes_num == 1u);
+				FreePipelineCache(&cache);
+			}
+
+			pipeline_cache_t cache;
+			InitPipelineCache(&cache, MakeMemoryCacheStorage(&storage), 7);
+			EXPECT(LoadPipelineCache(&cache));
+			EXPECT(CachedBlobEquals(&cache, CACHED_ROOT_SIGNATURE, 1, "root"));
+			EXPECT(CachedBlobEquals(&cache, CACHED_PIPELINE_STATE, 1, "pso one"));
+			EXPECT(CachedBlobEquals(&cache, CACHED_PIPELINE_STATE, 2, "pso two"));
+			EXPECT(!CachedBlobEquals(&cache, CACHED_ROOT_SIGNATURE, 2, "pso two"));
+			FreePipelineCache(&cache);
+			FreeMemory(storage.data);
+		},
+		CASE("other driver stamp or damaged data start cold") {
+			memory_cache_storage_t storage = {};
+			pipeline_cache_t cache;
+			InitPipelineCache(&cache, MakeMemoryCacheStorage(&storage), 7);
+			StoreCachedBlob(&cache, CACHED_PIPELINE_STATE, 3, "pso", 3);
+			SavePipelineCache(&cache);
+			FreePipelineCache(&cache);
+
+			InitPipelineCache(&cache, MakeMemoryCacheStorage(&storage), 8);
+			EXPECT(!LoadPipelineCache(&cache));
+			EXPECT(!CachedBlobEquals(&cache, CACHED_PIPELINE_STATE, 3, "pso"));
+			FreePipelineCache(&cache);
+
+			Back(storage.data) ^= 1;
+			InitPipelineCache(&cache, MakeMemoryCacheStorage(&storage), 7);
+			EXPECT(!LoadPipelineCache(&cache));
+			FreePipelineCache(&cache);
+
+			Back(storage.data) ^= 1;
+			PopBack(storage.data);
+			InitPipelineCache(&cache, MakeMemoryCacheStorage(&storage), 7);
+			EXPECT(!LoadPipelineCache(&cache));
+			// cold cache refills and gets written again
+			StoreCachedBlob(&cache, CACHED_PIPELINE_STATE, 3, "pso", 3);
+			EXPECT(SavePipelineCache(&cache));
+			FreePipelineCache(&cache);
+
+			InitPipelineCache(&cache, MakeMemoryCacheStorage(&storage), 7);
+			EXPECT(LoadPipelineCache(&cache));
+			EXPECT(CachedBlobEquals(&cache, CACHED_PIPELINE_STATE, 3, "pso"));
+			FreePipelineCache(&cache);
+			FreeMemory(storage.data);
+		},
+		CASE("replaced blobs don't stay in the saved data") {
+			memory_cache_storage_t storage = {};
+			pipeline_cache_t cache;
+			InitPipelineCache(&cache, MakeMemoryCacheStorage(&storage), 7);
+			StoreCachedBlob(&cache, CACHED_PIPELINE_STATE, 5, "rejected by driver", 18);
+			StoreCachedBlob(&cache, CACHED_PIPELINE_STATE, 5, "rebuilt", 7);
+			EXPECT(CachedBlobEquals(&cache, CACHED_PIPELINE_STATE, 5, "rebuilt"));
+			SavePipelineCache(&cache);
+			u64 savedSize = Size(storage.data);
+			FreePipelineCache(&cache);
+
+			InitPipelineCache(&cache, MakeMemoryCacheStorage(&storage), 7);
+			StoreCachedBlob(&cache, CACHED_PIPELINE_STATE, 5, "rebuilt", 7);
+			SavePipelineCache(&cache);
+			EXPECT(Size(storage.data) == savedSize);
+			FreePipelineCache(&cache);
+			FreeMemory(storage.data);
+		},
+		CASE("lookups wait for a load started in the background") {
+			memory_cache_storage_t storage = {};
+			pipeline_cache_t cache;
+			InitPipelineCache(&cache, MakeMemoryCacheStorage(&storage), 7);
+			for (u64 key = 0; key < 1000; ++key) {
+				StoreCachedBlob(&cache, CACHED_PIPELINE_STATE, key, "pipeline state blob", 19);
+			}
+			SavePipelineCache(&cache);
+			FreePipelineCache(&cache);
+
+			InitScheduler();
+			InitPipelineCache(&cache, MakeMemoryCacheStorage(&storage), 7);
+			BeginLoadPipelineCache(&cache);
+			EXPECT(CachedBlobEquals(&cache, CACHED_PIPELINE_STATE, 999, "pipeline state blob"));
+			EXPECT(Size(cache.entries) == 1000);
+			FreePipelineCache(&cache);
+			ShutdownScheduler();
+			FreeMemory(storage.data);
+		}
+	};
+
+	Essence::InitMemoryAllocators();
+	lest::run(specification, argc, argv);
+	Essence::ShutdownMemoryAllocators();
+}
+
+#include "PipelineDependencies.h"
+
+void TestPipelineDependencies(int argc, char * argv[]) {
+	using namespace Essence;
+
+	const lest::test specification[] = {
+		CASE("shaders list what was built from them once, by kind") {
+			pipeline_dependencies_t dependencies = {};
+
+			// vs 3 and ps 5 shared by two pipelines, cs 9 alone
+			AddPipelineDependency(&dependencies, 3, DEPENDENT_PIPELINE, 100);
+			AddPipelineDependency(&dependencies, 5, DEPENDENT_PIPELINE, 100);
+			AddPipelineDependency(&dependencies, 3, DEPENDENT_PIPELINE, 101);
+			AddPipelineDependency(&dependencies, 5, DEPENDENT_PIPELINE, 101);
+			AddPipelineDependency(&dependencies, 3, DEPENDENT_GRAPHICS_BINDINGS, 0x500000003ull);
+			AddPipelineDependency(&dependencies, 9, DEPENDENT_COMPUTE_BINDINGS, 9);
+			AddPipelineDependency(&dependencies, 9, DEPENDENT_PIPELINE, 200);
+			// recreated after a reload
+			AddPipelineDependency(&dependencies, 3, DEPENDENT_GRAPHICS_BINDINGS, 0x500000003ull);
+			AddPipelineDependency(&dependencies, 3, DEPENDENT_PIPELINE, 100);
+
+			Array<u64> keys;
+			GatherPipelineDependents(dependencies, 3, DEPENDENT_PIPELINE, &keys);
+			EXPECT(Size(keys) == 2);
+			EXPECT(((keys[0] == 100 && keys[1] == 101) || (keys[0] == 101 && keys[1] == 100)));
+
+			Clear(keys);
+			GatherPipelineDependents(dependencies, 3, DEPENDENT_GRAPHICS_BINDINGS, &keys);
+			EXPECT(Size(keys) == 1);
+			EXPECT(keys[0] == 0x500000003ull);
+
+			Clear(keys);
+			GatherPipelineDependents(dependencies, 9, DEPENDENT_PIPELINE, &keys);
+			GatherPipelineDependents(dependencies, 9, DEPENDENT_COMPUTE_BINDINGS, &keys);
+			EXPECT(Size(keys) == 2);
+
+			// nothing built from it, or never seen
+			Clear(keys);
+			GatherPipelineDependents(dependencies, 4, DEPENDENT_PIPELINE, &keys);
+			GatherPipelineDependents(dependencies, 1000, DEPENDENT_PIPELINE, &keys);
+			EXPECT(Size(keys) == 0);
+
+			FreeMemory(keys);
+			FreePipelineDependencies(&dependencies);
+		},
+		CASE("recompiling a few shaders reaches only their pipelines") {
+			random_generator rng(67);
+			pipeline_dependencies_t dependencies = {};
+
+			const u32 shadersNum = 200;
+			const u32 pipelinesNum = 5000;
+			u32 vsOf[pipelinesNum];
+			u32 psOf[pipelinesNum];
+			for (u32 p = 0; p < pipelinesNum; ++p) {
+				vsOf[p] = rng.u32Next() % (shadersNum / 2);
+				psOf[p] = shadersNum / 2 + rng.u32Next() % (shadersNum / 2);
+				AddPipelineDependency(&dependencies, vsOf[p], DEPENDENT_PIPELINE, p);
+				AddPipelineDependency(&dependencies, psOf[p], DEPENDENT_PIPELINE, p);
+			}
+
+			const u32 recompiled[] = { 7, 150 };
+			Array<u64> keys;
+			for (u32 shader : recompiled) {
+				GatherPipelineDependents(dependencies, shader, DEPENDENT_PIPELINE, &keys);
+			}
+
+			u32 expected = 0;
+			for (u32 p = 0; p < pipelinesNum; ++p) {
+				expected += vsOf[p] == 7;
+				expected += psOf[p] == 150;
+			}
+			u32 wrong = 0;
+			for (auto key : keys) {
+				wrong += vsOf[key] != 7 && psOf[key] != 150;
+			}
+			EXPECT(Size(keys) == expected);
+			EXPECT(wrong == 0u);
+			EXPECT(Size(keys) < pipelinesNum / 10);
+
+			FreeMemory(keys);
+			FreePipelineDependencies(&dependencies);
+		}
+	};
+
+	Essence::InitMemoryAllocators();
+	lest::run(specification, argc, argv);
+	Essence::ShutdownMemoryAllocators();
+}
+
+#include "ShaderCompiler.h"
+#include <thread>
+
+// stands in for d3dcompiler, bytecode is the desc spelled out
+struct stub_shader_compiler_t {
+	abool						gate;		// compiles spin until it opens
+	ai32						entered_num;
+	ai32						compiles_num;
+	Essence::CriticalSection	lock;
+	Essence::Array<u64>			published_keys;
+	Essence::Array<u64>			failed_keys;
+	u32							wrong_bytecode_num;
+};
+
+bool CompileWithStub(void* user, Essence::shader_compile_desc_t const& desc, Essence::IAllocator* allocator, Essence::shader_compile_output_t* output) {
+	auto stub = (stub_shader_compiler_t*)user;
+	stub->entered_num++;
+	while (!stub->gate) {
+		std::this_thread::yield();
+	}
+	stub->compiles_num++;
+	if (strcmp(desc.function, "broken") == 0) {
+		return false;
+	}
+	char text[256];
+	output->bytesize = snprintf(text, sizeof(text), "%s:%s:%s", desc.file, desc.function, desc.profile);
+	output->bytecode = allocator->Allocate(output->bytesize, 1);
+	memcpy(output->bytecode, text, output->bytesize);
+	return true;
+}
+
+// keys are i for file shaders/i.hlsl
+void PublishToStub(void* user, u64 key, Essence::shader_compile_output_t const& output) {
+	auto stub = (stub_shader_compiler_t*)user;
+	Essence::ScopeLock lock(&stub->lock);
+	if (!output.bytecode) {
+		PushBack(stub->failed_keys, key);
+		return;
+	}
+	char expected[256];
+	auto bytesize = snprintf(expected, sizeof(expected), "shaders/%u.hlsl:main:ps_5_1", (u32)key);
+	stub->wrong_bytecode_num += output.bytesize != (u64)bytesize || memcmp(output.bytecode, expected, bytesize) != 0;
+	PushBack(stub->published_keys, key);
+	Essence::GetMallocAllocator()->Free(output.bytecode);
+}
+
+Essence::shader_compile_handle RequestStubCompile(Essence::shader_compile_service_t* service, u32 key, const char* function) {
+	char file[64];
+	snprintf(file, sizeof(file), "shaders/%u.hlsl", key);
+	Essence::shader_compile_desc_t desc;
+	desc.file = file;
+	desc.function = function;
+	desc.profile = "ps_5_1";
+	desc.defines = nullptr;
+	desc.defines_num = 0;
+	return RequestShaderCompile(service, key, desc);
+}
+
+void TestShaderCompiler(int argc, char * argv[]) {
+	using namespace Essence;
+
+	const lest::test specification[] = {
+		CASE("repeated requests in flight join and every key gets published") {
+			InitScheduler();
+			stub_shader_compiler_t stub;
+			stub.gate = false;
+			stub.entered_num = 0;
+			stub.compiles_num = 0;
+			stub.wrong_bytecode_num = 0;
+			shader_compile_service_t service;
+			InitShaderCompileService(&service, { &stub, CompileWithStub }, GetMallocAllocator(), PublishToStub, &stub);
+
+			const u32 keysNum = 16;
+			shader_compile_handle handles[keysNum];
+			u32 joinedWrong = 0;
+			for (u32 round = 0; round < 4; ++round) {
+				for (u32 key = 0; key < keysNum; ++key) {
+					auto handle = RequestStubCompile(&service, key, "main");
+					if (round == 0) {
+						handles[key] = handle;
+					}
+					joinedWrong += handle != handles[key];
+				}
+			}
+			EXPECT(joinedWrong == 0u);
+			EXPECT(!IsShaderCompileDone(&service, handles[0]));
+
+			stub.gate = true;
+			WaitForShaderCompile(&service, handles[5]);
+			EXPECT(IsShaderCompileDone(&service, handles[5]));
+			WaitForShaderCompiles(&service);
+
+			u32 doneNum = 0;
+			for (auto handle : handles) {
+				doneNum += IsShaderCompileDone(&service, handle);
+			}
+			EXPECT(doneNum == keysNum);
+			// requests after a compile started make it run once more, never more than that
+			EXPECT(stub.compiles_num >= (i32)keysNum);
+			EXPECT(stub.compiles_num <= 2 * (i32)keysNum);
+			EXPECT(Size(stub.published_keys) == (u64)stub.compiles_num);
+			EXPECT(stub.wrong_bytecode_num == 0u);
+
+			// done keys compile again
+			i32 compiled = stub.compiles_num;
+			auto again = RequestStubCompile(&service, 3, "main");
+			EXPECT(again != handles[3]);
+			WaitForShaderCompile(&service, again);
+			EXPECT(stub.compiles_num == compiled + 1);
+
+			FreeShaderCompileService(&service);
+			FreeMemory(stub.published_keys);
+			FreeMemory(stub.failed_keys);
+			ShutdownScheduler();
+		},
+		CASE("request for a compile already running compiles again before it is done") {
+			InitScheduler();
+			stub_shader_compiler_t stub;
+			stub.gate = false;
+			stub.entered_num = 0;
+			stub.compiles_num = 0;
+			stub.wrong_bytecode_num = 0;
+			shader_compile_service_t service;
+			InitShaderCompileService(&service, { &stub, CompileWithStub }, GetMallocAllocator(), PublishToStub, &stub);
+
+			auto first = RequestStubCompile(&service, 7, "main");
+			// backend has the old sources by now
+			while (stub.entered_num == 0) {
+				std::this_thread::yield();
+			}
+			auto edited = RequestStubCompile(&service, 7, "main");
+			EXPECT(edited == first);
+
+			stub.gate = true;
+			WaitForShaderCompile(&service, first);
+			EXPECT(IsShaderCompileDone(&service, first));
+			EXPECT(stub.compiles_num == 2);
+			EXPECT(Size(stub.published_keys) == 2);
+			EXPECT(stub.wrong_bytecode_num == 0u);
+
+			FreeShaderCompileService(&service);
+			FreeMemory(stub.published_keys);
+			FreeMemory(stub.failed_keys);
+			ShutdownScheduler();
+		},
+		CASE("failed compile is published without bytecode") {
+			InitScheduler();
+			stub_shader_compiler_t stub;
+			stub.gate = true;
+			stub.entered_num = 0;
+			stub.compiles_num = 0;
+			stub.wrong_bytecode_num = 0;
+			shader_compile_service_t service;
+			InitShaderCompileService(&service, { &stub, CompileWithStub }, GetMallocAllocator(), PublishToStub, &stub);
+
+			RequestStubCompile(&service, 1, "main");
+			auto broken = RequestStubCompile(&service, 2, "broken");
+			WaitForShaderCompile(&service, broken);
+			WaitForShaderCompiles(&service);
+
+			EXPECT(Size(stub.failed_keys) == 1);
+			EXPECT(stub.failed_keys[0] == 2u);
+			EXPECT(Size(stub.published_keys) == 1);
+			EXPECT(stub.published_keys[0] == 1u);
+
+			FreeShaderCompileService(&service);
+			FreeMemory(stub.published_keys);
+			FreeMemory(stub.failed_keys);
+			ShutdownScheduler();
+		}
+	};
+
+	Essence::InitMemoryAllocators();
+	lest::run(specification, argc, argv);
+	Essence::ShutdownMemoryAllocators();
+}
+
+#include "ShaderCache.h"
+
+// stands in for the shaders directory, texts can be swapped to simulate edits
+struct memory_shader_files_t {
+	const char*	paths[8];
+	const char*	texts[8];
+	u32			files_num;
+};
+
+bool ReadMemoryShaderFile(void* user, const char* path, Essence::Array<u8>* outData) {
+	auto files = (memory_shader_files_t*)user;
+	for (u32 i = 0; i < files->files_num; ++i) {
+		if (strcmp(files->paths[i], path) == 0) {
+			Clear(*outData);
+			Append(*outData, (const u8*)files->texts[i], strlen(files->texts[i]));
+			return true;
+		}
+	}
+	return false;
+}
+
+Essence::shader_source_reader_t MakeMemoryShaderReader(memory_shader_files_t* files) {
+	Essence::shader_source_reader_t reader;
+	reader.user = files;
+	reader.read = ReadMemoryShaderFile;
+	return reader;
+}
+
+// lighting includes common and shadows, shadows includes common again and a missing file
+memory_shader_files_t MakeTestShaderFiles() {
+	memory_shader_files_t files = {};
+	files.paths[0] = "shaders/lighting.hlsl";
+	files.texts[0] = "#include \"common.hlsl\"\n  # include <inc/shadows.hlsli>\nfloat4 main() : SV_Target { return 0; }\n";
+	files.paths[1] = "shaders/common.hlsl";
+	files.texts[1] = "cbuffer Frame : register(b0) { float4x4 ViewProj; }\n";
+	files.paths[2] = "shaders/inc/shadows.hlsli";
+	files.texts[2] = "#include \"../common.hlsl\"\n#include \"missing.hlsli\"\n// #include \"commented.hlsli\"\n";
+	files.paths[3] = "shaders/post.hlsl";
+	files.texts[3] = "#include \"common.hlsl\"\n";
+	files.paths[4] = "shaders/sky.hlsl";
+	files.texts[4] = "float4 main() : SV_Target { return 1; }\n";
+	files.files_num = 5;
+	return files;
+}
+
+bool SourcesInclude(Essence::shader_sources_t const& sources, const char* path) {
+	auto pathHash = Essence::GetShaderPathHash(path);
+	for (auto known : sources.path_hashes) {
+		if (known == pathHash) {
+			return true;
+		}
+	}
+	return false;
+}
+
+u64 GetTestShaderKey(memory_shader_files_t* files, const char* file, const char* function, const char* profile, u64 compilerVersion, Essence::shader_macro_t const* defines = nullptr, u32 definesNum = 0) {
+	using namespace Essence;
+	shader_sources_t sources;
+	GatherShaderSources(MakeMemoryShaderReader(files), file, &sources);
+	shader_compile_desc_t desc;
+	desc.file = file;
+	desc.function = function;
+	desc.profile = profile;
+	desc.defines = defines;
+	desc.defines_num = definesNum;
+	u64 key = GetShaderCacheKey(sources, desc, compilerVersion);
+	FreeShaderSources(&sources);
+	return key;
+}
+
+Essence::shader_compile_output_t MakeTestBytecode(const char* text, u32 instructions) {
+	Essence::shader_compile_output_t output = {};
+	output.bytecode = (void*)text;
+	output.bytesize = strlen(text);
+	output.reflection.instructions = instructions;
+	return output;
+}
+
+bool CachedShaderEquals(Essence::shader_cache_t* cache, u64 key, const char* expected, u32 instructions) {
+	Essence::shader_compile_output_t output = {};
+	bool found = Essence::FindCachedShader(cache, key, Essence::GetMallocAllocator(), &output);
+	bool equal = found && output.bytesize == strlen(expected) && memcmp(output.bytecode, expected, output.bytesize) == 0 && output.reflection.instructions == instructions;
+	if (found) {
+		Essence::GetMallocAllocator()->Free(output.bytecode);
+	}
+	return equal;
+}
+
+void TestShaderCache(int argc, char * argv[]) {
+	using namespace Essence;
+
+	const lest::test specification[] = {
+		CASE("sources are gathered through includes once each") {
+			auto files = MakeTestShaderFiles();
+			shader_sources_t sources;
+			GatherShaderSources(MakeMemoryShaderReader(&files), "shaders/lighting.hlsl", &sources);
+
+			EXPECT(Size(sources.path_hashes) == 5);
+			EXPECT(sources.path_hashes[0] == GetShaderPathHash("shaders/lighting.hlsl"));
+			EXPECT(SourcesInclude(sources, "shaders/common.hlsl"));
+			EXPECT(SourcesInclude(sources, "shaders/inc/shadows.hlsli"));
+			EXPECT(SourcesInclude(sources, "shaders/inc/../common.hlsl"));
+			EXPECT(SourcesInclude(sources, "shaders/inc/missing.hlsli"));
+			EXPECT(!SourcesInclude(sources, "shaders/post.hlsl"));
+			EXPECT(sources.content_hashes[0] != 0u);
+			EXPECT(sources.content_hashes[4] == 0u);
+
+			GatherShaderSources(MakeMemoryShaderReader(&files), "shaders/sky.hlsl", &sources);
+			EXPECT(Size(sources.path_hashes) == 1);
+			FreeShaderSources(&sources);
+		},
+		CASE("key follows every source, entry, profile, define and compiler") {
+			auto files = MakeTestShaderFiles();
+			u64 key = GetTestShaderKey(&files, "shaders/lighting.hlsl", "main", "ps_5_1", 47);
+			EXPECT(key == GetTestShaderKey(&files, "shaders/lighting.hlsl", "main", "ps_5_1", 47));
+			EXPECT(key != GetTestShaderKey(&files, "shaders/lighting.hlsl", "other", "ps_5_1", 47));
+			EXPECT(key != GetTestShaderKey(&files, "shaders/lighting.hlsl", "main", "ps_5_0", 47));
+			EXPECT(key != GetTestShaderKey(&files, "shaders/lighting.hlsl", "main", "ps_5_1", 48));
+			shader_macro_t defines[] = { { "ALPHA_TEST", "1" }, { "SKINNED", "1" } };
+			u64 definesKey = GetTestShaderKey(&files, "shaders/lighting.hlsl", "main", "ps_5_1", 47, defines, 2);
+			EXPECT(key != definesKey);
+			EXPECT(definesKey != GetTestShaderKey(&files, "shaders/lighting.hlsl", "main", "ps_5_1", 47, defines, 1));
+			EXPECT(definesKey == GetTestShaderKey(&files, "shaders/lighting.hlsl", "main", "ps_5_1", 47, defines, 2));
+
+			// edit two includes deep
+			files.texts[1] = "cbuffer Frame : register(b1) { float4x4 ViewProj; }\n";
+			EXPECT(key != GetTestShaderKey(&files, "shaders/lighting.hlsl", "main", "ps_5_1", 47));
+
+			// missing include showing up
+			u64 beforeKey = GetTestShaderKey(&files, "shaders/lighting.hlsl", "main", "ps_5_1", 47);
+			files.paths[5] = "shaders/inc/missing.hlsli";
+			files.texts[5] = "";
+			files.files_num = 6;
+			EXPECT(beforeKey != GetTestShaderKey(&files, "shaders/lighting.hlsl", "main", "ps_5_1", 47));
+		},
+		CASE("bytecode and reflection survive a save and load") {
+			memory_cache_storage_t storage = {};
+			{
+				shader_cache_t cache;
+				InitShaderCache(&cache, MakeMemoryCacheStorage(&storage), 1 << 20);
+				EXPECT(!LoadShaderCache(&cache));
+				StoreCachedShader(&cache, 1, MakeTestBytecode("dxbc one", 11));
+				StoreCachedShader(&cache, 2, MakeTestBytecode("dxbc two", 22));
+				EXPECT(SaveShaderCache(&cache));
+				EXPECT(SaveShaderCache(&cache));
+				EXPECT(storage.writes_num == 1u);
+				FreeShaderCache(&cache);
+			}
+
+			shader_cache_t cache;
+			InitShaderCache(&cache, MakeMemoryCacheStorage(&storage), 1 << 20);
+			EXPECT(LoadShaderCache(&cache));
+			EXPECT(CachedShaderEquals(&cache, 1, "dxbc one", 11));
+			EXPECT(CachedShaderEquals(&cache, 2, "dxbc two", 22));
+			EXPECT(!CachedShaderEquals(&cache, 3, "dxbc two", 22));
+			FreeShaderCache(&cache);
+
+			// damaged data starts cold
+			storage.data[Size(storage.data) / 2] ^= 1;
+			InitShaderCache(&cache, MakeMemoryCacheStorage(&storage), 1 << 20);
+			EXPECT(!LoadShaderCache(&cache));
+			EXPECT(!CachedShaderEquals(&cache, 1, "dxbc one", 11));
+			FreeShaderCache(&cache);
+			FreeMemory(storage.data);
+		},
+		CASE("least recently used bytecode goes first when over budget") {
+			memory_cache_storage_t storage = {};
+			shader_cache_t cache;
+			// room for three 8 byte blobs
+			InitShaderCache(&cache, MakeMemoryCacheStorage(&storage), 24);
+			StoreCachedShader(&cache, 1, MakeTestBytecode("blob 001", 1));
+			StoreCachedShader(&cache, 2, MakeTestBytecode("blob 002", 2));
+			StoreCachedShader(&cache, 3, MakeTestBytecode("blob 003", 3));
+			SaveShaderCache(&cache);
+			FreeShaderCache(&cache);
+
+			// next launch uses 1 and 3 and compiles 4
+			InitShaderCache(&cache, MakeMemoryCacheStorage(&storage), 24);
+			EXPECT(LoadShaderCache(&cache));
+			EXPECT(CachedShaderEquals(&cache, 1, "blob 001", 1));
+			EXPECT(CachedShaderEquals(&cache, 3, "blob 003", 3));
+			StoreCachedShader(&cache, 4, MakeTestBytecode("blob 004", 4));
+			SaveShaderCache(&cache);
+			FreeShaderCache(&cache);
+
+			InitShaderCache(&cache, MakeMemoryCacheStorage(&storage), 24);
+			EXPECT(LoadShaderCache(&cache));
+			EXPECT(Size(cache.entries) == 3);
+			EXPECT(CachedShaderEquals(&cache, 1, "blob 001", 1));
+			EXPECT(!CachedShaderEquals(&cache, 2, "blob 002", 2));
+			EXPECT(CachedShaderEquals(&cache, 3, "blob 003", 3));
+			EXPECT(CachedShaderEquals(&cache, 4, "blob 004", 4));
+			FreeShaderCache(&cache);
+			FreeMemory(storage.data);
+		},
+		CASE("edits reach only roots built from the edited file") {
+			auto files = MakeTestShaderFiles();
+			auto reader = MakeMemoryShaderReader(&files);
+			shader_include_graph_t graph;
+			shader_sources_t sources;
+			const char* roots[] = { "shaders/lighting.hlsl", "shaders/post.hlsl", "shaders/sky.hlsl" };
+			for (auto root : roots) {
+				GatherShaderSources(reader, root, &sources);
+				TrackShaderSources(&graph, sources);
+			}
+			// compiled again, nothing new
+			GatherShaderSources(reader, roots[0], &sources);
+			TrackShaderSources(&graph, sources);
+
+			Array<u64> changed;
+			FindChangedShaderRoots(&graph, reader, &changed);
+			EXPECT(Size(changed) == 0);
+
+			files.texts[2] = "#include \"../common.hlsl\"\nfloat Shadow() { return 1; }\n";
+			FindChangedShaderRoots(&graph, reader, &changed);
+			EXPECT(Size(changed) == 1);
+			EXPECT(changed[0] == GetShaderPathHash(roots[0]));
+
+			// seen once, reported once
+			Clear(changed);
+			FindChangedShaderRoots(&graph, reader, &changed);
+			EXPECT(Size(changed) == 0);
+
+			files.texts[1] = "// touched\n";
+			FindChangedShaderRoots(&graph, reader, &changed);
+			EXPECT(Size(changed) == 2);
+			EXPECT(!SourcesInclude(sources, roots[2]));
+			u32 skyChanged = 0;
+			for (auto root : changed) {
+				skyChanged += root == GetShaderPathHash(roots[2]);
+			}
+			EXPECT(skyChanged == 0u);
+
+			FreeMemory(changed);
+			FreeShaderSources(&sources);
+			FreeShaderIncludeGraph(&graph);
+		}
+	};
+
+	Essence::InitMemoryAllocators();
+	lest::run(specification, argc, argv);
+	Essence::ShutdownMemoryAllocators();
+}
+
+#include "ShaderPermutations.h"
+
+// spells out the defines it got into user
+bool CompileRecordingDefines(void* user, Essence::shader_compile_desc_t const& desc, Essence::IAllocator* allocator, Essence::shader_compile_output_t* output) {
+	auto text = (char*)user;
+	int written = 0;
+	for (u32 i = 0; i < desc.defines_num; ++i) {
+		written += snprintf(text + written, 256 - written, "%s=%s;", desc.defines[i].name, desc.defines[i].definition);
+	}
+	output->bytecode = allocator->Allocate(1, 1);
+	output->bytesize = 1;
+	return true;
+}
+
+void PublishNowhere(void* user, u64 key, Essence::shader_compile_output_t const& output) {
+	Essence::GetMallocAllocator()->Free(output.bytecode);
+}
+
+struct permutation_readers_t {
+	Essence::permutation_table_t*	table;
+	au32							published;		// keys 1 to this are in
+	abool							done;
+	ai32							wrong;
+	ai32							lookups;
+};
+
+void ReadPermutationsConcurrently(permutation_readers_t* readers) {
+	u32 seed = 12345;
+	while (!readers->done) {
+		u32 published = readers->published;
+		if (!published) {
+			continue;
+		}
+		seed = seed * 1664525u + 1013904223u;
+		u64 key = 1 + (seed >> 8) % published;
+		u32 value = 0;
+		if (!FindPermutation(*readers->table, key, &value) || value != (u32)key * 3) {
+			readers->wrong++;
+		}
+		readers->lookups++;
+	}
+}
+
+void TestShaderPermutations(int argc, char * argv[]) {
+	using namespace Essence;
+
+	const lest::test specification[] = {
+		CASE("permutation bits turn on their feature defines") {
+			shader_features_t features = {};
+			features.names[0] = "NORMAL_MAP";
+			features.names[1] = "ALPHA_TEST";
+			features.names[2] = "SKINNED";
+			features.num = 3;
+
+			shader_macro_t macros[MAX_SHADER_FEATURES];
+			EXPECT(GetPermutationDefines(features, 0, macros) == 0u);
+			EXPECT(GetPermutationDefines(features, 5, macros) == 2u);
+			EXPECT(strcmp(macros[0].name, "NORMAL_MAP") == 0);
+			EXPECT(strcmp(macros[1].name, "SKINNED") == 0);
+			EXPECT(strcmp(macros[1].definition, "1") == 0);
+		},
+		CASE("defines are copied with the compile request") {
+			InitScheduler();
+			char seen[256] = {};
+			shader_compile_service_t service;
+			InitShaderCompileService(&service, { seen, CompileRecordingDefines }, GetMallocAllocator(), PublishNowhere, nullptr);
+
+			char name[] = "SKINNED";
+			shader_macro_t defines[] = { { "ALPHA_TEST", "1" }, { name, "2" } };
+			shader_compile_desc_t desc;
+			desc.file = "shaders/gbuffer.hlsl";
+			desc.function = "PShader";
+			desc.profile = "ps_5_1";
+			desc.defines = defines;
+			desc.defines_num = 2;
+			auto handle = RequestShaderCompile(&service, 1, desc);
+			// caller memory is gone by the time it compiles
+			defines[0].name = "CHANGED";
+			name[0] = 'X';
+			WaitForShaderCompile(&service, handle);
+			EXPECT(strcmp(seen, "ALPHA_TEST=1;SKINNED=2;") == 0);
+
+			FreeShaderCompileService(&service);
+			ShutdownScheduler();
+		},
+		CASE("lookup table finds every key across growth") {
+			permutation_table_t table;
+			table.current = nullptr;
+			u32 value = 0;
+			EXPECT(!FindPermutation(table, 7, &value));
+
+			// 0 is stored under another slot key, still findable
+			InsertPermutation(&table, 0, 100);
+			for (u64 key = 1; key <= 5000; ++key) {
+				InsertPermutation(&table, key * 0x9E3779B97F4A7C15ull, (u32)key);
+			}
+			u32 wrong = 0;
+			for (u64 key = 1; key <= 5000; ++key) {
+				wrong += !FindPermutation(table, key * 0x9E3779B97F4A7C15ull, &value) || value != (u32)key;
+			}
+			EXPECT(wrong == 0u);
+			EXPECT(FindPermutation(table, 0, &value));
+			EXPECT(value == 100u);
+			EXPECT(!FindPermutation(table, 5001 * 0x9E3779B97F4A7C15ull, &value));
+			EXPECT(Size(table.retired) > 0);
+
+			InsertPermutation(&table, 1 * 0x9E3779B97F4A7C15ull, 42);
+			EXPECT(FindPermutation(table, 1 * 0x9E3779B97F4A7C15ull, &value));
+			EXPECT(value == 42u);
+			FreePermutationTable(&table);
+		},
+		CASE("readers without locks see every published key while the table grows") {
+			permutation_table_t table;
+			InitPermutationTable(&table, 0);
+			permutation_readers_t readers;
+			readers.table = &table;
+			readers.published = 0;
+			readers.done = false;
+			readers.wrong = 0;
+			readers.lookups = 0;
+
+			std::thread threads[3];
+			for (auto& thread : threads) {
+				thread = std::thread(ReadPermutationsConcurrently, &readers);
+			}
+			for (u32 key = 1; key <= 20000; ++key) {
+				InsertPermutation(&table, key, key * 3);
+				readers.published = key;
+				if (key % 1000 == 0) {
+					std::this_thread::yield();
+				}
+			}
+			while (readers.lookups < 10000) {
+				std::this_thread::yield();
+			}
+			readers.done = true;
+			for (auto& thread : threads) {
+				thread.join();
+			}
+			EXPECT(readers.wrong == 0);
+			FreePermutationTable(&table);
+		},
+		CASE("precompile list round trips and skips malformed lines") {
+			shader_permutation_entry_t entries[] = {
+				{ "shaders/gbuffer.hlsl", "PShader", "ps_5_1", 0x5 },
+				{ "shaders/gbuffer.hlsl", "VShader", "vs_5_1", 0 },
+				{ "shaders/culling.hlsl", "Main", "cs_5_0", 0xFFFFFFFF },
+				{ "C:/My Projects/shaders/post fx.hlsl", "Bloom", "ps_5_1", 0x2 }
+			};
+			Array<char> text;
+			WriteShaderPermutationList(entries, 4, &text);
+			const char* junk = "\r\nbroken line\nmain ps_5_1 nothex shaders/x.hlsl\nmain ps_5_1 123456789 shaders/x.hlsl\nmain ps_5_1 0\n  main\tps_5_0 a0  shaders/y z.hlsl  \r\n";
+			Append(text, junk, strlen(junk));
+
+			Array<shader_permutation_entry_t> parsed;
+			Array<char> strings;
+			ParseShaderPermutationList(text.DataPtr, Size(text), &parsed, &strings);
+			EXPECT(Size(parsed) == 5);
+			u32 mismatches = 0;
+			for (u32 i = 0; i < 4; ++i) {
+				mismatches += strcmp(parsed[i].file, entries[i].file) != 0;
+				mismatches += strcmp(parsed[i].function, entries[i].function) != 0;
+				mismatches += strcmp(parsed[i].profile, entries[i].profile) != 0;
+				mismatches += parsed[i].permutation != entries[i].permutation;
+			}
+			EXPECT(mismatches == 0u);
+			// spaces inside the path stay, the ones around it don't
+			EXPECT(strcmp(parsed[4].file, "shaders/y z.hlsl") == 0);
+			EXPECT(strcmp(parsed[4].function, "main") == 0);
+			EXPECT(strcmp(parsed[4].profile, "ps_5_0") == 0);
+			EXPECT(parsed[4].permutation == 0xA0u);
+
+			FreeMemory(text);
+			FreeMemory(parsed);
+			FreeMemory(strings);
+		}
+	};
+
+	Essence::InitMemoryAllocators();
+	lest::run(specification, argc, argv);
+	Essence::ShutdownMemoryAllocators();
+}
+
+
+#include "RangeAllocator.h"
+
+// maximal runs of unowned slots, the allocator keeps one free range for each
+u32 CountFreeRuns(Essence::Array<u32> const& owner) {
+	u32 runs = 0;
+	for (u32 i = 0; i < Essence::Size(owner); ++i) {
+		if (owner[i] == 0 && (i == 0 || owner[i - 1] != 0)) {
+			++runs;
+		}
+	}
+	return runs;
+}
+
+void TestRangeAllocator(int argc, char * argv[]) {
+	using namespace Essence;
+
+	const lest::test specification[] = {
+		CASE("allocations are carved from the front and split the rest") {
+			range_allocator_t allocator = {};
+			InitRangeAllocator(&allocator, 100);
+
+			auto a = AllocateRange(&allocator, 10);
+			auto b = AllocateRange(&allocator, 20);
+			EXPECT(a.node != NULL_RANGE);
+			EXPECT(b.node != NULL_RANGE);
+			EXPECT(a.offset == 0u);
+			EXPECT(b.offset == 10u);
+
+			auto stats = GetRangeAllocatorStats(allocator);
+			EXPECT(stats.used == 30u);
+			EXPECT(stats.allocations_num == 2u);
+			EXPECT(stats.free_ranges_num == 1u);
+			EXPECT(stats.largest_free == 70u);
+			EXPECT(stats.fragmentation == 0.f);
+
+			FreeRangeAllocator(&allocator);
+		},
+		CASE("freed neighbours merge right away") {
+			range_allocator_t allocator = {};
+			InitRangeAllocator(&allocator, 64);
+
+			auto a = AllocateRange(&allocator, 16);
+			auto b = AllocateRange(&allocator, 16);
+			auto c = AllocateRange(&allocator, 16);
+			FreeRange(&allocator, a);
+			FreeRange(&allocator, c);
+
+			auto stats = GetRangeAllocatorStats(allocator);
+			EXPECT(stats.free_ranges_num == 2u);
+			EXPECT(stats.largest_free == 32u);
+			EXPECT(stats.fragmentation == 1.f - 32.f / 48.f);
+
+			FreeRange(&allocator, b);
+			stats = GetRangeAllocatorStats(allocator);
+			EXPECT(stats.free_ranges_num == 1u);
+			EXPECT(stats.largest_free == 64u);
+			EXPECT(stats.used == 0u);
+
+			// whole range is usable again in one piece
+			auto all = AllocateRange(&allocator, 64);
+			EXPECT(all.node != NULL_RANGE);
+			EXPECT(all.offset == 0u);
+
+			FreeRangeAllocator(&allocator);
+		},
+		CASE("holes too small fail instead of overlapping") {
+			range_allocator_t allocator = {};
+			InitRangeAllocator(&allocator, 1024);
+
+			range_allocation_t ranges[8];
+			for (u32 i = 0; i < 8; ++i) {
+				ranges[i] = AllocateRange(&allocator, 128);
+			}
+			EXPECT(AllocateRange(&allocator, 1).node == NULL_RANGE);
+
+			FreeRange(&allocator, ranges[1]);
+			FreeRange(&allocator, ranges[5]);
+			EXPECT(AllocateRange(&allocator, 200).node == NULL_RANGE);
+
+			auto fits = AllocateRange(&allocator, 100);
+			EXPECT(fits.node != NULL_RANGE);
+			EXPECT((fits.offset == 128u || fits.offset == 640u));
+
+			FreeRangeAllocator(&allocator);
+		},
+		CASE("sizes past a block and off power of two") {
+			range_allocator_t allocator = {};
+			InitRangeAllocator(&allocator, 32 * 1024);
+
+			auto a = AllocateRange(&allocator, 1000);
+			auto b = AllocateRange(&allocator, 4097);
+			auto c = AllocateRange(&allocator, 3);
+			EXPECT(a.offset == 0u);
+			EXPECT(b.offset == 1000u);
+			EXPECT(c.offset == 5097u);
+
+			FreeRange(&allocator, a);
+			// exact small class reuses the hole at the front
+			auto d = AllocateRange(&allocator, 7);
+			EXPECT(d.offset == 0u);
+
+			FreeRangeAllocator(&allocator);
+		},
+		CASE("random allocations never overlap and free space stays merged") {
+			const u32 capacity = 4096;
+			range_allocator_t allocator = {};
+			InitRangeAllocator(&allocator, capacity);
+
+			Array<u32> owner;
+			Resize(owner, capacity);
+			for (auto& slot : owner) {
+				slot = 0;
+			}
+			Array<range_allocation_t> live;
+			Array<u32> liveSizes;
+
+			random_generator rng(49);
+			u32 used = 0;
+			bool ok = true;
+			for (u32 step = 0; step < 20000 && ok; ++step) {
+				bool allocate = Size(live) == 0 || rng.u32Next(100) < 55;
+				if (allocate) {
+					u32 size = rng.u32Next(4) == 0 ? 1 + rng.u32Next(600) : 1 + rng.u32Next(24);
+					auto range = AllocateRange(&allocator, size);
+					if (range.node == NULL_RANGE) {
+						// rounding up to a class can't lose more than a factor of two
+						ok = GetRangeAllocatorStats(allocator).largest_free < size * 2;
+						continue;
+					}
+					ok = range.offset + size <= capacity;
+					for (u32 i = 0; ok && i < size; ++i) {
+						ok = owner[range.offset + i] == 0;
+						owner[range.offset + i] = step + 1;
+					}
+					PushBack(live, range);
+					PushBack(liveSizes, size);
+					used += size;
+				}
+				else {
+					u32 index = rng.u32Next((u32)Size(live));
+					auto range = live[index];
+					for (u32 i = 0; i < liveSizes[index]; ++i) {
+						owner[range.offset + i] = 0;
+					}
+					used -= liveSizes[index];
+					FreeRange(&allocator, range);
+					live[index] = Back(live);
+					PopBack(live);
+					liveSizes[index] = Back(liveSizes);
+					PopBack(liveSizes);
+				}
+
+				auto stats = GetRangeAllocatorStats(allocator);
+				ok = ok && stats.used == used && stats.allocations_num == Size(live) && stats.free_ranges_num == CountFreeRuns(owner);
+			}
+			EXPECT(ok);
+
+			for (auto range : live) {
+				FreeRange(&allocator, range);
+			}
+			auto stats = GetRangeAllocatorStats(allocator);
+			EXPECT(stats.used == 0u);
+			EXPECT(stats.free_ranges_num == 1u);
+			EXPECT(stats.largest_free == capacity);
+
+			FreeMemory(owner);
+			FreeMemory(live);
+			FreeMemory(liveSizes);
+			FreeRangeAllocator(&allocator);
+		}
+	};
+
+	Essence::InitMemoryAllocators();
+	lest::run(specification, argc, argv);
+	Essence::ShutdownMemoryAllocators();
+}
+
+
+#include "UploadAllocator.h"
+
+// fences are frame numbers, everything up to completed is done
+struct fake_upload_gpu_t {
+	u64		completed;
+	u32		created;
+	u32		destroyed;
+	u64		live_bytes;
+};
+
+bool CreateFakeUploadBlock(void* user, u64 size, Essence::upload_block_memory_t* outMemory) {
+	auto gpu = (fake_upload_gpu_t*)user;
+	outMemory->mapped_ptr = Essence::GetMallocAllocator()->Allocate(size, 256);
+	outMemory->resource = outMemory->mapped_ptr;
+	outMemory->gpu_address = 0x10000000ull * (gpu->created + 1);
+	gpu->created++;
+	gpu->live_bytes += size;
+	return true;
+}
+
+void DestroyFakeUploadBlock(void* user, Essence::upload_block_memory_t const& memory) {
+	auto gpu = (fake_upload_gpu_t*)user;
+	Essence::GetMallocAllocator()->Free(memory.mapped_ptr);
+	gpu->destroyed++;
+}
+
+bool IsFakeUploadFenceCompleted(void* user, u64 fence) {
+	return fence <= ((fake_upload_gpu_t*)user)->completed;
+}
+
+Essence::upload_backend_t MakeFakeUploadBackend(fake_upload_gpu_t* gpu) {
+	*gpu = {};
+	return { gpu, CreateFakeUploadBlock, DestroyFakeUploadBlock, IsFakeUploadFenceCompleted };
+}
+
+Essence::upload_allocator_desc_t FakeUploadDesc() {
+	Essence::upload_allocator_desc_t desc;
+	desc.ring_size = 64 * 1024;
+	desc.block_size = 16 * 1024;
+	desc.large_size = 48 * 1024;
+	desc.history_frames = 4;
+	return desc;
+}
+
+void TestUploadAllocator(int argc, char * argv[]) {
+	using namespace Essence;
+
+	const lest::test specification[] = {
+		CASE("small uploads come from the ring in order") {
+			fake_upload_gpu_t gpu;
+			upload_allocator_t allocator;
+			InitUploadAllocator(&allocator, MakeFakeUploadBackend(&gpu), FakeUploadDesc());
+
+			auto a = AllocateUpload(&allocator, 100, 256);
+			auto b = AllocateUpload(&allocator, 100, 256);
+			auto c = AllocateUpload(&allocator, 8, 16);
+			EXPECT(a.offset == 0u);
+			EXPECT(b.offset == 256u);
+			EXPECT(c.offset == 368u);
+			EXPECT(a.resource == b.resource);
+			EXPECT(b.gpu_address == a.gpu_address + 256);
+			EXPECT(b.write_ptr == pointer_add(a.write_ptr, 256));
+			EXPECT(gpu.created == 1u);
+
+			auto stats = GetUploadAllocatorStats(allocator);
+			EXPECT(stats.ring_used == 376u);
+			EXPECT(stats.blocks_num == 0u);
+
+			FreeUploadAllocator(&allocator);
+			EXPECT(gpu.destroyed == gpu.created);
+		},
+		CASE("ring space comes back once its fence completes and never straddles the end") {
+			fake_upload_gpu_t gpu;
+			upload_allocator_t allocator;
+			InitUploadAllocator(&allocator, MakeFakeUploadBackend(&gpu), FakeUploadDesc());
+
+			AllocateUpload(&allocator, 40 * 1024, 256);
+			FenceUploads(&allocator, 1);
+			auto wrapped = AllocateUpload(&allocator, 20 * 1024, 256);
+			FenceUploads(&allocator, 2);
+			EXPECT(wrapped.offset == 40u * 1024);
+
+			// 4k left at the end, not enough, and the start is still in flight
+			auto overflow = AllocateUpload(&allocator, 8 * 1024, 256);
+			EXPECT(overflow.resource != wrapped.resource);
+			EXPECT(GetUploadAllocatorStats(allocator).overflow_bytes == 0u);
+			FenceUploads(&allocator, 3);
+			EXPECT(GetUploadAllocatorStats(allocator).overflow_bytes == 8u * 1024);
+
+			gpu.completed = 1;
+			RetireUploads(&allocator);
+			auto lapped = AllocateUpload(&allocator, 8 * 1024, 256);
+			EXPECT(lapped.resource == wrapped.resource);
+			EXPECT(lapped.offset == 0u);
+
+			FreeUploadAllocator(&allocator);
+			EXPECT(gpu.destroyed == gpu.created);
+		},
+		CASE("overflow blocks are reused after their fence instead of created again") {
+			fake_upload_gpu_t gpu;
+			upload_allocator_t allocator;
+			auto desc = FakeUploadDesc();
+			desc.ring_size = 0;
+			InitUploadAllocator(&allocator, MakeFakeUploadBackend(&gpu), desc);
+
+			for (u64 frame = 1; frame <= 8; ++frame) {
+				for (u32 i = 0; i < 20; ++i) {
+					auto upload = AllocateUpload(&allocator, 1000, 256);
+					memset(upload.write_ptr, (int)i, 1000);
+				}
+				FenceUploads(&allocator, frame);
+				// gpu runs two frames behind
+				gpu.completed = frame > 2 ? frame - 2 : 0;
+				RetireUploads(&allocator);
+			}
+			// 20 * 1024 bytes a frame is two blocks, three frames are in flight at most
+			EXPECT(gpu.created == 6u);
+
+			FreeUploadAllocator(&allocator);
+			EXPECT(gpu.destroyed == gpu.created);
+		},
+		CASE("overflow uploads bigger than a block still fit in theirs") {
+			fake_upload_gpu_t gpu;
+			upload_allocator_t allocator;
+			auto desc = FakeUploadDesc();
+			desc.ring_size = 0;
+			InitUploadAllocator(&allocator, MakeFakeUploadBackend(&gpu), desc);
+
+			// between block_size and large_size
+			auto between = AllocateUpload(&allocator, 32 * 1024, 256);
+			memset(between.write_ptr, 1, 32 * 1024);
+			EXPECT(between.offset == 0u);
+			EXPECT(GetUploadAllocatorStats(allocator).pooled_bytes == 32u * 1024);
+
+			// the next small one doesn't fit behind it and gets a regular block
+			auto small = AllocateUpload(&allocator, 1024, 256);
+			EXPECT(small.resource != between.resource);
+			EXPECT(GetUploadAllocatorStats(allocator).pooled_bytes == 48u * 1024);
+
+			FreeUploadAllocator(&allocator);
+			EXPECT(gpu.destroyed == gpu.created);
+		},
+		CASE("large uploads get a whole block that is pooled by size") {
+			fake_upload_gpu_t gpu;
+			upload_allocator_t allocator;
+			InitUploadAllocator(&allocator, MakeFakeUploadBackend(&gpu), FakeUploadDesc());
+
+			auto big = AllocateUpload(&allocator, 6400000, 16);
+			EXPECT(big.offset == 0u);
+			memset(big.write_ptr, 1, 6400000);
+			EXPECT(GetUploadAllocatorStats(allocator).ring_used == 0u);
+			FenceUploads(&allocator, 1);
+			EXPECT(GetUploadAllocatorStats(allocator).large_bytes == 6400000u);
+
+			// still in flight, needs another one
+			auto second = AllocateUpload(&allocator, 6400000, 16);
+			EXPECT(second.resource != big.resource);
+			FenceUploads(&allocator, 2);
+
+			gpu.completed = 1;
+			RetireUploads(&allocator);
+			u32 created = gpu.created;
+			auto reused = AllocateUpload(&allocator, 6000000, 16);
+			EXPECT(reused.resource == big.resource);
+			EXPECT(gpu.created == created);
+
+			// far smaller requests don't pin the big block
+			gpu.completed = 2;
+			RetireUploads(&allocator);
+			auto small = AllocateUpload(&allocator, 64 * 1024, 16);
+			EXPECT(small.resource != second.resource);
+			EXPECT(gpu.created == created + 1);
+
+			FreeUploadAllocator(&allocator);
+			EXPECT(gpu.destroyed == gpu.created);
+		},
+		CASE("pool shrinks back once a spike leaves the history") {
+			fake_upload_gpu_t gpu;
+			upload_allocator_t allocator;
+			InitUploadAllocator(&allocator, MakeFakeUploadBackend(&gpu), FakeUploadDesc());
+
+			for (u32 i = 0; i < 8; ++i) {
+				AllocateUpload(&allocator, 1024 * 1024, 16);
+			}
+			FenceUploads(&allocator, 1);
+			gpu.completed = 1;
+			RetireUploads(&allocator);
+			EXPECT(GetUploadAllocatorStats(allocator).pooled_bytes == 8u * 1024 * 1024);
+
+			u64 frame = 2;
+			for (; frame < 2 + 8; ++frame) {
+				AllocateUpload(&allocator, 1024 * 1024, 16);
+				FenceUploads(&allocator, frame);
+				gpu.completed = frame;
+				RetireUploads(&allocator);
+			}
+			auto stats = GetUploadAllocatorStats(allocator);
+			EXPECT(stats.pooled_bytes == 1024u * 1024);
+			EXPECT(stats.blocks_num == 1u);
+			EXPECT(gpu.created == 8u + 1);
+
+			FreeUploadAllocator(&allocator);
+			EXPECT(gpu.destroyed == gpu.created);
+		},
+		CASE("threads allocating from the ring never overlap") {
+			fake_upload_gpu_t gpu;
+			upload_allocator_t allocator;
+			auto desc = FakeUploadDesc();
+			desc.ring_size = 1024 * 1024;
+			InitUploadAllocator(&allocator, MakeFakeUploadBackend(&gpu), desc);
+
+			const u32 threadsNum = 4;
+			const u32 uploadsNum = 500;
+			std::thread threads[threadsNum];
+			for (u32 t = 0; t < threadsNum; ++t) {
+				threads[t] = std::thread([&allocator, t]() {
+					for (u32 i = 0; i < uploadsNum; ++i) {
+						auto upload = AllocateUpload(&allocator, 64 + (i % 7) * 32, 256);
+						memset(upload.write_ptr, (int)t + 1, 64 + (i % 7) * 32);
+					}
+				});
+			}
+			for (auto& thread : threads) {
+				thread.join();
+			}
+			FenceUploads(&allocator, 1);
+
+			// every allocation starts on its own 256 boundary, first byte names the writer
+			u32 counted[threadsNum] = {};
+			auto bytes = (u8*)allocator.ring.mapped_ptr;
+			for (u64 offset = 0; offset < GetUploadAllocatorStats(allocator).ring_used; offset += 256) {
+				if (bytes[offset] >= 1 && bytes[offset] <= threadsNum) {
+					counted[bytes[offset] - 1]++;
+				}
+			}
+			bool all = true;
+			for (u32 t = 0; t < threadsNum; ++t) {
+				all = all && counted[t] == uploadsNum;
+			}
+			EXPECT(all);
+
+			FreeUploadAllocator(&allocator);
+		}
+	};
+
+	Essence::InitMemoryAllocators();
+	lest::run(specification, argc, argv);
+	Essence::ShutdownMemoryAllocators();
+}
+
+#include "PoseCache.h"
+
+// 4 seconds of animation
+Essence::pose_cache_query_t MakeTestPoseQuery(u32 animationIndex, float time) {
+	Essence::pose_cache_query_t query = {};
+	query.model = 3;
+	query.animation_index = animationIndex;
+	query.lod = 1;
+	query.time = time;
+	query.duration = 100.f;
+	query.ticks_per_second = 25.f;
+	query.blended = false;
+	return query;
+}
+
+void TestPoseCache(int argc, char * argv[]) {
+	using namespace Essence;
+
+	const lest::test specification[] = {
+		CASE("states with the same pose share the first one's") {
+			pose_cache_t cache = {};
+			cache.step = 0.1f;
+
+			u32 owner = 0;
+			float stepTime = -1.f;
+			EXPECT(SharePose(cache, MakeTestPoseQuery(0, 1.07f), 10, &owner, &stepTime) == POSE_CACHE_OWNER);
+			EXPECT(lest::approx(stepTime) == 1.f);
+			// same step, one lap later
+			EXPECT(SharePose(cache, MakeTestPoseQuery(0, 1.02f), 11, &owner, &stepTime) == POSE_CACHE_SHARED);
+			EXPECT(owner == 10u);
+			EXPECT(SharePose(cache, MakeTestPoseQuery(0, 5.03f), 12, &owner, &stepTime) == POSE_CACHE_SHARED);
+			EXPECT(owner == 10u);
+
+			FreeMemory(cache);
+		},
+		CASE("another animation, time step, lod or model evaluates separately") {
+			pose_cache_t cache = {};
+			cache.step = 0.1f;
+
+			u32 owner = 0;
+			float stepTime;
+			EXPECT(SharePose(cache, MakeTestPoseQuery(0, 1.05f), 10, &owner, &stepTime) == POSE_CACHE_OWNER);
+			EXPECT(SharePose(cache, MakeTestPoseQuery(1, 1.05f), 11, &owner, &stepTime) == POSE_CACHE_OWNER);
+			EXPECT(SharePose(cache, MakeTestPoseQuery(0, 1.15f), 12, &owner, &stepTime) == POSE_CACHE_OWNER);
+			auto otherLod = MakeTestPoseQuery(0, 1.05f);
+			otherLod.lod = 2;
+			EXPECT(SharePose(cache, otherLod, 13, &owner, &stepTime) == POSE_CACHE_OWNER);
+			auto otherModel = MakeTestPoseQuery(0, 1.05f);
+			otherModel.model = 4;
+			EXPECT(SharePose(cache, otherModel, 14, &owner, &stepTime) == POSE_CACHE_OWNER);
+
+			EXPECT(SharePose(cache, MakeTestPoseQuery(1, 1.05f), 15, &owner, &stepTime) == POSE_CACHE_SHARED);
+			EXPECT(owner == 11u);
+
+			FreeMemory(cache);
+		},
+		CASE("colliding hash with another key evaluates separately") {
+			pose_cache_t cache = {};
+			cache.step = 0.1f;
+
+			auto query = MakeTestPoseQuery(0, 1.05f);
+			auto key = MakePoseCacheKey(cache, query);
+			// another pose already sits where this one hashes to
+			pose_cache_owner_t other;
+			other.key = MakePoseCacheKey(cache, MakeTestPoseQuery(1, 2.05f));
+			other.owner = 10;
+			Set(cache.owners, GetPoseCacheHash(key), other);
+
+			u32 owner = 0;
+			float stepTime;
+			EXPECT(SharePose(cache, query, 11, &owner, &stepTime) == POSE_CACHE_UNSHARED);
+			EXPECT(owner == 0u);
+			EXPECT(Get(cache.owners, GetPoseCacheHash(key))->owner == 10u);
+
+			FreeMemory(cache);
+		},
+		CASE("faded or layered states never share") {
+			pose_cache_t cache = {};
+			cache.step = 0.1f;
+
+			u32 owner = 0;
+			float stepTime;
+			auto blended = MakeTestPoseQuery(0, 1.05f);
+			blended.blended = true;
+			EXPECT(SharePose(cache, blended, 10, &owner, &stepTime) == POSE_CACHE_UNSHARED);
+			// didn't take the slot either
+			EXPECT(SharePose(cache, MakeTestPoseQuery(0, 1.05f), 11, &owner, &stepTime) == POSE_CACHE_OWNER);
+			EXPECT(SharePose(cache, blended, 12, &owner, &stepTime) == POSE_CACHE_UNSHARED);
+
+			cache.step = 0.f;
+			Clear(cache);
+			EXPECT(SharePose(cache, MakeTestPoseQuery(0, 1.05f), 13, &owner, &stepTime) == POSE_CACHE_UNSHARED);
+			EXPECT(SharePose(cache, MakeTestPoseQuery(0, 1.05f), 14, &owner, &stepTime) == POSE_CACHE_UNSHARED);
+
+			FreeMemory(cache);
+		}
+	};
+
+	Essence::InitMemoryAllocators();
+	lest::run(specification, argc, argv);
+	Essence::ShutdownMemoryAllocators();
+}
+
 #if 1
 //
 //#include "JobScheduler.h"
@@ -472,7 +3951,14 @@ void TestScheduler(int argc, char * argv[]) {
 //	}
 //}
 
+void RunBenchmarks(int argc, char * argv[]);
+
 int main(int argc, char * argv[]) {
+	if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+		RunBenchmarks(argc, argv);
+		return 0;
+	}
+
 	Essence::InitMemoryAllocators();
 
 	TestArray(argc, argv);
@@ -480,6 +3966,23 @@ int main(int argc, char * argv[]) {
 	TestCollections(argc, argv);
 	TestString(argc, argv);
 	TestScheduler(argc, argv);
+	TestMeshlets(argc, argv);
+	TestBvh(argc, argv);
+	TestAnimation(argc, argv);
+	TestSkinning(argc, argv);
+	TestCulling(argc, argv);
+	TestRenderQueue(argc, argv);
+	TestDynamicBvh(argc, argv);
+	TestResourceTracking(argc, argv);
+	TestPipelineKey(argc, argv);
+	TestPipelineCache(argc, argv);
+	TestPipelineDependencies(argc, argv);
+	TestShaderCompiler(argc, argv);
+	TestShaderCache(argc, argv);
+	TestShaderPermutations(argc, argv);
+	TestRangeAllocator(argc, argv);
+	TestUploadAllocator(argc, argv);
+	TestPoseCache(argc, argv);
 
 	Essence::ShutdownMemoryAllocators();
 
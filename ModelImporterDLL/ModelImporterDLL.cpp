@@ -428,6 +428,13 @@ allocated_memory_handle LoadModel(const char* path, model_definition* outModelDe
 		vmax = XMVectorMax(vmax, XMLoadFloat3(imported.positions.data() + i));
 	}
 
+	// sphere around the box center, tighter than the box corners for round meshes
+	XMVECTOR center = XMVectorScale(XMVectorAdd(vmin, vmax), 0.5f);
+	XMVECTOR radius = XMVectorZero();
+	for (auto i = 0u; i<imported.positions.size(); ++i) {
+		radius = XMVectorMax(radius, XMVector3Length(XMVectorSubtract(XMLoadFloat3(imported.positions.data() + i), center)));
+	}
+
 	outModelDefinition->verticesNum = baseVertex;
 	outModelDefinition->indicesNum = startIndex;
 
@@ -462,6 +469,8 @@ allocated_memory_handle LoadModel(const char* path, model_definition* outModelDe
 
 	XMStoreFloat3(&outModelDefinition->boundingBoxMin, vmin);
 	XMStoreFloat3(&outModelDefinition->boundingBoxMax, vmax);
+	XMStoreFloat3(&outModelDefinition->boundingSphereCenter, center);
+	outModelDefinition->boundingSphereRadius = XMVectorGetX(radius);
 
 	return modelData;
 }